@@ -0,0 +1,11 @@
+-- Bulk Zigbee onboarding: long pairing window with install codes + auto-accept list,
+-- and the coordinator's device interview (endpoints/clusters) on discovered rows.
+
+ALTER TABLE `ZigbeePairingSession`
+  ADD COLUMN `bulk` BOOLEAN NOT NULL DEFAULT false,
+  ADD COLUMN `autoAccept` JSON NULL;
+
+ALTER TABLE `ZigbeeDiscoveredDevice`
+  ADD COLUMN `endpoints` JSON NULL,
+  ADD COLUMN `interviewOk` BOOLEAN NULL,
+  ADD COLUMN `autoAccepted` BOOLEAN NOT NULL DEFAULT false;
@@ -0,0 +1,5 @@
+-- LAN control: the backend seals the hub's LAN key to this pinned public key
+-- instead of publishing it in clear.
+
+ALTER TABLE `Hub`
+  ADD COLUMN `lanPubKey` VARCHAR(130) NULL;
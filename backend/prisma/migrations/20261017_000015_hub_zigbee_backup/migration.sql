@@ -0,0 +1,19 @@
+-- Zigbee network backup: the hub's sealed blob is kept here instead of retained on the broker.
+
+CREATE TABLE `HubZigbeeBackup` (
+  `id` INTEGER NOT NULL AUTO_INCREMENT,
+  `hubId` VARCHAR(80) NOT NULL,
+  `link` INTEGER NOT NULL,
+  `takenAt` DATETIME(3) NOT NULL,
+  `bytes` INTEGER NOT NULL,
+  `devices` INTEGER NOT NULL,
+  `blob` MEDIUMBLOB NOT NULL,
+  `createdAt` DATETIME(3) NOT NULL DEFAULT CURRENT_TIMESTAMP(3),
+  `updatedAt` DATETIME(3) NOT NULL DEFAULT CURRENT_TIMESTAMP(3) ON UPDATE CURRENT_TIMESTAMP(3),
+  UNIQUE INDEX `HubZigbeeBackup_hubId_link_key` (`hubId`, `link`),
+  PRIMARY KEY (`id`)
+) DEFAULT CHARACTER SET utf8mb4 COLLATE utf8mb4_unicode_ci;
+
+ALTER TABLE `HubZigbeeBackup`
+  ADD CONSTRAINT `HubZigbeeBackup_hubId_fkey`
+  FOREIGN KEY (`hubId`) REFERENCES `Hub`(`hubId`) ON DELETE CASCADE ON UPDATE CASCADE;
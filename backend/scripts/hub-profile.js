@@ -0,0 +1,205 @@
+#!/usr/bin/env node
+/*
+  Hub profiler client + symbolizer
+
+  - Starts a sampling profile on a hub (home/hub/<hubId>/profile/cmd)
+  - Waits for profile/report, prints stall reports (profile/stall) as they arrive
+  - Symbolizes raw PCs with addr2line against the hub firmware ELF and prints
+    a flat profile per function (and per task)
+  - Offline: symbolize a saved report (--report file.json)
+
+  Usage:
+    cd backend
+    MQTT_URL=mqtt://localhost:1883 MQTT_USERNAME=smarthome MQTT_PASSWORD=smarthome123 \
+      node scripts/hub-profile.js --hub <hubId> --elf hub_host_mqtt_uart_patched.ino.elf \
+        [--hz 250] [--seconds 30] [--stall-ms 300] [--save report.json]
+    node scripts/hub-profile.js --report report.json --elf <elf>
+    node scripts/hub-profile.js --hub <hubId> --stalls-only [--stall-ms 300]
+
+  addr2line defaults to xtensa-esp32-elf-addr2line on PATH (ADDR2LINE=... to override).
+*/
+
+import mqtt from "mqtt";
+import crypto from "crypto";
+import fs from "fs";
+import { execFileSync } from "child_process";
+
+function getEnv(name, fallback) {
+  const v = process.env[name];
+  return v == null || v === "" ? fallback : v;
+}
+
+function parseArgs(argv) {
+  const out = {};
+  for (let i = 0; i < argv.length; i++) {
+    const a = argv[i];
+    if (!a.startsWith("--")) continue;
+    const key = a.slice(2);
+    const next = argv[i + 1];
+    if (next == null || next.startsWith("--")) out[key] = true;
+    else {
+      out[key] = next;
+      i++;
+    }
+  }
+  return out;
+}
+
+const args = parseArgs(process.argv.slice(2));
+const addr2line = getEnv("ADDR2LINE", "xtensa-esp32-elf-addr2line");
+
+function elfShaPrefix(elfPath) {
+  const h = crypto.createHash("sha256").update(fs.readFileSync(elfPath)).digest("hex");
+  return h.slice(0, 16);
+}
+
+// Returns Map(pc -> "function (file:line)"). Unknown PCs (ROM, IRAM stubs) map to "??".
+function symbolize(elfPath, pcs) {
+  const map = new Map();
+  const uniq = [...new Set(pcs)];
+  if (!elfPath || uniq.length === 0) return map;
+  let text = "";
+  try {
+    text = execFileSync(addr2line, ["-fiaC", "-e", elfPath, ...uniq], { encoding: "utf8", maxBuffer: 16 << 20 });
+  } catch (e) {
+    console.error(`[hub-profile] addr2line failed (${addr2line}): ${e.message}`);
+    return map;
+  }
+  // -a prints the address line, then function/location pairs (several when inlined).
+  let cur = null;
+  let frames = [];
+  const flush = () => {
+    if (cur) map.set(cur, frames.join(" <- ") || "??");
+  };
+  const lines = text.split("\n");
+  for (let i = 0; i < lines.length; i++) {
+    const line = lines[i].trim();
+    if (!line) continue;
+    if (/^0x[0-9a-f]+$/i.test(line)) {
+      flush();
+      cur = `0x${line.slice(2).replace(/^0+/, "").padStart(8, "0").toLowerCase()}`;
+      frames = [];
+      continue;
+    }
+    const loc = (lines[i + 1] || "").trim();
+    i++;
+    const file = loc.replace(/^.*[\\/]/, "");
+    frames.push(line === "??" ? "??" : `${line} (${file})`);
+  }
+  flush();
+  return map;
+}
+
+function normPc(pc) {
+  const n = Number.parseInt(String(pc), 16);
+  return `0x${n.toString(16).padStart(8, "0")}`;
+}
+
+function printStall(stall, elfPath) {
+  const bt = (stall.bt || []).map(normPc);
+  const sym = symbolize(elfPath, bt);
+  console.log(`\n== stall in ${stall.section}/${stall.tag || "-"}: ${stall.ms} ms (fw=${stall.fw})`);
+  bt.forEach((pc, i) => console.log(`  #${i} ${pc} ${sym.get(pc) || ""}`));
+}
+
+function printReport(report, elfPath) {
+  if (elfPath && report.elfSha && elfShaPrefix(elfPath) !== report.elfSha) {
+    console.warn(`[hub-profile] WARNING: ELF sha256 does not match report (elfSha=${report.elfSha}); symbols may be wrong`);
+  }
+  const top = (report.top || []).map(([task, pc, n]) => ({ task, pc: normPc(pc), n: Number(n) }));
+  const sym = symbolize(elfPath, top.map((t) => t.pc));
+
+  console.log(
+    `\nfw=${report.fw} hz=${report.hz} ms=${report.ms} samples=${report.samples} dropped=${report.dropped} ` +
+      `stalls=${report.stalls} (threshold ${report.stallMs} ms)`
+  );
+  console.log(`max section ms: loop=${report.maxMs?.loop ?? "?"} mqtt=${report.maxMs?.mqtt ?? "?"}`);
+  const total = Number(report.samples) || 1;
+  console.log("\nsamples per task:");
+  for (const [task, n] of Object.entries(report.tasks || {})) {
+    console.log(`  ${task.padEnd(10)} ${String(n).padStart(7)}  ${((100 * n) / total).toFixed(1)}%`);
+  }
+
+  // Flat profile: several PCs land in the same function, fold them (innermost frame only).
+  const byFn = new Map();
+  for (const t of top) {
+    const fn = (sym.get(t.pc) || t.pc).split(" <- ")[0].replace(/ \(.*\)$/, "");
+    const key = `${t.task}\t${fn}`;
+    byFn.set(key, (byFn.get(key) || 0) + t.n);
+  }
+  const rows = [...byFn.entries()].sort((a, b) => b[1] - a[1]);
+  console.log("\nhottest functions (top PCs only):");
+  for (const [key, n] of rows.slice(0, 40)) {
+    const [task, fn] = key.split("\t");
+    console.log(`  ${((100 * n) / total).toFixed(1).padStart(5)}%  ${String(n).padStart(6)}  ${task.padEnd(10)} ${fn}`);
+  }
+}
+
+if (args.report) {
+  printReport(JSON.parse(fs.readFileSync(args.report, "utf8")), args.elf);
+  process.exit(0);
+}
+
+if (!args.hub) {
+  console.error("usage: hub-profile.js --hub <hubId> [--elf file] | --report file.json [--elf file]");
+  process.exit(2);
+}
+
+const url = getEnv("MQTT_URL", "mqtt://localhost:1883");
+const username = getEnv("MQTT_USERNAME", "");
+const password = getEnv("MQTT_PASSWORD", "");
+const base = `home/hub/${args.hub}/profile`;
+const seconds = Number(args.seconds || 30);
+
+const client = mqtt.connect(url, {
+  clientId: `hubprof-${crypto.randomUUID().slice(0, 8)}`,
+  clean: true,
+  keepalive: 20,
+  connectTimeout: 8000,
+  ...(username ? { username } : {}),
+  ...(password ? { password } : {}),
+});
+
+client.on("connect", () => {
+  client.subscribe([`${base}/report`, `${base}/stall`], { qos: 0 }, (err) => {
+    if (err) {
+      console.error(`[hub-profile] subscribe failed: ${err.message}`);
+      process.exit(1);
+    }
+    const cmd = args["stalls-only"] ? {} : { action: "start", hz: Number(args.hz || 250), durationSec: seconds };
+    if (args["stall-ms"]) cmd.stallMs = Number(args["stall-ms"]);
+    client.publish(`${base}/cmd`, JSON.stringify(cmd), { qos: 1 });
+    console.log(`[hub-profile] ${args["stalls-only"] ? "watching stalls" : `profiling ${seconds}s`} on ${args.hub}`);
+    if (!args["stalls-only"]) {
+      // The hub reports on its own when the duration runs out; this only guards a lost report.
+      setTimeout(() => client.publish(`${base}/cmd`, JSON.stringify({ action: "stop" }), { qos: 1 }), (seconds + 15) * 1000);
+    }
+  });
+});
+
+client.on("message", (topic, buf) => {
+  let msg;
+  try {
+    msg = JSON.parse(buf.toString("utf8"));
+  } catch {
+    return;
+  }
+  if (topic.endsWith("/stall")) {
+    printStall(msg, args.elf);
+    return;
+  }
+  if (args.save) fs.writeFileSync(args.save, JSON.stringify(msg, null, 2));
+  printReport(msg, args.elf);
+  client.end(true);
+  process.exit(0);
+});
+
+client.on("error", (err) => {
+  console.error(`[hub-profile] mqtt error: ${err.message}`);
+  process.exit(1);
+});
+
+process.on("SIGINT", () => {
+  if (!args["stalls-only"]) client.publish(`${base}/cmd`, JSON.stringify({ action: "stop" }), { qos: 1 });
+  setTimeout(() => process.exit(0), 500);
+});
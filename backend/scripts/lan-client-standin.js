@@ -0,0 +1,94 @@
+#!/usr/bin/env node
+/*
+  LAN control stand-in client
+
+  - Gets a LAN token from the backend (POST /hubs/:hubId/lan/token)
+  - Connects to the hub WebSocket, authenticates, measures ping RTT
+  - Optionally sends one Zigbee action and waits for ack + cmd_result
+  - Exit code 0 on success, 1 on failure
+
+  Requires a runtime with global WebSocket (Node >= 22).
+
+  Usage:
+    cd backend
+    API_URL=http://localhost:3000 API_TOKEN=<jwt> HUB_ID=hub-aabbcc \
+      [HUB_HOST=192.168.1.50] [IEEE=00124b0000000001 ACTION=light.set ARGS='{"on":true}'] \
+      node scripts/lan-client-standin.js
+*/
+
+function getEnv(name, fallback) {
+  const v = process.env[name];
+  return v == null || v === "" ? fallback : v;
+}
+
+const apiUrl = getEnv("API_URL", "http://localhost:3000").replace(/\/+$/, "");
+const apiToken = getEnv("API_TOKEN", "");
+const hubId = getEnv("HUB_ID", "");
+const pings = Number(getEnv("PINGS", "20"));
+const timeoutMs = Number(getEnv("LAN_TEST_TIMEOUT_MS", "8000"));
+
+function fail(msg) {
+  console.error(`[lan-standin] FAIL ${msg}`);
+  process.exit(1);
+}
+
+if (typeof WebSocket !== "function") fail("global WebSocket not available (use Node >= 22)");
+if (!apiToken || !hubId) fail("API_TOKEN and HUB_ID are required");
+
+const res = await fetch(`${apiUrl}/hubs/${encodeURIComponent(hubId)}/lan/token`, {
+  method: "POST",
+  headers: { Authorization: `Bearer ${apiToken}`, "Content-Type": "application/json" },
+  body: "{}",
+});
+if (!res.ok) fail(`token endpoint HTTP ${res.status}`);
+const info = await res.json();
+const host = getEnv("HUB_HOST", info.lan.ip || info.lan.mdnsHost);
+const url = `ws://${host}:${info.lan.port}${info.lan.wsPath}`;
+
+const timer = setTimeout(() => fail(`TIMEOUT after ${timeoutMs}ms url=${url}`), timeoutMs);
+const ws = new WebSocket(url);
+const rtts = [];
+let pingSentAt = 0;
+let setSentAt = 0;
+
+function sendPing() {
+  pingSentAt = performance.now();
+  ws.send(JSON.stringify({ type: "ping", t: pings - rtts.length }));
+}
+
+function sendActionOrFinish() {
+  const ieee = getEnv("IEEE", "");
+  const action = getEnv("ACTION", "");
+  if (!ieee || !action) return finish();
+  const cmdId = crypto.randomUUID().replace(/-/g, "");
+  setSentAt = performance.now();
+  ws.send(JSON.stringify({ type: "set", ieee, body: { cmdId, action, args: JSON.parse(getEnv("ARGS", "{}")) } }));
+}
+
+function finish(extra = "") {
+  clearTimeout(timer);
+  const sorted = [...rtts].sort((a, b) => a - b);
+  const p = (q) => sorted[Math.min(sorted.length - 1, Math.floor(q * sorted.length))]?.toFixed(1);
+  console.log(`[lan-standin] OK url=${url} pings=${rtts.length} p50=${p(0.5)}ms p95=${p(0.95)}ms ${extra}`);
+  ws.close();
+  process.exit(0);
+}
+
+ws.onopen = () => ws.send(JSON.stringify({ type: "auth", token: info.token }));
+ws.onerror = () => fail(`websocket error url=${url}`);
+ws.onmessage = (ev) => {
+  const msg = JSON.parse(String(ev.data));
+  if (msg.type === "auth_err") fail("hub rejected token (key not provisioned?)");
+  if (msg.type === "auth_ok") return sendPing();
+  if (msg.type === "pong") {
+    rtts.push(performance.now() - pingSentAt);
+    return rtts.length < pings ? sendPing() : sendActionOrFinish();
+  }
+  if (msg.type === "ack") {
+    console.log(`[lan-standin] ack status=${msg.status} cmdId=${msg.cmdId} in ${(performance.now() - setSentAt).toFixed(1)}ms`);
+    return;
+  }
+  if (msg.type === "cmd_result") {
+    finish(`cmd_result ok=${msg.data?.ok} in ${(performance.now() - setSentAt).toFixed(1)}ms`);
+  }
+};
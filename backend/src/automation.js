@@ -99,7 +99,9 @@ function compileActions(actions, deviceById) {
       if (!ieee) continue;
       out.push({ kind: "ZIGBEE", ieee, action, params });
     } else {
-      out.push({ kind: "MQTT", deviceId: dev.deviceId, action, params });
+      // Hub publishes home/<homeId>/device/<deviceId>/set {cmdId, payload: params} and tracks /ack.
+      if (!params || typeof params !== "object") continue;
+      out.push({ kind: "MQTT", homeId: dev.homeId, deviceId: dev.deviceId, action, params });
     }
   }
   return out;
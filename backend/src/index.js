@@ -30,6 +30,7 @@ import {
   adminMqttClearRetainedSchema,
   deviceClaimSchema,
   zigbeeOpenPairingSchema,
+  zigbeeBulkPairingSchema,
   zigbeePairingConfirmSchema,
   zigbeePairingRejectSchema,
   lockAddPinSchema,
@@ -38,14 +39,24 @@ import {
   firmwareRolloutCreateSchema,
   automationCreateSchema,
   automationUpdateSchema,
+  analyticsConfigSchema,
   validateCommandForType,
 } from "./validators.js";
-import { connectMqttClient, publishCommand, publishMgmtCommand, topicPrefixForDevice } from "./mqtt.js";
+import {
+  connectMqttClient,
+  publishCommand,
+  publishMgmtCommand,
+  topicPrefixForDevice,
+  bindZigbeeDeviceByIeee,
+  confirmZigbeeBind,
+} from "./mqtt.js";
+import { appendLogLine } from "./logFile.js";
 import { startOtaRolloutEngine } from "./otaRollout.js";
 import { addSseClient, removeSseClient, emitToHome, getSseStats } from "./sse.js";
 import { startCommandTimeoutSweeper, startResetRequestTimeoutSweeper } from "./commandTimeout.js";
 import { normalizeIeee, suggestModelsByFingerprint, guessDeviceTypeFromModelId } from "./zigbee.js";
 import { enqueueAutomationSync } from "./automation.js";
+import { issueLanToken, publishHubLanKey, zigbeeBackupUrlSig } from "./lanControl.js";
 import { buildDescriptorFromProductModel, buildDescriptorSummaryFromProductModel } from "./descriptor.js";
 
 dotenv.config();
@@ -55,18 +66,6 @@ const app = express();
 const __filename = fileURLToPath(import.meta.url);
 const __dirname = path.dirname(__filename);
 
-const LOG_DIR = process.env.LOG_DIR || path.join(__dirname, "..", "logs");
-fs.mkdirSync(LOG_DIR, { recursive: true });
-
-function appendLogLine(filename, obj) {
-  try {
-    fs.appendFileSync(path.join(LOG_DIR, filename), JSON.stringify(obj) + "\n");
-  } catch (e) {
-    // never crash on logging
-    console.warn("[logger] failed to write log:", e?.message || e);
-  }
-}
-
 app.use((req, res, next) => {
   const startedAt = Date.now();
   const requestId = crypto.randomUUID();
@@ -2158,6 +2157,8 @@ async function activateHubFromInventory({ serial, setupCode, homeId, name, insta
       rssi: runtime.rssi ?? undefined,
       online: runtime.online,
       lastSeen: runtime.lastSeenAt ?? undefined,
+      // New owner: re-pin whatever LAN wrap key the hub publishes now.
+      lanPubKey: null,
     },
     create: {
       hubId: runtime.hubId,
@@ -2177,6 +2178,12 @@ async function activateHubFromInventory({ serial, setupCode, homeId, name, insta
     data: { status: "BOUND", claimedAt: now, claimedByUserId: userId, claimedHomeId: homeId },
   });
 
+  // Replay the hub's retained lan/pub so the pin is taken right away.
+  if (mqttClient.connected) {
+    const lanPubTopic = `home/hub/${hub.hubId}/lan/pub`;
+    mqttClient.subscribe(lanPubTopic, { qos: 1 }, () => setTimeout(() => mqttClient.unsubscribe(lanPubTopic), 2000));
+  }
+
   // MVP credential row (shared broker user). DB is ready for per-hub rotation later.
   const mqttUser = process.env.MQTT_USERNAME || "";
   const mqttPass = process.env.MQTT_PASSWORD || "";
@@ -2291,6 +2298,123 @@ app.get("/hubs/:id", authRequired, async (req, res) => {
   res.json({ hub });
 });
 
+// LAN control: short-lived token the app presents to the hub's local WebSocket
+// (ws://<hub ip>:8080/ws, also advertised as _smarthome._tcp via mDNS).
+// The app falls back to the cloud path when the hub is unreachable.
+app.post("/hubs/:hubId/lan/token", authRequired, async (req, res) => {
+  const hubId = String(req.params.hubId || "").trim();
+  if (!hubId) return res.status(400).json({ error: "hubId is required" });
+  const hub = await prisma.hub.findUnique({
+    where: { hubId },
+    select: { hubId: true, homeId: true, ip: true, online: true, lanPubKey: true },
+  });
+  if (!hub) return res.status(404).json({ error: "Hub not found" });
+  const m = await requireHomeRole(req, res, hub.homeId, "MEMBER");
+  if (!m) return;
+  // The key is sealed to the hub's pinned lan/pub key; without it the hub cannot verify tokens.
+  if (!hub.lanPubKey) return res.status(409).json({ error: "Hub has not published its LAN key yet" });
+
+  // Idempotent: (re)provision the key so a hub that missed it can verify the token.
+  if (mqttClient.connected) publishHubLanKey(mqttClient, hub);
+
+  const { token, expiresAt } = issueLanToken({ hubId: hub.hubId, homeId: hub.homeId, userId: req.user.id });
+  res.json({
+    token,
+    expiresAt,
+    hubId: hub.hubId,
+    lan: {
+      ip: hub.ip ?? null,
+      mdnsHost: `${hub.hubId}.local`,
+      port: 8080,
+      wsPath: "/ws",
+    },
+  });
+});
+
+// Sensor anomaly detectors on the hub (retained so a rebooted hub re-applies it).
+app.put("/hubs/:hubId/analytics/config", authRequired, async (req, res) => {
+  const hubId = String(req.params.hubId || "").trim();
+  if (!hubId) return res.status(400).json({ error: "hubId is required" });
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { hubId: true, homeId: true } });
+  if (!hub) return res.status(404).json({ error: "Hub not found" });
+  const m = await requireHomeRole(req, res, hub.homeId, "ADMIN");
+  if (!m) return;
+
+  const parsed = analyticsConfigSchema.safeParse(req.body);
+  if (!parsed.success) return res.status(400).json({ error: parsed.error.flatten() });
+  if (!mqttClient.connected) return res.status(503).json({ error: "MQTT not connected" });
+
+  const topic = `home/hub/${hub.hubId}/analytics/config`;
+  mqttClient.publish(topic, JSON.stringify(parsed.data), { qos: 1, retain: true });
+  res.json({ ok: true, hubId: hub.hubId, topic, config: parsed.data });
+});
+
+// Zigbee network backups (sealed by the hub, see firmware "ZIGBEE NETWORK BACKUP").
+app.get("/hubs/:hubId/zigbee/backups", authRequired, async (req, res) => {
+  const hubId = String(req.params.hubId || "").trim();
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { hubId: true, homeId: true } });
+  if (!hub) return res.status(404).json({ error: "Hub not found" });
+  const m = await requireHomeRole(req, res, hub.homeId, "MEMBER");
+  if (!m) return;
+  const backups = await prisma.hubZigbeeBackup.findMany({
+    where: { hubId },
+    select: { link: true, takenAt: true, bytes: true, devices: true, updatedAt: true },
+    orderBy: { link: "asc" },
+  });
+  res.json({ hubId, backups });
+});
+
+// Restore a coordinator from the backend copy: the hub downloads the sealed blob
+// from a short-lived link. fromHubId (same home) restores a replaced hub's backup.
+app.post("/hubs/:hubId/zigbee/restore", authRequired, async (req, res) => {
+  const hubId = String(req.params.hubId || "").trim();
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { hubId: true, homeId: true } });
+  if (!hub) return res.status(404).json({ error: "Hub not found" });
+  const m = await requireHomeRole(req, res, hub.homeId, "ADMIN");
+  if (!m) return;
+
+  const link = Number(req.body?.link ?? 0);
+  if (!Number.isInteger(link) || link < 0 || link > 9) return res.status(400).json({ error: "link must be 0..9" });
+  const fromHubId = String(req.body?.fromHubId || hubId).trim();
+  const from = await prisma.hub.findUnique({ where: { hubId: fromHubId }, select: { hubId: true, homeId: true } });
+  // The blob is sealed with the home's backup key: only a hub of the same home can open it.
+  if (!from || from.homeId !== hub.homeId) return res.status(404).json({ error: "Source hub not found in this home" });
+  const backup = await prisma.hubZigbeeBackup.findUnique({
+    where: { hubId_link: { hubId: fromHubId, link } },
+    select: { takenAt: true, bytes: true, devices: true },
+  });
+  if (!backup) return res.status(404).json({ error: "No backup for this link" });
+  if (!mqttClient.connected) return res.status(503).json({ error: "MQTT not connected" });
+
+  const exp = Math.floor(Date.now() / 1000) + 600;
+  const sig = zigbeeBackupUrlSig(fromHubId, link, exp);
+  const base = process.env.PUBLIC_BASE_URL || `${req.protocol}://${req.get("host")}`;
+  const url = `${base}/hub-files/zigbee-backup/${encodeURIComponent(fromHubId)}/${link}?exp=${exp}&sig=${sig}`;
+  const cmd = { link, url, force: req.body?.force === true };
+  mqttClient.publish(`home/hub/${hub.hubId}/zigbee/restore`, JSON.stringify(cmd), { qos: 1, retain: false });
+  res.json({ ok: true, hubId: hub.hubId, fromHubId, link, backup });
+});
+
+app.get("/hub-files/zigbee-backup/:hubId/:link", async (req, res) => {
+  const hubId = String(req.params.hubId || "");
+  const link = Number(req.params.link);
+  const exp = Number(req.query.exp);
+  const sig = String(req.query.sig || "");
+  const want = zigbeeBackupUrlSig(hubId, link, exp);
+  if (!Number.isFinite(exp) || exp < Date.now() / 1000 || sig.length !== want.length ||
+      !crypto.timingSafeEqual(Buffer.from(sig), Buffer.from(want))) {
+    return res.status(403).json({ error: "Link expired or invalid" });
+  }
+  const backup = await prisma.hubZigbeeBackup.findUnique({
+    where: { hubId_link: { hubId, link } },
+    select: { blob: true },
+  });
+  if (!backup) return res.status(404).json({ error: "No backup" });
+  res.set("Content-Type", "application/octet-stream");
+  res.set("Cache-Control", "no-store");
+  res.send(Buffer.from(backup.blob));
+});
+
 // -------------------------
 // Devices
 // -------------------------
@@ -2690,7 +2814,7 @@ app.delete("/devices/:id", authRequired, async (req, res) => {
 // Commands (tracking: cmdId + ACK + TIMEOUT)
 // -------------------------
 
-async function createAndPublishZigbeeActionCommand({ device, action, argsForDb, argsForPublish }) {
+async function createAndPublishZigbeeActionCommand({ device, action, argsForDb, argsForPublish, clientCmdId }) {
   if (device.protocol !== "ZIGBEE") {
     throw new Error("createAndPublishZigbeeActionCommand requires ZIGBEE device");
   }
@@ -2704,18 +2828,27 @@ async function createAndPublishZigbeeActionCommand({ device, action, argsForDb,
     throw err;
   }
 
-  const cmdId = crypto.randomUUID();
+  // A client that already tried the hub's LAN socket passes that cmdId, so the hub
+  // drops this copy as a duplicate if the LAN frame did get through.
+  const cmdId = clientCmdId || crypto.randomUUID();
   const payloadDb = { action, args: argsForDb ?? {} };
 
-  const created = await prisma.command.create({
-    data: {
-      deviceId: device.id,
-      cmdId,
-      payload: payloadDb,
-      status: "PENDING",
-    },
-    select: { sentAt: true },
-  });
+  let created;
+  try {
+    created = await prisma.command.create({
+      data: {
+        deviceId: device.id,
+        cmdId,
+        payload: payloadDb,
+        status: "PENDING",
+      },
+      select: { sentAt: true },
+    });
+  } catch (e) {
+    // Same client cmdId retried: already recorded and published.
+    if (clientCmdId && e?.code === "P2002") return { cmdId, status: "PENDING" };
+    throw e;
+  }
 
   const topic = `home/zb/${device.zigbeeIeee}/set`;
   const argsOut = argsForPublish ?? argsForDb ?? {};
@@ -2771,6 +2904,9 @@ app.post("/devices/:id/command", authRequired, async (req, res) => {
       return res.status(400).json({ error: "params must be an object" });
     }
     payload = { action, args: params };
+    if (body.cmdId != null && !/^[A-Za-z0-9-]{8,36}$/.test(String(body.cmdId))) {
+      return res.status(400).json({ error: "cmdId must be 8-36 characters [A-Za-z0-9-]" });
+    }
   } else {
     const validation = validateCommandForType(device.type, body);
     if (!validation.ok) return res.status(400).json({ error: validation.error });
@@ -2812,6 +2948,7 @@ app.post("/devices/:id/command", authRequired, async (req, res) => {
         action: payload.action,
         argsForDb,
         argsForPublish,
+        clientCmdId: body.cmdId != null ? String(body.cmdId) : undefined,
       });
       return res.status(201).json(r);
     } catch (e) {
@@ -3233,8 +3370,25 @@ async function openZigbeePairingSession(req, res, input) {
     }
   }
 
+  // Bulk onboarding: long window + install codes + IEEEs bound without a manual confirm.
+  const bulk = !!input?.bulk;
+  const autoAccept = bulk ? [...new Set((input?.autoAccept || []).map((x) => normalizeIeee(x)).filter(Boolean))] : [];
+  const installCodes = [];
+  if (bulk) {
+    for (const ic of input?.installCodes || []) {
+      const ieee = normalizeIeee(ic?.ieee);
+      if (!ieee) {
+        res.status(400).json({ error: `invalid install code ieee: ${ic?.ieee}` });
+        return null;
+      }
+      installCodes.push({ ieee, code: ic.code });
+    }
+  }
+
   const token = crypto.randomUUID();
-  const durationSec = getPairingDurationSec({ durationSec: input?.durationSec ?? 60 });
+  const durationSec = bulk
+    ? Math.max(30, Math.min(1800, Math.floor(Number(input?.durationSec) || 600)))
+    : getPairingDurationSec({ durationSec: input?.durationSec ?? 60 });
   const expiresAt = new Date(Date.now() + durationSec * 1000);
 
   await prisma.zigbeePairingSession.create({
@@ -3246,15 +3400,25 @@ async function openZigbeePairingSession(req, res, input) {
       mode,
       claimedSerial,
       expectedModelId: expectedModelId || null,
+      bulk,
+      autoAccept: bulk ? autoAccept : undefined,
       expiresAt,
     },
   });
 
-  mqttClient.publish(
-    `home/hub/${hubId}/zigbee/pairing/open`,
-    JSON.stringify({ token, durationSec, mode, claimedSerial, expectedModelId: expectedModelId || null }),
-    { qos: 1 },
-  );
+  if (bulk) {
+    mqttClient.publish(
+      `home/hub/${hubId}/zigbee/pairing/bulk`,
+      JSON.stringify({ token, durationSec, installCodes, autoAccept }),
+      { qos: 1 },
+    );
+  } else {
+    mqttClient.publish(
+      `home/hub/${hubId}/zigbee/pairing/open`,
+      JSON.stringify({ token, durationSec, mode, claimedSerial, expectedModelId: expectedModelId || null }),
+      { qos: 1 },
+    );
+  }
 
   return {
     token,
@@ -3264,6 +3428,9 @@ async function openZigbeePairingSession(req, res, input) {
     mode,
     claimedSerial,
     expectedModelId: expectedModelId || null,
+    bulk,
+    installCodes: installCodes.length,
+    autoAccept,
   };
 }
 
@@ -3617,6 +3784,37 @@ app.post("/hubs/:hubId/pairing/open", authRequired, async (req, res) => {
   res.status(201).json({ token: result.token, expiresAt: result.expiresAt, hubId: result.hubId, homeId: result.homeId, mode: result.mode });
 });
 
+/**
+ * Bulk onboarding: one pairing window (up to 30 min) for many devices.
+ * The hub loads install codes into the coordinator before permitting joins and reports
+ * progress on home/hub/<hubId>/zigbee/pairing/progress. Devices in autoAccept are bound
+ * as soon as their discovered record arrives; the rest are confirmed as usual.
+ */
+app.post("/hubs/:hubId/pairing/bulk", authRequired, async (req, res) => {
+  const parsed = zigbeeBulkPairingSchema.safeParse({ ...req.body, hubId: req.params.hubId });
+  if (!parsed.success) return res.status(400).json({ error: parsed.error.flatten() });
+
+  const result = await openZigbeePairingSession(req, res, {
+    hubId: req.params.hubId,
+    homeId: parsed.data.homeId ?? null,
+    durationSec: parsed.data.durationSec ?? 600,
+    mode: "LEGACY",
+    bulk: true,
+    installCodes: parsed.data.installCodes ?? [],
+    autoAccept: parsed.data.autoAccept ?? [],
+  });
+  if (!result) return;
+
+  res.status(201).json({
+    token: result.token,
+    expiresAt: result.expiresAt,
+    hubId: result.hubId,
+    homeId: result.homeId,
+    installCodes: result.installCodes,
+    autoAccept: result.autoAccept,
+  });
+});
+
 app.get("/hubs/:hubId/pairing/discovered", authRequired, async (req, res) => {
   const token = String(req.query.token || "").trim();
   if (!token) return res.status(400).json({ error: "token required" });
@@ -3855,84 +4053,33 @@ async function createZigbeeDeviceFromToken(req, res, token, ieeeRaw, input) {
       where: { serial: inv.serial },
       data: { status: "BOUND" },
     }).catch(() => {});
-  } else {
-    // TYPE_FIRST / LEGACY: bind by IEEE (unique)
-    const existing = await prisma.device.findUnique({ where: { zigbeeIeee: ieee }, select: { deviceId: true } }).catch(() => null);
-    const deviceId = existing?.deviceId || crypto.randomUUID();
-    device = await prisma.device.upsert({
-      where: { deviceId },
-      update: {
-        homeId,
-        roomId: targetRoomId,
-        name: finalName,
-        type: finalType,
-        protocol: "ZIGBEE",
-        modelId: chosenModelId ?? null,
-        zigbeeIeee: ieee,
-        hubId: session.hubId,
-        legacyTopicBase: `home/zb/${ieee}`,
-        lifecycleStatus: "BOUND",
-        boundAt: now,
-        unboundAt: null,
-        lastProvisionedAt: now,
-      },
-      create: {
-        name: finalName,
-        type: finalType,
-        protocol: "ZIGBEE",
-        deviceId,
-        homeId,
-        roomId: targetRoomId,
-        createdById: req.user.id,
-        modelId: chosenModelId ?? null,
-        zigbeeIeee: ieee,
-        hubId: session.hubId,
-        legacyTopicBase: `home/zb/${ieee}`,
-        lifecycleStatus: "BOUND",
-        boundAt: now,
-        lastProvisionedAt: now,
-      },
-    });
-  }
-
-  await prisma.deviceStateCurrent.upsert({
-    where: { deviceId: device.id },
-    update: {},
-    create: { deviceId: device.id, state: null, online: false },
-  });
-
-  // Mark discovered row as CONFIRMED (best-effort)
-  await prisma.zigbeeDiscoveredDevice
-    .update({ where: { hubId_ieee: { hubId: session.hubId, ieee } }, data: { status: "CONFIRMED", homeId, ownerId: req.user.id, suggestedModelId: chosenModelId ?? discovered?.suggestedModelId ?? null } })
-    .catch(() => {});
 
-  // Notify hub host so it can configure bind/report if needed.
-  mqttClient.publish(
-    `home/hub/${session.hubId}/zigbee/pairing/confirm`,
-    JSON.stringify({
+    await confirmZigbeeBind(mqttClient, {
+      device,
+      hubId: session.hubId,
+      homeId,
+      userId: req.user.id,
       token,
       ieee,
+      suggestedModelId: chosenModelId ?? discovered?.suggestedModelId ?? null,
+      mode: sessionMode,
+    });
+  } else {
+    // TYPE_FIRST / LEGACY: bind by IEEE (unique)
+    device = await bindZigbeeDeviceByIeee(mqttClient, {
+      hubId: session.hubId,
       homeId,
-      deviceId: device.deviceId,
-      deviceDbId: device.id,
+      userId: req.user.id,
+      token,
+      ieee,
+      name: finalName,
       type: finalType,
+      roomId: targetRoomId,
       modelId: chosenModelId ?? null,
-    }),
-    { qos: 1 },
-  );
-
-  appendLogLine("audit.log", {
-    ts: new Date().toISOString(),
-    event: "device.bound",
-    userId: req.user.id,
-    homeId,
-    hubId: session.hubId,
-    ieee,
-    deviceId: device.deviceId,
-    deviceDbId: device.id,
-    modelId: chosenModelId ?? null,
-    mode: sessionMode,
-  });
+      suggestedModelId: discovered?.suggestedModelId ?? null,
+      mode: sessionMode,
+    });
+  }
 
   // attach descriptor in response when useful
   device.productModel = productModel || null;
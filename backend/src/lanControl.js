@@ -0,0 +1,95 @@
+import crypto from "crypto";
+
+function getNumberEnv(name, fallback) {
+  const v = Number(process.env[name]);
+  return Number.isFinite(v) && v > 0 ? v : fallback;
+}
+
+function lanSecret() {
+  return process.env.LAN_TOKEN_SECRET || process.env.JWT_SECRET || "dev_secret_change_me";
+}
+
+function b64url(buf) {
+  return Buffer.from(buf).toString("base64").replace(/=+$/g, "").replace(/\+/g, "-").replace(/\//g, "_");
+}
+
+/**
+ * Per-hub LAN key (32 bytes, hex). Derived from the server secret so nothing
+ * extra has to be stored; rotating LAN_TOKEN_SECRET rotates every hub key.
+ */
+export function deriveHubLanKey(hubId) {
+  return crypto.createHmac("sha256", lanSecret()).update(`lan-key:${hubId}`).digest("hex");
+}
+
+/**
+ * Zigbee network backup key (32 bytes, hex), per home so a replacement hub in
+ * the same home opens the previous hub's backups. Its own secret, independent
+ * of the LAN key; the hub only ever receives it inside the sealed lan/key
+ * envelope and keeps it in NVS.
+ */
+export function deriveZigbeeBackupKey(homeId) {
+  const secret = process.env.ZB_BACKUP_SECRET || `zb-backup:${lanSecret()}`;
+  return crypto.createHmac("sha256", secret).update(`zb-backup:home:${homeId}`).digest("hex");
+}
+
+/** Signature of a short-lived restore download link (the blob is sealed; this only limits who can pull it). */
+export function zigbeeBackupUrlSig(hubId, link, exp) {
+  const secret = process.env.ZB_BACKUP_SECRET || `zb-backup:${lanSecret()}`;
+  return crypto.createHmac("sha256", secret).update(`zb-backup-url:${hubId}:${link}:${exp}`).digest("hex");
+}
+
+/**
+ * Short-lived LAN control token, verified offline by the hub:
+ *   <base64url(json)>.<base64url(HMAC-SHA256(hubLanKey, base64url(json)))>
+ * json = { hub, home, uid, iat, exp } (seconds)
+ */
+export function issueLanToken({ hubId, homeId, userId }) {
+  const ttlSec = getNumberEnv("LAN_TOKEN_TTL_SEC", 12 * 3600);
+  const iat = Math.floor(Date.now() / 1000);
+  const exp = iat + ttlSec;
+  const body = b64url(JSON.stringify({ hub: hubId, home: homeId, uid: userId, iat, exp }));
+  const key = Buffer.from(deriveHubLanKey(hubId), "hex");
+  const sig = b64url(crypto.createHmac("sha256", key).update(body).digest());
+  return { token: `${body}.${sig}`, expiresAt: new Date(exp * 1000).toISOString() };
+}
+
+/** Hub key-wrapping public key: P-256, uncompressed, hex ("04" + X + Y). */
+export function isHubLanPubKey(hex) {
+  return typeof hex === "string" && /^04[0-9a-f]{128}$/i.test(hex);
+}
+
+/**
+ * Provision the LAN key to the hub, sealed to the hub's pinned lan/pub key so
+ * it never sits on the broker in clear (retained so a rebooted hub picks it up):
+ *   { v:2, keyId, epk, iv, ct, tag } (hex)
+ *   AES-256-GCM, AAD = hubId, key = SHA-256(ECDH(epk, hubPub) || "lan-key-wrap:" || hubId)
+ *   plaintext { key, bak } (bak: Zigbee network backup key of the hub's home)
+ * Hub persists both in NVS so LAN control keeps working while the cloud is down.
+ */
+export function publishHubLanKey(client, { hubId, homeId, lanPubKey }) {
+  if (!isHubLanPubKey(lanPubKey)) return null;
+  const key = deriveHubLanKey(hubId);
+  const keyId = key.slice(0, 8);
+
+  const ecdh = crypto.createECDH("prime256v1");
+  const epk = ecdh.generateKeys();
+  const shared = ecdh.computeSecret(Buffer.from(lanPubKey, "hex"));
+  const kek = crypto.createHash("sha256").update(shared).update(`lan-key-wrap:${hubId}`).digest();
+  const iv = crypto.randomBytes(12);
+  const cipher = crypto.createCipheriv("aes-256-gcm", kek, iv);
+  cipher.setAAD(Buffer.from(hubId));
+  const inner = { key };
+  if (homeId != null) inner.bak = deriveZigbeeBackupKey(homeId);
+  const ct = Buffer.concat([cipher.update(JSON.stringify(inner)), cipher.final()]);
+
+  const envelope = {
+    v: 2,
+    keyId,
+    epk: epk.toString("hex"),
+    iv: iv.toString("hex"),
+    ct: ct.toString("hex"),
+    tag: cipher.getAuthTag().toString("hex"),
+  };
+  client.publish(`home/hub/${hubId}/lan/key`, JSON.stringify(envelope), { qos: 1, retain: true });
+  return keyId;
+}
@@ -0,0 +1,21 @@
+import fs from "fs";
+import path from "path";
+import { fileURLToPath } from "url";
+
+const __dirname = path.dirname(fileURLToPath(import.meta.url));
+
+// Resolved on first write: index.js loads .env only after its imports ran.
+let logDir = null;
+
+export function appendLogLine(filename, obj) {
+  try {
+    if (!logDir) {
+      logDir = process.env.LOG_DIR || path.join(__dirname, "..", "logs");
+      fs.mkdirSync(logDir, { recursive: true });
+    }
+    fs.appendFileSync(path.join(logDir, filename), JSON.stringify(obj) + "\n");
+  } catch (e) {
+    // never crash on logging
+    console.warn("[logger] failed to write log:", e?.message || e);
+  }
+}
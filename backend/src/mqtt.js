@@ -4,6 +4,8 @@ import { prisma } from "./prisma.js";
 import { emitToHome } from "./sse.js";
 import { normalizeIeee, suggestModelsByFingerprint, guessDeviceTypeFromModelId } from "./zigbee.js";
 import { handleAutomationSyncResult } from "./automation.js";
+import { isHubLanPubKey, publishHubLanKey } from "./lanControl.js";
+import { appendLogLine } from "./logFile.js";
 
 function nowIso() {
   return new Date().toISOString();
@@ -106,14 +108,14 @@ function parseHubTopic(topic) {
 
 
 function parseZigbeePlaneTopic(topic) {
-  // home/zb/<ieee>/{state|event|cmd_result}
+  // home/zb/<ieee>/{state|event|cmd_result|availability}
   const parts = topic.split("/");
   if (parts.length < 4) return null;
   if (parts[0] !== "home" || parts[1] !== "zb") return null;
   const ieee = normalizeIeee(parts[2]);
   if (!ieee) return null;
   const channel = parts[3];
-  if (!["state", "event", "cmd_result"].includes(channel)) return null;
+  if (!["state", "event", "cmd_result", "availability"].includes(channel)) return null;
   return { ieee, channel };
 }
 
@@ -450,6 +452,25 @@ async function handleHubZigbeeVersion({ hubId }, payloadObj) {
   });
 }
 
+async function handleHubZigbeeHealth({ hubId }, payloadObj) {
+  // expected: { ts, state, links:[...] } (retained, published by hub coordinator supervision)
+  if (!payloadObj || typeof payloadObj !== "object") return;
+  const state = typeof payloadObj.state === "string" ? payloadObj.state.slice(0, 20) : null;
+  if (!state) return;
+
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { homeId: true } });
+  if (!hub) return;
+
+  emitToHome(hub.homeId, "hub_zigbee_health", {
+    homeId: hub.homeId,
+    hubId,
+    state,
+    // One entry per coordinator link: { link, state, channel, devices, inflight, hb, metrics, ... }
+    links: Array.isArray(payloadObj.links) ? payloadObj.links.slice(0, 8) : [],
+    ts: payloadObj.ts ?? null,
+  });
+}
+
 async function handleHubOtaCmdResult({ hubId }, payloadObj) {
   // expected: { ts, cmdId, ok, code?, message?, version }
   if (!payloadObj || typeof payloadObj !== "object") return;
@@ -512,8 +533,8 @@ async function handleHubOtaCmdResult({ hubId }, payloadObj) {
   }
 }
 
-async function handleZigbeeDiscovered({ hubId }, payloadObj) {
-  // expected: { token, ieee, shortAddr, manufacturer, model, swBuildId? }
+async function handleZigbeeDiscovered({ hubId }, payloadObj, client) {
+  // expected: { token, ieee, shortAddr, manufacturer, model, swBuildId?, interviewOk?, endpoints?, autoAccepted? }
   if (!payloadObj?.token || !payloadObj?.ieee) return;
 
   const normIeee = normalizeIeee(payloadObj.ieee);
@@ -554,6 +575,14 @@ async function handleZigbeeDiscovered({ hubId }, payloadObj) {
   const suggestedModelId = suggestions[0]?.modelId ?? null;
   const suggestedType = suggestedModelId ? guessDeviceTypeFromModelId(suggestedModelId) : (payloadObj.suggestedType ?? null);
 
+  // Coordinator interview (absent on legacy coordinators)
+  const endpoints = Array.isArray(payloadObj.endpoints) ? payloadObj.endpoints.slice(0, 8) : undefined;
+  const interviewOk = typeof payloadObj.interviewOk === "boolean" ? payloadObj.interviewOk : undefined;
+
+  // Bulk onboarding: only IEEEs pre-registered on the session are bound without a confirm.
+  const autoAccepted =
+    !!session.bulk && Array.isArray(session.autoAccept) && session.autoAccept.includes(normIeee);
+
   await prisma.zigbeeDiscoveredDevice.upsert({
     where: { hubId_ieee: { hubId, ieee: normIeee } },
     update: {
@@ -564,6 +593,9 @@ async function handleZigbeeDiscovered({ hubId }, payloadObj) {
       swBuildId,
       suggestedModelId,
       suggestedType,
+      endpoints,
+      interviewOk,
+      autoAccepted,
       status: "PENDING",
       homeId,
       ownerId,
@@ -580,10 +612,17 @@ async function handleZigbeeDiscovered({ hubId }, payloadObj) {
       swBuildId,
       suggestedModelId,
       suggestedType,
+      endpoints,
+      interviewOk,
+      autoAccepted,
       status: "PENDING",
     },
   });
 
+  if (autoAccepted) {
+    await autoBindDiscoveredZigbee({ hubId, homeId, ownerId, token: payloadObj.token, ieee: normIeee, model, suggestedModelId, suggestedType }, client);
+  }
+
   // SERIAL_FIRST: create/update provisional Device (bind IEEE -> DeviceInventory.deviceUuid)
   if (session.mode === "SERIAL_FIRST" && session.claimedSerial) {
     const inv = await prisma.deviceInventory.findUnique({ where: { serial: session.claimedSerial } }).catch(() => null);
@@ -649,9 +688,150 @@ async function handleZigbeeDiscovered({ hubId }, payloadObj) {
     suggestedModelId,
     suggestedType,
     suggestions: suggestions.slice(0, 5),
+    interviewOk: interviewOk ?? null,
+    endpoints: endpoints ?? null,
+    autoAccepted,
+  });
+}
+
+// Last steps of every Zigbee bind (pairing confirm and bulk auto-accept): state row,
+// discovered row CONFIRMED, pairing/confirm to the hub so it configures
+// bind/report, and the audit entry.
+export async function confirmZigbeeBind(client, { device, hubId, homeId, userId, token, ieee, suggestedModelId, mode }) {
+  await prisma.deviceStateCurrent.upsert({
+    where: { deviceId: device.id },
+    update: {},
+    create: { deviceId: device.id, state: null, online: false },
+  });
+
+  await prisma.zigbeeDiscoveredDevice
+    .update({
+      where: { hubId_ieee: { hubId, ieee } },
+      data: { status: "CONFIRMED", homeId, ownerId: userId, suggestedModelId: suggestedModelId ?? null },
+    })
+    .catch(() => {});
+
+  client?.publish(
+    `home/hub/${hubId}/zigbee/pairing/confirm`,
+    JSON.stringify({
+      token,
+      ieee,
+      homeId,
+      deviceId: device.deviceId,
+      deviceDbId: device.id,
+      type: device.type,
+      modelId: device.modelId ?? null,
+    }),
+    { qos: 1 },
+  );
+
+  appendLogLine("audit.log", {
+    ts: new Date().toISOString(),
+    event: "device.bound",
+    userId,
+    homeId,
+    hubId,
+    ieee,
+    deviceId: device.deviceId,
+    deviceDbId: device.id,
+    modelId: device.modelId ?? null,
+    mode,
   });
 }
 
+// Binds a Zigbee device by IEEE (unique): LEGACY / TYPE_FIRST confirm and bulk
+// auto-accept. rename=false keeps the name/type/room of a device that is already
+// known and only fills in its model.
+export async function bindZigbeeDeviceByIeee(
+  client,
+  { hubId, homeId, userId, token, ieee, name, type, roomId = null, modelId = null, suggestedModelId = null, mode, rename = true },
+) {
+  const existing = await prisma.device.findUnique({ where: { zigbeeIeee: ieee }, select: { deviceId: true } }).catch(() => null);
+  const deviceId = existing?.deviceId || crypto.randomUUID();
+  const now = new Date();
+
+  const device = await prisma.device.upsert({
+    where: { deviceId },
+    update: {
+      homeId,
+      ...(rename ? { roomId, name, type, modelId } : { modelId: modelId ?? undefined }),
+      protocol: "ZIGBEE",
+      zigbeeIeee: ieee,
+      hubId,
+      legacyTopicBase: `home/zb/${ieee}`,
+      lifecycleStatus: "BOUND",
+      boundAt: now,
+      unboundAt: null,
+      lastProvisionedAt: now,
+    },
+    create: {
+      name,
+      type,
+      protocol: "ZIGBEE",
+      deviceId,
+      homeId,
+      roomId,
+      createdById: userId,
+      modelId,
+      zigbeeIeee: ieee,
+      hubId,
+      legacyTopicBase: `home/zb/${ieee}`,
+      lifecycleStatus: "BOUND",
+      boundAt: now,
+      lastProvisionedAt: now,
+    },
+  });
+
+  await confirmZigbeeBind(client, {
+    device,
+    hubId,
+    homeId,
+    userId,
+    token,
+    ieee,
+    suggestedModelId: modelId ?? suggestedModelId,
+    mode,
+  });
+  return device;
+}
+
+// Bulk onboarding auto-accept: same binding as a LEGACY confirm with the suggested model.
+async function autoBindDiscoveredZigbee({ hubId, homeId, ownerId, token, ieee, model, suggestedModelId, suggestedType }, client) {
+  const existing = await prisma.device.findUnique({ where: { zigbeeIeee: ieee }, select: { homeId: true } }).catch(() => null);
+  if (existing && existing.homeId !== homeId) {
+    log("warn", `[ZB] auto-accept skipped: ${ieee} is bound to another home`);
+    return;
+  }
+
+  const type = guessDeviceTypeFromModelId(suggestedModelId) || suggestedType || "relay";
+  const productModel = suggestedModelId
+    ? await prisma.productModel.findUnique({ where: { id: suggestedModelId }, select: { name: true } }).catch(() => null)
+    : null;
+  const name = productModel?.name || model || `${type}-${ieee.slice(-4)}`;
+
+  const dev = await bindZigbeeDeviceByIeee(client, {
+    hubId,
+    homeId,
+    userId: ownerId,
+    token,
+    ieee,
+    name,
+    type,
+    modelId: suggestedModelId ?? null,
+    mode: "AUTO_ACCEPT",
+    rename: false,
+  });
+
+  emitToHome(homeId, "device_bound", { homeId, hubId, ieee, deviceId: dev.deviceId, autoAccepted: true });
+}
+
+async function handleZigbeePairingProgress({ hubId }, payloadObj) {
+  // expected: { token, bulk, active, remainingSec, announced, interviewed, interviewFailed, autoAccepted, installCodes, installCodesLoaded, installCodesFailed?:[ieee] }
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { homeId: true } }).catch(() => null);
+  if (!hub?.homeId) return;
+  emitToHome(hub.homeId, "zigbee_pairing_progress", { hubId, ...payloadObj });
+}
+
 
 async function findSingleDeviceByZigbeeIeee(ieee) {
   const rows = await prisma.device.findMany({
@@ -798,6 +978,204 @@ async function handleZigbeePlaneEventMessage({ ieee }, payloadObj) {
   });
 }
 
+async function handleZigbeePlaneAvailabilityMessage({ ieee }, payloadObj) {
+  // expected: { online, ts, lastSeen? } (retained, hub availability tracker; transitions only)
+  if (!payloadObj || typeof payloadObj !== "object" || typeof payloadObj.online !== "boolean") return;
+  const device = await findSingleDeviceByZigbeeIeee(ieee);
+  if (!device) return;
+
+  const online = payloadObj.online;
+  const lastSeenMs = Number(payloadObj.lastSeen);
+  const lastSeen = Number.isFinite(lastSeenMs) && lastSeenMs > 1e12 ? new Date(lastSeenMs) : new Date();
+
+  const current = await prisma.deviceStateCurrent.findUnique({
+    where: { deviceId: device.id },
+    select: { online: true, firstSeenAt: true },
+  });
+  const prevOnline = current?.online;
+
+  const updateData = { online, lastSeen };
+  if (online && !current?.firstSeenAt) {
+    updateData.firstSeenAt = lastSeen;
+    updateData.everOnline = true;
+  }
+
+  await prisma.deviceStateCurrent.upsert({
+    where: { deviceId: device.id },
+    update: updateData,
+    create: {
+      deviceId: device.id,
+      state: null,
+      online,
+      lastSeen,
+      firstSeenAt: online ? lastSeen : null,
+      everOnline: online ? true : false,
+    },
+  });
+
+  if (prevOnline === null || prevOnline === undefined || prevOnline !== online) {
+    await prisma.deviceStateHistory.create({
+      data: { deviceId: device.id, state: null, online, lastSeen },
+    });
+  }
+
+  emitToHome(device.homeId, "device_status_changed", {
+    homeId: device.homeId,
+    deviceDbId: device.id,
+    deviceId: device.deviceId,
+    ieee,
+    online,
+    lastSeen: lastSeen.toISOString(),
+    protocol: "ZIGBEE",
+  });
+}
+
+async function handleHubLanPub({ hubId }, payloadObj, client) {
+  // expected: { alg:"p256", pub:"04..." } (retained, re-published by the hub on every connect)
+  const pub = String(payloadObj?.pub || "").toLowerCase();
+  if (!isHubLanPubKey(pub)) return;
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { hubId: true, homeId: true, lanPubKey: true } });
+  if (!hub) return;
+  if (hub.lanPubKey && hub.lanPubKey !== pub) {
+    // Pinned at first sight; only hub (re)activation clears the pin.
+    log("warn", "hub lan/pub differs from pinned key (ignored)", { hubId });
+    return;
+  }
+  if (!hub.lanPubKey) await prisma.hub.update({ where: { hubId }, data: { lanPubKey: pub } });
+  publishHubLanKey(client, { hubId, homeId: hub.homeId, lanPubKey: pub });
+}
+
+async function handleHubZigbeeBackupSummary({ hubId, link }, payloadObj, client) {
+  // expected: { ts, link, bytes, devices, nvram } (retained after every backup; the blob itself is not retained)
+  const ts = Number(payloadObj?.ts);
+  if (!Number.isFinite(ts) || ts <= 0) return;
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { hubId: true } });
+  if (!hub) return;
+  const have = await prisma.hubZigbeeBackup.findUnique({
+    where: { hubId_link: { hubId, link } },
+    select: { takenAt: true },
+  });
+  if (have && have.takenAt.getTime() >= ts) return;
+  // Newer than our copy (or we missed the blob while offline): ask the hub for it.
+  client.publish(`home/hub/${hubId}/zigbee/backup/get`, JSON.stringify({ link }), { qos: 1, retain: false });
+}
+
+async function handleHubZigbeeBackupBlob({ hubId, link }, payloadObj) {
+  // expected: { ts, link, bytes, devices, nvram, blob:"<base64 sealed blob>" } (non-retained)
+  const ts = Number(payloadObj?.ts);
+  const blob = typeof payloadObj?.blob === "string" ? Buffer.from(payloadObj.blob, "base64") : null;
+  if (!Number.isFinite(ts) || ts <= 0 || !blob || blob.length < 32 || blob.length > 128 * 1024) return;
+  if (blob.subarray(0, 3).toString("latin1") !== "ZBE") return;
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { hubId: true } });
+  if (!hub) return;
+  const data = {
+    takenAt: new Date(ts),
+    bytes: blob.length,
+    devices: Math.max(0, Number(payloadObj?.devices) || 0),
+    blob,
+  };
+  await prisma.hubZigbeeBackup.upsert({
+    where: { hubId_link: { hubId, link } },
+    update: data,
+    create: { hubId, link, ...data },
+  });
+  log("info", "zigbee backup stored", { hubId, link, bytes: blob.length, devices: data.devices });
+}
+
+async function handleHubZigbeeLastSeen({ hubId }, payloadObj) {
+  // expected: { ts, devices: { <ieee>: <epochMs>, ... } } (retained, periodic index from hub)
+  const devices = payloadObj?.devices;
+  if (!devices || typeof devices !== "object") return;
+
+  const entries = Object.entries(devices)
+    .map(([k, v]) => [normalizeIeee(k), Number(v)])
+    .filter(([k, v]) => k && Number.isFinite(v) && v > 1e12)
+    .slice(0, 256);
+  if (!entries.length) return;
+
+  const rows = await prisma.device.findMany({
+    where: { zigbeeIeee: { in: entries.map(([k]) => k) } },
+    select: { id: true, zigbeeIeee: true },
+  });
+  const byIeee = new Map(rows.map((r) => [r.zigbeeIeee, r.id]));
+
+  // Only refresh lastSeen here; online/offline comes from availability transitions.
+  for (const [ieee, ms] of entries) {
+    const deviceDbId = byIeee.get(ieee);
+    if (!deviceDbId) continue;
+    await prisma.deviceStateCurrent
+      .updateMany({ where: { deviceId: deviceDbId }, data: { lastSeen: new Date(ms) } })
+      .catch(() => {});
+  }
+  log("debug", "zigbee last_seen index applied", { hubId, count: entries.length });
+}
+
+async function handleDeviceTopicMessage(devParsed, message) {
+  if (devParsed.channel === "state") {
+    const pj = safeJsonParse(message);
+    if (!pj.ok) return;
+    await handleStateMessage(devParsed, pj.value);
+    return;
+  }
+  if (devParsed.channel === "status") {
+    await handleStatusMessage(devParsed, message);
+    return;
+  }
+  if (devParsed.channel === "ack") {
+    const pj = safeJsonParse(message);
+    if (!pj.ok) return;
+    await handleAckMessage(devParsed, pj.value);
+  }
+}
+
+async function handleHubBridgeBatch({ hubId }, payloadObj) {
+  // expected: { ts, items: [{ t: "home/<homeId>/device/<id>/<channel>", p: <json|string>, r }] }
+  const items = Array.isArray(payloadObj?.items) ? payloadObj.items.slice(0, 64) : [];
+  if (!items.length) return;
+
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { homeId: true } }).catch(() => null);
+  if (!hub?.homeId) {
+    log("warn", "bridge batch from unbound hub ignored", { hubId, count: items.length });
+    return;
+  }
+
+  let applied = 0;
+  for (const it of items) {
+    const devParsed = typeof it?.t === "string" ? parseDeviceTopic(it.t) : null;
+    // A hub may only speak for devices of its own home.
+    if (!devParsed || devParsed.homeId !== hub.homeId) continue;
+    const raw = typeof it.p === "string" ? it.p : JSON.stringify(it.p ?? null);
+    await handleDeviceTopicMessage(devParsed, Buffer.from(raw, "utf8"));
+    applied++;
+  }
+  log("debug", "bridge batch applied", { hubId, applied, total: items.length });
+}
+
+async function handleHubAnalyticsSummary({ hubId }, payloadObj) {
+  // expected: { ts, windowMs, raw, sensors: [{ ieee, metric, n, min, max, mean, last, ewma, std, anomalies?, active? }] }
+  const sensors = Array.isArray(payloadObj?.sensors) ? payloadObj.sensors.slice(0, 64) : [];
+  if (!sensors.length) return;
+
+  const hub = await prisma.hub.findUnique({ where: { hubId }, select: { homeId: true } }).catch(() => null);
+  if (hub?.homeId) {
+    emitToHome(hub.homeId, "analytics_summary", { hubId, ts: payloadObj.ts ?? null, windowMs: payloadObj.windowMs ?? null, sensors });
+  }
+
+  // Hub stopped forwarding raw TH reports: the summary's last value is the current state.
+  if (payloadObj.raw !== false) return;
+  const byIeee = new Map();
+  for (const s of sensors) {
+    const ieee = normalizeIeee(s?.ieee);
+    if (!ieee || typeof s.metric !== "string" || !Number.isFinite(Number(s.last))) continue;
+    const reported = byIeee.get(ieee) ?? {};
+    reported[s.metric] = Number(s.last);
+    byIeee.set(ieee, reported);
+  }
+  for (const [ieee, reported] of byIeee) {
+    await handleZigbeePlaneStateMessage({ ieee }, { ts: payloadObj.ts ?? null, reported });
+  }
+}
+
 async function handleZigbeePlaneCmdResultMessage({ ieee }, payloadObj) {
   const device = await findSingleDeviceByZigbeeIeee(ieee);
   if (!device) return;
@@ -835,6 +1213,10 @@ async function handleZigbeePlaneCmdResultMessage({ ieee }, payloadObj) {
       ackedAt: now.toISOString(),
       error: errorText,
       protocol: "ZIGBEE",
+      // Coordinator-tracked delivery: round trip to the device's answer, attempts used, "zcl" | "aps".
+      ...(Number.isFinite(payloadObj?.ms) ? { latencyMs: payloadObj.ms } : {}),
+      ...(Number.isFinite(payloadObj?.attempts) ? { attempts: payloadObj.attempts } : {}),
+      ...(typeof payloadObj?.confirm === "string" ? { confirm: payloadObj.confirm } : {}),
     });
   }
 
@@ -1037,9 +1419,12 @@ export function subscribeIngestTopics(client) {
   // Hub topics
   client.subscribe("home/hub/+/status", { qos: 0 }, (err) => err && log("warn", "subscribe hub status failed", err));
   client.subscribe("home/hub/+/zigbee/discovered", { qos: 0 }, (err) => err && log("warn", "subscribe zigbee discovered failed", err));
+  client.subscribe("home/hub/+/zigbee/pairing/progress", { qos: 0 }, (err) => err && log("warn", "subscribe zigbee pairing progress failed", err));
   // Sprint 7: Hub OTA + Zigbee coordinator fwVersion
   client.subscribe("home/hub/+/ota/cmd_result", { qos: 0 }, (err) => err && log("warn", "subscribe hub ota cmd_result failed", err));
   client.subscribe("home/hub/+/zigbee/version", { qos: 0 }, (err) => err && log("warn", "subscribe hub zigbee version failed", err));
+  // Coordinator liveness supervision (retained)
+  client.subscribe("home/hub/+/zigbee/health", { qos: 0 }, (err) => err && log("warn", "subscribe hub zigbee health failed", err));
 
   // Sprint 8: Automation rules sync_result ingest
   client.subscribe("home/hub/+/automation/sync_result", { qos: 0 }, (err) => err && log("warn", "subscribe hub automation sync_result failed", err));
@@ -1048,6 +1433,17 @@ export function subscribeIngestTopics(client) {
   client.subscribe("home/zb/+/state", { qos: 0 }, (err) => err && log("warn", "subscribe zb state failed", err));
   client.subscribe("home/zb/+/event", { qos: 0 }, (err) => err && log("warn", "subscribe zb event failed", err));
   client.subscribe("home/zb/+/cmd_result", { qos: 0 }, (err) => err && log("warn", "subscribe zb cmd_result failed", err));
+  client.subscribe("home/zb/+/availability", { qos: 0 }, (err) => err && log("warn", "subscribe zb availability failed", err));
+  client.subscribe("home/hub/+/zigbee/last_seen", { qos: 0 }, (err) => err && log("warn", "subscribe zigbee last_seen failed", err));
+  // Wi-Fi devices behind the hub's LAN broker (coalesced state)
+  client.subscribe("home/hub/+/bridge/batch", { qos: 1 }, (err) => err && log("warn", "subscribe hub bridge batch failed", err));
+  // LAN control: hub key-wrapping public key (retained)
+  client.subscribe("home/hub/+/lan/pub", { qos: 1 }, (err) => err && log("warn", "subscribe hub lan pub failed", err));
+  // Zigbee network backup: retained summary per link, blob on request (never retained)
+  client.subscribe("home/hub/+/zigbee/backup/+", { qos: 1 }, (err) => err && log("warn", "subscribe zigbee backup failed", err));
+  client.subscribe("home/hub/+/zigbee/backup/+/blob", { qos: 1 }, (err) => err && log("warn", "subscribe zigbee backup blob failed", err));
+  // On-hub sensor analytics (anomalies arrive as home/zb/<ieee>/event type=sensor.anomaly)
+  client.subscribe("home/hub/+/analytics/summary", { qos: 0 }, (err) => err && log("warn", "subscribe hub analytics summary failed", err));
 
   // Diagnostics
   client.subscribe("diagnostics/#", { qos: 0 }, (err) => err && log("warn", "subscribe diagnostics failed", err));
@@ -1178,22 +1574,7 @@ export function connectMqttClient() {
 
       const devParsed = parseDeviceTopic(topic);
       if (devParsed) {
-        if (devParsed.channel === "state") {
-          const pj = safeJsonParse(message);
-          if (!pj.ok) return;
-          await handleStateMessage(devParsed, pj.value);
-          return;
-        }
-        if (devParsed.channel === "status") {
-          await handleStatusMessage(devParsed, message);
-          return;
-        }
-        if (devParsed.channel === "ack") {
-          const pj = safeJsonParse(message);
-          if (!pj.ok) return;
-          await handleAckMessage(devParsed, pj.value);
-          return;
-        }
+        await handleDeviceTopicMessage(devParsed, message);
         return;
       }
 
@@ -1206,7 +1587,13 @@ export function connectMqttClient() {
         if (hubParsed.rest.length === 2 && hubParsed.rest[0] === "zigbee" && hubParsed.rest[1] === "discovered") {
           const pj = safeJsonParse(message);
           if (!pj.ok) return;
-          await handleZigbeeDiscovered(hubParsed, pj.value);
+          await handleZigbeeDiscovered(hubParsed, pj.value, client);
+          return;
+        }
+        if (hubParsed.rest.length === 3 && hubParsed.rest[0] === "zigbee" && hubParsed.rest[1] === "pairing" && hubParsed.rest[2] === "progress") {
+          const pj = safeJsonParse(message);
+          if (!pj.ok) return;
+          await handleZigbeePairingProgress(hubParsed, pj.value);
           return;
         }
         if (hubParsed.rest.length === 2 && hubParsed.rest[0] === "zigbee" && hubParsed.rest[1] === "version") {
@@ -1215,6 +1602,45 @@ export function connectMqttClient() {
           await handleHubZigbeeVersion(hubParsed, pj.value);
           return;
         }
+        if (hubParsed.rest.length === 2 && hubParsed.rest[0] === "zigbee" && hubParsed.rest[1] === "health") {
+          const pj = safeJsonParse(message);
+          if (!pj.ok) return;
+          await handleHubZigbeeHealth(hubParsed, pj.value);
+          return;
+        }
+        if (hubParsed.rest.length === 2 && hubParsed.rest[0] === "zigbee" && hubParsed.rest[1] === "last_seen") {
+          const pj = safeJsonParse(message);
+          if (!pj.ok) return;
+          await handleHubZigbeeLastSeen(hubParsed, pj.value);
+          return;
+        }
+        if (hubParsed.rest.length >= 3 && hubParsed.rest[0] === "zigbee" && hubParsed.rest[1] === "backup" &&
+            /^[0-9]$/.test(hubParsed.rest[2])) {
+          const pj = safeJsonParse(message);
+          if (!pj.ok) return;
+          const target = { hubId: hubParsed.hubId, link: Number(hubParsed.rest[2]) };
+          if (hubParsed.rest.length === 3) await handleHubZigbeeBackupSummary(target, pj.value, client);
+          else if (hubParsed.rest.length === 4 && hubParsed.rest[3] === "blob") await handleHubZigbeeBackupBlob(target, pj.value);
+          return;
+        }
+        if (hubParsed.rest.length === 2 && hubParsed.rest[0] === "lan" && hubParsed.rest[1] === "pub") {
+          const pj = safeJsonParse(message);
+          if (!pj.ok) return;
+          await handleHubLanPub(hubParsed, pj.value, client);
+          return;
+        }
+        if (hubParsed.rest.length === 2 && hubParsed.rest[0] === "analytics" && hubParsed.rest[1] === "summary") {
+          const pj = safeJsonParse(message);
+          if (!pj.ok) return;
+          await handleHubAnalyticsSummary(hubParsed, pj.value);
+          return;
+        }
+        if (hubParsed.rest.length === 2 && hubParsed.rest[0] === "bridge" && hubParsed.rest[1] === "batch") {
+          const pj = safeJsonParse(message);
+          if (!pj.ok) return;
+          await handleHubBridgeBatch(hubParsed, pj.value);
+          return;
+        }
         if (hubParsed.rest.length === 2 && hubParsed.rest[0] === "ota" && hubParsed.rest[1] === "cmd_result") {
           const pj = safeJsonParse(message);
           if (!pj.ok) return;
@@ -1251,6 +1677,10 @@ export function connectMqttClient() {
           await handleZigbeePlaneCmdResultMessage(zbParsed, pj.value);
           return;
         }
+        if (zbParsed.channel === "availability") {
+          await handleZigbeePlaneAvailabilityMessage(zbParsed, pj.value);
+          return;
+        }
       }
 
 
@@ -164,6 +164,31 @@ export const deviceClaimSchema = z.object({
   room: z.string().min(1).max(80).optional().nullable(),
 });
 
+// On-hub sensor analytics (hub_host SENSOR ANALYTICS); missing keys keep hub defaults.
+const analyticsMetricSchema = z.object({
+  rocPerMin: z.number().min(0).max(1000).optional(),
+  stuckMin: z.number().int().min(0).max(7 * 24 * 60).optional(),
+  stuckEps: z.number().min(0).max(100).optional(),
+  min: z.number().optional().nullable(),
+  max: z.number().optional().nullable(),
+});
+
+export const analyticsConfigSchema = z.object({
+  enabled: z.boolean().optional(),
+  forwardRaw: z.boolean().optional(),
+  alpha: z.number().min(0.001).max(1).optional(),
+  z: z.number().min(1).max(20).optional(),
+  warmup: z.number().int().min(2).max(1000).optional(),
+  cooldownSec: z.number().int().min(0).max(86400).optional(),
+  summarySec: z.number().int().min(30).max(86400).optional(),
+  metrics: z
+    .object({
+      temperature: analyticsMetricSchema.optional(),
+      humidity: analyticsMetricSchema.optional(),
+    })
+    .optional(),
+});
+
 export const zigbeeOpenPairingSchema = z.object({
   // Sprint 1 legacy: {homeId, hubId?, durationSec?}
   // Sprint 2: add Xiaomi-style flows (mode + claimedSerial/expectedModelId)
@@ -176,6 +201,28 @@ export const zigbeeOpenPairingSchema = z.object({
   expectedModelId: z.string().min(1).max(50).optional().nullable(),
 });
 
+// Bulk onboarding: one long window, install codes loaded before joins, auto-accept list.
+export const zigbeeBulkPairingSchema = z.object({
+  homeId: z.number().int().positive().optional().nullable(),
+  hubId: z.string().min(2).max(80).optional().nullable(),
+  durationSec: z.number().int().min(30).max(1800).optional().nullable(),
+  installCodes: z
+    .array(
+      z.object({
+        ieee: z.string().min(4).max(64),
+        // Install code incl. CRC-16 as hex (8/10/14/18 bytes); separators allowed.
+        code: z
+          .string()
+          .transform((s) => s.replace(/[^0-9a-fA-F]/g, "").toUpperCase())
+          .refine((s) => [16, 20, 28, 36].includes(s.length), "code must be 8/10/14/18 bytes of hex incl. CRC"),
+      }),
+    )
+    .max(32)
+    .optional()
+    .nullable(),
+  autoAccept: z.array(z.string().min(4).max(64)).max(64).optional().nullable(),
+});
+
 export const zigbeePairingConfirmSchema = z.object({
   hubId: z.string().min(2).max(80).optional().nullable(),
   token: z.string().min(6).max(80),
@@ -24,24 +24,78 @@
     - Sub: home/zb/<ieee>/set
     - Pub: home/zb/<ieee>/state (retain)
     - Pub: home/zb/<ieee>/cmd_result
+    - Pub: home/hub/<HUB_ID>/zigbee/health (retain, coordinator supervision)
+    - Pub: home/hub/<HUB_ID>/zigbee/last_seen (retain, periodic last-seen index)
+    - Pub: home/zb/<ieee>/availability (retain, online/offline transitions)
+    - Pub: home/hub/<HUB_ID>/lan/pub (retain, P-256 public key the backend seals the LAN key to)
+    - Sub: home/hub/<HUB_ID>/lan/key (retain, sealed LAN control key from backend)
+    - Sub: home/hub/<HUB_ID>/lanbroker/config (retain, local MQTT broker on/off + credentials)
+    - Pub: home/hub/<HUB_ID>/bridge/batch (coalesced state from LAN Wi-Fi devices)
+    - Pub: home/<homeId>/device/<id>/set + Sub .../ack (automation actions kind "MQTT")
+    - Sub: home/hub/<HUB_ID>/analytics/config (retain, sensor anomaly detectors)
+    - Pub: home/hub/<HUB_ID>/analytics/summary (periodic per-sensor summary)
+    - Sub: home/hub/<HUB_ID>/profile/cmd (sampling profiler start/stop/dump, stall threshold)
+    - Pub: home/hub/<HUB_ID>/profile/report + profile/stall (raw PCs, see backend/scripts/hub-profile.js)
+    - Sub: home/hub/<HUB_ID>/zigbee/backup/run + backup/get + zigbee/restore (coordinator replacement)
+    - Pub: home/hub/<HUB_ID>/zigbee/backup/<link> (retain, summary only) + backup/<link>/blob (encrypted,
+      not retained) + zigbee/backup/state
+
+  LAN control (same LAN as the phone, no cloud round-trip):
+    - mDNS: <HUB_ID>.local, service _smarthome._tcp (port LAN_HTTP_PORT)
+    - GET  /info  -> {hubId, fwVersion, ws}
+    - WS   /ws    -> first frame {"type":"auth","token":"<backend-issued>"}
+                     then {"type":"set","ieee":"...","body":{cmdId, action, args}}
+                     (body = exactly the home/zb/<ieee>/set payload)
+                     {"type":"ping","t":123} -> {"type":"pong","t":123}
+                  <- {"type":"state"|"event"|"cmd_result"|"availability","ieee":"...","data":{...}}
+    - MQTT :1883 (optional, lanbroker/config) -> Wi-Fi devices connect to the hub,
+                  mDNS service _mqtt._tcp; see LAN MQTT BROKER section.
 
   UART protocol: newline-delimited JSON.
   - Coordinator -> hub:
       {"evt":"device_annce","ieee":"00124b0000000001","short":"0x1234"}
-      {"evt":"attr_report","ieee":"00124b0000000001","cluster":"onoff","attr":"onoff","value":1}
+      {"evt":"attr_report","ieee":"00124b0000000001","u":1,"attrs":[{"cluster":"temperature","attr":"value","value":23.45},
+        {"cluster":"humidity","attr":"value","value":41.2}]}  (one line per ZCL frame / short window;
+        "u":1 = values typed and in display units; without "u" (IDF / older coordinators, also the flat
+        "cluster","attr","value" form) temperature/humidity are raw x100)
       {"evt":"join_state","enabled":true,"duration":60}
       {"evt":"cmd_result","cmdId":"...","ieee":"00124b0000000001","ok":true}
+      {"evt":"cmd_sent","cmdId":"..."}  (tracked command transmitted; its cmd_result carries ms/attempts/confirm)
+      {"evt":"cmd_backpressure","on":true,"free":4,"payloadFree":3}  (hold device commands until on:false)
+      {"evt":"report_cfg","ieee":"...","ep":1,"cluster":1026,"op":"configure","ok":true,"attrs":[...]}
+        -> home/zb/<ieee>/event type "zigbee.report_cfg"
+      {"evt":"bind_table","ieee":"...","cmdId":"...","ok":true,"total":2,"entries":[{ep,cluster,dst|group,dstEp}]}
+        -> home/zb/<ieee>/event type "zigbee.bind_table"
+      {"evt":"bindings","items":[{src,ep,cluster,dst,dstEp,state}]}
+        -> home/hub/<id>/zigbee/bindings/<link> (retained)
+      {"evt":"net_backup","state":"begin"|"done"|"failed",...} / {"evt":"net_backup","k","off","len","data"}
+        -> sealed, kept in LittleFS and sent to home/hub/<id>/zigbee/backup/<link>/blob (see ZIGBEE NETWORK BACKUP)
+      {"evt":"net_restore","seq":3,"ok":true} / {"evt":"net_restore","state":"done","ok":true,...}
+      {"evt":"resync","state":"started"|"progress"|"done"|"stopped","devices":12,"reads":40,...}
+        -> home/hub/<id>/zigbee/resync/progress
       {"evt":"log","msg":"..."}
+      {"evt":"hb","seq":1,"up":2000,"q":0,"qMax":32,"zb":"formed","zbAgeMs":2,"heap":200000,"minHeap":190000,
+       "qHw":5,"poolMin":27,"plMin":6,"poolFail":0,"bp":false,"zbWakes":1830,"dispUsMax":410,"dispUsAvg":95,
+       "attrs":120,"attrLines":64}
   - Hub -> coordinator:
       {"cmd":"permit_join","duration":60}
       {"cmd":"zcl_onoff","ieee":"00124b0000000001","value":1,"cmdId":"..."}
       {"cmd":"zcl_level","ieee":"00124b0000000001","value":128,"cmdId":"..."}
       {"cmd":"remove_device","ieee":"00124b0000000001"}
+      {"cmd":"resync","rate":4,"sleepyWaitSec":600} / {"cmd":"resync","stop":true}
+      {"cmd":"bind"|"unbind","ieee":"...","endpoint":1,"cluster":6,"dst":"<ieee>","dstEp":1,"cmdId":"..."}
+        (unbind also takes "group":"0x0001" instead of dst/dstEp); {"cmd":"bind_table","ieee":"...","cmdId":"..."}
+      {"cmd":"bind_list"}
+      {"cmd":"net_backup"} / {"cmd":"net_restore","seq":0,"state":"begin"|"commit"|"abort",...}
+      {"cmd":"ping"} / {"cmd":"reboot"}   (coordinator supervision)
 
   Arduino IDE dependencies (Library Manager):
     - ArduinoJson (v6)
     - AsyncMqttClient
     - AsyncTCP (ESP32)
+    - ESPAsyncWebServer (LAN control WebSocket)
+    (lan_mqtt_broker.h/.cpp in this sketch folder: local MQTT broker on AsyncTCP)
+    (hub_profiler.h/.cpp in this sketch folder: sampling profiler + stall detector)
 
   Notes:
   - If Mosquitto runs in Docker on your PC, MQTT_HOST must be your PC LAN IP
@@ -62,17 +116,50 @@ struct auto_light_off_t;
 struct auto_evt_key_t;
 struct fp_entry_t;
 struct gate_state_t;
+struct th_state_t;
+struct attr_apply_t;
+struct avail_entry_t;
+struct lan_ws_client_t;
+struct coord_link_t;
+struct coord_link_cfg_t;
+struct link_tx_slot_t;
+struct link_tx_guard_t;
+struct zb_route_t;
+struct lan_bridge_item_t;
+struct auto_mqtt_pending_t;
+struct auto_rule_stats_t;
+struct ana_metric_cfg_t;
+struct ana_cfg_t;
+struct ana_stream_t;
+struct net_backup_rx_t;
+struct net_restore_tx_t;
 
 #include <WiFi.h>
 #include <AsyncTCP.h>
 #include <AsyncMqttClient.h>
+#include <ESPAsyncWebServer.h>
+#include <ESPmDNS.h>
 #include <ArduinoJson.h>
 #include <HTTPClient.h>
 #include <Update.h>
 #include "mbedtls/sha256.h"
+#include "mbedtls/md.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/gcm.h"
+#include "mbedtls/ecdh.h"
 #include <esp_system.h>
 #include <Preferences.h>
+#include <LittleFS.h>
 #include <time.h>
+#include <sys/time.h>
+#include <esp_idf_version.h>
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include <esp_app_desc.h>
+#else
+#include <esp_ota_ops.h>
+#endif
+#include "lan_mqtt_broker.h"
+#include "hub_profiler.h"
 
 // ----------------- CONFIG -----------------
 static const char* WIFI_SSID = "502_vtv1";
@@ -109,6 +196,30 @@ static const int UART2_RX = 16; // Hub RX2 (connect to C6 TX)
 static const int UART2_TX = 17; // Hub TX2 (connect to C6 RX)
 static const uint32_t UART_BAUD = 115200;
 
+// Coordinator supervision: GPIO wired to the C6 EN pin (active-low reset).
+// Set to -1 if EN is not wired; recovery then stops at the soft reboot step.
+static const int COORD_EN_PIN = 4;
+
+// Additional coordinators (one Zigbee network each, flash each C6 with a different ZB_CHANNEL).
+// Link 1 uses Serial1 remapped away from the flash pins.
+#ifndef COORD_LINK_COUNT
+#define COORD_LINK_COUNT 1
+#endif
+static const int UART1_RX = 26;     // Hub RX1 (connect to 2nd C6 TX)
+static const int UART1_TX = 27;     // Hub TX1 (connect to 2nd C6 RX)
+static const int COORD1_EN_PIN = 25;
+
+// Per-link flow control: device commands outstanding at the coordinator
+// (its command pool holds 32) and hub-side FIFO behind that.
+static const uint8_t LINK_MAX_INFLIGHT = 8;
+static const uint8_t LINK_TXQ_LEN = 8;
+static const size_t LINK_TXQ_LINE_MAX = 512;
+// A credit whose cmd_sent / cmd_result never came back is reclaimed after this
+// (covers sleepy-device retries and slow binds on the coordinator).
+static const uint32_t LINK_CREDIT_TIMEOUT_MS = 30000;
+// cmd_backpressure holds the FIFO at most this long if the matching on:false is lost.
+static const uint32_t LINK_BACKPRESSURE_MAX_MS = 3000;
+
 // ----------------- LIMITS / BUFFERS -----------------
 #ifndef MQTT_RX_BUF_SIZE
 #define MQTT_RX_BUF_SIZE 4096
@@ -116,11 +227,20 @@ static const uint32_t UART_BAUD = 115200;
 static char mqttRxBuf[MQTT_RX_BUF_SIZE];
 static bool mqttDropping = false;
 
-// UART line buffer size (newline-delimited JSON frames).
+// UART line buffer size (newline-delimited JSON frames), one per coordinator link.
 static const size_t UART_LINE_BUF_SIZE = 2048;// was 768
-static char uartLineBuf[UART_LINE_BUF_SIZE];
-static size_t uartLineLen = 0;
-static bool uartLineOverflow = false;
+
+// Zigbee network backup / restore (see ZIGBEE NETWORK BACKUP)
+static const size_t NET_BACKUP_MAX = 80 * 1024;                        // plain backup; 256 devices ~40 KB + stack NVRAM
+static const size_t NET_PART_BYTES = 192;                              // NVS bytes per UART line
+static const uint32_t NET_BACKUP_FIRST_MS = 10UL * 60UL * 1000UL;      // first periodic run after boot
+static const uint32_t NET_BACKUP_INTERVAL_MS = 3600UL * 1000UL;       // bounds the frame-counter gap on restore
+static const uint32_t NET_BACKUP_IDLE_MS = 15000;                      // coordinator stopped streaming
+static const uint32_t NET_RESTORE_ACK_MS = 3000;
+static const uint8_t NET_RESTORE_TRIES = 3;
+static const uint32_t NET_FETCH_CONNECT_MS = 3000;                     // restore download: connect + headers
+static const uint32_t NET_FETCH_IDLE_MS = 15000;                       // restore download: body stalled
+static const size_t NET_FETCH_CHUNK = 1024;                            // body bytes read per loop pass
 
 // Reconnect backoff
 static const uint32_t BACKOFF_MIN_MS = 1000;
@@ -133,6 +253,46 @@ static const uint32_t MQTT_CONNECT_TIMEOUT_MS = 10000;
 // Hub status heartbeat (optional, keeps retained fresh)
 static const uint32_t HUB_STATUS_HEARTBEAT_MS = 60000;
 
+// Coordinator supervision (coordinator sends {"evt":"hb"} every 2s)
+static const uint32_t COORD_HB_SILENCE_MS = 7000;      // no UART traffic at all
+static const uint32_t COORD_ZB_STUCK_MS = 5000;        // zb_task has not iterated
+static const uint32_t COORD_QUEUE_STUCK_MS = 10000;    // command queue full and not draining
+static const uint32_t COORD_SOFT_WAIT_MS = 3000;       // after ping
+static const uint32_t COORD_REBOOT_WAIT_MS = 10000;    // after {"cmd":"reboot"}
+static const uint32_t COORD_HARD_WAIT_MS = 12000;      // after EN pulse
+static const uint32_t COORD_EN_PULSE_MS = 50;
+static const uint32_t COORD_HARD_BACKOFF_MAX_MS = 300000;
+static const uint32_t COORD_HEALTH_PUBLISH_MS = 30000;
+
+// Device availability: offline after AVAIL_MISSED_REPORTS expected reports are missed.
+static const uint8_t AVAIL_MISSED_REPORTS = 3;
+static const uint32_t AVAIL_GRACE_MS = 5000;
+static const uint32_t AVAIL_DEFAULT_INTERVAL_MS = 15UL * 60UL * 1000UL; // unknown model
+static const uint32_t AVAIL_INDEX_PUBLISH_MS = 60000;
+
+// Sensor analytics (anomaly detectors per sensor metric, see SENSOR ANALYTICS)
+static const size_t ANA_STREAM_MAX = 64;     // TH_CACHE_SIZE sensors x 2 metrics
+static const size_t ANA_SUMMARY_CHUNK = 16;  // streams per summary message
+
+// LAN control (local WebSocket)
+static const uint16_t LAN_HTTP_PORT = 8080;
+static const size_t LAN_WS_MAX_CLIENTS = 4;
+static const uint32_t LAN_AUTH_TIMEOUT_MS = 5000;
+
+// Automation MQTT-device actions: no /ack within this window counts as a timeout.
+static const uint32_t AUTO_MQTT_ACK_TIMEOUT_MS = 3000;
+
+// LAN MQTT broker for Wi-Fi devices (off until enabled via lanbroker/config)
+static const uint16_t LAN_MQTT_PORT = 1883;
+static const uint32_t LAN_BRIDGE_BATCH_MS_DEFAULT = 250;
+static const size_t LAN_BRIDGE_PENDING_MAX = 32;       // distinct topics held between flushes
+static const size_t LAN_BRIDGE_BATCH_MAX_BYTES = 3072; // split larger batches
+
+// Profiler: timer always runs at the base rate for stall detection; profiles raise it.
+static const uint32_t PROF_BASE_HZ = 100;
+static const uint32_t PROF_STALL_MS_DEFAULT = 500;
+static const size_t PROF_REPORT_TOP = 64;
+
 // ----------------- GLOBALS -----------------
 AsyncMqttClient mqtt;
 
@@ -144,11 +304,34 @@ String tPairOpen;
 String tPairConfirm;
 String tPairReject;
 String tPairClose;
+String tPairBulk;
+String tPairProgress;
+String tZbResync;
+String tZbResyncProgress;
+String tZbTopology;
+String tZbBindings;
+String tZbBindingsGet;
+String tZbBackup;
+String tZbBackupRun;
+String tZbBackupState;
+String tZbBackupGet;
+String tZbRestore;
 String tDiscovered;
 String tHubStatus;
 String tHubZigbeeVersion;
+String tHubZigbeeHealth;
+String tHubZigbeeLastSeen;
+String tHubLanKey;
+String tHubLanPub;
+String tHubLanBrokerConfig;
+String tHubBridgeBatch;
+String tHubAnalyticsConfig;
+String tHubAnalyticsSummary;
 String tOtaCmd;
 String tOtaCmdResult;
+String tProfileCmd;
+String tProfileReport;
+String tProfileStall;
 String tZbSetWildcard = "home/zb/+/set";
 String tZbEventWildcard = "home/zb/+/event"; // Sprint 5: rule lock->gate
 
@@ -157,6 +340,15 @@ String tAutomationSync;
 String tAutomationSyncResult;
 String tAutomationEvent;
 
+// LAN control: mirror of data-plane publishes to authenticated local clients.
+static void lanBroadcast(const char* type, const String& ieee16, const String& payload);
+
+// Local MQTT broker for Wi-Fi devices on the same LAN.
+static LanMqttBroker gLanBroker;
+
+// Sampling profiler + loop/MQTT-callback stall detector.
+static HubProfiler gProf;
+
 // Sprint 5: automation rule config (NVS)
 static Preferences gRulePrefs;
 static String gRuleLockIeee;
@@ -193,6 +385,38 @@ struct auto_evt_key_t {
 static auto_evt_key_t gAutoEvtSeen[AUTO_EVENT_DEDUP_MAX];
 static uint8_t gAutoEvtSeenPtr = 0;
 
+// Cross-plane actions (kind "MQTT"): /set to a Wi-Fi device, correlated with its /ack.
+// Acks can arrive on the async_tcp task (local broker), so the table is under gAutoMqttMux;
+// completion/timeout reporting happens in automationTick().
+static const size_t AUTO_MQTT_PENDING_MAX = 16;
+struct auto_mqtt_pending_t {
+  bool used;
+  bool done;      // ack received, waiting for automationTick to report it
+  bool ok;
+  bool local;     // delivered through the LAN broker
+  char cmdId[33];
+  uint8_t ruleIdx;
+  uint32_t ruleId;
+  uint32_t sentMs;
+  uint32_t ackMs;
+  char error[48];
+};
+static auto_mqtt_pending_t gAutoMqttPending[AUTO_MQTT_PENDING_MAX];
+static portMUX_TYPE gAutoMqttMux = portMUX_INITIALIZER_UNLOCKED;
+
+struct auto_rule_stats_t {
+  uint32_t sent;
+  uint32_t acked;
+  uint32_t failed;
+  uint32_t timeouts;
+  uint32_t lastAckMs;
+  uint32_t maxAckMs;
+  uint32_t sumAckMs; // over acked+failed, for the average
+};
+static auto_rule_stats_t gAutoRuleStats[AUTO_RULE_MAX];
+
+static bool lanBrokerDeliverLocal(const String& topic, const String& payload);
+
 // OTA state
 static bool gOtaBusy = false;
 
@@ -258,6 +482,25 @@ static fp_entry_t* fp_upsert(const char* ieee16) {
   return &fpCache[oldest];
 }
 
+// Empty strings leave the cached value alone (fingerprints arrive piecemeal on legacy coordinators).
+static void fpUpdate(const String& ieee16, const char* manuf, const char* model, const char* swBuildId) {
+  fp_entry_t* fp = fp_upsert(ieee16.c_str());
+  if (!fp) return;
+  if (manuf && manuf[0]) {
+    strncpy(fp->manufacturer, manuf, sizeof(fp->manufacturer) - 1);
+    fp->manufacturer[sizeof(fp->manufacturer) - 1] = 0;
+  }
+  if (model && model[0]) {
+    strncpy(fp->model, model, sizeof(fp->model) - 1);
+    fp->model[sizeof(fp->model) - 1] = 0;
+  }
+  if (swBuildId && swBuildId[0]) {
+    strncpy(fp->swBuildId, swBuildId, sizeof(fp->swBuildId) - 1);
+    fp->swBuildId[sizeof(fp->swBuildId) - 1] = 0;
+  }
+  fp->lastUpdateMs = millis();
+}
+
 // -----------------
 // GATE_PIR_V1 state cache (needs full snapshot; no partial overwrites)
 // -----------------
@@ -278,7 +521,8 @@ static gate_state_t gateCache[GATE_CACHE_SIZE];
 // -----------------
 // TH_SENSOR_V1 state cache (needs full snapshot; no partial overwrites)
 // Contract:
-// - coordinator forwards ZCL attr_report value x100
+// - coordinator forwards attr_report already in °C / %RH (typed ZCL decoding, "u":1);
+//   lines without "u" carry raw x100 and are scaled in attrReportApply
 // - hub_host publishes retained home/zb/<ieee>/state {ts, reported:{temperature, humidity}}
 // -----------------
 
@@ -288,8 +532,8 @@ struct th_state_t {
   char ieee16[17];
   bool hasTemp;
   bool hasHum;
-  int32_t tempX100;
-  int32_t humX100;
+  float temp;
+  float hum;
   uint32_t lastUpdateMs;
 };
 
@@ -317,8 +561,8 @@ static th_state_t* th_upsert(const char* ieee16) {
       thCache[i].ieee16[sizeof(thCache[i].ieee16) - 1] = 0;
       thCache[i].hasTemp = false;
       thCache[i].hasHum = false;
-      thCache[i].tempX100 = 0;
-      thCache[i].humX100 = 0;
+      thCache[i].temp = 0;
+      thCache[i].hum = 0;
       thCache[i].lastUpdateMs = millis();
       return &thCache[i];
     }
@@ -337,8 +581,8 @@ static th_state_t* th_upsert(const char* ieee16) {
   thCache[oldest].ieee16[sizeof(thCache[oldest].ieee16) - 1] = 0;
   thCache[oldest].hasTemp = false;
   thCache[oldest].hasHum = false;
-  thCache[oldest].tempX100 = 0;
-  thCache[oldest].humX100 = 0;
+  thCache[oldest].temp = 0;
+  thCache[oldest].hum = 0;
   thCache[oldest].lastUpdateMs = millis();
   return &thCache[oldest];
 }
@@ -547,12 +791,35 @@ static void buildTopics() {
   tPairConfirm = base + "/pairing/confirm";
   tPairReject = base + "/pairing/reject";
   tPairClose = base + "/pairing/close";
+  tPairBulk = base + "/pairing/bulk";
+  tPairProgress = base + "/pairing/progress";
+  tZbResync = base + "/resync";
+  tZbResyncProgress = base + "/resync/progress";
+  tZbTopology = base + "/topology";
+  tZbBindings = base + "/bindings";
+  tZbBindingsGet = base + "/bindings/get";
+  tZbBackup = base + "/backup";
+  tZbBackupRun = base + "/backup/run";
+  tZbBackupState = base + "/backup/state";
+  tZbBackupGet = base + "/backup/get";
+  tZbRestore = base + "/restore";
   tDiscovered = base + "/discovered";
   tHubStatus = String("home/hub/") + gHubId + "/status";
   // Sprint 7: coordinator firmware version passthrough + Hub OTA
   tHubZigbeeVersion = String("home/hub/") + gHubId + "/zigbee/version";
+  tHubZigbeeHealth = base + "/health";
+  tHubZigbeeLastSeen = base + "/last_seen";
+  tHubLanKey = String("home/hub/") + gHubId + "/lan/key";
+  tHubLanPub = String("home/hub/") + gHubId + "/lan/pub";
+  tHubLanBrokerConfig = String("home/hub/") + gHubId + "/lanbroker/config";
+  tHubBridgeBatch = String("home/hub/") + gHubId + "/bridge/batch";
+  tHubAnalyticsConfig = String("home/hub/") + gHubId + "/analytics/config";
+  tHubAnalyticsSummary = String("home/hub/") + gHubId + "/analytics/summary";
   tOtaCmd = String("home/hub/") + gHubId + "/ota/cmd";
   tOtaCmdResult = String("home/hub/") + gHubId + "/ota/cmd_result";
+  tProfileCmd = String("home/hub/") + gHubId + "/profile/cmd";
+  tProfileReport = String("home/hub/") + gHubId + "/profile/report";
+  tProfileStall = String("home/hub/") + gHubId + "/profile/stall";
 
   // Sprint 8: local automations sync + logs
   tAutomationSync = String("home/hub/") + gHubId + "/automation/sync";
@@ -622,12 +889,8 @@ static bool isPairingActive() {
   return (int32_t)(millis() - activePairingUntilMs) <= 0;
 }
 
-static void uartSendJson(const JsonDocument& doc) {
-  String out;
-  serializeJson(doc, out);
-  Serial2.print(out);
-  Serial2.print('\n');
-}
+// Routed to the right coordinator link (see COORDINATOR LINKS).
+static void uartSendJson(const JsonDocument& doc);
 
 static bool topicIsZbSet(const String& topic, String& outIeee16) {
   // Expected: home/zb/<ieee>/set
@@ -671,7 +934,8 @@ static void mqttPublish(const String& topic, const String& payload, uint8_t qos,
 static void publishZbState(const String& ieee16, const JsonDocument& state) {
   String topic = String("home/zb/") + ieee16 + "/state";
   // Contract v1: envelope with ts + reported.*
-  StaticJsonDocument<768> env;
+  // Sized from the state: SmartLock snapshots (fragmented over Zigbee) run up to ~1 KB of JSON.
+  DynamicJsonDocument env(state.memoryUsage() + measureJson(state) + 512);
   const uint64_t ts = nowMs();
   env["ts"] = (unsigned long long)ts;
   JsonObject reported = env.createNestedObject("reported");
@@ -693,14 +957,15 @@ static void publishZbState(const String& ieee16, const JsonDocument& state) {
     reported[kv.key().c_str()] = kv.value();
   }
 
-  // Sprint 10: normalize SmartLock state contracts coming from low-end MCU (no real-time clock)
-  // - If lockoutRemainMs present: convert to epoch lockoutUntil based on envelope ts
-  // - Ensure lastAction.atMs exists and is epoch (fallback to ts)
+  // SmartLock: times (lastAction.atMs, lockoutUntil) are epoch ms stamped by the lock itself
+  // from hub time sync; until it is synced they are omitted and lockoutRemainMs is sent instead.
+  // Consumers (app, seed data) only read lockoutUntil, so the remainder is converted here.
   if (reported["lock"].is<JsonObject>()) {
     JsonObject lock = reported["lock"].as<JsonObject>();
     if (lock.containsKey("lockoutRemainMs")) {
-      uint32_t remain = lock["lockoutRemainMs"].as<uint32_t>();
-      lock["lockoutUntil"] = (unsigned long long)(ts + (uint64_t)remain);
+      if (!lock.containsKey("lockoutUntil")) {
+        lock["lockoutUntil"] = (unsigned long long)(ts + lock["lockoutRemainMs"].as<uint32_t>());
+      }
       lock.remove("lockoutRemainMs");
     }
 
@@ -709,49 +974,46 @@ static void publishZbState(const String& ieee16, const JsonDocument& state) {
     bool hasLock = lock["lastAction"].is<JsonObject>();
     if (hasTop && !hasLock) {
       lock["lastAction"] = reported["lastAction"].as<JsonObjectConst>();
-      hasLock = true;
     } else if (!hasTop && hasLock) {
       reported["lastAction"] = lock["lastAction"].as<JsonObjectConst>();
-      hasTop = true;
-    }
-
-    if (hasLock) {
-      JsonObject la = lock["lastAction"].as<JsonObject>();
-      if (!la.containsKey("atMs") || la["atMs"].as<uint64_t>() < 1000000000000ULL) {
-        la["atMs"] = (unsigned long long)ts;
-      }
-    }
-  }
-  if (reported["lastAction"].is<JsonObject>()) {
-    JsonObject la = reported["lastAction"].as<JsonObject>();
-    if (!la.containsKey("atMs") || la["atMs"].as<uint64_t>() < 1000000000000ULL) {
-      la["atMs"] = (unsigned long long)ts;
     }
   }
 
   String payload;
   serializeJson(env, payload);
+  lanBroadcast("state", ieee16, payload);
   mqttPublish(topic, payload, 0, true);
 }
 
-static void publishZbCmdResult(const String& ieee16, const char* cmdId, bool ok, const char* error) {
+// msg: the coordinator frame; delivery details (ms, attempts, confirm) are passed through when present.
+static void publishZbCmdResult(const String& ieee16, const char* cmdId, bool ok, const char* error,
+                               const JsonDocument* msg = nullptr) {
   String topic = String("home/zb/") + ieee16 + "/cmd_result";
-  StaticJsonDocument<256> doc;
+  StaticJsonDocument<320> doc;
   doc["ts"] = (unsigned long long)nowMs();
   if (cmdId && cmdId[0] != '\0') doc["cmdId"] = cmdId;
   doc["ok"] = ok;
   if (!ok && error && error[0] != '\0') doc["error"] = error;
+  if (msg && (*msg)["tracked"].is<bool>()) {
+    doc["ms"] = (*msg)["ms"] | 0;
+    doc["attempts"] = (*msg)["attempts"] | 1;
+    if ((*msg)["confirm"].is<const char*>()) doc["confirm"] = (*msg)["confirm"].as<const char*>();
+    if (!(*msg)["zclStatus"].isNull()) doc["zclStatus"] = (*msg)["zclStatus"] | 0;
+  }
 
   String payload;
   serializeJson(doc, payload);
+  lanBroadcast("cmd_result", ieee16, payload);
   mqttPublish(topic, payload, 0, false);
 }
 
-static void publishZbEvent(const String& ieee16, const char* type, const JsonVariantConst data) {
+// deviceTs: epoch ms stamped by the device (time-synced via the coordinator); 0 = use hub time.
+static void publishZbEvent(const String& ieee16, const char* type, const JsonVariantConst data, uint64_t deviceTs = 0) {
   if (!type || type[0] == '\0') return;
   String topic = String("home/zb/") + ieee16 + "/event";
-  StaticJsonDocument<384> doc;
-  doc["ts"] = (unsigned long long)nowMs();
+  // Sized from data: zigbee.report_cfg and SmartLock history events run up to ~1 KB.
+  DynamicJsonDocument doc(data.memoryUsage() + measureJson(data) + 384);
+  doc["ts"] = (unsigned long long)(deviceTs ? deviceTs : nowMs());
   doc["type"] = type;
   if (!data.isNull()) {
     doc["data"] = data;
@@ -763,6 +1025,7 @@ static void publishZbEvent(const String& ieee16, const char* type, const JsonVar
 
   String payload;
   serializeJson(doc, payload);
+  lanBroadcast("event", ieee16, payload);
   mqttPublish(topic, payload, 0, false);
 }
 
@@ -922,6 +1185,150 @@ static void autoPublishZbSet(const char* ieee16, const char* action, JsonVariant
   mqttPublish(topic, payload, 1, false);
 }
 
+// Publish the Wi-Fi device contract home/<homeId>/device/<deviceId>/set {cmdId, ts, payload}.
+// Goes to the LAN broker when the device is connected to it, upstream otherwise.
+static bool autoPublishMqttSet(uint32_t homeId, const char* deviceId, JsonVariantConst paramsV, uint8_t ruleIdx,
+                               uint32_t ruleId, String& outCmdId, bool& outLocal) {
+  if (homeId == 0 || !deviceId || deviceId[0] == '\0') return false;
+  if (!paramsV.is<JsonObjectConst>()) return false;
+
+  const String cmdId = genCmdId();
+  StaticJsonDocument<384> out;
+  out["cmdId"] = cmdId;
+  out["ts"] = (unsigned long long)nowMs();
+  out["payload"] = paramsV;
+  String payload;
+  serializeJson(out, payload);
+
+  const String topic = String("home/") + String(homeId) + "/device/" + deviceId + "/set";
+  const bool local = lanBrokerDeliverLocal(topic, payload);
+  if (!local) {
+    if (!mqtt.connected()) return false;
+    mqttPublish(topic, payload, 1, false);
+  }
+
+  portENTER_CRITICAL(&gAutoMqttMux);
+  auto_mqtt_pending_t* slot = &gAutoMqttPending[0];
+  for (size_t i = 0; i < AUTO_MQTT_PENDING_MAX; i++) {
+    if (!gAutoMqttPending[i].used) {
+      slot = &gAutoMqttPending[i];
+      break;
+    }
+    if ((int32_t)(gAutoMqttPending[i].sentMs - slot->sentMs) < 0) slot = &gAutoMqttPending[i]; // evict oldest
+  }
+  memset(slot, 0, sizeof(*slot));
+  slot->used = true;
+  slot->local = local;
+  strncpy(slot->cmdId, cmdId.c_str(), sizeof(slot->cmdId) - 1);
+  slot->ruleIdx = ruleIdx;
+  slot->ruleId = ruleId;
+  slot->sentMs = millis();
+  portEXIT_CRITICAL(&gAutoMqttMux);
+
+  if (ruleIdx < AUTO_RULE_MAX) gAutoRuleStats[ruleIdx].sent++;
+  outCmdId = cmdId;
+  outLocal = local;
+  return true;
+}
+
+// Any task: match a Wi-Fi device /ack against outstanding automation commands.
+static void automationOnMqttAck(const char* cmdId, bool ok, const char* error) {
+  if (!cmdId || cmdId[0] == '\0') return;
+  const uint32_t now = millis();
+  portENTER_CRITICAL(&gAutoMqttMux);
+  for (size_t i = 0; i < AUTO_MQTT_PENDING_MAX; i++) {
+    auto_mqtt_pending_t& p = gAutoMqttPending[i];
+    if (!p.used || p.done || strcmp(p.cmdId, cmdId) != 0) continue;
+    p.done = true;
+    p.ok = ok;
+    p.ackMs = now - p.sentMs;
+    if (error) {
+      strncpy(p.error, error, sizeof(p.error) - 1);
+      p.error[sizeof(p.error) - 1] = '\0';
+    }
+    break;
+  }
+  portEXIT_CRITICAL(&gAutoMqttMux);
+}
+
+// Subscribe upstream to the /ack of every MQTT-device action target
+// (devices still on the cloud broker; LAN broker acks are seen directly).
+static void autoSubscribeMqttAcks() {
+  if (!mqtt.connected()) return;
+  JsonArrayConst rules = gAutoRulesDoc.as<JsonArrayConst>();
+  if (rules.isNull()) return;
+  for (JsonObjectConst rule : rules) {
+    for (JsonObjectConst act : rule["actions"].as<JsonArrayConst>()) {
+      if (strcmp(act["kind"] | "", "MQTT") != 0) continue;
+      const uint32_t homeId = act["homeId"] | 0;
+      const char* deviceId = act["deviceId"] | "";
+      if (homeId == 0 || deviceId[0] == '\0') continue;
+      const String topic = String("home/") + String(homeId) + "/device/" + deviceId + "/ack";
+      mqtt.subscribe(topic.c_str(), 1);
+    }
+  }
+}
+
+static void publishMqttActionOutcome(const auto_mqtt_pending_t& p, const char* kind) {
+  StaticJsonDocument<384> logDoc;
+  logDoc["ts"] = (unsigned long long)nowMs();
+  logDoc["appliedVersion"] = gAutoAppliedVersion;
+  logDoc["ruleId"] = p.ruleId;
+  logDoc["kind"] = kind;
+  logDoc["cmdId"] = p.cmdId;
+  logDoc["via"] = p.local ? "lan" : "cloud";
+  if (p.done) {
+    logDoc["ok"] = p.ok;
+    logDoc["latencyMs"] = p.ackMs;
+    if (p.error[0]) logDoc["error"] = p.error;
+  }
+  if (p.ruleIdx < AUTO_RULE_MAX) {
+    const auto_rule_stats_t& st = gAutoRuleStats[p.ruleIdx];
+    JsonObject so = logDoc.createNestedObject("stats");
+    so["sent"] = st.sent;
+    so["acked"] = st.acked;
+    so["failed"] = st.failed;
+    so["timeouts"] = st.timeouts;
+    const uint32_t n = st.acked + st.failed;
+    so["avgAckMs"] = n ? st.sumAckMs / n : 0;
+    so["maxAckMs"] = st.maxAckMs;
+  }
+  String out;
+  serializeJson(logDoc, out);
+  mqttPublish(tAutomationEvent, out, 0, false);
+}
+
+// Loop task: account acks and timeouts of MQTT-device actions.
+static void automationMqttPendingTick() {
+  const uint32_t now = millis();
+  for (size_t i = 0; i < AUTO_MQTT_PENDING_MAX; i++) {
+    auto_mqtt_pending_t p;
+    portENTER_CRITICAL(&gAutoMqttMux);
+    p = gAutoMqttPending[i];
+    const bool timedOut = p.used && !p.done && (now - p.sentMs) > AUTO_MQTT_ACK_TIMEOUT_MS;
+    if (p.used && (p.done || timedOut)) gAutoMqttPending[i].used = false;
+    portEXIT_CRITICAL(&gAutoMqttMux);
+    if (!p.used || (!p.done && !timedOut)) continue;
+
+    if (p.ruleIdx < AUTO_RULE_MAX) {
+      auto_rule_stats_t& st = gAutoRuleStats[p.ruleIdx];
+      if (p.done) {
+        if (p.ok) st.acked++;
+        else st.failed++;
+        st.lastAckMs = p.ackMs;
+        st.sumAckMs += p.ackMs;
+        if (p.ackMs > st.maxAckMs) st.maxAckMs = p.ackMs;
+      } else {
+        st.timeouts++;
+      }
+    }
+    if (!p.done) {
+      Serial.printf("[Auto] rule=%u mqtt ack timeout cmdId=%s\n", (unsigned)p.ruleId, p.cmdId);
+    }
+    publishMqttActionOutcome(p, p.done ? "mqtt_ack" : "mqtt_ack_timeout");
+  }
+}
+
 static void autoScheduleLightOff(const char* ieee16, uint32_t ruleId, uint32_t afterSec) {
   if (!ieee16 || ieee16[0] == '\0') return;
   if (afterSec == 0) return;
@@ -1037,6 +1444,20 @@ static void automationOnZbEvent(const String& ieee16, JsonDocument& evtDoc) {
     if (!actions.isNull()) {
       for (JsonObjectConst act : actions) {
         const char* kind = act["kind"] | "ZIGBEE";
+        if (strcmp(kind, "MQTT") == 0) {
+          const char* deviceId = act["deviceId"] | "";
+          String cmdId;
+          bool local = false;
+          if (!autoPublishMqttSet(act["homeId"] | 0, deviceId, act["params"], (uint8_t)(idx - 1), ruleId, cmdId,
+                                  local)) {
+            continue;
+          }
+          JsonObject al = actLog.createNestedObject();
+          al["deviceId"] = deviceId;
+          al["cmdId"] = cmdId;
+          al["via"] = local ? "lan" : "cloud";
+          continue;
+        }
         if (strcmp(kind, "ZIGBEE") != 0) continue;
 
         const char* tgtIeee = act["ieee"] | "";
@@ -1110,6 +1531,11 @@ static void handleAutomationSync(JsonDocument& doc) {
   }
 
   memset(gAutoRuleLastExecMs, 0, sizeof(gAutoRuleLastExecMs));
+  memset(gAutoRuleStats, 0, sizeof(gAutoRuleStats));
+  portENTER_CRITICAL(&gAutoMqttMux);
+  for (size_t i = 0; i < AUTO_MQTT_PENDING_MAX; i++) gAutoMqttPending[i].used = false;
+  portEXIT_CRITICAL(&gAutoMqttMux);
+  autoSubscribeMqttAcks();
   for (size_t i = 0; i < AUTO_LIGHT_OFF_MAX; i++) gAutoLightOff[i].used = false;
   for (size_t i = 0; i < AUTO_EVENT_DEDUP_MAX; i++) gAutoEvtSeen[i].used = false;
   gAutoEvtSeenPtr = 0;
@@ -1121,6 +1547,7 @@ static void handleAutomationSync(JsonDocument& doc) {
 // Runs periodically in the main loop (handles scheduled auto-off actions).
 static void automationTick() {
   if (gAutoAppliedVersion == 0) return;
+  automationMqttPendingTick();
   if (!mqtt.connected()) return;
 
   uint32_t now = millis();
@@ -1160,13 +1587,17 @@ static void publishGatePirSnapshot(const String& ieee16, const gate_state_t* s)
   publishZbState(ieee16, state);
 }
 
-static void publishDiscovered(const String& ieeeRaw, uint32_t shortAddr) {
+static bool bulkIsAutoAccept(const String& ieee16);
+
+// interview: the coordinator's device_interview frame, or null on the legacy
+// annce/basic_fingerprint path (coordinators without interview support).
+static void publishDiscovered(const String& ieeeRaw, uint32_t shortAddr, JsonVariantConst interview) {
   if (!isPairingActive()) return;
 
   String ieee16 = normalizeIeee(ieeeRaw);
   if (ieee16.isEmpty()) return;
 
-  StaticJsonDocument<400> doc;
+  DynamicJsonDocument doc(2048);
   doc["token"] = activePairingToken;
   doc["ts"] = (unsigned long long)nowMs();
   doc["ieee"] = ieee16;
@@ -1180,19 +1611,31 @@ static void publishDiscovered(const String& ieeeRaw, uint32_t shortAddr) {
     if (fp->swBuildId[0]) doc["swBuildId"] = fp->swBuildId;
   }
 
+  if (!interview.isNull()) {
+    doc["interviewOk"] = interview["ok"] | false;
+    const char* ivErr = interview["error"] | "";
+    if (ivErr[0]) doc["interviewError"] = ivErr;
+    if (interview["endpoints"].is<JsonArrayConst>()) doc["endpoints"] = interview["endpoints"];
+  }
+  if (bulkIsAutoAccept(ieee16)) doc["autoAccepted"] = true;
+
   String payload;
   serializeJson(doc, payload);
   mqttPublish(tDiscovered, payload, 0, false);
 }
 
+static const char* coordAggregateStateStr();
+
 static void publishHubOnline(bool online) {
-  StaticJsonDocument<320> doc;
+  StaticJsonDocument<384> doc;
   doc["online"] = online;
   doc["fwVersion"] = HUB_FIRMWARE_VERSION;
   doc["buildTime"] = HUB_BUILD_TIME;
   doc["mac"] = WiFi.macAddress();
   doc["ip"] = (WiFi.status() == WL_CONNECTED) ? WiFi.localIP().toString() : String("");
   doc["rssi"] = (WiFi.status() == WL_CONNECTED) ? WiFi.RSSI() : 0;
+  doc["coordinator"] = coordAggregateStateStr();
+  if (gLanBroker.running()) doc["lanMqttClients"] = gLanBroker.stats().clients;
   doc["ts"] = (unsigned long long)nowMs();
 
   String payload;
@@ -1212,129 +1655,2719 @@ static void publishCoordinatorFwInfo(const String& fwVersion, const String& buil
   mqttPublish(tHubZigbeeVersion, payload, 1, true);
 }
 
-// ----------------- HUB OTA (Sprint 7) -----------------
-static String bytesToHex(const uint8_t* buf, size_t len) {
-  static const char* hex = "0123456789abcdef";
-  String s;
-  s.reserve(len * 2);
-  for (size_t i = 0; i < len; i++) {
-    uint8_t b = buf[i];
-    s += hex[(b >> 4) & 0xF];
-    s += hex[b & 0xF];
+// ----------------- COORDINATOR LINKS -----------------
+// One hub can drive several coordinators (one UART each, e.g. Serial2 + Serial1),
+// each running its own Zigbee network on its own channel. Capacity and airtime
+// therefore scale with COORD_LINK_COUNT.
+//
+// Per link:
+//   - independent line parser (lineBuf)
+//   - supervision (see below) with its own EN pin and metrics
+//   - flow control: at most LINK_MAX_INFLIGHT device commands outstanding
+//     (released by cmd_result, re-synced from hb.q); extra commands wait in a
+//     small TX FIFO, and are rejected with cmd_result "hub_busy" when that is full.
+//
+// Routing: every frame naming a device teaches ieee -> link. The table is
+// persisted in NVS so commands after a hub reboot go to the right coordinator
+// before the device speaks again. It holds COORD_DEVICE_MAX devices per link.
+// With several links a command for a device never heard is rejected with
+// cmd_result "unknown_device"; a single-link hub sends it to link 0.
+// Pairing opens permit_join on the least-loaded healthy link only, so new
+// devices spread across coordinators.
+//
+// Supervision: each coordinator sends {"evt":"hb"} every 2s from its Arduino
+// loop(). A link is faulty on:
+//   - silence:  no valid UART line for COORD_HB_SILENCE_MS (C6 hung / crashed / UART dead)
+//   - stuck:    heartbeats arrive but zb_task is not iterating (zbAgeMs) or the
+//               command queue stays full (commands would silently go nowhere)
+// Recovery escalates: SOFT (flush RX + ping) -> REBOOT (cmd, only if loop() is alive)
+// -> HARD (EN pulse, retried with exponential backoff). On recovery the hub
+// re-applies transient state (permit_join) and publishes metrics.
+// Supervision is armed after the first heartbeat so an older coordinator
+// firmware without heartbeats (or an unwired link) is never reset.
+
+static const uint8_t COORD_ST_UNKNOWN = 0;
+static const uint8_t COORD_ST_OK = 1;
+static const uint8_t COORD_ST_SOFT = 2;
+static const uint8_t COORD_ST_REBOOT = 3;
+static const uint8_t COORD_ST_HARD = 4;
+static const uint8_t COORD_ST_FAILED = 5; // hard reset did not help; waiting for backoff
+
+struct coord_link_cfg_t {
+  HardwareSerial* port;
+  int rxPin;
+  int txPin;
+  int enPin; // -1 = EN not wired
+};
+
+static const coord_link_cfg_t COORD_LINK_CFG[COORD_LINK_COUNT] = {
+  {&Serial2, UART2_RX, UART2_TX, COORD_EN_PIN},
+#if COORD_LINK_COUNT > 1
+  {&Serial1, UART1_RX, UART1_TX, COORD1_EN_PIN},
+#endif
+};
+
+struct link_tx_slot_t {
+  char ieee16[17];
+  char cmdId[41];
+  char line[LINK_TXQ_LINE_MAX];
+};
+
+struct coord_link_t {
+  // UART parser
+  char lineBuf[UART_LINE_BUF_SIZE];
+  size_t lineLen;
+  bool lineOverflow;
+
+  // Identity (fw_info)
+  uint8_t channel;
+  uint16_t maxDevices;
+  uint16_t devices; // routes pointing at this link
+  bool interview;   // coordinator sends one device_interview per join
+
+  // Supervision
+  uint8_t state;
+  bool armed;
+  uint32_t lastRxMs;         // any valid JSON line
+  uint32_t lastHbMs;
+  uint32_t lastHealthyMs;    // last heartbeat that passed all checks
+  uint32_t queueFullSinceMs;
+  uint32_t faultAtMs;        // detection time (start of TTR)
+  uint32_t stepAtMs;         // start of current recovery step
+  uint32_t enReleaseAtMs;    // non-zero while EN is held low
+  uint32_t hardBackoffMs;
+  char reason[16];
+
+  // Last heartbeat contents
+  uint32_t hbSeq, hbUp, hbQ, hbQMax, hbZbAgeMs, hbHeap, hbMinHeap;
+  uint32_t hbTxDrop, hbTxOvf;  // coordinator UART lines dropped (TX buffer full / oversize)
+  uint32_t hbQHw, hbPoolMin, hbPlMin, hbPoolFail;  // coordinator command pool high-water marks
+  uint32_t hbZbWakes, hbDispUsMax, hbDispUsAvg;     // zb_task wakeups; UART -> dispatch latency
+  uint32_t hbAttrs, hbAttrLines;                    // attributes forwarded / attr_report lines sent
+
+  // attr_report batching (received lines, attributes in them, resulting state publishes)
+  uint32_t rptLines, rptAttrs, rptPublishes;
+  char hbZb[12];
+
+  // Supervision metrics
+  uint32_t faults, softRecoveries, reboots, hardResets;
+  uint32_t lastTtdMs, lastTtrMs, maxTtdMs, maxTtrMs;
+
+  // Flow control: one credit per device command, returned by its cmdId
+  uint8_t inflight;
+  char creditId[LINK_MAX_INFLIGHT][41]; // "" = free
+  uint32_t creditAtMs[LINK_MAX_INFLIGHT];
+  uint32_t creditTimeouts;
+  link_tx_slot_t txq[LINK_TXQ_LEN];
+  uint8_t txqHead;
+  uint8_t txqCount;
+  uint32_t txSent, txQueued, txRejected;
+  bool backpressure;          // coordinator asked to hold device commands
+  uint32_t backpressureAtMs;
+  uint32_t backpressureEvents;
+};
+
+static coord_link_t gLinks[COORD_LINK_COUNT];
+static uint32_t gCoordNextHealthPubMs = 0;
+static int8_t gPairingLink = -1; // link that currently has permit_join open
+
+// --- Device -> link routing (persisted) ---
+struct zb_route_t {
+  uint8_t ieee[8];
+  uint8_t link;
+  uint8_t used;
+};
+static const size_t COORD_DEVICE_MAX = 256; // devices per coordinator (its hello's maxDevices)
+static const size_t ROUTE_MAX = COORD_LINK_COUNT * COORD_DEVICE_MAX;
+static zb_route_t gRoutes[ROUTE_MAX];
+static bool gRoutesDirty = false;
+static uint32_t gRoutesSaveAtMs = 0;
+static Preferences gRoutePrefs;
+
+static bool ieee16ToBytes(const char* ieee16, uint8_t out[8]) {
+  if (!ieee16 || strlen(ieee16) != 16) return false;
+  for (size_t i = 0; i < 8; i++) {
+    char b[3] = {ieee16[2 * i], ieee16[2 * i + 1], 0};
+    if (!isHexChar(b[0]) || !isHexChar(b[1])) return false;
+    out[i] = (uint8_t)strtoul(b, nullptr, 16);
   }
-  return s;
+  return true;
 }
 
-static bool isHex64(const String& s) {
-  if (s.length() != 64) return false;
-  for (size_t i = 0; i < s.length(); i++) {
-    char c = s[i];
-    bool ok = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
-    if (!ok) return false;
+static int routeFind(const uint8_t ieee[8]) {
+  for (size_t i = 0; i < ROUTE_MAX; i++) {
+    if (gRoutes[i].used && memcmp(gRoutes[i].ieee, ieee, 8) == 0) return (int)i;
   }
-  return true;
+  return -1;
 }
 
-static void publishOtaResult(const String& cmdId, bool ok, const String& code, const String& message, const String& version) {
-  StaticJsonDocument<320> doc;
-  doc["ts"] = (unsigned long long)nowMs();
-  doc["cmdId"] = cmdId;
-  doc["ok"] = ok;
-  doc["version"] = version;
-  if (!ok) {
-    if (code.length()) doc["code"] = code;
-    if (message.length()) doc["message"] = message;
+// Link owning the device, or -1 when it was never heard on any link of a
+// multi-link hub (a single-link hub sends everything to link 0).
+static int routeLinkFor(const char* ieee16) {
+  uint8_t b[8];
+  const int i = ieee16ToBytes(ieee16, b) ? routeFind(b) : -1;
+  if (i >= 0 && gRoutes[i].link < COORD_LINK_COUNT) return gRoutes[i].link;
+  return COORD_LINK_COUNT > 1 ? -1 : 0;
+}
+
+static void routeRecount() {
+  for (size_t li = 0; li < COORD_LINK_COUNT; li++) gLinks[li].devices = 0;
+  for (size_t i = 0; i < ROUTE_MAX; i++) {
+    if (gRoutes[i].used && gRoutes[i].link < COORD_LINK_COUNT) gLinks[gRoutes[i].link].devices++;
+  }
+}
+
+static void routeLearn(const String& ieee16, uint8_t li) {
+  uint8_t b[8];
+  if (!ieee16ToBytes(ieee16.c_str(), b)) return;
+  int i = routeFind(b);
+  if (i >= 0) {
+    if (gRoutes[i].link == li) return;
+    Serial.printf("[Route] %s moved link %u -> %u\n", ieee16.c_str(), (unsigned)gRoutes[i].link, (unsigned)li);
+    gLinks[gRoutes[i].link].devices--;
   } else {
-    if (message.length()) doc["message"] = message;
+    for (size_t k = 0; k < ROUTE_MAX; k++) {
+      if (!gRoutes[k].used) {
+        i = (int)k;
+        break;
+      }
+    }
+    if (i < 0) {
+      Serial.printf("[Route] table full, %s not persisted\n", ieee16.c_str());
+      return;
+    }
+    memcpy(gRoutes[i].ieee, b, 8);
+    gRoutes[i].used = 1;
+  }
+  gRoutes[i].link = li;
+  gLinks[li].devices++;
+  gRoutesDirty = true;
+  gRoutesSaveAtMs = millis() + 5000; // batch bursts (pairing, boot announce storm)
+}
+
+static void loadRoutesFromNvs() {
+  memset(gRoutes, 0, sizeof(gRoutes));
+  gRoutePrefs.begin("zbroute", true);
+  size_t n = gRoutePrefs.getBytesLength("tbl");
+  // A table saved with a smaller ROUTE_MAX loads into the head.
+  if (n > 0 && n <= sizeof(gRoutes) && n % sizeof(zb_route_t) == 0) gRoutePrefs.getBytes("tbl", gRoutes, n);
+  gRoutePrefs.end();
+  routeRecount();
+}
+
+static void saveRoutesIfDue() {
+  if (!gRoutesDirty || !timeDue(millis(), gRoutesSaveAtMs)) return;
+  gRoutePrefs.begin("zbroute", false);
+  gRoutePrefs.putBytes("tbl", gRoutes, sizeof(gRoutes));
+  gRoutePrefs.end();
+  gRoutesDirty = false;
+}
+
+static const char* coordStateStr(uint8_t st) {
+  switch (st) {
+    case COORD_ST_OK: return "ok";
+    case COORD_ST_SOFT: return "soft_resync";
+    case COORD_ST_REBOOT: return "rebooting";
+    case COORD_ST_HARD: return "hard_reset";
+    case COORD_ST_FAILED: return "failed";
+    default: return "unknown";
+  }
+}
+
+static bool linkUsable(uint8_t li) {
+  const coord_link_t& L = gLinks[li];
+  // Unarmed links (no heartbeat yet / old firmware) are used as-is.
+  return !L.armed || L.state == COORD_ST_OK;
+}
+
+// Worst state across armed links (for hub status / top-level health).
+static const char* coordAggregateStateStr() {
+  uint8_t worst = COORD_ST_UNKNOWN;
+  for (size_t li = 0; li < COORD_LINK_COUNT; li++) {
+    if (!gLinks[li].armed) continue;
+    if (worst == COORD_ST_UNKNOWN || gLinks[li].state > worst) worst = gLinks[li].state;
+  }
+  return coordStateStr(worst);
+}
+
+static void publishCoordinatorHealth() {
+  gCoordNextHealthPubMs = millis() + COORD_HEALTH_PUBLISH_MS;
+  if (!mqtt.connected()) return;
+
+  DynamicJsonDocument doc(256 + COORD_LINK_COUNT * 640);
+  doc["ts"] = (unsigned long long)nowMs();
+  doc["state"] = coordAggregateStateStr();
+  JsonArray links = doc.createNestedArray("links");
+  for (size_t li = 0; li < COORD_LINK_COUNT; li++) {
+    const coord_link_t& L = gLinks[li];
+    JsonObject o = links.createNestedObject();
+    o["link"] = li;
+    o["state"] = coordStateStr(L.state);
+    if (L.reason[0]) o["reason"] = L.reason;
+    o["lastRxAgeMs"] = L.lastRxMs ? (uint32_t)(millis() - L.lastRxMs) : 0;
+    if (L.channel) o["channel"] = L.channel;
+    o["devices"] = L.devices;
+    if (L.maxDevices) o["maxDevices"] = L.maxDevices;
+    o["inflight"] = L.inflight;
+    o["creditTimeouts"] = L.creditTimeouts;
+    o["txq"] = L.txqCount;
+    o["txRejected"] = L.txRejected;
+    o["backpressure"] = L.backpressure;
+    o["backpressureEvents"] = L.backpressureEvents;
+    JsonObject rpt = o.createNestedObject("reports");
+    rpt["lines"] = L.rptLines;
+    rpt["attrs"] = L.rptAttrs;
+    rpt["publishes"] = L.rptPublishes;
+
+    if (L.lastHbMs) {
+      JsonObject hb = o.createNestedObject("hb");
+      hb["seq"] = L.hbSeq;
+      hb["up"] = L.hbUp;
+      hb["q"] = L.hbQ;
+      hb["qMax"] = L.hbQMax;
+      hb["zb"] = L.hbZb;
+      hb["zbAgeMs"] = L.hbZbAgeMs;
+      hb["heap"] = L.hbHeap;
+      hb["minHeap"] = L.hbMinHeap;
+      hb["txDrop"] = L.hbTxDrop;
+      hb["txOvf"] = L.hbTxOvf;
+      hb["qHw"] = L.hbQHw;
+      hb["poolMin"] = L.hbPoolMin;
+      hb["plMin"] = L.hbPlMin;
+      hb["poolFail"] = L.hbPoolFail;
+      hb["zbWakes"] = L.hbZbWakes;
+      hb["dispUsMax"] = L.hbDispUsMax;
+      hb["dispUsAvg"] = L.hbDispUsAvg;
+      hb["attrs"] = L.hbAttrs;
+      hb["attrLines"] = L.hbAttrLines;
+      hb["ageMs"] = (uint32_t)(millis() - L.lastHbMs);
+    }
+
+    JsonObject m = o.createNestedObject("metrics");
+    m["faults"] = L.faults;
+    m["softRecoveries"] = L.softRecoveries;
+    m["reboots"] = L.reboots;
+    m["hardResets"] = L.hardResets;
+    m["lastTtdMs"] = L.lastTtdMs;
+    m["lastTtrMs"] = L.lastTtrMs;
+    m["maxTtdMs"] = L.maxTtdMs;
+    m["maxTtrMs"] = L.maxTtrMs;
   }
+
   String payload;
   serializeJson(doc, payload);
-  mqttPublish(tOtaCmdResult, payload, 1, false);
+  mqttPublish(tHubZigbeeHealth, payload, 1, true);
 }
 
-static void runHubOta(const String& cmdId, const String& version, const String& url, const String& sha256Expected, int sizeHint) {
-  if (gOtaBusy) {
-    publishOtaResult(cmdId, false, "BUSY", "OTA already in progress", version);
-    return;
+// --- Link TX + flow control ---
+// Commands arrive from the MQTT/WebSocket task, credits come back on the loop
+// task (cmd_result / hb): the TX FIFOs and inflight counters share one lock.
+static SemaphoreHandle_t gLinkTxMutex = nullptr;
+
+struct link_tx_guard_t {
+  link_tx_guard_t() {
+    if (gLinkTxMutex) xSemaphoreTakeRecursive(gLinkTxMutex, portMAX_DELAY);
   }
+  ~link_tx_guard_t() {
+    if (gLinkTxMutex) xSemaphoreGiveRecursive(gLinkTxMutex);
+  }
+};
 
-  if (WiFi.status() != WL_CONNECTED) {
-    publishOtaResult(cmdId, false, "NO_WIFI", "WiFi not connected", version);
+static void linkWriteLine(uint8_t li, const char* line, size_t len) {
+  HardwareSerial* port = COORD_LINK_CFG[li].port;
+  port->write((const uint8_t*)line, len);
+  port->write('\n');
+}
+
+// Commands the caller did not tag get a hub cmdId, so that their cmd_sent /
+// cmd_result releases the credit instead of LINK_CREDIT_TIMEOUT_MS.
+static const char LINK_AUTO_CMD_PREFIX[] = "hub-";
+static uint32_t gLinkAutoCmdSeq = 0;
+
+static bool linkIsAutoCmdId(const char* cmdId) {
+  return strncmp(cmdId, LINK_AUTO_CMD_PREFIX, sizeof(LINK_AUTO_CMD_PREFIX) - 1) == 0;
+}
+
+static void linkRejectCmd(uint8_t li, const char* ieee16, const char* cmdId, const char* error) {
+  gLinks[li].txRejected++;
+  if (ieee16 && ieee16[0]) publishZbCmdResult(String(ieee16), linkIsAutoCmdId(cmdId) ? "" : cmdId, false, error);
+}
+
+static void linkTakeCredit(coord_link_t& L, const char* cmdId) {
+  for (uint8_t i = 0; i < LINK_MAX_INFLIGHT; i++) {
+    if (L.creditId[i][0]) continue;
+    strncpy(L.creditId[i], cmdId, sizeof(L.creditId[i]) - 1);
+    L.creditId[i][sizeof(L.creditId[i]) - 1] = 0;
+    L.creditAtMs[i] = millis();
+    L.inflight++;
     return;
   }
-  if (url.length() < 10 || (!url.startsWith("http://") && !url.startsWith("https://"))) {
-    publishOtaResult(cmdId, false, "BAD_URL", "url must be http(s)", version);
-    return;
+}
+
+// Returns the credit held by cmdId; results for control commands match nothing.
+static bool linkReleaseCredit(coord_link_t& L, const char* cmdId) {
+  if (!cmdId || !cmdId[0]) return false;
+  for (uint8_t i = 0; i < LINK_MAX_INFLIGHT; i++) {
+    if (!L.creditId[i][0] || strcmp(L.creditId[i], cmdId) != 0) continue;
+    L.creditId[i][0] = 0;
+    if (L.inflight > 0) L.inflight--;
+    return true;
   }
-  if (!isHex64(sha256Expected)) {
-    publishOtaResult(cmdId, false, "BAD_SHA256", "sha256 must be 64-hex", version);
-    return;
+  return false;
+}
+
+static void linkPumpTx(uint8_t li) {
+  link_tx_guard_t guard;
+  coord_link_t& L = gLinks[li];
+  while (L.txqCount > 0 && L.inflight < LINK_MAX_INFLIGHT && !L.backpressure) {
+    link_tx_slot_t& slot = L.txq[L.txqHead];
+    linkWriteLine(li, slot.line, strlen(slot.line));
+    linkTakeCredit(L, slot.cmdId);
+    L.txSent++;
+    L.txqHead = (uint8_t)((L.txqHead + 1) % LINK_TXQ_LEN);
+    L.txqCount--;
   }
+}
 
-  gOtaBusy = true;
-  Serial.printf("[OTA] begin cmdId=%s version=%s url=%s\n", cmdId.c_str(), version.c_str(), url.c_str());
+static void linkDropTxQueue(uint8_t li, const char* error) {
+  link_tx_guard_t guard;
+  coord_link_t& L = gLinks[li];
+  while (L.txqCount > 0) {
+    link_tx_slot_t& slot = L.txq[L.txqHead];
+    linkRejectCmd(li, slot.ieee16, slot.cmdId, error);
+    L.txqHead = (uint8_t)((L.txqHead + 1) % LINK_TXQ_LEN);
+    L.txqCount--;
+  }
+  L.inflight = 0;
+  for (uint8_t i = 0; i < LINK_MAX_INFLIGHT; i++) L.creditId[i][0] = 0;
+  L.backpressure = false;
+}
 
-  HTTPClient http;
-  http.setTimeout(15000);
-  if (!http.begin(url)) {
-    gOtaBusy = false;
-    publishOtaResult(cmdId, false, "HTTP_BEGIN", "http.begin failed", version);
+// Control commands (ping/reboot/permit_join) bypass flow control.
+static void linkSendControl(uint8_t li, const JsonDocument& doc) {
+  String out;
+  serializeJson(doc, out);
+  linkWriteLine(li, out.c_str(), out.length());
+}
+
+static void linkSendDeviceCmd(uint8_t li, const JsonDocument& doc) {
+  link_tx_guard_t guard;
+  coord_link_t& L = gLinks[li];
+  const char* ieee16 = doc["ieee"] | "";
+  const char* cmdId = doc["cmdId"] | "";
+  char autoId[16] = "";
+
+  if (!linkUsable(li)) {
+    linkRejectCmd(li, ieee16, cmdId, "coordinator_unavailable");
     return;
   }
-
-  int httpCode = http.GET();
-  if (httpCode <= 0) {
-    String m = String("GET failed: ") + http.errorToString(httpCode);
-    http.end();
-    gOtaBusy = false;
-    publishOtaResult(cmdId, false, "HTTP_GET", m, version);
+  if (L.txqCount >= LINK_TXQ_LEN) {
+    linkRejectCmd(li, ieee16, cmdId, "hub_busy");
     return;
   }
-  if (httpCode != HTTP_CODE_OK) {
-    String m = String("HTTP status ") + String(httpCode);
-    http.end();
-    gOtaBusy = false;
-    publishOtaResult(cmdId, false, "HTTP_STATUS", m, version);
+
+  if (!cmdId[0]) snprintf(autoId, sizeof(autoId), "%s%lu", LINK_AUTO_CMD_PREFIX, (unsigned long)++gLinkAutoCmdSeq);
+  const size_t extra = autoId[0] ? strlen(",\"cmdId\":\"\"") + strlen(autoId) : 0;
+  const size_t len = measureJson(doc);
+  if (len + extra >= LINK_TXQ_LINE_MAX) {
+    linkRejectCmd(li, ieee16, cmdId, "payload_too_large");
     return;
   }
+  const uint8_t tail = (uint8_t)((L.txqHead + L.txqCount) % LINK_TXQ_LEN);
+  link_tx_slot_t& slot = L.txq[tail];
+  strncpy(slot.ieee16, ieee16, sizeof(slot.ieee16) - 1);
+  slot.ieee16[sizeof(slot.ieee16) - 1] = 0;
+  strncpy(slot.cmdId, autoId[0] ? autoId : cmdId, sizeof(slot.cmdId) - 1);
+  slot.cmdId[sizeof(slot.cmdId) - 1] = 0;
+  const size_t n = serializeJson(doc, slot.line, sizeof(slot.line));
+  if (autoId[0] && n > 0 && slot.line[n - 1] == '}') {
+    snprintf(slot.line + n - 1, sizeof(slot.line) - (n - 1), ",\"cmdId\":\"%s\"}", autoId);
+  }
+  L.txqCount++;
+  L.txQueued++;
+  linkPumpTx(li);
+}
 
-  int contentLen = http.getSize();
-  int expectedSize = (sizeHint > 0) ? sizeHint : contentLen;
-  if (expectedSize <= 0) {
-    // Update can still proceed without size, but it's safer to require it.
-    expectedSize = contentLen;
+static int8_t coordPickPairingLink() {
+  int8_t best = -1;
+  for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+    const coord_link_t& L = gLinks[li];
+    // Only links we have actually heard from (or link 0 as the legacy default).
+    if (!linkUsable(li) || (!L.armed && li != 0)) continue;
+    if (L.maxDevices && L.devices >= L.maxDevices) continue;
+    if (best < 0 || L.devices < gLinks[best].devices) best = (int8_t)li;
   }
+  return best;
+}
 
-  if (!Update.begin(expectedSize > 0 ? expectedSize : UPDATE_SIZE_UNKNOWN)) {
-    String m = String("Update.begin failed: ") + String(Update.errorString());
-    http.end();
-    gOtaBusy = false;
-    publishOtaResult(cmdId, false, "UPDATE_BEGIN", m, version);
+// Route a hub->coordinator JSON command:
+//   - device commands (have "ieee")     -> link owning the device, flow-controlled
+//   - permit_join duration>0           -> least-loaded link (spreads joins)
+//   - everything else (close, etc.)    -> all links
+static void uartSendJson(const JsonDocument& doc) {
+  const char* cmd = doc["cmd"] | "";
+  const char* ieee = doc["ieee"] | "";
+
+  if (ieee[0]) {
+    const int li = routeLinkFor(ieee);
+    if (li < 0) {
+      // Guessing would hand the command to a coordinator that does not know the device.
+      publishZbCmdResult(String(ieee), doc["cmdId"] | "", false, "unknown_device");
+      return;
+    }
+    linkSendDeviceCmd((uint8_t)li, doc);
     return;
   }
 
-  WiFiClient* stream = http.getStreamPtr();
-  const size_t bufSize = 1024;
-  uint8_t buf[bufSize];
-  size_t writtenTotal = 0;
+  if (strcmp(cmd, "permit_join") == 0 && (doc["duration"] | 0) > 0) {
+    int8_t li = coordPickPairingLink();
+    if (li < 0) {
+      Serial.println("[ZB] permit_join: no usable coordinator link");
+      return;
+    }
+    // Only one network accepts joins at a time.
+    if (gPairingLink >= 0 && gPairingLink != li) {
+      StaticJsonDocument<64> off;
+      off["cmd"] = "permit_join";
+      off["duration"] = 0;
+      linkSendControl((uint8_t)gPairingLink, off);
+    }
+    gPairingLink = li;
+    Serial.printf("[ZB] permit_join on link %d (devices=%u ch=%u)\n", li, (unsigned)gLinks[li].devices,
+                  (unsigned)gLinks[li].channel);
+    linkSendControl((uint8_t)li, doc);
+    return;
+  }
+  if (strcmp(cmd, "permit_join") == 0) gPairingLink = -1;
 
-  mbedtls_sha256_context ctx;
-  mbedtls_sha256_init(&ctx);
-  // Arduino-ESP32 toolchain often ships mbedTLS without the *_ret variants.
-  // Use the non-ret APIs for broad compatibility.
-  mbedtls_sha256_starts(&ctx, 0);
+  for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) linkSendControl(li, doc);
+}
 
-  uint32_t lastProgressMs = millis();
-  while (http.connected()) {
-    size_t avail = stream->available();
-    if (!avail) {
-      delay(5);
-      if (millis() - lastProgressMs > 20000) {
-        // Keep watchdog fed and avoid stuck loop; still continue.
-        lastProgressMs = millis();
-      }
-      continue;
-    }
+// --- Supervision ---
+static void coordSetState(uint8_t li, uint8_t st) {
+  coord_link_t& L = gLinks[li];
+  if (L.state == st) return;
+  Serial.printf("[Coord%u] state %s -> %s (reason=%s)\n", (unsigned)li, coordStateStr(L.state), coordStateStr(st),
+                L.reason[0] ? L.reason : "-");
+  L.state = st;
+  L.stepAtMs = millis();
+  publishCoordinatorHealth();
+}
+
+static void coordFlushUartRx(uint8_t li) {
+  HardwareSerial* port = COORD_LINK_CFG[li].port;
+  while (port->available()) port->read();
+  gLinks[li].lineLen = 0;
+  gLinks[li].lineOverflow = false;
+}
+
+static void coordSendSimpleCmd(uint8_t li, const char* cmd) {
+  StaticJsonDocument<96> u;
+  u["cmd"] = cmd;
+  if (strcmp(cmd, "reboot") == 0) u["cmdId"] = genCmdId();
+  linkSendControl(li, u);
+}
+
+static void coordPulseEn(uint8_t li) {
+  const int pin = COORD_LINK_CFG[li].enPin;
+  if (pin < 0) return;
+  digitalWrite(pin, LOW);
+  gLinks[li].enReleaseAtMs = millis() + COORD_EN_PULSE_MS;
+  if (gLinks[li].enReleaseAtMs == 0) gLinks[li].enReleaseAtMs = 1;
+  gLinks[li].hardResets++;
+  Serial.printf("[Coord%u] EN pulse (hard reset)\n", (unsigned)li);
+}
+
+static void availabilityRebaseDeadlines();
+static void bulkOnLinkRestart(uint8_t li);
+static void timeSyncSendLink(uint8_t li);
+
+// Ask the coordinator to re-read device state at its own pace. No cmdId: progress
+// comes back as evt "resync", so this never touches the link's credit window.
+static void coordSendResync(uint8_t li, uint8_t rate = 0, int32_t sleepyWaitSec = -1, bool stop = false) {
+  StaticJsonDocument<128> u;
+  u["cmd"] = "resync";
+  if (stop) u["stop"] = true;
+  if (rate) u["rate"] = rate;
+  if (sleepyWaitSec >= 0) u["sleepyWaitSec"] = sleepyWaitSec;
+  linkSendControl(li, u);
+  Serial.printf("[Coord%u] resync %s\n", (unsigned)li, stop ? "stop" : "requested");
+}
+
+// Ask the coordinator for a Mgmt_Lqi crawl of its mesh. Like resync it goes out without
+// a cmdId credit; routers come back as evt "topology_node", the summary as evt "topology".
+static void coordSendTopology(uint8_t li, uint16_t gapMs = 0, int16_t weakLqi = -1, bool stop = false) {
+  StaticJsonDocument<128> u;
+  u["cmd"] = "topology";
+  if (stop) u["stop"] = true;
+  if (gapMs) u["gapMs"] = gapMs;
+  if (weakLqi >= 0) u["weakLqi"] = weakLqi;
+  linkSendControl(li, u);
+  Serial.printf("[Coord%u] topology %s\n", (unsigned)li, stop ? "stop" : "requested");
+}
+
+// Ask the coordinator to republish its desired bindings (evt "bindings").
+static void coordSendBindList(uint8_t li) {
+  StaticJsonDocument<64> u;
+  u["cmd"] = "bind_list";
+  linkSendControl(li, u);
+}
+
+// Re-apply transient coordinator state that is lost on a restart.
+static void coordResyncAfterRecovery(uint8_t li) {
+  // Devices could not be heard while the coordinator was down; restart their windows.
+  availabilityRebaseDeadlines();
+  bulkOnLinkRestart(li);
+  timeSyncSendLink(li);
+  if (isPairingActive() && gPairingLink == (int8_t)li) {
+    uint32_t remainSec = (activePairingUntilMs - millis()) / 1000U;
+    if (remainSec >= 5) {
+      StaticJsonDocument<128> u;
+      u["cmd"] = "permit_join";
+      u["duration"] = remainSec;
+      linkSendControl(li, u);
+      Serial.printf("[Coord%u] resync permit_join duration=%u\n", (unsigned)li, (unsigned)remainSec);
+    }
+  }
+  // Cached states may have drifted while the coordinator was down.
+  coordSendResync(li);
+}
+
+static void coordOnHealthy(uint8_t li) {
+  coord_link_t& L = gLinks[li];
+  const uint32_t now = millis();
+  L.lastHealthyMs = now;
+  if (L.state == COORD_ST_OK) return;
+
+  const uint8_t prev = L.state;
+  if (prev != COORD_ST_UNKNOWN && L.faultAtMs) {
+    L.lastTtrMs = now - L.faultAtMs;
+    if (L.lastTtrMs > L.maxTtrMs) L.maxTtrMs = L.lastTtrMs;
+    if (prev == COORD_ST_SOFT) L.softRecoveries++;
+    Serial.printf("[Coord%u] recovered via %s ttr=%lums\n", (unsigned)li, coordStateStr(prev),
+                  (unsigned long)L.lastTtrMs);
+  }
+  L.faultAtMs = 0;
+  L.hardBackoffMs = 0;
+  L.reason[0] = 0;
+  coordSetState(li, COORD_ST_OK);
+  if (prev != COORD_ST_UNKNOWN) coordResyncAfterRecovery(li);
+  // First healthy heartbeat after a hub boot: retained states are whatever was last
+  // published before the restart, so refresh them from the devices.
+  else coordSendResync(li);
+}
+
+static void coordOnFault(uint8_t li, const char* reason) {
+  coord_link_t& L = gLinks[li];
+  const uint32_t now = millis();
+  strncpy(L.reason, reason, sizeof(L.reason) - 1);
+  L.reason[sizeof(L.reason) - 1] = 0;
+  L.faults++;
+  L.faultAtMs = now;
+  // TTD: from the last moment the coordinator was known good to detection.
+  const uint32_t ref = L.lastHealthyMs ? L.lastHealthyMs : L.lastRxMs;
+  L.lastTtdMs = ref ? (now - ref) : 0;
+  if (L.lastTtdMs > L.maxTtdMs) L.maxTtdMs = L.lastTtdMs;
+  Serial.printf("[Coord%u] fault=%s ttd=%lums\n", (unsigned)li, reason, (unsigned long)L.lastTtdMs);
+
+  // Queued commands would only execute late (or never); fail them now.
+  linkDropTxQueue(li, "coordinator_unavailable");
+  coordFlushUartRx(li);
+  coordSendSimpleCmd(li, "ping");
+  coordSetState(li, COORD_ST_SOFT);
+}
+
+// Called for every {"evt":"hb"} received on link li.
+static void coordOnHeartbeat(uint8_t li, const JsonDocument& msg) {
+  coord_link_t& L = gLinks[li];
+  const uint32_t now = millis();
+  L.armed = true;
+  L.lastHbMs = now;
+  L.hbSeq = msg["seq"] | 0;
+  L.hbUp = msg["up"] | 0;
+  L.hbQ = msg["q"] | 0;
+  L.hbQMax = msg["qMax"] | 0;
+  L.hbZbAgeMs = msg["zbAgeMs"] | 0;
+  L.hbHeap = msg["heap"] | 0;
+  L.hbMinHeap = msg["minHeap"] | 0;
+  L.hbTxDrop = msg["txDrop"] | 0;
+  L.hbTxOvf = msg["txOvf"] | 0;
+  L.hbQHw = msg["qHw"] | 0;
+  L.hbPoolMin = msg["poolMin"] | 0;
+  L.hbPlMin = msg["plMin"] | 0;
+  L.hbPoolFail = msg["poolFail"] | 0;
+  L.hbZbWakes = msg["zbWakes"] | 0;
+  L.hbDispUsMax = msg["dispUsMax"] | 0;
+  L.hbDispUsAvg = msg["dispUsAvg"] | 0;
+  L.hbAttrs = msg["attrs"] | 0;
+  L.hbAttrLines = msg["attrLines"] | 0;
+  const char* zb = msg["zb"] | "";
+  strncpy(L.hbZb, zb, sizeof(L.hbZb) - 1);
+  L.hbZb[sizeof(L.hbZb) - 1] = 0;
+
+  // hb carries the current backpressure state: heal a lost cmd_backpressure
+  // on:false, and re-assert (and re-arm the safety timeout for) one that is
+  // still on after LINK_BACKPRESSURE_MAX_MS released it.
+  // Credits are not healed from hb.q: a command can be on the wire or already
+  // dequeued without its cmd_sent having arrived; lost credits time out instead.
+  link_tx_guard_t guard;
+  const bool bp = msg["bp"] | false;
+  if (bp) {
+    if (!L.backpressure) L.backpressureEvents++;
+    L.backpressure = true;
+    L.backpressureAtMs = now;
+  } else if (L.backpressure) {
+    L.backpressure = false;
+    linkPumpTx(li);
+  }
+
+  const bool queueFull = L.hbQMax > 0 && L.hbQ >= L.hbQMax;
+  if (!queueFull) {
+    L.queueFullSinceMs = 0;
+  } else if (!L.queueFullSinceMs) {
+    L.queueFullSinceMs = now;
+  }
+
+  const bool zbStuck = L.hbZbAgeMs > COORD_ZB_STUCK_MS;
+  const bool queueStuck = L.queueFullSinceMs && (now - L.queueFullSinceMs) > COORD_QUEUE_STUCK_MS;
+  // Stack still forming after a reset is not a fault by itself; it is just not healthy yet.
+  const bool formed = strcmp(L.hbZb, "formed") == 0;
+
+  if (zbStuck || queueStuck) {
+    if (L.state == COORD_ST_OK || L.state == COORD_ST_UNKNOWN) {
+      coordOnFault(li, zbStuck ? "zb_task_stuck" : "queue_stuck");
+    }
+    return;
+  }
+  if (formed) coordOnHealthy(li);
+}
+
+// Called for every cmd_sent / untracked cmd_result received on link li.
+static void coordOnCmdResult(uint8_t li, const char* cmdId) {
+  link_tx_guard_t guard;
+  if (linkReleaseCredit(gLinks[li], cmdId)) linkPumpTx(li);
+}
+
+// Called for every {"evt":"cmd_backpressure"} received on link li.
+static void coordOnBackpressure(uint8_t li, const JsonDocument& msg) {
+  link_tx_guard_t guard;
+  coord_link_t& L = gLinks[li];
+  const bool on = msg["on"] | false;
+  if (on && !L.backpressure) {
+    L.backpressureEvents++;
+    L.backpressureAtMs = millis();
+  }
+  L.backpressure = on;
+  if (!on) linkPumpTx(li);
+}
+
+static void coordLinkTick(uint8_t li) {
+  coord_link_t& L = gLinks[li];
+  const int enPin = COORD_LINK_CFG[li].enPin;
+  const uint32_t now = millis();
+
+  if (L.backpressure && (now - L.backpressureAtMs) > LINK_BACKPRESSURE_MAX_MS) {
+    link_tx_guard_t guard;
+    L.backpressure = false;
+    linkPumpTx(li);
+  }
+
+  if (L.inflight > 0) {
+    link_tx_guard_t guard;
+    bool freed = false;
+    for (uint8_t i = 0; i < LINK_MAX_INFLIGHT; i++) {
+      if (!L.creditId[i][0] || (now - L.creditAtMs[i]) <= LINK_CREDIT_TIMEOUT_MS) continue;
+      Serial.printf("[Coord%u] credit timeout cmdId=%s\n", (unsigned)li, L.creditId[i]);
+      L.creditId[i][0] = 0;
+      if (L.inflight > 0) L.inflight--;
+      L.creditTimeouts++;
+      freed = true;
+    }
+    if (freed) linkPumpTx(li);
+  }
+
+  if (L.enReleaseAtMs && timeDue(now, L.enReleaseAtMs)) {
+    digitalWrite(enPin, HIGH);
+    L.enReleaseAtMs = 0;
+    L.stepAtMs = now; // wait window starts when the C6 is released
+  }
+
+  if (!L.armed) return;
+
+  const bool silent = (now - L.lastRxMs) > COORD_HB_SILENCE_MS;
+  const uint32_t inStep = now - L.stepAtMs;
+
+  switch (L.state) {
+    case COORD_ST_UNKNOWN:
+    case COORD_ST_OK:
+      if (silent) coordOnFault(li, "silence");
+      break;
+
+    case COORD_ST_SOFT:
+      if (inStep < COORD_SOFT_WAIT_MS) break;
+      // loop() still answers heartbeats -> a cooperative restart is possible.
+      if ((now - L.lastHbMs) <= COORD_HB_SILENCE_MS) {
+        L.reboots++;
+        coordSendSimpleCmd(li, "reboot");
+        coordSetState(li, COORD_ST_REBOOT);
+      } else if (enPin >= 0) {
+        coordPulseEn(li);
+        coordSetState(li, COORD_ST_HARD);
+      } else {
+        coordSetState(li, COORD_ST_FAILED);
+      }
+      break;
+
+    case COORD_ST_REBOOT:
+      if (inStep < COORD_REBOOT_WAIT_MS) break;
+      if (enPin >= 0) {
+        coordPulseEn(li);
+        coordSetState(li, COORD_ST_HARD);
+      } else {
+        coordSetState(li, COORD_ST_FAILED);
+      }
+      break;
+
+    case COORD_ST_HARD:
+      if (L.enReleaseAtMs || inStep < COORD_HARD_WAIT_MS) break;
+      L.hardBackoffMs = L.hardBackoffMs ? min(L.hardBackoffMs * 2, COORD_HARD_BACKOFF_MAX_MS) : COORD_HARD_WAIT_MS;
+      Serial.printf("[Coord%u] hard reset did not recover, next try in %lums\n", (unsigned)li,
+                    (unsigned long)L.hardBackoffMs);
+      coordSetState(li, COORD_ST_FAILED);
+      break;
+
+    case COORD_ST_FAILED:
+      if (enPin < 0) {
+        // No EN wiring: keep retrying the soft path.
+        if (inStep >= COORD_REBOOT_WAIT_MS) {
+          coordFlushUartRx(li);
+          coordSendSimpleCmd(li, "ping");
+          coordSetState(li, COORD_ST_SOFT);
+        }
+      } else if (inStep >= L.hardBackoffMs) {
+        coordPulseEn(li);
+        L.state = COORD_ST_HARD; // stay quiet; FAILED<->HARD flapping is not news
+        L.stepAtMs = now;
+      }
+      break;
+  }
+}
+
+static void coordinatorSupervisionTick() {
+  for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) coordLinkTick(li);
+  saveRoutesIfDue();
+  if (mqtt.connected() && timeDue(millis(), gCoordNextHealthPubMs)) publishCoordinatorHealth();
+}
+
+static void coordLinksBegin() {
+  memset(gLinks, 0, sizeof(gLinks));
+  gLinkTxMutex = xSemaphoreCreateRecursiveMutex();
+  loadRoutesFromNvs();
+  for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+    const coord_link_cfg_t& c = COORD_LINK_CFG[li];
+    c.port->begin(UART_BAUD, SERIAL_8N1, c.rxPin, c.txPin);
+    // Coordinator EN (idle high = running)
+    if (c.enPin >= 0) {
+      pinMode(c.enPin, OUTPUT);
+      digitalWrite(c.enPin, HIGH);
+    }
+  }
+  unsigned routes = 0;
+  for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) routes += gLinks[li].devices;
+  Serial.printf("[Coord] %u link(s), %u persisted route(s)\n", (unsigned)COORD_LINK_COUNT, routes);
+}
+
+// ----------------- TIME DISTRIBUTION -----------------
+// Only the hub has NTP. It pushes epoch time to every coordinator:
+//   {"cmd":"time_sync","epoch":<sec>,"ms":<0..999>}
+// The coordinator serves it as the Zigbee Time cluster, which end devices (the
+// SmartLock bridge -> ESP8266) read so they can stamp their own events.
+// Sent on coordinator boot (fw_info), after recovery, and every TIME_SYNC_INTERVAL_MS.
+
+static const uint32_t TIME_SYNC_INTERVAL_MS = 10UL * 60UL * 1000UL;
+static uint32_t gNextTimeSyncMs = 0;
+
+static void timeSyncSendLink(uint8_t li) {
+  if (!gTimeSynced) return;
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  StaticJsonDocument<96> u;
+  u["cmd"] = "time_sync";
+  u["epoch"] = (uint32_t)tv.tv_sec;
+  u["ms"] = (uint16_t)(tv.tv_usec / 1000);
+  // Control frame: must not wait behind device commands, or the stamp would be stale.
+  linkSendControl(li, u);
+}
+
+static void timeSyncTick() {
+  if (!gTimeSynced) return;
+  const uint32_t now = millis();
+  // First run after NTP sync goes out immediately.
+  if (gNextTimeSyncMs && !timeDue(now, gNextTimeSyncMs)) return;
+  gNextTimeSyncMs = now + TIME_SYNC_INTERVAL_MS;
+  if (gNextTimeSyncMs == 0) gNextTimeSyncMs = 1;
+  for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+    if (linkUsable(li)) timeSyncSendLink(li);
+  }
+}
+
+// ----------------- BULK ONBOARDING -----------------
+// One long pairing window for installing many devices at once:
+//   home/hub/<hubId>/zigbee/pairing/bulk
+//   { token, durationSec<=1800, installCodes:[{ieee, code}], autoAccept:[ieee] }
+// Install codes are loaded into every coordinator before joins are allowed (a code
+// counts once the coordinator acked it; unacked sends are retried, then reported as
+// failed), then permit_join is re-issued in slices (the coordinator caps one window at 255 s).
+// Each joined device yields exactly one discovered record (after the coordinator's
+// interview); devices on the autoAccept list are flagged so the backend binds them
+// without a manual confirm. Progress goes to .../pairing/progress.
+
+static const uint16_t BULK_MIN_DURATION_SEC = 30;
+static const uint16_t BULK_MAX_DURATION_SEC = 1800;
+static const uint16_t BULK_PERMIT_SLICE_SEC = 240;
+static const uint8_t BULK_IC_MAX = 32;
+static const uint8_t BULK_AUTO_MAX = 64;
+static const uint32_t BULK_IC_PACE_MS = 50;   // keep the coordinator's command queue (16) from overflowing
+static const uint32_t BULK_IC_ACK_MS = 2000;  // install_code result expected within this
+static const uint8_t BULK_IC_TRIES = 3;
+static const uint32_t BULK_PROGRESS_MS = 5000;
+
+struct bulk_ic_t {
+  char ieee16[17];
+  char code[37];   // hex incl. CRC, up to 18 bytes
+  uint8_t sentMask; // per coordinator link, waiting for its install_code result
+  uint8_t okMask;
+  uint8_t failMask; // gave up after BULK_IC_TRIES
+  uint8_t tries[COORD_LINK_COUNT];
+  uint32_t sentMs[COORD_LINK_COUNT];
+};
+
+struct bulk_state_t {
+  bool active;
+  uint32_t nextPermitMs;
+  uint32_t nextIcMs;
+  uint32_t nextProgressMs;
+  uint8_t icCount;
+  bulk_ic_t ic[BULK_IC_MAX];
+  uint8_t autoCount;
+  char autoAccept[BULK_AUTO_MAX][17];
+  uint16_t announced;
+  uint16_t interviewed;
+  uint16_t interviewFailed;
+  uint16_t autoAccepted;
+};
+
+static bulk_state_t gBulk;
+
+static bool bulkIsAutoAccept(const String& ieee16) {
+  if (!gBulk.active) return false;
+  for (uint8_t i = 0; i < gBulk.autoCount; i++) {
+    if (strncmp(gBulk.autoAccept[i], ieee16.c_str(), 16) == 0) return true;
+  }
+  return false;
+}
+
+static void publishBulkProgress(const char* reason) {
+  StaticJsonDocument<1024> doc;
+  doc["token"] = activePairingToken;
+  doc["ts"] = (unsigned long long)nowMs();
+  doc["bulk"] = true;
+  doc["active"] = gBulk.active && isPairingActive();
+  doc["remainingSec"] = isPairingActive() ? (uint32_t)((activePairingUntilMs - millis()) / 1000U) : 0;
+  doc["announced"] = gBulk.announced;
+  doc["interviewed"] = gBulk.interviewed;
+  doc["interviewFailed"] = gBulk.interviewFailed;
+  doc["autoAccepted"] = gBulk.autoAccepted;
+  doc["installCodes"] = gBulk.icCount;
+  uint8_t loaded = 0;
+  JsonArray failed;
+  for (uint8_t i = 0; i < gBulk.icCount; i++) {
+    const bulk_ic_t& ic = gBulk.ic[i];
+    if (ic.failMask) {
+      if (failed.isNull()) failed = doc.createNestedArray("installCodesFailed");
+      failed.add(ic.ieee16);
+    } else if (ic.okMask) {
+      loaded++;
+    }
+  }
+  doc["installCodesLoaded"] = loaded;
+  if (reason && reason[0]) doc["reason"] = reason;
+  String payload;
+  serializeJson(doc, payload);
+  mqttPublish(tPairProgress, payload, 0, false);
+}
+
+static void bulkEnd(const char* reason) {
+  if (!gBulk.active) return;
+  gBulk.active = false;
+  Serial.printf("[Bulk] end (%s) announced=%u interviewed=%u failed=%u auto=%u\n", reason,
+                (unsigned)gBulk.announced, (unsigned)gBulk.interviewed, (unsigned)gBulk.interviewFailed,
+                (unsigned)gBulk.autoAccepted);
+  publishBulkProgress(reason);
+}
+
+static void handlePairBulk(const JsonDocument& doc) {
+  const char* token = doc["token"] | "";
+  int durationSec = doc["durationSec"] | 600;
+  if (durationSec < BULK_MIN_DURATION_SEC) durationSec = BULK_MIN_DURATION_SEC;
+  if (durationSec > BULK_MAX_DURATION_SEC) durationSec = BULK_MAX_DURATION_SEC;
+
+  memset(&gBulk, 0, sizeof(gBulk));
+  for (JsonVariantConst v : doc["installCodes"].as<JsonArrayConst>()) {
+    if (gBulk.icCount >= BULK_IC_MAX) break;
+    String ieee16 = normalizeIeee(v["ieee"] | "");
+    // Printed codes come grouped ("83FE-D340-..."); keep the hex digits only.
+    char hex[sizeof(gBulk.ic[0].code)];
+    size_t n = 0;
+    bool tooLong = false;
+    for (const char* c = v["code"] | ""; *c; c++) {
+      if (!isxdigit((unsigned char)*c)) continue;
+      if (n + 1 >= sizeof(hex)) {
+        tooLong = true;
+        break;
+      }
+      hex[n++] = *c;
+    }
+    hex[n] = 0;
+    if (ieee16.isEmpty() || tooLong || n < 16 || (n % 2) != 0) {
+      Serial.printf("[Bulk] skip install code ieee=%s\n", (const char*)(v["ieee"] | ""));
+      continue;
+    }
+    bulk_ic_t& ic = gBulk.ic[gBulk.icCount++];
+    strncpy(ic.ieee16, ieee16.c_str(), sizeof(ic.ieee16) - 1);
+    strncpy(ic.code, hex, sizeof(ic.code) - 1);
+  }
+  for (JsonVariantConst v : doc["autoAccept"].as<JsonArrayConst>()) {
+    if (gBulk.autoCount >= BULK_AUTO_MAX) break;
+    String ieee16 = normalizeIeee(v | "");
+    if (ieee16.isEmpty()) continue;
+    strncpy(gBulk.autoAccept[gBulk.autoCount++], ieee16.c_str(), 16);
+  }
+
+  String tok = String(token);
+  if (tok.isEmpty()) tok = genPairToken();
+  activePairingToken = tok;
+  activePairingUntilMs = millis() + (uint32_t)durationSec * 1000U;
+
+  gBulk.active = true;
+  gBulk.nextPermitMs = millis();
+  gBulk.nextIcMs = millis();
+  gBulk.nextProgressMs = millis();
+  Serial.printf("[Bulk] open token=%s duration=%d installCodes=%u autoAccept=%u\n", activePairingToken.c_str(),
+                durationSec, (unsigned)gBulk.icCount, (unsigned)gBulk.autoCount);
+}
+
+// A restarted coordinator has lost the codes we loaded into it.
+static void bulkOnLinkRestart(uint8_t li) {
+  const uint8_t bit = (uint8_t)(1U << li);
+  for (uint8_t i = 0; i < gBulk.icCount; i++) {
+    gBulk.ic[i].sentMask &= (uint8_t)~bit;
+    gBulk.ic[i].okMask &= (uint8_t)~bit;
+    gBulk.ic[i].failMask &= (uint8_t)~bit;
+    gBulk.ic[i].tries[li] = 0;
+  }
+}
+
+static void bulkOnInstallCodeResult(uint8_t li, const char* ieeeRaw, bool ok, const char* error) {
+  String ieee16 = normalizeIeee(ieeeRaw);
+  const uint8_t bit = (uint8_t)(1U << li);
+  for (uint8_t i = 0; i < gBulk.icCount; i++) {
+    bulk_ic_t& ic = gBulk.ic[i];
+    if (strncmp(ic.ieee16, ieee16.c_str(), 16) != 0) continue;
+    if (!(ic.sentMask & bit)) break; // late answer to a send already given up on
+    ic.sentMask &= (uint8_t)~bit;
+    if (ok) {
+      ic.okMask |= bit;
+    } else if (ic.tries[li] >= BULK_IC_TRIES) {
+      ic.failMask |= bit;
+      publishBulkProgress("install_code_failed");
+    }
+    // Otherwise the pump sends it again.
+    break;
+  }
+  if (!ok) Serial.printf("[Bulk] link %u install code %s failed: %s\n", (unsigned)li, ieee16.c_str(), error);
+}
+
+static void bulkOnAnnounce() {
+  if (gBulk.active) gBulk.announced++;
+}
+
+static void bulkOnInterview(bool ok, bool autoAccepted) {
+  if (!gBulk.active) return;
+  gBulk.interviewed++;
+  if (!ok) gBulk.interviewFailed++;
+  if (autoAccepted) gBulk.autoAccepted++;
+}
+
+// Sends the next install code that is unsent or whose result timed out; true while
+// any usable link still has a code neither acked nor given up on.
+static bool bulkPumpInstallCodes() {
+  const uint32_t now = millis();
+  bool waiting = false;
+  for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+    if (!linkUsable(li)) continue;
+    const uint8_t bit = (uint8_t)(1U << li);
+    for (uint8_t i = 0; i < gBulk.icCount; i++) {
+      bulk_ic_t& ic = gBulk.ic[i];
+      if ((ic.okMask | ic.failMask) & bit) continue;
+      if ((ic.sentMask & bit) && (now - ic.sentMs[li]) < BULK_IC_ACK_MS) {
+        waiting = true;
+        continue;
+      }
+      if (ic.tries[li] >= BULK_IC_TRIES) {
+        ic.sentMask &= (uint8_t)~bit;
+        ic.failMask |= bit;
+        Serial.printf("[Bulk] link %u install code %s: no result, giving up\n", (unsigned)li, ic.ieee16);
+        publishBulkProgress("install_code_failed");
+        continue;
+      }
+      StaticJsonDocument<160> u;
+      u["cmd"] = "install_code";
+      u["ieee"] = ic.ieee16;
+      u["code"] = ic.code;
+      // Not a device command: goes to every coordinator, outside per-device flow control.
+      linkSendControl(li, u);
+      ic.sentMask |= bit;
+      ic.sentMs[li] = now;
+      ic.tries[li]++;
+      return true;
+    }
+  }
+  return waiting;
+}
+
+static void bulkTick() {
+  if (!gBulk.active) return;
+  const uint32_t now = millis();
+
+  if (!timeDue(now, gBulk.nextIcMs)) return;
+  gBulk.nextIcMs = now + BULK_IC_PACE_MS;
+  // Joins wait until every code is loaded, otherwise an early device fails its key exchange.
+  if (bulkPumpInstallCodes()) return;
+
+  if (timeDue(now, gBulk.nextPermitMs) && isPairingActive()) {
+    uint32_t remainSec = (activePairingUntilMs - now) / 1000U;
+    if (remainSec > 254) remainSec = 254;
+    if (remainSec >= 5) {
+      StaticJsonDocument<128> u;
+      u["cmd"] = "permit_join";
+      u["duration"] = remainSec;
+      uartSendJson(u);
+    }
+    gBulk.nextPermitMs = now + (uint32_t)BULK_PERMIT_SLICE_SEC * 1000U;
+  }
+
+  if (mqtt.connected() && timeDue(now, gBulk.nextProgressMs)) {
+    gBulk.nextProgressMs = now + BULK_PROGRESS_MS;
+    publishBulkProgress(nullptr);
+  }
+}
+
+// ----------------- DEVICE AVAILABILITY -----------------
+// Every UART frame that names a device counts as "seen". Each device has an
+// expected report interval (by model from the Basic fingerprint) and a deadline
+// = lastSeen + interval * AVAIL_MISSED_REPORTS + grace. Deadlines live in an
+// indexed binary min-heap, so the periodic check only looks at the root and a
+// "seen" update is O(log n); nothing iterates over all devices.
+//
+// The interval is the device's configured max reporting interval once a
+// report_cfg for it has been seen (coordinator profile after the interview, or a
+// zigbee.report_cfg / report_read from the backend); the model table is the
+// fallback until then.
+//
+// Only transitions are published (retained home/zb/<ieee>/availability); the
+// per-device lastSeen timestamps go out as one compact index every minute.
+
+struct avail_model_interval_t {
+  const char* model;
+  uint32_t intervalMs;
+};
+
+static const avail_model_interval_t AVAIL_MODEL_INTERVALS[] = {
+  {"TH_SENSOR_V1", 30UL * 60UL * 1000UL}, // coordinator profile default (max 1800s) until report_cfg is seen
+  {"LOCK_V2_DUALMCU", 10000},    // lock bridge re-sends snapshot every 10s
+  {"GATE_PIR_V1", 5UL * 60UL * 1000UL},
+};
+
+static const size_t AVAIL_MAX = ROUTE_MAX; // every device the coordinators can hold
+struct avail_entry_t {
+  bool used;
+  bool online;
+  char ieee16[17];
+  uint32_t lastSeenMs;   // millis()
+  uint64_t lastSeenAt;   // epoch ms (best-effort)
+  uint32_t deadlineMs;   // millis() at which the device is declared offline
+  uint32_t rptMaxMs;     // configured max reporting interval, 0 = not seen yet
+  int16_t heapPos;       // position in gAvailHeap, -1 when not scheduled
+};
+
+static avail_entry_t gAvail[AVAIL_MAX];
+static uint16_t gAvailHeap[AVAIL_MAX]; // entry indexes ordered by deadline
+static size_t gAvailHeapLen = 0;
+static bool gAvailIndexDirty = false;
+static uint32_t gAvailNextIndexPubMs = 0;
+static uint32_t gAvailTransitions = 0;
+
+static int availFind(const char* ieee16);
+
+static uint32_t availIntervalFor(const char* ieee16) {
+  const int idx = availFind(ieee16);
+  if (idx >= 0 && gAvail[idx].rptMaxMs) return gAvail[idx].rptMaxMs;
+  fp_entry_t* fp = fp_find(ieee16);
+  if (fp && fp->model[0]) {
+    for (size_t i = 0; i < sizeof(AVAIL_MODEL_INTERVALS) / sizeof(AVAIL_MODEL_INTERVALS[0]); i++) {
+      if (strncmp(fp->model, AVAIL_MODEL_INTERVALS[i].model, sizeof(fp->model)) == 0) {
+        return AVAIL_MODEL_INTERVALS[i].intervalMs;
+      }
+    }
+  }
+  return AVAIL_DEFAULT_INTERVAL_MS;
+}
+
+// Wrap-safe ordering of millis() deadlines.
+static bool availBefore(uint16_t a, uint16_t b) {
+  return (int32_t)(gAvail[a].deadlineMs - gAvail[b].deadlineMs) < 0;
+}
+
+static void availHeapSwap(size_t i, size_t j) {
+  uint16_t t = gAvailHeap[i];
+  gAvailHeap[i] = gAvailHeap[j];
+  gAvailHeap[j] = t;
+  gAvail[gAvailHeap[i]].heapPos = (int16_t)i;
+  gAvail[gAvailHeap[j]].heapPos = (int16_t)j;
+}
+
+static void availSiftUp(size_t i) {
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!availBefore(gAvailHeap[i], gAvailHeap[parent])) break;
+    availHeapSwap(i, parent);
+    i = parent;
+  }
+}
+
+static void availSiftDown(size_t i) {
+  while (true) {
+    size_t l = 2 * i + 1;
+    size_t r = l + 1;
+    size_t m = i;
+    if (l < gAvailHeapLen && availBefore(gAvailHeap[l], gAvailHeap[m])) m = l;
+    if (r < gAvailHeapLen && availBefore(gAvailHeap[r], gAvailHeap[m])) m = r;
+    if (m == i) break;
+    availHeapSwap(i, m);
+    i = m;
+  }
+}
+
+static void availHeapRemove(uint16_t idx) {
+  int16_t pos = gAvail[idx].heapPos;
+  if (pos < 0) return;
+  gAvailHeapLen--;
+  if ((size_t)pos != gAvailHeapLen) {
+    availHeapSwap((size_t)pos, gAvailHeapLen);
+    availSiftDown((size_t)pos);
+    availSiftUp((size_t)pos);
+  }
+  gAvail[idx].heapPos = -1;
+}
+
+static void availSchedule(uint16_t idx, uint32_t deadlineMs) {
+  avail_entry_t& e = gAvail[idx];
+  e.deadlineMs = deadlineMs;
+  if (e.heapPos < 0) {
+    gAvailHeap[gAvailHeapLen] = idx;
+    e.heapPos = (int16_t)gAvailHeapLen;
+    gAvailHeapLen++;
+  }
+  // Deadline may move either way (model learned after first report).
+  availSiftUp((size_t)e.heapPos);
+  availSiftDown((size_t)e.heapPos);
+}
+
+static int availFind(const char* ieee16) {
+  for (size_t i = 0; i < AVAIL_MAX; i++) {
+    if (gAvail[i].used && strncmp(gAvail[i].ieee16, ieee16, 16) == 0) return (int)i;
+  }
+  return -1;
+}
+
+static int availUpsert(const char* ieee16) {
+  int idx = availFind(ieee16);
+  if (idx >= 0) return idx;
+  int victim = -1;
+  for (size_t i = 0; i < AVAIL_MAX; i++) {
+    if (!gAvail[i].used) {
+      victim = (int)i;
+      break;
+    }
+  }
+  if (victim < 0) {
+    // Full (more devices than the coordinators hold): reuse the entry heard from least recently.
+    victim = 0;
+    for (size_t i = 1; i < AVAIL_MAX; i++) {
+      if ((int32_t)(gAvail[i].lastSeenMs - gAvail[victim].lastSeenMs) < 0) victim = (int)i;
+    }
+    Serial.printf("[Avail] table full, %s no longer tracked\n", gAvail[victim].ieee16);
+    availHeapRemove((uint16_t)victim);
+  }
+  avail_entry_t& e = gAvail[victim];
+  memset(&e, 0, sizeof(e));
+  e.used = true;
+  e.heapPos = -1;
+  strncpy(e.ieee16, ieee16, sizeof(e.ieee16) - 1);
+  return victim;
+}
+
+static void publishAvailability(const avail_entry_t& e) {
+  StaticJsonDocument<128> doc;
+  doc["online"] = e.online;
+  doc["ts"] = (unsigned long long)nowMs();
+  if (e.lastSeenAt) doc["lastSeen"] = (unsigned long long)e.lastSeenAt;
+  String payload;
+  serializeJson(doc, payload);
+  lanBroadcast("availability", String(e.ieee16), payload);
+  mqttPublish(String("home/zb/") + e.ieee16 + "/availability", payload, 1, true);
+}
+
+// Called for every UART frame attributed to a device.
+static void availabilitySeen(const String& ieee16) {
+  if (ieee16.isEmpty()) return;
+  int idx = availUpsert(ieee16.c_str());
+  if (idx < 0) return;
+  avail_entry_t& e = gAvail[idx];
+  const uint32_t now = millis();
+  e.lastSeenMs = now;
+  e.lastSeenAt = nowMs();
+  gAvailIndexDirty = true;
+
+  const uint32_t interval = availIntervalFor(e.ieee16);
+  availSchedule((uint16_t)idx, now + interval * AVAIL_MISSED_REPORTS + AVAIL_GRACE_MS);
+
+  if (!e.online) {
+    e.online = true;
+    gAvailTransitions++;
+    Serial.printf("[Avail] %s online\n", e.ieee16);
+    publishAvailability(e);
+  }
+}
+
+// {"evt":"report_cfg"} from the coordinator: the shortest max interval among the
+// attributes configured for reporting is how long the device may stay quiet.
+static void availabilityOnReportCfg(const String& ieee16, const JsonDocument& msg) {
+  if (ieee16.isEmpty()) return;
+  uint32_t maxS = 0;
+  for (JsonVariantConst a : msg["attrs"].as<JsonArrayConst>()) {
+    if ((a["status"] | 0xFF) != 0) continue;
+    const uint32_t m = a["max"] | 0;
+    if (m == 0 || m >= 0xFFFF) continue; // no periodic report / reporting disabled
+    if (maxS == 0 || m < maxS) maxS = m;
+  }
+  if (maxS == 0) return;
+  const int idx = availUpsert(ieee16.c_str());
+  if (idx < 0) return;
+  avail_entry_t& e = gAvail[idx];
+  // report_cfg comes per cluster: the device may stay quiet only as long as its
+  // shortest configured interval, so a later, longer one does not raise it.
+  const uint32_t maxMs = e.rptMaxMs ? min(e.rptMaxMs, maxS * 1000UL) : maxS * 1000UL;
+  if (e.rptMaxMs == maxMs) return;
+  e.rptMaxMs = maxMs;
+  Serial.printf("[Avail] %s report interval %lus\n", e.ieee16, (unsigned long)(maxMs / 1000UL));
+  if (e.heapPos >= 0) availSchedule((uint16_t)idx, e.lastSeenMs + e.rptMaxMs * AVAIL_MISSED_REPORTS + AVAIL_GRACE_MS);
+}
+
+static void availabilityRebaseDeadlines() {
+  const uint32_t now = millis();
+  for (size_t i = 0; i < AVAIL_MAX; i++) {
+    if (!gAvail[i].used || gAvail[i].heapPos < 0) continue;
+    availSchedule((uint16_t)i, now + availIntervalFor(gAvail[i].ieee16) * AVAIL_MISSED_REPORTS + AVAIL_GRACE_MS);
+  }
+}
+
+static void publishLastSeenIndex() {
+  gAvailNextIndexPubMs = millis() + AVAIL_INDEX_PUBLISH_MS;
+  if (!gAvailIndexDirty || !mqtt.connected()) return;
+
+  DynamicJsonDocument doc(256 + AVAIL_MAX * 48);
+  doc["ts"] = (unsigned long long)nowMs();
+  JsonObject devices = doc.createNestedObject("devices");
+  for (size_t i = 0; i < AVAIL_MAX; i++) {
+    if (!gAvail[i].used || !gAvail[i].lastSeenAt) continue;
+    devices[gAvail[i].ieee16] = (unsigned long long)gAvail[i].lastSeenAt;
+  }
+  doc["transitions"] = gAvailTransitions;
+  String payload;
+  serializeJson(doc, payload);
+  mqttPublish(tHubZigbeeLastSeen, payload, 0, true);
+  gAvailIndexDirty = false;
+}
+
+static void availabilityTick() {
+  const uint32_t now = millis();
+  if (timeDue(now, gAvailNextIndexPubMs)) publishLastSeenIndex();
+
+  while (gAvailHeapLen > 0) {
+    const uint16_t idx = gAvailHeap[0];
+    avail_entry_t& e = gAvail[idx];
+    if (!timeDue(now, e.deadlineMs)) break;
+    // While its coordinator is down nothing can be heard; do not blame the device.
+    const int li = routeLinkFor(e.ieee16);
+    if (li >= 0 && !linkUsable((uint8_t)li)) {
+      availSchedule(idx, now + availIntervalFor(e.ieee16));
+      continue;
+    }
+    availHeapRemove(idx); // re-scheduled on the next frame from this device
+    if (e.online) {
+      e.online = false;
+      gAvailTransitions++;
+      Serial.printf("[Avail] %s offline (silent %lums)\n", e.ieee16, (unsigned long)(now - e.lastSeenMs));
+      publishAvailability(e);
+    }
+  }
+}
+
+// ----------------- SENSOR ANALYTICS (anomaly detection) -----------------
+// Streaming detectors per (sensor, metric) in a fixed table, so the backend does
+// not need every raw TH report to alert:
+//   zscore    : |x - EWMA mean| / EWMA std above `z` after `warmup` samples
+//   roc       : |dx/dt| above rocPerMin (units per minute)
+//   stuck     : value within stuckEps for stuckMin minutes (active until it moves)
+//   threshold : outside [min, max] (active until back in range)
+// Anomalies go out as home/zb/<ieee>/event {type:"sensor.anomaly"} (so hub rules
+// can react); every summarySec a home/hub/<HUB_ID>/analytics/summary carries
+// per-stream n/min/max/mean/last. With forwardRaw=false TH state is no longer
+// published per report and the summary's `last` becomes the state source.
+// Config (retained, NVS "analytics"): home/hub/<HUB_ID>/analytics/config
+
+enum { ANA_TEMPERATURE = 0, ANA_HUMIDITY = 1, ANA_METRIC_COUNT = 2 };
+static const char* const ANA_METRIC_NAMES[ANA_METRIC_COUNT] = {"temperature", "humidity"};
+
+static const uint8_t ANA_F_STUCK = 0x01;
+static const uint8_t ANA_F_LOW = 0x02;
+static const uint8_t ANA_F_HIGH = 0x04;
+
+struct ana_metric_cfg_t {
+  float rocPerMin;   // 0 = off
+  uint32_t stuckMs;  // 0 = off
+  float stuckEps;
+  bool hasMin;
+  bool hasMax;
+  float min;
+  float max;
+};
+
+struct ana_cfg_t {
+  bool enabled;
+  bool forwardRaw;
+  float alpha;       // EWMA weight of the newest sample
+  float z;
+  uint16_t warmup;
+  uint32_t cooldownMs; // per stream, for point detectors (zscore/roc)
+  uint32_t summaryMs;
+  ana_metric_cfg_t metric[ANA_METRIC_COUNT];
+};
+
+struct ana_stream_t {
+  bool used;
+  char ieee16[17];
+  uint8_t metric;
+  uint16_t n;        // samples seen (saturates), gates the z-score warmup
+  float mean;
+  float var;
+  float last;
+  uint32_t lastMs;
+  float stuckRef;
+  uint32_t stuckSinceMs;
+  uint8_t active;    // ANA_F_*
+  uint32_t lastAlertMs;
+  // current summary window
+  uint16_t wN;
+  float wMin;
+  float wMax;
+  float wSum;
+  uint16_t wAnomalies;
+};
+
+static ana_cfg_t gAnaCfg;
+static ana_stream_t gAnaStreams[ANA_STREAM_MAX];
+static uint32_t gAnaNextSummaryMs = 0;
+static uint32_t gAnaWindowStartMs = 0;
+static Preferences gAnaPrefs;
+
+static float anaRound2(float v) {
+  return roundf(v * 100.0f) / 100.0f;
+}
+
+static void anaConfigDefaults(ana_cfg_t& c) {
+  memset(&c, 0, sizeof(c));
+  c.enabled = true;
+  c.forwardRaw = true;
+  c.alpha = 0.1f;
+  c.z = 4.0f;
+  c.warmup = 20;
+  c.cooldownMs = 10UL * 60UL * 1000UL;
+  c.summaryMs = 5UL * 60UL * 1000UL;
+  c.metric[ANA_TEMPERATURE].rocPerMin = 2.0f;
+  c.metric[ANA_TEMPERATURE].stuckMs = 60UL * 60UL * 1000UL;
+  c.metric[ANA_TEMPERATURE].stuckEps = 0.01f;
+  c.metric[ANA_HUMIDITY].rocPerMin = 10.0f;
+  c.metric[ANA_HUMIDITY].stuckMs = 60UL * 60UL * 1000UL;
+  c.metric[ANA_HUMIDITY].stuckEps = 0.01f;
+}
+
+// Missing keys keep their defaults, so the backend can send partial configs.
+static void anaConfigParse(JsonVariantConst v, ana_cfg_t& c) {
+  anaConfigDefaults(c);
+  if (!v.is<JsonObjectConst>()) return;
+  c.enabled = v["enabled"] | c.enabled;
+  c.forwardRaw = v["forwardRaw"] | c.forwardRaw;
+  c.alpha = constrain(v["alpha"] | c.alpha, 0.001f, 1.0f);
+  c.z = constrain(v["z"] | c.z, 1.0f, 20.0f);
+  c.warmup = constrain(v["warmup"] | (int)c.warmup, 2, 1000);
+  c.cooldownMs = constrain(v["cooldownSec"] | (long)(c.cooldownMs / 1000), 0L, 86400L) * 1000UL;
+  c.summaryMs = constrain(v["summarySec"] | (long)(c.summaryMs / 1000), 30L, 86400L) * 1000UL;
+  for (uint8_t m = 0; m < ANA_METRIC_COUNT; m++) {
+    JsonVariantConst mv = v["metrics"][ANA_METRIC_NAMES[m]];
+    if (!mv.is<JsonObjectConst>()) continue;
+    ana_metric_cfg_t& mc = c.metric[m];
+    mc.rocPerMin = mv["rocPerMin"] | mc.rocPerMin;
+    mc.stuckMs = (uint32_t)(mv["stuckMin"] | (long)(mc.stuckMs / 60000UL)) * 60000UL;
+    mc.stuckEps = mv["stuckEps"] | mc.stuckEps;
+    mc.hasMin = !mv["min"].isNull();
+    mc.hasMax = !mv["max"].isNull();
+    mc.min = mv["min"] | 0.0f;
+    mc.max = mv["max"] | 0.0f;
+  }
+}
+
+static void loadAnalyticsConfigFromNvs() {
+  gAnaPrefs.begin("analytics", true);
+  String json = gAnaPrefs.getString("cfg", "");
+  gAnaPrefs.end();
+  StaticJsonDocument<1024> doc;
+  if (json.isEmpty() || deserializeJson(doc, json)) doc.clear();
+  anaConfigParse(doc.as<JsonVariantConst>(), gAnaCfg);
+  gAnaNextSummaryMs = millis() + gAnaCfg.summaryMs;
+  gAnaWindowStartMs = millis();
+  Serial.printf("[Ana] enabled=%d forwardRaw=%d summary=%lus\n", (int)gAnaCfg.enabled, (int)gAnaCfg.forwardRaw,
+                (unsigned long)(gAnaCfg.summaryMs / 1000));
+}
+
+static void handleAnalyticsConfig(JsonDocument& doc) {
+  anaConfigParse(doc.as<JsonVariantConst>(), gAnaCfg);
+  String json;
+  serializeJson(doc, json);
+  gAnaPrefs.begin("analytics", false);
+  if (gAnaPrefs.getString("cfg", "") != json) gAnaPrefs.putString("cfg", json);
+  gAnaPrefs.end();
+  gAnaNextSummaryMs = millis() + gAnaCfg.summaryMs;
+  Serial.printf("[Ana] config enabled=%d forwardRaw=%d z=%.1f\n", (int)gAnaCfg.enabled, (int)gAnaCfg.forwardRaw,
+                gAnaCfg.z);
+}
+
+// TH state is still published per report unless the backend opted out.
+static bool analyticsForwardRaw() {
+  return !gAnaCfg.enabled || gAnaCfg.forwardRaw;
+}
+
+static ana_stream_t* anaStreamUpsert(const char* ieee16, uint8_t metric) {
+  ana_stream_t* freeSlot = nullptr;
+  ana_stream_t* oldest = &gAnaStreams[0];
+  for (size_t i = 0; i < ANA_STREAM_MAX; i++) {
+    ana_stream_t& s = gAnaStreams[i];
+    if (s.used && s.metric == metric && strcmp(s.ieee16, ieee16) == 0) return &s;
+    if (!s.used && !freeSlot) freeSlot = &s;
+    if (s.used && (int32_t)(s.lastMs - oldest->lastMs) < 0) oldest = &s;
+  }
+  ana_stream_t* s = freeSlot ? freeSlot : oldest;
+  memset(s, 0, sizeof(*s));
+  s->used = true;
+  strncpy(s->ieee16, ieee16, sizeof(s->ieee16) - 1);
+  s->metric = metric;
+  return s;
+}
+
+static void anaEmit(ana_stream_t& s, const char* detector, float value, const char* extraKey, float extra,
+                    int active) {
+  StaticJsonDocument<256> data;
+  data["metric"] = ANA_METRIC_NAMES[s.metric];
+  data["detector"] = detector;
+  data["value"] = anaRound2(value);
+  data["mean"] = anaRound2(s.mean);
+  data["std"] = anaRound2(sqrtf(s.var));
+  if (extraKey) data[extraKey] = anaRound2(extra);
+  if (active >= 0) data["active"] = active != 0;
+  s.wAnomalies++;
+  Serial.printf("[Ana] %s %s %s value=%.2f\n", s.ieee16, ANA_METRIC_NAMES[s.metric], detector, value);
+  publishZbEvent(String(s.ieee16), "sensor.anomaly", data.as<JsonVariantConst>());
+}
+
+static void analyticsOnSample(const char* ieee16, uint8_t metric, float value) {
+  if (!gAnaCfg.enabled || metric >= ANA_METRIC_COUNT) return;
+  ana_stream_t& s = *anaStreamUpsert(ieee16, metric);
+  const ana_metric_cfg_t& mc = gAnaCfg.metric[metric];
+  const uint32_t now = millis();
+
+  if (s.wN == 0) {
+    s.wMin = s.wMax = value;
+    s.wSum = 0;
+  }
+  s.wN++;
+  s.wSum += value;
+  if (value < s.wMin) s.wMin = value;
+  if (value > s.wMax) s.wMax = value;
+
+  if (s.n == 0) {
+    s.mean = value;
+    s.var = 0;
+    s.stuckRef = value;
+    s.stuckSinceMs = now;
+  } else {
+    const bool canAlert = s.lastAlertMs == 0 || (now - s.lastAlertMs) >= gAnaCfg.cooldownMs;
+    bool alerted = false;
+
+    const uint32_t dtMs = now - s.lastMs;
+    if (mc.rocPerMin > 0 && dtMs >= 1000) {
+      const float rate = (value - s.last) * 60000.0f / (float)dtMs;
+      if (fabsf(rate) > mc.rocPerMin && canAlert) {
+        anaEmit(s, "roc", value, "ratePerMin", rate, -1);
+        alerted = true;
+      }
+    }
+
+    const float sd = sqrtf(s.var);
+    if (!alerted && s.n >= gAnaCfg.warmup && sd > 0.001f) {
+      const float z = (value - s.mean) / sd;
+      if (fabsf(z) > gAnaCfg.z && canAlert) {
+        anaEmit(s, "zscore", value, "z", z, -1);
+        alerted = true;
+      }
+    }
+    if (alerted) s.lastAlertMs = now ? now : 1;
+
+    if (mc.stuckMs > 0) {
+      if (fabsf(value - s.stuckRef) <= mc.stuckEps) {
+        if (!(s.active & ANA_F_STUCK) && (now - s.stuckSinceMs) >= mc.stuckMs) {
+          s.active |= ANA_F_STUCK;
+          anaEmit(s, "stuck", value, "forMin", (now - s.stuckSinceMs) / 60000.0f, 1);
+        }
+      } else {
+        if (s.active & ANA_F_STUCK) {
+          s.active &= ~ANA_F_STUCK;
+          anaEmit(s, "stuck", value, nullptr, 0, 0);
+        }
+        s.stuckRef = value;
+        s.stuckSinceMs = now;
+      }
+    }
+  }
+
+  // Absolute limits (edge-triggered, both directions).
+  const bool low = mc.hasMin && value < mc.min;
+  const bool high = mc.hasMax && value > mc.max;
+  if (low != ((s.active & ANA_F_LOW) != 0)) {
+    s.active ^= ANA_F_LOW;
+    anaEmit(s, "threshold", value, "min", mc.min, low ? 1 : 0);
+  }
+  if (high != ((s.active & ANA_F_HIGH) != 0)) {
+    s.active ^= ANA_F_HIGH;
+    anaEmit(s, "threshold", value, "max", mc.max, high ? 1 : 0);
+  }
+
+  // EWMA mean/variance (West's incremental form), updated after scoring.
+  const float diff = value - s.mean;
+  const float incr = gAnaCfg.alpha * diff;
+  s.mean += incr;
+  s.var = (1.0f - gAnaCfg.alpha) * (s.var + diff * incr);
+  if (s.n < 0xFFFF) s.n++;
+  s.last = value;
+  s.lastMs = now;
+}
+
+static void publishAnalyticsSummary() {
+  const uint32_t now = millis();
+  const uint32_t windowMs = now - gAnaWindowStartMs;
+  gAnaWindowStartMs = now;
+
+  DynamicJsonDocument doc(3072);
+  JsonArray sensors;
+  size_t inChunk = 0;
+  auto flush = [&]() {
+    if (inChunk == 0) return;
+    String payload;
+    serializeJson(doc, payload);
+    mqttPublish(tHubAnalyticsSummary, payload, 0, false);
+    inChunk = 0;
+  };
+
+  for (size_t i = 0; i < ANA_STREAM_MAX; i++) {
+    ana_stream_t& s = gAnaStreams[i];
+    if (!s.used || s.wN == 0) continue;
+    if (inChunk == 0) {
+      doc.clear();
+      doc["ts"] = (unsigned long long)nowMs();
+      doc["windowMs"] = windowMs;
+      doc["raw"] = gAnaCfg.forwardRaw;
+      sensors = doc.createNestedArray("sensors");
+    }
+    JsonObject o = sensors.createNestedObject();
+    o["ieee"] = s.ieee16;
+    o["metric"] = ANA_METRIC_NAMES[s.metric];
+    o["n"] = s.wN;
+    o["min"] = anaRound2(s.wMin);
+    o["max"] = anaRound2(s.wMax);
+    o["mean"] = anaRound2(s.wSum / s.wN);
+    o["last"] = anaRound2(s.last);
+    o["ewma"] = anaRound2(s.mean);
+    o["std"] = anaRound2(sqrtf(s.var));
+    if (s.wAnomalies) o["anomalies"] = s.wAnomalies;
+    if (s.active) o["active"] = s.active;
+    s.wN = 0;
+    s.wAnomalies = 0;
+    if (++inChunk >= ANA_SUMMARY_CHUNK) flush();
+  }
+  flush();
+}
+
+static void analyticsTick() {
+  if (!gAnaCfg.enabled || !mqtt.connected()) return;
+  if (!timeDue(millis(), gAnaNextSummaryMs)) return;
+  gAnaNextSummaryMs = millis() + gAnaCfg.summaryMs;
+  publishAnalyticsSummary();
+}
+
+// ----------------- LAN CONTROL (WebSocket + mDNS) -----------------
+// Phone on the same LAN talks to the hub directly: one WS frame in, one UART
+// line out, no broker hop. Auth is a backend-issued token:
+//   <b64url(json)>.<b64url(HMAC-SHA256(lanKey, b64url(json)))>, json={hub,home,uid,iat,exp}
+// The key never crosses the broker in clear: the hub publishes a P-256 public key
+// on lan/pub, the backend pins it and returns the key sealed to it (ECDH + AES-GCM)
+// on lan/key. The key is kept in NVS so LAN control keeps working while the
+// cloud/broker is unreachable.
+// Token expiry without NTP is checked against a monotonic floor: the newest iat
+// accepted so far (NVS) plus the uptime since it was seen.
+// Commands reuse the MQTT zb/set handler verbatim (same contract).
+
+static void handleMqttJsonMessage(const String& topic, const char* jsonText);
+static bool zbSetWasSeen(const String& cmdId);
+
+static AsyncWebServer gLanHttp(LAN_HTTP_PORT);
+static AsyncWebSocket gLanWs("/ws");
+static bool gLanStarted = false;
+static uint8_t gLanKey[32];
+static bool gLanKeyValid = false;
+// Zigbee network backup key of this hub's home (see ZIGBEE NETWORK BACKUP); NVS "lan"/"bak".
+static uint8_t gNetBakKey[32];
+static bool gNetBakKeyValid = false;
+static uint32_t gLanNextCleanupMs = 0;
+// Key-wrapping pair; the private half never leaves NVS.
+static uint8_t gLanWrapSk[32];
+static uint8_t gLanWrapPub[65];
+static bool gLanWrapValid = false;
+// Monotonic clock floor for token expiry while time is unsynced (seconds).
+static uint64_t gLanFloorSec = 0;
+static uint32_t gLanFloorAtMs = 0;
+static uint64_t gLanFloorSavedSec = 0;
+static const uint32_t LAN_FLOOR_SAVE_SEC = 3600; // NVS write granularity
+
+struct lan_ws_client_t {
+  uint32_t id;       // 0 = free
+  bool authed;
+  uint32_t connectedMs;
+  uint64_t expSec;   // token expiry
+};
+static lan_ws_client_t gLanClients[LAN_WS_MAX_CLIENTS];
+static portMUX_TYPE gLanMux = portMUX_INITIALIZER_UNLOCKED;
+
+static Preferences gLanPrefs;
+
+static bool hexToBytes(const char* hex, uint8_t* out, size_t outLen) {
+  if (!hex || strlen(hex) != outLen * 2) return false;
+  for (size_t i = 0; i < outLen; i++) {
+    char hi = hex[2 * i], lo = hex[2 * i + 1];
+    if (!isHexChar(hi) || !isHexChar(lo)) return false;
+    auto nib = [](char c) -> uint8_t {
+      if (c >= '0' && c <= '9') return c - '0';
+      if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+      return c - 'A' + 10;
+    };
+    out[i] = (uint8_t)((nib(hi) << 4) | nib(lo));
+  }
+  return true;
+}
+
+static int lanRng(void* ctx, unsigned char* out, size_t len) {
+  (void)ctx;
+  while (len > 0) {
+    const uint32_t r = esp_random();
+    const size_t n = len < 4 ? len : 4;
+    memcpy(out, &r, n);
+    out += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Load the wrap key pair, generating it on first boot.
+static void lanWrapKeyInit() {
+  gLanPrefs.begin("lan", false);
+  gLanWrapValid = gLanPrefs.getBytes("wsk", gLanWrapSk, sizeof(gLanWrapSk)) == sizeof(gLanWrapSk) &&
+                  gLanPrefs.getBytes("wpk", gLanWrapPub, sizeof(gLanWrapPub)) == sizeof(gLanWrapPub);
+  if (!gLanWrapValid) {
+    mbedtls_ecp_group grp;
+    mbedtls_mpi d;
+    mbedtls_ecp_point q;
+    mbedtls_ecp_group_init(&grp);
+    mbedtls_mpi_init(&d);
+    mbedtls_ecp_point_init(&q);
+    size_t olen = 0;
+    int rc = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_SECP256R1);
+    if (rc == 0) rc = mbedtls_ecp_gen_keypair(&grp, &d, &q, lanRng, nullptr);
+    if (rc == 0) rc = mbedtls_mpi_write_binary(&d, gLanWrapSk, sizeof(gLanWrapSk));
+    if (rc == 0) {
+      rc = mbedtls_ecp_point_write_binary(&grp, &q, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen, gLanWrapPub, sizeof(gLanWrapPub));
+    }
+    gLanWrapValid = rc == 0 && olen == sizeof(gLanWrapPub) &&
+                    gLanPrefs.putBytes("wsk", gLanWrapSk, sizeof(gLanWrapSk)) == sizeof(gLanWrapSk) &&
+                    gLanPrefs.putBytes("wpk", gLanWrapPub, sizeof(gLanWrapPub)) == sizeof(gLanWrapPub);
+    mbedtls_ecp_point_free(&q);
+    mbedtls_mpi_free(&d);
+    mbedtls_ecp_group_free(&grp);
+    Serial.printf("[LAN] wrap key %s\n", gLanWrapValid ? "generated" : "generation failed");
+  }
+  gLanPrefs.end();
+}
+
+static void loadLanKeyFromNvs() {
+  lanWrapKeyInit();
+  gLanPrefs.begin("lan", true);
+  String k = gLanPrefs.getString("key", "");
+  gLanFloorSec = gLanFloorSavedSec = gLanPrefs.getULong64("tfloor", 0);
+  gNetBakKeyValid = gLanPrefs.isKey("bak") && gLanPrefs.getBytes("bak", gNetBakKey, sizeof(gNetBakKey)) == sizeof(gNetBakKey);
+  gLanPrefs.end();
+  gLanFloorAtMs = millis();
+  gLanKeyValid = hexToBytes(k.c_str(), gLanKey, sizeof(gLanKey));
+  Serial.printf("[LAN] key %s\n", gLanKeyValid ? "loaded" : "not provisioned");
+}
+
+static void publishLanWrapKey() {
+  if (!gLanWrapValid) return;
+  char hex[2 * sizeof(gLanWrapPub) + 1];
+  for (size_t i = 0; i < sizeof(gLanWrapPub); i++) snprintf(hex + 2 * i, 3, "%02x", gLanWrapPub[i]);
+  StaticJsonDocument<256> doc;
+  doc["alg"] = "p256";
+  doc["pub"] = hex;
+  String payload;
+  serializeJson(doc, payload);
+  mqttPublish(tHubLanPub, payload, 1, true);
+}
+
+// Open a sealed envelope from the backend:
+//   {v:2, epk, iv, ct, tag} (hex), AES-256-GCM, AAD = hubId,
+//   key = SHA-256(ECDH(wrap sk, epk) || "lan-key-wrap:" || hubId)
+static bool lanOpenSealed(JsonDocument& doc, uint8_t* out, size_t outCap, size_t& outLen) {
+  const char* ctHex = doc["ct"] | "";
+  outLen = strlen(ctHex) / 2;
+  uint8_t epk[65], iv[12], tag[16];
+  if ((doc["v"] | 0) != 2 || !gLanWrapValid || outLen == 0 || outLen > outCap ||
+      !hexToBytes(doc["epk"] | "", epk, sizeof(epk)) || !hexToBytes(doc["iv"] | "", iv, sizeof(iv)) ||
+      !hexToBytes(doc["tag"] | "", tag, sizeof(tag)) || !hexToBytes(ctHex, out, outLen)) {
+    return false;
+  }
+
+  mbedtls_ecp_group grp;
+  mbedtls_mpi d, z;
+  mbedtls_ecp_point p;
+  mbedtls_ecp_group_init(&grp);
+  mbedtls_mpi_init(&d);
+  mbedtls_mpi_init(&z);
+  mbedtls_ecp_point_init(&p);
+  uint8_t shared[32];
+  int rc = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_SECP256R1);
+  if (rc == 0) rc = mbedtls_ecp_point_read_binary(&grp, &p, epk, sizeof(epk));
+  if (rc == 0) rc = mbedtls_ecp_check_pubkey(&grp, &p);
+  if (rc == 0) rc = mbedtls_mpi_read_binary(&d, gLanWrapSk, sizeof(gLanWrapSk));
+  if (rc == 0) rc = mbedtls_ecdh_compute_shared(&grp, &z, &p, &d, lanRng, nullptr);
+  if (rc == 0) rc = mbedtls_mpi_write_binary(&z, shared, sizeof(shared));
+  mbedtls_ecp_point_free(&p);
+  mbedtls_mpi_free(&z);
+  mbedtls_mpi_free(&d);
+  mbedtls_ecp_group_free(&grp);
+
+  uint8_t kek[32];
+  if (rc == 0) {
+    const String label = String("lan-key-wrap:") + gHubId;
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, shared, sizeof(shared));
+    mbedtls_sha256_update(&sha, (const unsigned char*)label.c_str(), label.length());
+    mbedtls_sha256_finish(&sha, kek);
+    mbedtls_sha256_free(&sha);
+
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    rc = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, kek, 256);
+    if (rc == 0) {
+      rc = mbedtls_gcm_auth_decrypt(&gcm, outLen, iv, sizeof(iv), (const unsigned char*)gHubId.c_str(), gHubId.length(),
+                                    tag, sizeof(tag), out, out);
+    }
+    mbedtls_gcm_free(&gcm);
+  }
+  memset(shared, 0, sizeof(shared));
+  memset(kek, 0, sizeof(kek));
+  return rc == 0;
+}
+
+static void handleLanKeyMessage(JsonDocument& doc) {
+  uint8_t plain[192];
+  size_t plainLen = 0;
+  if (!lanOpenSealed(doc, plain, sizeof(plain) - 1, plainLen)) {
+    Serial.println("[LAN] reject key (expect envelope sealed to lan/pub)");
+    return;
+  }
+  plain[plainLen] = 0;
+  StaticJsonDocument<256> inner;
+  const bool parsed = !deserializeJson(inner, (const char*)plain);
+  memset(plain, 0, sizeof(plain));
+  const char* key = parsed ? (inner["key"] | "") : "";
+  uint8_t tmp[32];
+  // Backup key rides in the same envelope; a home change brings a new one.
+  if (hexToBytes(parsed ? (inner["bak"] | "") : "", tmp, sizeof(tmp)) &&
+      !(gNetBakKeyValid && memcmp(tmp, gNetBakKey, sizeof(tmp)) == 0)) {
+    memcpy(gNetBakKey, tmp, sizeof(tmp));
+    gNetBakKeyValid = true;
+    gLanPrefs.begin("lan", false);
+    gLanPrefs.putBytes("bak", gNetBakKey, sizeof(gNetBakKey));
+    gLanPrefs.end();
+    Serial.println("[LAN] zigbee backup key provisioned");
+  }
+  memset(tmp, 0, sizeof(tmp));
+  if (!hexToBytes(key, tmp, sizeof(tmp))) {
+    Serial.println("[LAN] reject key (expect 64 hex)");
+    return;
+  }
+  if (gLanKeyValid && memcmp(tmp, gLanKey, sizeof(tmp)) == 0) return; // retained replay
+  memcpy(gLanKey, tmp, sizeof(tmp));
+  gLanKeyValid = true;
+  gLanPrefs.begin("lan", false);
+  gLanPrefs.putString("key", key);
+  gLanPrefs.end();
+  Serial.printf("[LAN] key provisioned keyId=%.8s\n", key);
+}
+
+static uint64_t lanFloorNowSec() {
+  if (gLanFloorSec == 0) return 0;
+  return gLanFloorSec + (uint32_t)(millis() - gLanFloorAtMs) / 1000U;
+}
+
+// Seconds since epoch: real time once synced, else the monotonic floor (0 = unknown).
+static uint64_t lanClockSec() {
+  return gTimeSynced ? nowMs() / 1000ULL : lanFloorNowSec();
+}
+
+static void lanRaiseFloor(uint64_t sec) {
+  if (sec <= lanFloorNowSec()) return;
+  gLanFloorSec = sec;
+  gLanFloorAtMs = millis();
+  if (gLanFloorSec < gLanFloorSavedSec + LAN_FLOOR_SAVE_SEC) return;
+  gLanFloorSavedSec = gLanFloorSec;
+  gLanPrefs.begin("lan", false);
+  gLanPrefs.putULong64("tfloor", gLanFloorSec);
+  gLanPrefs.end();
+}
+
+// base64url -> bytes (mbedtls wants standard alphabet + padding)
+static bool b64urlDecode(const char* in, size_t inLen, uint8_t* out, size_t outCap, size_t* outLen) {
+  if (inLen > 512) return false;
+  char buf[520];
+  size_t n = 0;
+  for (size_t i = 0; i < inLen; i++) {
+    char c = in[i];
+    buf[n++] = (c == '-') ? '+' : (c == '_') ? '/' : c;
+  }
+  while (n % 4) buf[n++] = '=';
+  return mbedtls_base64_decode(out, outCap, outLen, (const unsigned char*)buf, n) == 0;
+}
+
+static bool lanVerifyToken(const char* token, uint64_t& expOut) {
+  if (!gLanKeyValid || !token) return false;
+  const char* dot = strchr(token, '.');
+  if (!dot) return false;
+  const size_t bodyLen = (size_t)(dot - token);
+
+  uint8_t mac[32];
+  const mbedtls_md_info_t* info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+  if (mbedtls_md_hmac(info, gLanKey, sizeof(gLanKey), (const unsigned char*)token, bodyLen, mac) != 0) return false;
+
+  uint8_t sig[40];
+  size_t sigLen = 0;
+  if (!b64urlDecode(dot + 1, strlen(dot + 1), sig, sizeof(sig), &sigLen) || sigLen != sizeof(mac)) return false;
+  uint8_t diff = 0;
+  for (size_t i = 0; i < sizeof(mac); i++) diff |= (uint8_t)(mac[i] ^ sig[i]);
+  if (diff != 0) return false;
+
+  uint8_t body[384];
+  size_t bl = 0;
+  if (!b64urlDecode(token, bodyLen, body, sizeof(body) - 1, &bl)) return false;
+  body[bl] = 0;
+  StaticJsonDocument<256> claims;
+  if (deserializeJson(claims, (const char*)body)) return false;
+  const char* hub = claims["hub"] | "";
+  if (gHubId != hub) return false;
+  const uint64_t iat = claims["iat"] | 0ULL;
+  const uint64_t exp = claims["exp"] | 0ULL;
+  if (gTimeSynced) lanRaiseFloor(nowMs() / 1000ULL);
+  // No real time and no floor yet: nothing to bound the token's age with.
+  const uint64_t clock = lanClockSec();
+  if (clock == 0 || exp <= clock) return false;
+  lanRaiseFloor(iat);
+  expOut = exp;
+  return true;
+}
+
+static lan_ws_client_t* lanClientSlot(uint32_t id) {
+  for (size_t i = 0; i < LAN_WS_MAX_CLIENTS; i++) {
+    if (gLanClients[i].id == id) return &gLanClients[i];
+  }
+  return nullptr;
+}
+
+static void lanSendTo(uint32_t id, const JsonDocument& doc) {
+  String out;
+  serializeJson(doc, out);
+  gLanWs.text(id, out);
+}
+
+static void lanHandleWsText(AsyncWebSocketClient* client, const char* text) {
+  StaticJsonDocument<1024> doc;
+  if (deserializeJson(doc, text)) return;
+  const char* type = doc["type"] | "";
+
+  portENTER_CRITICAL(&gLanMux);
+  lan_ws_client_t* slot = lanClientSlot(client->id());
+  const bool authed = slot && slot->authed;
+  const uint64_t expSec = slot ? slot->expSec : 0;
+  portEXIT_CRITICAL(&gLanMux);
+
+  if (strcmp(type, "auth") == 0) {
+    uint64_t exp = 0;
+    const bool ok = lanVerifyToken(doc["token"] | "", exp);
+    StaticJsonDocument<128> r;
+    r["type"] = ok ? "auth_ok" : "auth_err";
+    r["hubId"] = gHubId;
+    lanSendTo(client->id(), r);
+    if (!ok) {
+      client->close();
+      return;
+    }
+    portENTER_CRITICAL(&gLanMux);
+    slot = lanClientSlot(client->id());
+    if (slot) {
+      slot->authed = true;
+      slot->expSec = exp;
+    }
+    portEXIT_CRITICAL(&gLanMux);
+    return;
+  }
+  if (!authed) {
+    client->close();
+    return;
+  }
+
+  if (strcmp(type, "ping") == 0) {
+    StaticJsonDocument<64> r;
+    r["type"] = "pong";
+    r["t"] = doc["t"];
+    lanSendTo(client->id(), r);
+    return;
+  }
+
+  if (strcmp(type, "set") == 0) {
+    String ieee16 = normalizeIeee(String(doc["ieee"] | ""));
+    JsonVariant body = doc["body"];
+    const char* status = "ok";
+    const char* reason = nullptr;
+    if (ieee16.isEmpty() || !body.is<JsonObject>()) {
+      status = "rejected";
+      reason = "bad_request";
+    } else if (lanClockSec() == 0 || expSec <= lanClockSec()) {
+      // Token expired since auth: the app re-authenticates or goes through the cloud.
+      status = "rejected";
+      reason = "token_expired";
+    } else {
+      if (!body.containsKey("cmdId")) body["cmdId"] = genCmdId();
+      if (zbSetWasSeen(body["cmdId"].as<String>())) {
+        status = "duplicate";
+      } else {
+        String bodyText;
+        serializeJson(body, bodyText);
+        handleMqttJsonMessage(String("home/zb/") + ieee16 + "/set", bodyText.c_str());
+      }
+    }
+
+    StaticJsonDocument<192> r;
+    r["type"] = "ack";
+    r["status"] = status;
+    if (reason) r["reason"] = reason;
+    r["ieee"] = ieee16;
+    r["cmdId"] = body["cmdId"];
+    lanSendTo(client->id(), r);
+    if (strcmp(status, "rejected") == 0 && reason && strcmp(reason, "token_expired") == 0) client->close();
+  }
+}
+
+static void onLanWsEvent(AsyncWebSocket* server, AsyncWebSocketClient* client, AwsEventType type, void* arg,
+                         uint8_t* data, size_t len) {
+  (void)server;
+  if (type == WS_EVT_CONNECT) {
+    bool placed = false;
+    portENTER_CRITICAL(&gLanMux);
+    for (size_t i = 0; i < LAN_WS_MAX_CLIENTS; i++) {
+      if (gLanClients[i].id == 0) {
+        gLanClients[i].id = client->id();
+        gLanClients[i].authed = false;
+        gLanClients[i].connectedMs = millis();
+        gLanClients[i].expSec = 0;
+        placed = true;
+        break;
+      }
+    }
+    portEXIT_CRITICAL(&gLanMux);
+    if (!placed) client->close();
+    return;
+  }
+  if (type == WS_EVT_DISCONNECT) {
+    portENTER_CRITICAL(&gLanMux);
+    lan_ws_client_t* slot = lanClientSlot(client->id());
+    if (slot) slot->id = 0;
+    portEXIT_CRITICAL(&gLanMux);
+    return;
+  }
+  if (type == WS_EVT_DATA) {
+    AwsFrameInfo* info = (AwsFrameInfo*)arg;
+    // Control frames are small; ignore fragmented messages.
+    if (!info->final || info->index != 0 || info->len != len || info->opcode != WS_TEXT) return;
+    if (len >= 1024) return;
+    char buf[1024];
+    memcpy(buf, data, len);
+    buf[len] = 0;
+    lanHandleWsText(client, buf);
+  }
+}
+
+static void lanBroadcast(const char* type, const String& ieee16, const String& payload) {
+  if (!gLanStarted) return;
+  uint32_t ids[LAN_WS_MAX_CLIENTS];
+  size_t n = 0;
+  portENTER_CRITICAL(&gLanMux);
+  for (size_t i = 0; i < LAN_WS_MAX_CLIENTS; i++) {
+    if (gLanClients[i].id && gLanClients[i].authed) ids[n++] = gLanClients[i].id;
+  }
+  portEXIT_CRITICAL(&gLanMux);
+  if (n == 0) return;
+
+  // payload is already-serialized JSON; splice instead of re-parsing.
+  String msg;
+  msg.reserve(payload.length() + 64);
+  msg += "{\"type\":\"";
+  msg += type;
+  msg += "\",\"ieee\":\"";
+  msg += ieee16;
+  msg += "\",\"data\":";
+  msg += payload;
+  msg += "}";
+  for (size_t i = 0; i < n; i++) gLanWs.text(ids[i], msg);
+}
+
+static void lanBegin() {
+  if (MDNS.begin(gHubId.c_str())) {
+    MDNS.addService("smarthome", "tcp", LAN_HTTP_PORT);
+    MDNS.addServiceTxt("smarthome", "tcp", "hubId", gHubId.c_str());
+    MDNS.addServiceTxt("smarthome", "tcp", "ws", "/ws");
+  } else {
+    Serial.println("[LAN] mDNS start failed");
+  }
+
+  gLanWs.onEvent(onLanWsEvent);
+  gLanHttp.addHandler(&gLanWs);
+  gLanHttp.on("/info", HTTP_GET, [](AsyncWebServerRequest* req) {
+    StaticJsonDocument<192> doc;
+    doc["hubId"] = gHubId;
+    doc["fwVersion"] = HUB_FIRMWARE_VERSION;
+    doc["ws"] = "/ws";
+    doc["keyProvisioned"] = gLanKeyValid;
+    String out;
+    serializeJson(doc, out);
+    req->send(200, "application/json", out);
+  });
+  gLanHttp.begin();
+  gLanStarted = true;
+  Serial.printf("[LAN] listening on %s:%u (%s.local)\n", WiFi.localIP().toString().c_str(),
+                (unsigned)LAN_HTTP_PORT, gHubId.c_str());
+}
+
+static void lanTick() {
+  if (!gLanStarted) {
+    if (WiFi.status() == WL_CONNECTED) lanBegin();
+    return;
+  }
+  const uint32_t now = millis();
+  if (!timeDue(now, gLanNextCleanupMs)) return;
+  gLanNextCleanupMs = now + 1000;
+
+  // Keep the expiry floor anchored across millis() wrap and moving with real time.
+  if ((uint32_t)(now - gLanFloorAtMs) > LAN_FLOOR_SAVE_SEC * 1000UL) {
+    if (gTimeSynced) {
+      lanRaiseFloor(nowMs() / 1000ULL);
+    } else if (gLanFloorSec) {
+      gLanFloorSec = lanFloorNowSec();
+      gLanFloorAtMs = now;
+    }
+  }
+
+  // Drop connections that never authenticated.
+  uint32_t stale[LAN_WS_MAX_CLIENTS];
+  size_t n = 0;
+  portENTER_CRITICAL(&gLanMux);
+  for (size_t i = 0; i < LAN_WS_MAX_CLIENTS; i++) {
+    if (gLanClients[i].id && !gLanClients[i].authed && (now - gLanClients[i].connectedMs) > LAN_AUTH_TIMEOUT_MS) {
+      stale[n++] = gLanClients[i].id;
+    }
+  }
+  portEXIT_CRITICAL(&gLanMux);
+  for (size_t i = 0; i < n; i++) gLanWs.close(stale[i]);
+  gLanWs.cleanupClients(LAN_WS_MAX_CLIENTS);
+}
+
+// ----------------- LAN MQTT BROKER (Wi-Fi devices) -----------------
+// Optional broker on :1883 so Wi-Fi devices (esp32_smarthome_mqtt) can point at
+// the hub instead of the cloud broker. Devices keep the exact same topics:
+//   up:   home/<homeId>/device/<deviceId>/{state,status,ack}
+//         status/ack are forwarded as-is; state is coalesced per topic and sent
+//         every batchMs as one home/hub/<HUB_ID>/bridge/batch message.
+//   down: a local SUBSCRIBE to .../set makes the hub subscribe upstream; the
+//         message is then delivered locally and not handled by the hub itself.
+// While upstream is down the latest value per topic is kept and flushed on reconnect.
+// Config (retained): home/hub/<HUB_ID>/lanbroker/config {enabled, user, pass, batchMs}
+
+struct lan_bridge_item_t {
+  bool used;
+  bool retain;
+  char topic[LANMQTT_MAX_TOPIC];
+  char* payload; // heap, NUL-terminated
+  size_t len;
+};
+
+static lan_bridge_item_t gBridgePending[LAN_BRIDGE_PENDING_MAX];
+static SemaphoreHandle_t gBridgeMutex = nullptr;
+static uint32_t gBridgeDrops = 0;
+static uint32_t gBridgeNextFlushMs = 0;
+
+static Preferences gLanBrokerPrefs;
+static bool gLanBrokerEnabled = false;
+static String gLanBrokerUser;
+static String gLanBrokerPass;
+static uint32_t gLanBrokerBatchMs = LAN_BRIDGE_BATCH_MS_DEFAULT;
+static bool gLanBrokerRestart = false;
+static bool gLanBrokerMdns = false;
+
+// "home/<homeId>/device/<deviceId>/<leaf>" -> leaf, else nullptr.
+static const char* lanDeviceTopicLeaf(const char* topic) {
+  if (strncmp(topic, "home/", 5) != 0) return nullptr;
+  const char* p = strchr(topic + 5, '/');
+  if (!p || p == topic + 5 || strncmp(p, "/device/", 8) != 0) return nullptr;
+  const char* dev = p + 8;
+  const char* leaf = strchr(dev, '/');
+  if (!leaf || leaf == dev) return nullptr;
+  leaf++;
+  if (!*leaf || strchr(leaf, '/')) return nullptr;
+  return leaf;
+}
+
+static void bridgeQueue(const char* topic, const uint8_t* payload, size_t len, bool retain) {
+  char* copy = (char*)malloc(len + 1);
+  if (!copy) {
+    gBridgeDrops++;
+    return;
+  }
+  memcpy(copy, payload, len);
+  copy[len] = 0;
+
+  char* old = nullptr;
+  xSemaphoreTake(gBridgeMutex, portMAX_DELAY);
+  lan_bridge_item_t* slot = nullptr;
+  lan_bridge_item_t* freeSlot = nullptr;
+  for (size_t i = 0; i < LAN_BRIDGE_PENDING_MAX; i++) {
+    if (gBridgePending[i].used && strcmp(gBridgePending[i].topic, topic) == 0) slot = &gBridgePending[i];
+    if (!gBridgePending[i].used && !freeSlot) freeSlot = &gBridgePending[i];
+  }
+  if (!slot) slot = freeSlot;
+  if (slot) {
+    old = slot->payload; // coalesce: newer value replaces the unsent one
+    slot->used = true;
+    slot->retain = retain;
+    strncpy(slot->topic, topic, sizeof(slot->topic) - 1);
+    slot->topic[sizeof(slot->topic) - 1] = 0;
+    slot->payload = copy;
+    slot->len = len;
+  } else {
+    old = copy;
+    gBridgeDrops++;
+  }
+  xSemaphoreGive(gBridgeMutex);
+  free(old);
+}
+
+// Runs on the async_tcp task for every message a local client publishes.
+static void onLanBrokerPublish(const char* topic, const uint8_t* payload, size_t len, bool retain) {
+  const char* leaf = lanDeviceTopicLeaf(topic);
+  if (!leaf) return; // not a device data-plane topic: stays local
+  const bool isState = strcmp(leaf, "state") == 0;
+  if (!isState && strcmp(leaf, "status") != 0 && strcmp(leaf, "ack") != 0) return;
+
+  if (strcmp(leaf, "ack") == 0) {
+    StaticJsonDocument<256> ack;
+    if (!deserializeJson(ack, payload, len)) {
+      automationOnMqttAck(ack["cmdId"] | "", ack["ok"] | false, ack["error"] | (const char*)nullptr);
+    }
+  }
+
+  if (!isState && mqtt.connected()) {
+    mqtt.publish(topic, 1, retain, (const char*)payload, len);
+    return;
+  }
+  bridgeQueue(topic, payload, len, retain);
+}
+
+static bool lanBrokerIsSetFilter(const char* filter) {
+  if (strpbrk(filter, "+#")) return false; // no wildcard subscriptions upstream
+  const char* leaf = lanDeviceTopicLeaf(filter);
+  return leaf && strcmp(leaf, "set") == 0;
+}
+
+static void lanBrokerUpstreamSubscribe(const char* filter) {
+  if (!lanBrokerIsSetFilter(filter) || !mqtt.connected()) return;
+  mqtt.subscribe(filter, 1);
+}
+
+static void appendJsonString(String& out, const char* s, size_t len) {
+  out += '"';
+  for (size_t i = 0; i < len; i++) {
+    const char c = s[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((uint8_t)c < 0x20) {
+      char esc[7];
+      snprintf(esc, sizeof(esc), "\\u%04x", (unsigned)(uint8_t)c);
+      out += esc;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+// ArduinoJson custom reader that counts what the parser consumed: it stops right
+// after the value, so trailing bytes are left unread.
+struct bridge_probe_reader_t {
+  const char* p;
+  size_t len;
+  size_t pos;
+  int read() { return pos < len ? (uint8_t)p[pos++] : -1; }
+  size_t readBytes(char* buf, size_t n) {
+    n = min(n, len - pos);
+    memcpy(buf, p + pos, n);
+    pos += n;
+    return n;
+  }
+};
+
+// Append one pending item to the batch JSON; payload spliced raw only when it is
+// exactly one JSON value (trailing whitespace aside), else sent as a string.
+static void bridgeAppendItem(String& out, const lan_bridge_item_t& it) {
+  size_t len = it.len;
+  while (len > 0 && isspace((unsigned char)it.payload[len - 1])) len--;
+  // A value ends in one of these; a number is only known to end at EOF, so the
+  // parser's look-ahead on "12," must not pass for a complete value.
+  const char last = len > 0 ? it.payload[len - 1] : 0;
+  bool isJson = last && (strchr("}]\"el", last) || isdigit((unsigned char)last));
+  if (isJson) {
+    StaticJsonDocument<16> filter;
+    filter.set(false); // syntax check only, keep nothing
+    StaticJsonDocument<16> probe;
+    bridge_probe_reader_t reader = {it.payload, len, 0};
+    isJson = deserializeJson(probe, reader, DeserializationOption::Filter(filter)) == DeserializationError::Ok &&
+             reader.pos == len;
+  }
+
+  out += "{\"t\":";
+  appendJsonString(out, it.topic, strlen(it.topic));
+  out += ",\"p\":";
+  if (isJson) {
+    out.concat(it.payload, len);
+  } else {
+    appendJsonString(out, it.payload, it.len);
+  }
+  out += it.retain ? ",\"r\":true}" : ",\"r\":false}";
+}
+
+static void bridgeFlush() {
+  lan_bridge_item_t items[LAN_BRIDGE_PENDING_MAX];
+  size_t n = 0;
+  xSemaphoreTake(gBridgeMutex, portMAX_DELAY);
+  for (size_t i = 0; i < LAN_BRIDGE_PENDING_MAX; i++) {
+    if (!gBridgePending[i].used) continue;
+    items[n++] = gBridgePending[i];
+    memset(&gBridgePending[i], 0, sizeof(gBridgePending[i])); // payload ownership moves to items[]
+  }
+  xSemaphoreGive(gBridgeMutex);
+  if (n == 0) return;
+
+  const String head = String("{\"ts\":") + String((unsigned long long)nowMs()) + ",\"items\":[";
+  String out = head;
+  size_t inBatch = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (inBatch > 0 && out.length() + items[i].len + LANMQTT_MAX_TOPIC > LAN_BRIDGE_BATCH_MAX_BYTES) {
+      out += "]}";
+      mqttPublish(tHubBridgeBatch, out, 1, false);
+      out = head;
+      inBatch = 0;
+    }
+    if (inBatch > 0) out += ",";
+    bridgeAppendItem(out, items[i]);
+    inBatch++;
+    free(items[i].payload);
+  }
+  out += "]}";
+  mqttPublish(tHubBridgeBatch, out, 1, false);
+}
+
+/**
+ * Deliver a /set to a Wi-Fi device connected to the local broker.
+ * Returns false when no local client is subscribed (caller goes upstream).
+ */
+static bool lanBrokerDeliverLocal(const String& topic, const String& payload) {
+  if (!gLanBroker.running() || !lanBrokerIsSetFilter(topic.c_str()) || !gLanBroker.hasSubscriber(topic.c_str())) {
+    return false;
+  }
+  return gLanBroker.publish(topic.c_str(), (const uint8_t*)payload.c_str(), payload.length(), false) > 0;
+}
+
+static void loadLanBrokerConfigFromNvs() {
+  gBridgeMutex = xSemaphoreCreateMutex();
+  gLanBrokerPrefs.begin("lanbroker", true);
+  gLanBrokerEnabled = gLanBrokerPrefs.getBool("en", false);
+  gLanBrokerUser = gLanBrokerPrefs.getString("user", "");
+  gLanBrokerPass = gLanBrokerPrefs.getString("pass", "");
+  gLanBrokerBatchMs = gLanBrokerPrefs.getUInt("batch", LAN_BRIDGE_BATCH_MS_DEFAULT);
+  gLanBrokerPrefs.end();
+  gLanBroker.onPublish(onLanBrokerPublish);
+  gLanBroker.onSubscribe(lanBrokerUpstreamSubscribe);
+  Serial.printf("[LANMQTT] %s\n", gLanBrokerEnabled ? "enabled" : "disabled");
+}
+
+static void handleLanBrokerConfig(JsonDocument& doc) {
+  const bool enabled = doc["enabled"] | false;
+  const String user = doc["user"] | "";
+  const String pass = doc["pass"] | "";
+  uint32_t batchMs = doc["batchMs"] | LAN_BRIDGE_BATCH_MS_DEFAULT;
+  if (batchMs < 50) batchMs = 50;
+  if (batchMs > 5000) batchMs = 5000;
+
+  if (enabled == gLanBrokerEnabled && user == gLanBrokerUser && pass == gLanBrokerPass &&
+      batchMs == gLanBrokerBatchMs) {
+    return; // retained replay
+  }
+  gLanBrokerRestart = gLanBroker.running() && (user != gLanBrokerUser || pass != gLanBrokerPass || !enabled);
+  gLanBrokerEnabled = enabled;
+  gLanBrokerUser = user;
+  gLanBrokerPass = pass;
+  gLanBrokerBatchMs = batchMs;
+
+  gLanBrokerPrefs.begin("lanbroker", false);
+  gLanBrokerPrefs.putBool("en", enabled);
+  gLanBrokerPrefs.putString("user", user);
+  gLanBrokerPrefs.putString("pass", pass);
+  gLanBrokerPrefs.putUInt("batch", batchMs);
+  gLanBrokerPrefs.end();
+  Serial.printf("[LANMQTT] config enabled=%d auth=%d batchMs=%u\n", (int)enabled, (int)!user.isEmpty(),
+                (unsigned)batchMs);
+}
+
+static void lanBrokerTick() {
+  if (gLanBrokerRestart) {
+    gLanBrokerRestart = false;
+    gLanBroker.end();
+    Serial.println("[LANMQTT] stopped");
+  }
+  if (!gLanBroker.running()) {
+    // mDNS comes up with the LAN control server.
+    if (!gLanBrokerEnabled || !gLanStarted) return;
+    gLanBroker.begin(LAN_MQTT_PORT, gLanBrokerUser.c_str(), gLanBrokerPass.c_str());
+    if (!gLanBrokerMdns) {
+      MDNS.addService("mqtt", "tcp", LAN_MQTT_PORT);
+      MDNS.addServiceTxt("mqtt", "tcp", "hubId", gHubId.c_str());
+      gLanBrokerMdns = true;
+    }
+    Serial.printf("[LANMQTT] listening on %s:%u\n", WiFi.localIP().toString().c_str(), (unsigned)LAN_MQTT_PORT);
+  }
+
+  gLanBroker.loop();
+  const uint32_t now = millis();
+  if (!mqtt.connected() || !timeDue(now, gBridgeNextFlushMs)) return;
+  gBridgeNextFlushMs = now + gLanBrokerBatchMs;
+  bridgeFlush();
+}
+
+// ----------------- PROFILER -----------------
+// home/hub/<HUB_ID>/profile/cmd:
+//   {"action":"start","hz":250,"durationSec":30}  -> report published when it runs out
+//   {"action":"dump"}                             -> report now, keep sampling
+//   {"action":"stop"}                             -> stop + report
+//   {"stallMs":300}                               -> stall threshold (any action, or alone)
+// profile/report: {ts, fw, elfSha, hz, ms, samples, dropped, tasks:{..}, maxMs:{loop, mqtt}, stalls,
+//                  top:[["loop","0x400d1234",57], ...]}
+// profile/stall (also printed as an IDF-style "Backtrace:" line on Serial):
+//   {ts, fw, elfSha, section:"loop"|"mqtt", tag, ms, bt:["0x400d1234", ...]}
+// PCs are raw: backend/scripts/hub-profile.js maps them to functions with the matching ELF.
+
+static const char* profElfSha() {
+  static char sha[17] = {0};
+  if (!sha[0]) {
+#if ESP_IDF_VERSION_MAJOR >= 5
+    const esp_app_desc_t* d = esp_app_get_description();
+#else
+    const esp_app_desc_t* d = esp_ota_get_app_description();
+#endif
+    for (int i = 0; i < 8; i++) snprintf(sha + i * 2, 3, "%02x", d->app_elf_sha256[i]);
+  }
+  return sha;
+}
+
+static void profHex(char* out, size_t cap, uint32_t pc) {
+  snprintf(out, cap, "0x%08lx", (unsigned long)pc);
+}
+
+static void publishProfileReport(const char* reason) {
+  const HubProfiler::Stats st = gProf.stats();
+  HubProfiler::Sample* top = (HubProfiler::Sample*)malloc(sizeof(HubProfiler::Sample) * PROF_REPORT_TOP);
+  if (!top) return;
+  const size_t n = gProf.top(top, PROF_REPORT_TOP);
+
+  DynamicJsonDocument doc(6144);
+  doc["ts"] = (unsigned long long)nowMs();
+  doc["fw"] = HUB_FIRMWARE_VERSION;
+  doc["elfSha"] = profElfSha();
+  doc["reason"] = reason;
+  doc["active"] = st.active;
+  doc["hz"] = st.hz;
+  doc["ms"] = st.elapsedMs;
+  doc["samples"] = st.samples;
+  doc["dropped"] = st.dropped;
+  JsonObject tasks = doc.createNestedObject("tasks");
+  for (uint8_t t = 0; t < HubProfiler::TASK_COUNT; t++) tasks[HubProfiler::taskName(t)] = st.perTask[t];
+  JsonObject maxMs = doc.createNestedObject("maxMs");
+  maxMs["loop"] = st.maxSectionMs[HubProfiler::SLOT_LOOP];
+  maxMs["mqtt"] = st.maxSectionMs[HubProfiler::SLOT_MQTT];
+  doc["stalls"] = st.stalls;
+  doc["stallMs"] = gProf.stallThreshold();
+  JsonArray arr = doc.createNestedArray("top");
+  char hex[12];
+  for (size_t i = 0; i < n; i++) {
+    JsonArray e = arr.createNestedArray();
+    e.add(HubProfiler::taskName(top[i].task));
+    profHex(hex, sizeof(hex), top[i].pc);
+    e.add(hex);
+    e.add(top[i].count);
+  }
+  free(top);
+
+  String payload;
+  serializeJson(doc, payload);
+  mqttPublish(tProfileReport, payload, 0, false);
+  Serial.printf("[Prof] report (%s) samples=%u top=%u bytes=%u\n", reason, (unsigned)st.samples, (unsigned)n,
+                (unsigned)payload.length());
+}
+
+static void publishProfileStall(const HubProfiler::Stall& s) {
+  const char* section = s.slot == HubProfiler::SLOT_LOOP ? "loop" : "mqtt";
+  // Same shape as an IDF panic backtrace so existing decoders accept it too.
+  Serial.printf("[Prof] stall %s/%s %ums\nBacktrace:", section, s.tag ? s.tag : "-", (unsigned)s.ms);
+  for (uint8_t i = 0; i < s.depth; i++) Serial.printf(" 0x%08lx:0x00000000", (unsigned long)s.pcs[i]);
+  Serial.println();
+
+  StaticJsonDocument<1024> doc;
+  doc["ts"] = (unsigned long long)nowMs();
+  doc["fw"] = HUB_FIRMWARE_VERSION;
+  doc["elfSha"] = profElfSha();
+  doc["section"] = section;
+  doc["tag"] = s.tag ? s.tag : "";
+  doc["ms"] = s.ms;
+  JsonArray bt = doc.createNestedArray("bt");
+  char hex[12];
+  for (uint8_t i = 0; i < s.depth; i++) {
+    profHex(hex, sizeof(hex), s.pcs[i]);
+    bt.add(hex);
+  }
+  String payload;
+  serializeJson(doc, payload);
+  mqttPublish(tProfileStall, payload, 0, false);
+}
+
+static void handleProfileCmd(const JsonDocument& doc) {
+  if (!doc["stallMs"].isNull()) gProf.setStallThreshold(doc["stallMs"] | PROF_STALL_MS_DEFAULT);
+  const char* action = doc["action"] | "";
+  if (strcmp(action, "start") == 0) {
+    uint32_t hz = doc["hz"] | 250;
+    uint32_t durationSec = doc["durationSec"] | 30;
+    if (durationSec > 600) durationSec = 600;
+    gProf.start(hz, durationSec * 1000U);
+    Serial.printf("[Prof] start hz=%u duration=%us\n", (unsigned)hz, (unsigned)durationSec);
+  } else if (strcmp(action, "stop") == 0) {
+    gProf.stop();
+    publishProfileReport("stop");
+  } else if (strcmp(action, "dump") == 0) {
+    publishProfileReport("dump");
+  }
+}
+
+static void profilerTick() {
+  static uint32_t nextRefreshMs = 0;
+  if (timeDue(millis(), nextRefreshMs)) {
+    nextRefreshMs = millis() + 5000;
+    gProf.refreshTasks();
+  }
+  if (gProf.expired()) publishProfileReport("done");
+  HubProfiler::Stall st;
+  while (gProf.popStall(st)) publishProfileStall(st);
+}
+
+// ----------------- HUB OTA (Sprint 7) -----------------
+static String bytesToHex(const uint8_t* buf, size_t len) {
+  static const char* hex = "0123456789abcdef";
+  String s;
+  s.reserve(len * 2);
+  for (size_t i = 0; i < len; i++) {
+    uint8_t b = buf[i];
+    s += hex[(b >> 4) & 0xF];
+    s += hex[b & 0xF];
+  }
+  return s;
+}
+
+static bool isHex64(const String& s) {
+  if (s.length() != 64) return false;
+  for (size_t i = 0; i < s.length(); i++) {
+    char c = s[i];
+    bool ok = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    if (!ok) return false;
+  }
+  return true;
+}
+
+static void publishOtaResult(const String& cmdId, bool ok, const String& code, const String& message, const String& version) {
+  StaticJsonDocument<320> doc;
+  doc["ts"] = (unsigned long long)nowMs();
+  doc["cmdId"] = cmdId;
+  doc["ok"] = ok;
+  doc["version"] = version;
+  if (!ok) {
+    if (code.length()) doc["code"] = code;
+    if (message.length()) doc["message"] = message;
+  } else {
+    if (message.length()) doc["message"] = message;
+  }
+  String payload;
+  serializeJson(doc, payload);
+  mqttPublish(tOtaCmdResult, payload, 1, false);
+}
+
+static void runHubOta(const String& cmdId, const String& version, const String& url, const String& sha256Expected, int sizeHint) {
+  // Runs inside the MQTT callback: a long download shows up as an "ota" stall there.
+  gProf.mark(HubProfiler::SLOT_MQTT, "ota");
+  if (gOtaBusy) {
+    publishOtaResult(cmdId, false, "BUSY", "OTA already in progress", version);
+    return;
+  }
+
+  if (WiFi.status() != WL_CONNECTED) {
+    publishOtaResult(cmdId, false, "NO_WIFI", "WiFi not connected", version);
+    return;
+  }
+  if (url.length() < 10 || (!url.startsWith("http://") && !url.startsWith("https://"))) {
+    publishOtaResult(cmdId, false, "BAD_URL", "url must be http(s)", version);
+    return;
+  }
+  if (!isHex64(sha256Expected)) {
+    publishOtaResult(cmdId, false, "BAD_SHA256", "sha256 must be 64-hex", version);
+    return;
+  }
+
+  gOtaBusy = true;
+  Serial.printf("[OTA] begin cmdId=%s version=%s url=%s\n", cmdId.c_str(), version.c_str(), url.c_str());
+
+  HTTPClient http;
+  http.setTimeout(15000);
+  if (!http.begin(url)) {
+    gOtaBusy = false;
+    publishOtaResult(cmdId, false, "HTTP_BEGIN", "http.begin failed", version);
+    return;
+  }
+
+  int httpCode = http.GET();
+  if (httpCode <= 0) {
+    String m = String("GET failed: ") + http.errorToString(httpCode);
+    http.end();
+    gOtaBusy = false;
+    publishOtaResult(cmdId, false, "HTTP_GET", m, version);
+    return;
+  }
+  if (httpCode != HTTP_CODE_OK) {
+    String m = String("HTTP status ") + String(httpCode);
+    http.end();
+    gOtaBusy = false;
+    publishOtaResult(cmdId, false, "HTTP_STATUS", m, version);
+    return;
+  }
+
+  int contentLen = http.getSize();
+  int expectedSize = (sizeHint > 0) ? sizeHint : contentLen;
+  if (expectedSize <= 0) {
+    // Update can still proceed without size, but it's safer to require it.
+    expectedSize = contentLen;
+  }
+
+  if (!Update.begin(expectedSize > 0 ? expectedSize : UPDATE_SIZE_UNKNOWN)) {
+    String m = String("Update.begin failed: ") + String(Update.errorString());
+    http.end();
+    gOtaBusy = false;
+    publishOtaResult(cmdId, false, "UPDATE_BEGIN", m, version);
+    return;
+  }
+
+  WiFiClient* stream = http.getStreamPtr();
+  const size_t bufSize = 1024;
+  uint8_t buf[bufSize];
+  size_t writtenTotal = 0;
+
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  // Arduino-ESP32 toolchain often ships mbedTLS without the *_ret variants.
+  // Use the non-ret APIs for broad compatibility.
+  mbedtls_sha256_starts(&ctx, 0);
+
+  uint32_t lastProgressMs = millis();
+  while (http.connected()) {
+    size_t avail = stream->available();
+    if (!avail) {
+      delay(5);
+      if (millis() - lastProgressMs > 20000) {
+        // Keep watchdog fed and avoid stuck loop; still continue.
+        lastProgressMs = millis();
+      }
+      continue;
+    }
     size_t toRead = avail;
     if (toRead > bufSize) toRead = bufSize;
     int n = stream->readBytes(buf, toRead);
@@ -1343,48 +4376,752 @@ static void runHubOta(const String& cmdId, const String& version, const String&
 
     mbedtls_sha256_update(&ctx, buf, (size_t)n);
 
-    size_t w = Update.write(buf, (size_t)n);
-    if (w != (size_t)n) {
-      String m = String("Update.write failed: ") + String(Update.errorString());
-      mbedtls_sha256_free(&ctx);
-      Update.abort();
-      http.end();
-      gOtaBusy = false;
-      publishOtaResult(cmdId, false, "UPDATE_WRITE", m, version);
+    size_t w = Update.write(buf, (size_t)n);
+    if (w != (size_t)n) {
+      String m = String("Update.write failed: ") + String(Update.errorString());
+      mbedtls_sha256_free(&ctx);
+      Update.abort();
+      http.end();
+      gOtaBusy = false;
+      publishOtaResult(cmdId, false, "UPDATE_WRITE", m, version);
+      return;
+    }
+    writtenTotal += w;
+
+    if (contentLen > 0 && (int)writtenTotal >= contentLen) break;
+    yield();
+  }
+
+  uint8_t hash[32];
+  mbedtls_sha256_finish(&ctx, hash);
+  mbedtls_sha256_free(&ctx);
+
+  http.end();
+
+  // Verify hash BEFORE finalizing OTA.
+  String sha256Actual = bytesToHex(hash, 32);
+  if (sha256Actual != sha256Expected) {
+    Update.abort();
+    gOtaBusy = false;
+    publishOtaResult(cmdId, false, "SHA_MISMATCH", String("actual=") + sha256Actual, version);
+    return;
+  }
+
+  if (!Update.end(true)) {
+    String m = String("Update.end failed: ") + String(Update.errorString());
+    gOtaBusy = false;
+    publishOtaResult(cmdId, false, "UPDATE_END", m, version);
+    return;
+  }
+
+  publishOtaResult(cmdId, true, "", "applied", version);
+  Serial.println("[OTA] success -> reboot");
+  delay(300);
+  ESP.restart();
+}
+
+// ----------------- ZIGBEE NETWORK BACKUP -----------------
+// A dead coordinator is replaced by restoring its network. The coordinator streams
+// its network parameters (PAN, extended PAN, channel, network key, its IEEE), its
+// NVS device and binding tables and an image of the stack NVRAM (frame counters,
+// link keys) as evt "net_backup"; the hub seals them with
+// AES-256-GCM under the home's backup key (its own backend secret, delivered in
+// the sealed lan/key envelope and kept only in NVS "lan"/"bak"), keeps the newest
+// copy per link in LittleFS (/zbbak<link>.bin; up to ~80 KB each, far more than
+// the NVS partition holds) and retains only a summary. The blob goes out non-retained
+// once after each backup and again on request, for the backend to store. A restore
+// takes the blob from a URL (backend copy, downloaded a chunk per loop pass) or
+// from LittleFS and plays it into the new coordinator one acked line at a time; the
+// coordinator reboots into the network under the old IEEE with the stack state
+// carried over (see the coordinator's Network backup). A backup without the NVRAM
+// image can only form the network anew: the restore then ends in state
+// "rejoin_required" rather than "done", and every device has to rejoin.
+//   Sub .../zigbee/backup/run   {link?}                -> also every NET_BACKUP_INTERVAL_MS
+//   Pub .../zigbee/backup/<link> (retain) {ts, link, bytes, devices, nvram}
+//   Sub .../zigbee/backup/get   {link?}                -> Pub .../zigbee/backup/<link>/blob (no retain)
+//       {ts, link, bytes, devices, blob:"<base64 sealed blob>"}
+//   Sub .../zigbee/restore      {link?, url?, force?}  url serves the sealed blob bytes
+//   Pub .../zigbee/backup/state {op:"backup"|"restore", state, link, error?, ...}
+//       restore states: started, downloading, committed, done | rejoin_required | failed
+// Sealed blob: "ZBE", version 2, iv(12), tag(16), ciphertext; the 4-byte header is the AAD.
+// (Version 1 was sealed under a LAN-key derivation and is refused: run a new backup.)
+// Plain: headerLen(2, LE) header JSON (the coordinator's begin line), then per NVS key
+//   keyLen(1) key dataLen(2, LE) data.
+
+struct net_backup_rx_t {
+  bool active;
+  bool begun;        // begin line seen
+  bool automatic;    // periodic run: never replaces a backup with an empty network
+  uint8_t li;
+  uint8_t* buf;
+  size_t len;
+  size_t cap;
+  uint32_t fnv;
+  uint16_t devices;
+  bool nvram;        // the coordinator sent its stack NVRAM image
+  uint32_t lastMs;
+};
+
+struct net_restore_tx_t {
+  bool active;
+  bool fetching;     // downloading the sealed blob (netRestoreFetchTick)
+  bool force;
+  uint8_t li;
+  uint8_t* sealed;   // download buffer
+  size_t sealedLen;
+  size_t got;
+  uint32_t fetchMs;  // last body bytes
+  uint8_t* plain;
+  size_t len;
+  size_t pos;        // current record
+  uint16_t recOff;   // bytes of the current record already acked
+  uint16_t partLen;  // bytes in the line waiting for its ack
+  uint16_t seq;
+  uint8_t tries;
+  uint32_t sentMs;
+  uint32_t bytes;
+  uint32_t fnv;
+};
+
+// zigbee/restore arrives on the MQTT task; loop() starts it.
+struct net_restore_req_t {
+  bool pending;
+  bool force;
+  uint8_t li;
+  char url[320];
+};
+
+static net_backup_rx_t gNetBackup;
+static net_restore_tx_t gNetRestore;
+static net_restore_req_t gNetRestoreReq;
+static HTTPClient gNetFetch;
+static uint8_t gNetBackupDue = 0; // links waiting for their backup (bit per link)
+static uint8_t gNetBlobDue = 0; // links whose blob was asked for (zigbee/backup/get)
+static uint32_t gNetBackupNextMs = 0;
+static bool gNetBakFs = false; // LittleFS mounted
+
+static uint32_t netFnv(uint32_t h, const uint8_t* p, size_t n) {
+  for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+static bool netBackupKey(uint8_t out[32]) {
+  if (!gNetBakKeyValid) return false;
+  memcpy(out, gNetBakKey, sizeof(gNetBakKey));
+  return true;
+}
+
+static void publishNetBackupState(const char* op, uint8_t li, const char* state, const char* error,
+                                  JsonVariantConst extra = JsonVariantConst()) {
+  StaticJsonDocument<384> doc;
+  doc["op"] = op;
+  doc["state"] = state;
+  doc["link"] = li;
+  if (error) doc["error"] = error;
+  if (extra.is<JsonObjectConst>()) {
+    for (JsonPairConst kv : extra.as<JsonObjectConst>()) doc[kv.key()] = kv.value();
+  }
+  doc["ts"] = (unsigned long long)nowMs();
+  String payload;
+  serializeJson(doc, payload);
+  mqttPublish(tZbBackupState, payload, 1, false);
+  Serial.printf("[NetBak] link%u %s %s%s%s\n", (unsigned)li, op, state, error ? " err=" : "", error ? error : "");
+}
+
+static void netBackupFree() {
+  free(gNetBackup.buf);
+  gNetBackup = net_backup_rx_t();
+}
+
+static void netBackupFail(const char* error) {
+  publishNetBackupState("backup", gNetBackup.li, "failed", error);
+  netBackupFree();
+}
+
+static bool netBackupAppend(const void* p, size_t n) {
+  net_backup_rx_t& b = gNetBackup;
+  if (b.len + n > b.cap) {
+    const size_t cap = b.len + n + 4096;
+    if (cap > NET_BACKUP_MAX) return false;
+    uint8_t* grown = (uint8_t*)realloc(b.buf, cap);
+    if (!grown) return false;
+    b.buf = grown;
+    b.cap = cap;
+  }
+  memcpy(b.buf + b.len, p, n);
+  b.len += n;
+  return true;
+}
+
+static void netBackupStart(uint8_t li, bool automatic) {
+  if (gNetBackup.active || gNetRestore.active) {
+    publishNetBackupState("backup", li, "failed", "busy");
+    return;
+  }
+  if (!gNetBakKeyValid) {
+    publishNetBackupState("backup", li, "failed", "no backup key (not provisioned by the backend)");
+    return;
+  }
+  if (!linkUsable(li)) {
+    publishNetBackupState("backup", li, "failed", "coordinator_unavailable");
+    return;
+  }
+  gNetBackup = net_backup_rx_t();
+  gNetBackup.active = true;
+  gNetBackup.li = li;
+  gNetBackup.automatic = automatic;
+  gNetBackup.lastMs = millis();
+  StaticJsonDocument<64> u;
+  u["cmd"] = "net_backup";
+  linkSendControl(li, u);
+}
+
+// Summary ("ZBE" blob length, device count, backup time), the head of the stored file.
+struct net_backup_meta_t {
+  uint64_t ts;
+  uint32_t bytes;
+  uint16_t devices;
+  bool nvram;
+};
+
+// Mounted on first use; a blank data partition is formatted then. Without one the
+// backend copy is the only one.
+static bool netBakFsReady() {
+  if (!gNetBakFs) gNetBakFs = LittleFS.begin(true);
+  return gNetBakFs;
+}
+
+static String netBakPath(uint8_t li) {
+  return "/zbbak" + String(li) + ".bin";
+}
+
+// Stored copy of link li: meta, then the sealed blob (malloc'd, caller frees).
+static uint8_t* netBakLoad(uint8_t li, net_backup_meta_t& meta, size_t& len) {
+  len = 0;
+  if (!netBakFsReady() || !LittleFS.exists(netBakPath(li))) return nullptr;
+  File f = LittleFS.open(netBakPath(li), "r");
+  if (!f) return nullptr;
+  uint8_t* buf = nullptr;
+  const size_t size = f.size();
+  if (size > sizeof(meta) && f.read((uint8_t*)&meta, sizeof(meta)) == sizeof(meta) &&
+      meta.bytes == size - sizeof(meta) && (buf = (uint8_t*)malloc(meta.bytes)) != nullptr &&
+      f.read(buf, meta.bytes) == meta.bytes) {
+    len = meta.bytes;
+  } else {
+    free(buf);
+    buf = nullptr;
+  }
+  f.close();
+  return buf;
+}
+
+// Written aside and renamed, so a reset mid-write keeps the previous copy.
+static bool netBakStore(uint8_t li, const uint8_t* sealed, size_t len, const net_backup_meta_t& meta) {
+  if (!netBakFsReady()) return false;
+  const String path = netBakPath(li);
+  const String tmp = path + ".tmp";
+  File f = LittleFS.open(tmp, "w");
+  if (!f) return false;
+  const bool ok = f.write((const uint8_t*)&meta, sizeof(meta)) == sizeof(meta) && f.write(sealed, len) == len;
+  f.close();
+  if (!ok) {
+    LittleFS.remove(tmp);
+    return false;
+  }
+  LittleFS.remove(path);
+  return LittleFS.rename(tmp, path);
+}
+
+// Sealed blob -> .../zigbee/backup/<link>/blob, never retained: the backend stores it.
+static bool netBackupPublishBlob(uint8_t li, const uint8_t* sealed, size_t sealedLen, const net_backup_meta_t& meta) {
+  if (!mqtt.connected()) return false;
+  size_t b64Len = 0;
+  mbedtls_base64_encode(nullptr, 0, &b64Len, sealed, sealedLen);
+  char* b64 = (char*)malloc(b64Len + 1);
+  if (!b64 || mbedtls_base64_encode((unsigned char*)b64, b64Len + 1, &b64Len, sealed, sealedLen) != 0) {
+    free(b64);
+    return false;
+  }
+  b64[b64Len] = 0;
+  String payload;
+  payload.reserve(b64Len + 128);
+  payload += "{\"ts\":";
+  payload += String((unsigned long long)meta.ts);
+  payload += ",\"link\":";
+  payload += String(li);
+  payload += ",\"bytes\":";
+  payload += String((unsigned)sealedLen);
+  payload += ",\"devices\":";
+  payload += String(meta.devices);
+  payload += ",\"nvram\":";
+  payload += meta.nvram ? "true" : "false";
+  payload += ",\"blob\":\"";
+  payload += b64;
+  payload += "\"}";
+  free(b64);
+  mqttPublish(tZbBackup + "/" + String(li) + "/blob", payload, 1, false);
+  return true;
+}
+
+static void netBackupPublishSummary(uint8_t li, const net_backup_meta_t& meta) {
+  StaticJsonDocument<128> doc;
+  doc["ts"] = (unsigned long long)meta.ts;
+  doc["link"] = li;
+  doc["bytes"] = meta.bytes;
+  doc["devices"] = meta.devices;
+  doc["nvram"] = meta.nvram;
+  String payload;
+  serializeJson(doc, payload);
+  mqttPublish(tZbBackup + "/" + String(li), payload, 1, true);
+}
+
+// zigbee/backup/get: the stored copy of each asked-for link, one per loop pass.
+static void netBackupBlobTick() {
+  if (!gNetBlobDue || !mqtt.connected() || gNetBackup.active) return;
+  uint8_t li = 0;
+  while (li < COORD_LINK_COUNT && !(gNetBlobDue & (1U << li))) li++;
+  if (li >= COORD_LINK_COUNT) {
+    gNetBlobDue = 0;
+    return;
+  }
+  gNetBlobDue &= (uint8_t)~(1U << li);
+
+  net_backup_meta_t meta = {};
+  size_t len = 0;
+  uint8_t* sealed = netBakLoad(li, meta, len);
+  if (len > 0 && netBackupPublishBlob(li, sealed, len, meta)) {
+    Serial.printf("[NetBak] link%u blob sent (%u bytes)\n", (unsigned)li, (unsigned)len);
+  } else {
+    publishNetBackupState("backup", li, "failed", "no backup stored on the hub");
+  }
+  free(sealed);
+}
+
+// Encrypt the collected plain backup, keep it in LittleFS and hand it to the backend.
+static void netBackupSeal() {
+  net_backup_rx_t& b = gNetBackup;
+  uint8_t key[32];
+  if (!netBackupKey(key)) {
+    netBackupFail("no backup key (not provisioned by the backend)");
+    return;
+  }
+  const size_t sealedLen = 4 + 12 + 16 + b.len;
+  uint8_t* sealed = (uint8_t*)malloc(sealedLen);
+  if (!sealed) {
+    netBackupFail("out of memory");
+    return;
+  }
+  uint8_t* hdr = sealed;
+  uint8_t* iv = sealed + 4;
+  uint8_t* tag = iv + 12;
+  memcpy(hdr, "ZBE\x02", 4);
+  for (uint8_t i = 0; i < 12; i += 4) {
+    const uint32_t r = esp_random();
+    memcpy(iv + i, &r, 4);
+  }
+  mbedtls_gcm_context gcm;
+  mbedtls_gcm_init(&gcm);
+  int rc = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, 256);
+  if (rc == 0) rc = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, b.len, iv, 12, hdr, 4, b.buf, tag + 16, 16, tag);
+  mbedtls_gcm_free(&gcm);
+  memset(key, 0, sizeof(key));
+  memset(b.buf, 0, b.len); // network key in clear
+  free(b.buf);             // the sealed copy and its base64 need the room
+  b.buf = nullptr;
+  if (rc != 0) {
+    free(sealed);
+    netBackupFail("encrypt failed");
+    return;
+  }
+
+  net_backup_meta_t meta = {};
+  meta.ts = nowMs();
+  meta.bytes = (uint32_t)sealedLen;
+  meta.devices = b.devices;
+  meta.nvram = b.nvram;
+  const bool stored = netBakStore(b.li, sealed, sealedLen, meta);
+
+  const bool published = netBackupPublishBlob(b.li, sealed, sealedLen, meta);
+  free(sealed);
+  // The summary is what stays on the broker; a backend that missed the blob asks for it.
+  if (stored) netBackupPublishSummary(b.li, meta);
+
+  StaticJsonDocument<128> extra;
+  extra["bytes"] = (unsigned)sealedLen;
+  extra["devices"] = b.devices;
+  extra["nvram"] = b.nvram;
+  extra["stored"] = stored;
+  extra["published"] = published;
+  publishNetBackupState("backup", b.li, stored || published ? "done" : "failed",
+                        stored || published ? nullptr : "nowhere to keep the backup", extra.as<JsonVariantConst>());
+  netBackupFree();
+}
+
+// UART: {"evt":"net_backup",...} from the coordinator.
+static void netBackupOnEvt(uint8_t li, JsonDocument& msg) {
+  net_backup_rx_t& b = gNetBackup;
+  if (!b.active || b.li != li) return;
+  b.lastMs = millis();
+  const char* state = msg["state"] | "";
+
+  if (strcmp(state, "failed") == 0) {
+    netBackupFail(msg["error"] | "coordinator failed");
+    return;
+  }
+  if (strcmp(state, "begin") == 0) {
+    b.len = 0;
+    b.fnv = 2166136261u;
+    b.devices = msg["devices"] | 0;
+    b.nvram = (msg["nvram"] | 0) > 0;
+    if (b.automatic && b.devices == 0) {
+      // Likely a replacement coordinator waiting for its restore: keep the old backup.
+      netBackupFail("empty network, previous backup kept");
+      return;
+    }
+    msg.remove("evt");
+    msg.remove("state");
+    String header;
+    serializeJson(msg, header);
+    const uint16_t hl = (uint16_t)header.length();
+    const uint8_t hlLe[2] = {(uint8_t)hl, (uint8_t)(hl >> 8)};
+    if (!netBackupAppend(hlLe, 2) || !netBackupAppend(header.c_str(), hl)) {
+      netBackupFail("out of memory");
+      return;
+    }
+    b.begun = true;
+    return;
+  }
+  if (!b.begun) return;
+
+  if (strcmp(state, "done") == 0) {
+    if ((msg["fnv"] | 0UL) != b.fnv) {
+      netBackupFail("checksum mismatch");
       return;
     }
-    writtenTotal += w;
+    netBackupSeal();
+    return;
+  }
 
-    if (contentLen > 0 && (int)writtenTotal >= contentLen) break;
-    yield();
+  const char* k = msg["k"] | "";
+  const char* data = msg["data"] | "";
+  const uint16_t off = msg["off"] | 0;
+  const uint16_t len = msg["len"] | 0;
+  uint8_t raw[NET_PART_BYTES];
+  size_t n = 0;
+  const size_t kl = strlen(k);
+  if (kl == 0 || kl > 15 || mbedtls_base64_decode(raw, sizeof(raw), &n, (const unsigned char*)data, strlen(data)) != 0) {
+    netBackupFail("bad part");
+    return;
+  }
+  bool ok = true;
+  if (off == 0) {
+    const uint8_t klen = (uint8_t)kl;
+    const uint8_t lenLe[2] = {(uint8_t)len, (uint8_t)(len >> 8)};
+    ok = netBackupAppend(&klen, 1) && netBackupAppend(k, kl) && netBackupAppend(lenLe, 2);
+  }
+  if (!ok || !netBackupAppend(raw, n)) {
+    netBackupFail("backup too large");
+    return;
   }
+  b.fnv = netFnv(b.fnv, raw, n);
+}
 
-  uint8_t hash[32];
-  mbedtls_sha256_finish(&ctx, hash);
-  mbedtls_sha256_free(&ctx);
+// ---- Restore ----
 
-  http.end();
+static void netRestoreFree() {
+  if (gNetRestore.fetching) gNetFetch.end();
+  free(gNetRestore.sealed);
+  if (gNetRestore.plain) {
+    memset(gNetRestore.plain, 0, gNetRestore.len);
+    free(gNetRestore.plain);
+  }
+  gNetRestore = net_restore_tx_t();
+}
 
-  // Verify hash BEFORE finalizing OTA.
-  String sha256Actual = bytesToHex(hash, 32);
-  if (sha256Actual != sha256Expected) {
-    Update.abort();
-    gOtaBusy = false;
-    publishOtaResult(cmdId, false, "SHA_MISMATCH", String("actual=") + sha256Actual, version);
+static void netRestoreFail(const char* error, bool abortCoord) {
+  if (abortCoord) {
+    StaticJsonDocument<64> u;
+    u["cmd"] = "net_restore";
+    u["state"] = "abort";
+    linkSendControl(gNetRestore.li, u);
+  }
+  publishNetBackupState("restore", gNetRestore.li, "failed", error);
+  netRestoreFree();
+}
+
+static void netRestoreSendNext() {
+  net_restore_tx_t& r = gNetRestore;
+  DynamicJsonDocument u(768);
+  u["cmd"] = "net_restore";
+  u["seq"] = r.seq;
+  r.partLen = 0;
+  if (r.seq == 0) {
+    const uint16_t hl = (uint16_t)(r.plain[0] | (r.plain[1] << 8));
+    StaticJsonDocument<384> header;
+    deserializeJson(header, (const char*)r.plain + 2, hl);
+    for (JsonPair kv : header.as<JsonObject>()) u[kv.key()] = kv.value();
+    u["state"] = "begin";
+    if (r.force) u["force"] = true;
+  } else if (r.pos < r.len) {
+    const uint8_t* rec = r.plain + r.pos;
+    const uint8_t kl = rec[0];
+    const uint16_t dl = (uint16_t)(rec[1 + kl] | (rec[2 + kl] << 8));
+    char k[16];
+    memcpy(k, rec + 1, kl);
+    k[kl] = 0;
+    r.partLen = (uint16_t)min((size_t)(dl - r.recOff), NET_PART_BYTES);
+    char data[4 * ((NET_PART_BYTES + 2) / 3) + 1];
+    size_t n = 0;
+    mbedtls_base64_encode((unsigned char*)data, sizeof(data), &n, rec + 3 + kl + r.recOff, r.partLen);
+    data[n] = 0;
+    u["k"] = k;
+    u["off"] = r.recOff;
+    u["len"] = dl;
+    u["data"] = data;
+  } else {
+    u["state"] = "commit";
+    u["bytes"] = r.bytes;
+    u["fnv"] = r.fnv;
+  }
+  linkSendControl(r.li, u);
+  r.sentMs = millis();
+}
+
+// Open the sealed blob (takes ownership), check its records and start playing it
+// into the coordinator.
+static void netRestoreOpen(uint8_t li, bool force, uint8_t* sealed, size_t sealedLen) {
+  netRestoreFree();
+  gNetRestore.li = li;
+  uint8_t key[32];
+  if (!netBackupKey(key)) {
+    free(sealed);
+    netRestoreFail("no backup key (not provisioned by the backend)", false);
+    return;
+  }
+  if (sealedLen <= 4 + 12 + 16 || memcmp(sealed, "ZBE", 3) != 0) {
+    free(sealed);
+    netRestoreFail("not a network backup", false);
+    return;
+  }
+  if (sealed[3] != 2) {
+    free(sealed);
+    netRestoreFail("backup sealed with the retired LAN-derived key, run a new backup", false);
+    return;
+  }
+  const size_t plainLen = sealedLen - (4 + 12 + 16);
+  uint8_t* plain = (uint8_t*)malloc(plainLen);
+  int rc = plain ? 0 : -1;
+  if (rc == 0) {
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    rc = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, 256);
+    if (rc == 0) {
+      rc = mbedtls_gcm_auth_decrypt(&gcm, plainLen, sealed + 4, 12, sealed, 4, sealed + 16, 16, sealed + 32, plain);
+    }
+    mbedtls_gcm_free(&gcm);
+  }
+  memset(key, 0, sizeof(key));
+  free(sealed);
+  if (rc != 0) {
+    free(plain);
+    netRestoreFail("cannot open backup (wrong key or corrupted)", false);
     return;
   }
 
-  if (!Update.end(true)) {
-    String m = String("Update.end failed: ") + String(Update.errorString());
-    gOtaBusy = false;
-    publishOtaResult(cmdId, false, "UPDATE_END", m, version);
+  // Walk the records once: reject a malformed blob before touching the coordinator.
+  net_restore_tx_t& r = gNetRestore;
+  r.plain = plain;
+  r.len = plainLen;
+  r.force = force;
+  r.fnv = 2166136261u;
+  size_t pos = plainLen >= 2 ? 2 + (size_t)(plain[0] | (plain[1] << 8)) : plainLen + 1;
+  r.pos = pos;
+  while (pos < plainLen) {
+    const uint8_t kl = plain[pos];
+    if (kl == 0 || kl > 15 || pos + 3 + kl > plainLen) break;
+    const uint16_t dl = (uint16_t)(plain[pos + 1 + kl] | (plain[pos + 2 + kl] << 8));
+    if (dl == 0 || pos + 3 + kl + dl > plainLen) break;
+    r.fnv = netFnv(r.fnv, plain + pos + 3 + kl, dl);
+    r.bytes += dl;
+    pos += 3 + kl + dl;
+  }
+  if (pos != plainLen) {
+    netRestoreFail("malformed backup", false);
     return;
   }
+  r.active = true;
+  publishNetBackupState("restore", li, "started", nullptr);
+  netRestoreSendNext();
+}
 
-  publishOtaResult(cmdId, true, "", "applied", version);
-  Serial.println("[OTA] success -> reboot");
-  delay(300);
-  ESP.restart();
+// loop(): a zigbee/restore request. The stored copy is opened at once; a URL is
+// downloaded by netRestoreFetchTick. Only the connect and response headers block,
+// bounded by NET_FETCH_CONNECT_MS.
+static void netRestoreStart(uint8_t li, const char* url, bool force) {
+  if (gNetBackup.active || gNetRestore.active) {
+    publishNetBackupState("restore", li, "failed", "busy");
+    return;
+  }
+  if (!linkUsable(li)) {
+    publishNetBackupState("restore", li, "failed", "coordinator_unavailable");
+    return;
+  }
+  if (!gNetBakKeyValid) {
+    publishNetBackupState("restore", li, "failed", "no backup key (not provisioned by the backend)");
+    return;
+  }
+
+  if (!url || !url[0]) {
+    net_backup_meta_t meta = {};
+    size_t len = 0;
+    uint8_t* buf = netBakLoad(li, meta, len);
+    if (!len) {
+      publishNetBackupState("restore", li, "failed", "no backup stored on the hub");
+      return;
+    }
+    netRestoreOpen(li, force, buf, len);
+    return;
+  }
+
+  if (WiFi.status() != WL_CONNECTED) {
+    publishNetBackupState("restore", li, "failed", "WiFi not connected");
+    return;
+  }
+  gNetFetch.setConnectTimeout(NET_FETCH_CONNECT_MS);
+  gNetFetch.setTimeout(NET_FETCH_CONNECT_MS);
+  if (!gNetFetch.begin(url) || gNetFetch.GET() != HTTP_CODE_OK) {
+    gNetFetch.end();
+    publishNetBackupState("restore", li, "failed", "download failed");
+    return;
+  }
+  const int size = gNetFetch.getSize();
+  uint8_t* buf = nullptr;
+  if (size <= 32 || (size_t)size > NET_BACKUP_MAX + 32 || (buf = (uint8_t*)malloc(size)) == nullptr) {
+    gNetFetch.end();
+    publishNetBackupState("restore", li, "failed", "bad backup size");
+    return;
+  }
+  net_restore_tx_t& r = gNetRestore;
+  r = net_restore_tx_t();
+  r.active = true;
+  r.fetching = true;
+  r.li = li;
+  r.force = force;
+  r.sealed = buf;
+  r.sealedLen = (size_t)size;
+  r.fetchMs = millis();
+  publishNetBackupState("restore", li, "downloading", nullptr);
+}
+
+// Whatever body bytes have arrived, at most NET_FETCH_CHUNK per pass.
+static void netRestoreFetchTick() {
+  net_restore_tx_t& r = gNetRestore;
+  WiFiClient* stream = gNetFetch.getStreamPtr();
+  size_t budget = NET_FETCH_CHUNK;
+  while (stream && budget > 0 && r.got < r.sealedLen && stream->available() > 0) {
+    const int n = stream->read(r.sealed + r.got, min(budget, r.sealedLen - r.got));
+    if (n <= 0) break;
+    r.got += (size_t)n;
+    budget -= (size_t)n;
+    r.fetchMs = millis();
+  }
+  if (r.got == r.sealedLen) {
+    gNetFetch.end();
+    r.fetching = false;
+    uint8_t* sealed = r.sealed;
+    r.sealed = nullptr;
+    netRestoreOpen(r.li, r.force, sealed, r.sealedLen);
+  } else if (!stream || (!gNetFetch.connected() && stream->available() <= 0)) {
+    netRestoreFail("download truncated", false);
+  } else if (millis() - r.fetchMs > NET_FETCH_IDLE_MS) {
+    netRestoreFail("download stalled", false);
+  }
+}
+
+// UART: {"evt":"net_restore",...}: per-line acks, and "done" once the rebooted
+// coordinator has formed the restored network.
+static void netRestoreOnEvt(uint8_t li, JsonDocument& msg) {
+  const char* state = msg["state"] | "";
+  if (strcmp(state, "done") == 0) {
+    msg.remove("evt");
+    msg.remove("state");
+    const bool ok = msg["ok"] | false;
+    const bool nvram = msg["nvram"] | false;
+    if (ok && !nvram) {
+      // Formed anew from the parameters: its frame counter restarted, so the network
+      // only works again once the devices have rejoined.
+      msg["message"] = "backup had no stack NVRAM image: every device must rejoin";
+      publishNetBackupState("restore", li, "rejoin_required", nullptr, msg.as<JsonVariantConst>());
+      return;
+    }
+    publishNetBackupState("restore", li, ok ? "done" : "failed", ok ? nullptr : (msg["error"] | "restore failed"),
+                          msg.as<JsonVariantConst>());
+    return;
+  }
+  net_restore_tx_t& r = gNetRestore;
+  if (!r.active || r.fetching || r.li != li || (msg["seq"] | -1) != (int)r.seq) return;
+  if (!(msg["ok"] | false)) {
+    netRestoreFail(msg["error"] | "rejected", false);
+    return;
+  }
+  if (r.seq > 0 && r.pos >= r.len) {
+    // Commit acked: the coordinator reboots and reports "done" when the network is up.
+    publishNetBackupState("restore", li, "committed", nullptr);
+    netRestoreFree();
+    return;
+  }
+  if (r.seq > 0) {
+    const uint8_t* rec = r.plain + r.pos;
+    const uint8_t kl = rec[0];
+    const uint16_t dl = (uint16_t)(rec[1 + kl] | (rec[2 + kl] << 8));
+    r.recOff += r.partLen;
+    if (r.recOff >= dl) {
+      r.pos += 3 + kl + dl;
+      r.recOff = 0;
+    }
+  }
+  r.seq++;
+  r.tries = 0;
+  netRestoreSendNext();
+}
+
+static void netBackupTick() {
+  const uint32_t now = millis();
+  if (gNetBackup.active && now - gNetBackup.lastMs > NET_BACKUP_IDLE_MS) netBackupFail("timeout");
+
+  if (gNetRestoreReq.pending) {
+    net_restore_req_t req = gNetRestoreReq;
+    gNetRestoreReq.pending = false;
+    netRestoreStart(req.li, req.url, req.force);
+  }
+  if (gNetRestore.active && gNetRestore.fetching) {
+    netRestoreFetchTick();
+  } else if (gNetRestore.active && now - gNetRestore.sentMs > NET_RESTORE_ACK_MS) {
+    if (++gNetRestore.tries >= NET_RESTORE_TRIES) {
+      netRestoreFail("timeout", true);
+    } else {
+      netRestoreSendNext();
+    }
+  }
+  netBackupBlobTick();
+
+  // Periodic backup of every live link, one at a time, once the backend can take it.
+  if (!gNetBakKeyValid || !mqtt.connected()) return;
+  if (gNetBackupNextMs == 0) gNetBackupNextMs = now + NET_BACKUP_FIRST_MS;
+  if (timeDue(now, gNetBackupNextMs)) {
+    gNetBackupNextMs = now + NET_BACKUP_INTERVAL_MS;
+    for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+      if (linkUsable(li)) gNetBackupDue |= (uint8_t)(1U << li);
+    }
+  }
+  if (gNetBackupDue && !gNetBackup.active && !gNetRestore.active) {
+    for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+      if (!(gNetBackupDue & (1U << li))) continue;
+      gNetBackupDue &= (uint8_t)~(1U << li);
+      if (linkUsable(li)) netBackupStart(li, true);
+      break;
+    }
+  }
 }
 
 // ----------------- NON-BLOCKING RECONNECT -----------------
@@ -1462,6 +5199,26 @@ static void ensureMqttNonBlocking() {
 }
 
 // ----------------- MQTT CALLBACKS -----------------
+// Recently dispatched zb/set cmdIds (LAN + cloud may deliver the same command).
+static const size_t ZB_SET_DEDUP_MAX = 16;
+static char gZbSetSeen[ZB_SET_DEDUP_MAX][41];
+static uint8_t gZbSetSeenPtr = 0;
+
+static bool zbSetWasSeen(const String& cmdId) {
+  for (size_t i = 0; i < ZB_SET_DEDUP_MAX; i++) {
+    if (gZbSetSeen[i][0] && cmdId.equals(gZbSetSeen[i])) return true;
+  }
+  return false;
+}
+
+static bool zbSetSeenRecently(const String& cmdId) {
+  if (zbSetWasSeen(cmdId)) return true;
+  strncpy(gZbSetSeen[gZbSetSeenPtr], cmdId.c_str(), sizeof(gZbSetSeen[0]) - 1);
+  gZbSetSeen[gZbSetSeenPtr][sizeof(gZbSetSeen[0]) - 1] = 0;
+  gZbSetSeenPtr = (uint8_t)((gZbSetSeenPtr + 1) % ZB_SET_DEDUP_MAX);
+  return false;
+}
+
 static void handleMqttJsonMessage(const String& topic, const char* jsonText) {
   // Sprint 8: automation sync payload can be larger than the previous default.
   StaticJsonDocument<2048> doc;
@@ -1488,12 +5245,116 @@ static void handleMqttJsonMessage(const String& topic, const char* jsonText) {
     return;
   }
 
+  if (topic == tHubLanKey) {
+    handleLanKeyMessage(doc);
+    return;
+  }
+
+  if (topic == tHubLanBrokerConfig) {
+    handleLanBrokerConfig(doc);
+    return;
+  }
+
+  if (topic == tProfileCmd) {
+    handleProfileCmd(doc);
+    return;
+  }
+
+  if (topic == tHubAnalyticsConfig) {
+    handleAnalyticsConfig(doc);
+    return;
+  }
+
+  // /ack of a Wi-Fi device targeted by a local automation (see autoSubscribeMqttAcks)
+  const char* devLeaf = lanDeviceTopicLeaf(topic.c_str());
+  if (devLeaf && strcmp(devLeaf, "ack") == 0) {
+    automationOnMqttAck(doc["cmdId"] | "", doc["ok"] | false, doc["error"] | (const char*)nullptr);
+    return;
+  }
+
   // Sprint 8: receive compiled automation rules from backend (versioned)
   if (topic == tAutomationSync) {
     handleAutomationSync(doc);
     return;
   }
 
+  if (topic == tPairBulk) {
+    handlePairBulk(doc);
+    return;
+  }
+
+  if (topic == tZbTopology) {
+    // { gapMs?: 50..10000, weakLqi?: 0..255, stop?: bool }
+    const uint16_t gapMs = (uint16_t)constrain((int)(doc["gapMs"] | 0), 0, 10000);
+    const int16_t weakLqi = doc.containsKey("weakLqi") ? (int16_t)constrain((int)(doc["weakLqi"] | 0), 0, 255) : -1;
+    const bool stop = doc["stop"] | false;
+    for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+      if (linkUsable(li)) coordSendTopology(li, gapMs, weakLqi, stop);
+    }
+    return;
+  }
+
+  if (topic == tZbBackupRun) {
+    // { link?: n }  (default: every usable link, one after the other)
+    if (doc.containsKey("link")) {
+      const uint8_t li = doc["link"] | 0;
+      if (li < COORD_LINK_COUNT) netBackupStart(li, false);
+    } else {
+      for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+        if (linkUsable(li)) gNetBackupDue |= (uint8_t)(1U << li);
+      }
+      gNetBackupNextMs = millis(); // next tick, also restarts the daily period
+    }
+    return;
+  }
+
+  if (topic == tZbBackupGet) {
+    // { link?: n }  (default: every link) -> .../zigbee/backup/<link>/blob from NVS
+    if (doc.containsKey("link")) {
+      const uint8_t li = doc["link"] | 0;
+      if (li < COORD_LINK_COUNT) gNetBlobDue |= (uint8_t)(1U << li);
+    } else {
+      gNetBlobDue = (uint8_t)((1U << COORD_LINK_COUNT) - 1);
+    }
+    return;
+  }
+
+  if (topic == tZbRestore) {
+    // { link?: n, url?: "https://..." (sealed blob; default: the hub's stored copy), force?: bool }
+    // Started from loop(): the download must not hold up the MQTT task.
+    const uint8_t li = doc["link"] | 0;
+    const char* url = doc["url"] | "";
+    if (li >= COORD_LINK_COUNT) return;
+    if (gNetRestoreReq.pending || strlen(url) >= sizeof(gNetRestoreReq.url)) {
+      publishNetBackupState("restore", li, "failed", gNetRestoreReq.pending ? "busy" : "url too long");
+      return;
+    }
+    gNetRestoreReq.li = li;
+    gNetRestoreReq.force = doc["force"] | false;
+    strncpy(gNetRestoreReq.url, url, sizeof(gNetRestoreReq.url) - 1);
+    gNetRestoreReq.url[sizeof(gNetRestoreReq.url) - 1] = 0;
+    gNetRestoreReq.pending = true;
+    return;
+  }
+
+  if (topic == tZbBindingsGet) {
+    for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+      if (linkUsable(li)) coordSendBindList(li);
+    }
+    return;
+  }
+
+  if (topic == tZbResync) {
+    // { rate?: reads/s 1..20, sleepyWaitSec?: 0..3600, stop?: bool }
+    const uint8_t rate = (uint8_t)constrain((int)(doc["rate"] | 0), 0, 20);
+    const int32_t sleepyWait = doc.containsKey("sleepyWaitSec") ? (int32_t)(doc["sleepyWaitSec"] | 0) : -1;
+    const bool stop = doc["stop"] | false;
+    for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) {
+      if (linkUsable(li)) coordSendResync(li, rate, sleepyWait, stop);
+    }
+    return;
+  }
+
   if (topic == tPairOpen) {
     // { token?, durationSec? }
     const char* token = doc["token"] | "";
@@ -1504,6 +5365,7 @@ static void handleMqttJsonMessage(const String& topic, const char* jsonText) {
     String tok = String(token);
     if (tok.isEmpty()) tok = genPairToken();
 
+    bulkEnd("replaced");
     activePairingToken = tok;
     activePairingUntilMs = millis() + (uint32_t)durationSec * 1000U;
 
@@ -1572,6 +5434,7 @@ static void handleMqttJsonMessage(const String& topic, const char* jsonText) {
   if (topic == tPairClose) {
     // Best-effort close: clear token and disable permit-join.
     Serial.println("[ZB] pairing close");
+    bulkEnd("closed");
     activePairingToken = "";
     activePairingUntilMs = 0;
 
@@ -1600,6 +5463,12 @@ static void handleMqttJsonMessage(const String& topic, const char* jsonText) {
     const char* action = doc["action"] | "";
     String cmdId = (cmdIdIn && cmdIdIn[0] != '\0') ? String(cmdIdIn) : genCmdId();
 
+    // The app may retry a LAN command over the cloud path with the same cmdId.
+    if (zbSetSeenRecently(cmdId)) {
+      Serial.printf("[ZB] duplicate cmdId=%s ignored\n", cmdId.c_str());
+      return;
+    }
+
     JsonVariant argsV = doc["args"];
     if (argsV.isNull()) argsV = doc["payload"]; // optional alias
 
@@ -1629,6 +5498,55 @@ static void handleMqttJsonMessage(const String& topic, const char* jsonText) {
       return;
     }
 
+    // Attribute reporting (ZCL Configure Reporting), answered by a "zigbee.report_cfg" event:
+    //   {action:"zigbee.report_cfg", args:{endpoint, cluster, attrs:[{attr,type?,min,max,change}]}}
+    //     (or a single attr,type,min,max,change in args)
+    //   {action:"zigbee.report_read", args:{endpoint, cluster, attrs:[0]}}
+    //   {action:"zigbee.report_profile"}  -> re-apply the coordinator's per-model profile
+    if (action && strncmp(action, "zigbee.report_", 14) == 0) {
+      const char* op = action + 14;
+      if (strcmp(op, "cfg") != 0 && strcmp(op, "read") != 0 && strcmp(op, "profile") != 0) {
+        publishZbCmdResult(ieee16, cmdId.c_str(), false, "unknown_action");
+        return;
+      }
+      StaticJsonDocument<512> u;
+      u["cmd"] = String("report_") + op;
+      u["ieee"] = ieee16;
+      u["endpoint"] = argsV["endpoint"] | 1;
+      if (!argsV["cluster"].isNull()) u["cluster"] = argsV["cluster"];
+      if (!argsV["attrs"].isNull()) {
+        u["attrs"] = argsV["attrs"];
+      } else if (!argsV["attr"].isNull()) {
+        static const char* const keys[] = {"attr", "type", "min", "max", "change"};
+        for (const char* k : keys) {
+          if (!argsV[k].isNull()) u[k] = argsV[k];
+        }
+      }
+      u["cmdId"] = cmdId;
+      uartSendJson(u);
+      return;
+    }
+
+    // Direct device-to-device bindings (ZDO Bind/Unbind_req), kept by the coordinator and
+    // re-applied when the source rejoins:
+    //   {action:"zigbee.bind", args:{endpoint, cluster, dst:"<ieee>", dstEp}}
+    //   {action:"zigbee.unbind", args:{...same, or group:"0x0001"...}}  (group bind is refused by the coordinator)
+    //   {action:"zigbee.bind_table"}  -> "zigbee.bind_table" event with the device's Mgmt_Bind rows
+    if (action && (strcmp(action, "zigbee.bind") == 0 || strcmp(action, "zigbee.unbind") == 0 ||
+                   strcmp(action, "zigbee.bind_table") == 0)) {
+      StaticJsonDocument<256> u;
+      u["cmd"] = action + 7;
+      u["ieee"] = ieee16;
+      u["endpoint"] = argsV["endpoint"] | 1;
+      static const char* const keys[] = {"cluster", "dst", "dstEp", "group"};
+      for (const char* k : keys) {
+        if (!argsV[k].isNull()) u[k] = argsV[k];
+      }
+      u["cmdId"] = cmdId;
+      uartSendJson(u);
+      return;
+    }
+
     const bool isGateAction = (action && strlen(action) > 0 && (strncmp(action, "gate.", 5) == 0 || strncmp(action, "light.", 6) == 0));
     const bool isGateDev = is_model_gate_pir(ieee16.c_str()) || isGateAction;
 	    const bool isLockAction = (action && strlen(action) > 0 && (strncmp(action, "lock.", 5) == 0));
@@ -1822,15 +5740,31 @@ static void onMqttConnect(bool sessionPresent) {
   mqtt.subscribe(tPairConfirm.c_str(), 1);
   mqtt.subscribe(tPairReject.c_str(), 1);
   mqtt.subscribe(tPairClose.c_str(), 1);
+  mqtt.subscribe(tPairBulk.c_str(), 1);
+  mqtt.subscribe(tZbResync.c_str(), 1);
+  mqtt.subscribe(tZbTopology.c_str(), 1);
+  mqtt.subscribe(tZbBindingsGet.c_str(), 1);
+  mqtt.subscribe(tZbBackupRun.c_str(), 1);
+  mqtt.subscribe(tZbBackupGet.c_str(), 1);
+  mqtt.subscribe(tZbRestore.c_str(), 1);
   mqtt.subscribe(tZbSetWildcard.c_str(), 1);
   mqtt.subscribe(tZbEventWildcard.c_str(), 0);
   mqtt.subscribe(tOtaCmd.c_str(), 1);
 
   // Sprint 8: automation rule sync (versioned)
   mqtt.subscribe(tAutomationSync.c_str(), 1);
+  mqtt.subscribe(tHubLanKey.c_str(), 1);
+  publishLanWrapKey();
+  mqtt.subscribe(tHubLanBrokerConfig.c_str(), 1);
+  mqtt.subscribe(tHubAnalyticsConfig.c_str(), 1);
+  mqtt.subscribe(tProfileCmd.c_str(), 1);
+  // Re-establish /set subscriptions for Wi-Fi devices already on the local broker.
+  gLanBroker.forEachSubscription(lanBrokerUpstreamSubscribe);
+  autoSubscribeMqttAcks();
 
   publishHubOnline(true);
   nextHubStatusMs = millis() + HUB_STATUS_HEARTBEAT_MS;
+  publishCoordinatorHealth();
 }
 
 static void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
@@ -1864,27 +5798,183 @@ static void onMqttMessage(char* topic, char* payload, AsyncMqttClientMessageProp
   if (index + len != total) return;
 
   mqttRxBuf[total] = '\0';
+  // /set for a Wi-Fi device on the local broker: hand it over verbatim.
+  // Only home/<homeId>/device/<id>/set: a local "#" must not swallow hub control topics.
+  if (gLanBroker.running() && lanBrokerIsSetFilter(topic) && gLanBroker.hasSubscriber(topic)) {
+    gLanBroker.publish(topic, (const uint8_t*)mqttRxBuf, total, false);
+    return;
+  }
+  gProf.sectionBegin(HubProfiler::SLOT_MQTT, "mqtt");
   handleMqttJsonMessage(String(topic), mqttRxBuf);
+  gProf.sectionEnd(HubProfiler::SLOT_MQTT);
+}
+
+// attr_report: the coordinator puts every attribute of a ZCL frame (and of a
+// short per-device window) on one line. Apply them all, then publish each
+// affected state snapshot once instead of once per attribute.
+struct attr_apply_t {
+  gate_state_t* gate = nullptr; // snapshot to publish
+  th_state_t* th = nullptr;
+  StaticJsonDocument<384> state; // generic devices
+  uint8_t publishes = 0;
+};
+
+static void attrReportFlush(const String& ieee16, attr_apply_t& ap) {
+  if (ap.gate) {
+    publishGatePirSnapshot(ieee16, ap.gate);
+    ap.publishes++;
+  }
+  if (ap.th && analyticsForwardRaw()) {
+    StaticJsonDocument<192> st;
+    if (ap.th->hasTemp) st["temperature"] = ap.th->temp;
+    if (ap.th->hasHum) st["humidity"] = ap.th->hum;
+    publishZbState(ieee16, st);
+    ap.publishes++;
+  }
+  if (ap.state.size()) {
+    publishZbState(ieee16, ap.state);
+    ap.publishes++;
+    ap.state.clear();
+  }
+  ap.gate = nullptr;
+  ap.th = nullptr;
+}
+
+// rawX100: the line has no "u" (unit) field -- IDF and pre-typed Arduino coordinators
+// send temperature/humidity as raw ZCL integers (0.01 units).
+static void attrReportApply(const String& ieee16, const char* cluster, const char* attr, JsonVariant value,
+                            attr_apply_t& ap, bool rawX100) {
+  // ZCL "invalid" readings (sensor not ready, ...) arrive as null: keep the last state.
+  if (value.isNull()) return;
+
+  if (is_model_gate_pir(ieee16.c_str())) {
+    gate_state_t* gs = gate_upsert(ieee16.c_str());
+    if (gs) {
+      // Gate state (OnOff)
+      if (strcmp(cluster, "onoff") == 0 && strcmp(attr, "onoff") == 0) {
+        const bool open = value.as<bool>();
+        const bool changed = (gs->gateOpen != open);
+        gs->gateOpen = open;
+        gs->lastUpdateMs = millis();
+        ap.gate = gs;
+        if (changed) {
+          StaticJsonDocument<96> data;
+          data["open"] = open;
+          publishZbEvent(ieee16, "gate.state", data.as<JsonVariantConst>());
+        }
+        return;
+      }
+
+      // Light state (Level)
+      if (strcmp(cluster, "level") == 0 && strcmp(attr, "level") == 0) {
+        const uint8_t lvl = value.as<uint8_t>();
+        const bool on = lvl > 0;
+        const bool changed = (gs->lightOn != on);
+        gs->lightOn = on;
+        gs->lightLevel = lvl;
+        gs->lastUpdateMs = millis();
+        ap.gate = gs;
+        if (changed) {
+          StaticJsonDocument<128> data;
+          data["on"] = on;
+          publishZbEvent(ieee16, "light.state", data.as<JsonVariantConst>());
+        }
+        return;
+      }
+
+      // PIR motion (Occupancy)
+      if (strcmp(cluster, "occupancy") == 0 && strcmp(attr, "occupied") == 0) {
+        const int occ = value.as<int>();
+        if (occ != 0) {
+          gs->motionLastAt = nowMs();
+          gs->lastUpdateMs = millis();
+          ap.gate = gs;
+          StaticJsonDocument<96> data;
+          data["level"] = occ;
+          publishZbEvent(ieee16, "motion.detected", data.as<JsonVariantConst>());
+        }
+        return;
+      }
+    }
+  }
+
+  // TH_SENSOR_V1: temperature/humidity reports are partial updates.
+  // Keep a per-device cache so we always publish a full snapshot.
+  if (strcmp(attr, "value") == 0) {
+    const bool isTemp = strcmp(cluster, "temperature") == 0;
+    const bool isHum = strcmp(cluster, "humidity") == 0;
+    if (isTemp || isHum) {
+      th_state_t* th = th_upsert(ieee16.c_str());
+      if (th) {
+        const float v = rawX100 ? value.as<float>() / 100.0f : value.as<float>();
+        if (isTemp) {
+          th->temp = v;
+          th->hasTemp = true;
+        } else {
+          th->hum = v;
+          th->hasHum = true;
+        }
+        th->lastUpdateMs = millis();
+        analyticsOnSample(ieee16.c_str(), isTemp ? ANA_TEMPERATURE : ANA_HUMIDITY, v);
+        ap.th = th;
+        return;
+      }
+    }
+  }
+
+  // Default mapping for generic Zigbee devices
+  JsonDocument& state = ap.state;
+  if (strcmp(cluster, "onoff") == 0 && strcmp(attr, "onoff") == 0) {
+    state["relay"] = value.as<bool>();
+  } else if (strcmp(cluster, "level") == 0 && strcmp(attr, "level") == 0) {
+    state["pwm"] = value;
+  } else if (strcmp(cluster, "power") == 0 || strcmp(cluster, "pressure") == 0 ||
+             strcmp(cluster, "illuminance") == 0) {
+    // Already typed and in display units by the coordinator.
+    state[strcmp(attr, "value") == 0 ? cluster : attr] = value;
+  } else {
+    // Raw attributes share one cluster/attr/value slot in the state contract.
+    if (state.containsKey("cluster")) attrReportFlush(ieee16, ap);
+    state["cluster"] = cluster;
+    state["attr"] = attr;
+    state["value"] = value;
+  }
 }
 
 // ----------------- UART -----------------
-static void processUartLines() {
-  while (Serial2.available()) {
-    char c = (char)Serial2.read();
+static void processUartLink(uint8_t li) {
+  coord_link_t& L = gLinks[li];
+  HardwareSerial& port = *COORD_LINK_CFG[li].port;
+  while (port.available()) {
+    char c = (char)port.read();
     if (c == '\r') continue;
 
     if (c == '\n') {
-      if (uartLineOverflow) {
-        Serial.printf("[UART] drop overlong line (>%u bytes)\n", (unsigned)(UART_LINE_BUF_SIZE - 1));
+      if (L.lineOverflow) {
+        Serial.printf("[UART%u] drop overlong line (>%u bytes)\n", (unsigned)li, (unsigned)(UART_LINE_BUF_SIZE - 1));
       } else {
-        uartLineBuf[uartLineLen] = '\0';
-        if (uartLineLen > 0) {
+        L.lineBuf[L.lineLen] = '\0';
+        if (L.lineLen > 0) {
           StaticJsonDocument<3072> msg;// was 768
-          DeserializationError err = deserializeJson(msg, uartLineBuf);
+          DeserializationError err = deserializeJson(msg, L.lineBuf);
           if (!err) {
             const char* evt = msg["evt"] | "";
+            L.lastRxMs = millis();
+
+            // Any frame about a device proves it is alive (failed cmd_result does not)
+            // and tells us which coordinator owns it.
+            if (msg.containsKey("ieee") && (strcmp(evt, "cmd_result") != 0 || (msg["ok"] | false))) {
+              String ieeeSeen = normalizeIeee(msg["ieee"] | "");
+              if (!ieeeSeen.isEmpty()) {
+                routeLearn(ieeeSeen, li);
+                availabilitySeen(ieeeSeen);
+              }
+            }
 
-            if (strcmp(evt, "device_annce") == 0) {
+            if (strcmp(evt, "hb") == 0) {
+              coordOnHeartbeat(li, msg);
+
+            } else if (strcmp(evt, "device_annce") == 0) {
               String ieeeRaw = msg["ieee"] | "";
               JsonVariant shortV = msg["short"];
               uint32_t shortAddr = 0;
@@ -1905,12 +5995,113 @@ static void processUartLines() {
                             ieee16.isEmpty() ? ieeeRaw.c_str() : ieee16.c_str(),
                             (unsigned)shortAddr);
 
-              publishDiscovered(ieeeRaw, shortAddr);
+              bulkOnAnnounce();
+              // Interviewing coordinators follow up with a complete record; publish once, then.
+              if (!L.interview) publishDiscovered(ieeeRaw, shortAddr, JsonVariantConst());
+
+            } else if (strcmp(evt, "device_interview") == 0) {
+              const char* sh = msg["short"] | "";
+              if (strncmp(sh, "0x", 2) == 0 || strncmp(sh, "0X", 2) == 0) sh += 2;
+              const uint32_t shortAddr = strtoul(sh, nullptr, 16);
+              const bool ok = msg["ok"] | false;
+
+              String ieee16 = normalizeIeee(msg["ieee"] | "");
+              if (!ieee16.isEmpty()) {
+                fpUpdate(ieee16, msg["manufacturer"] | "", msg["model"] | "", msg["swBuildId"] | "");
+                Serial.printf("[UART] device_interview ieee=%s short=0x%04x ok=%d eps=%u ms=%u%s%s\n", ieee16.c_str(),
+                              (unsigned)shortAddr, ok ? 1 : 0, (unsigned)msg["endpoints"].size(),
+                              (unsigned)(msg["ms"] | 0), ok ? "" : " err=", ok ? "" : (const char*)(msg["error"] | "-"));
+                bulkOnInterview(ok, bulkIsAutoAccept(ieee16));
+                publishDiscovered(ieee16, shortAddr, msg.as<JsonVariantConst>());
+              }
+
+            } else if (strcmp(evt, "report_cfg") == 0) {
+              String ieee16 = normalizeIeee(msg["ieee"] | "");
+              availabilityOnReportCfg(ieee16, msg);
+              if (!ieee16.isEmpty()) {
+                msg.remove("evt");
+                msg.remove("ieee");
+                publishZbEvent(ieee16, "zigbee.report_cfg", msg.as<JsonVariantConst>());
+              }
+
+            } else if (strcmp(evt, "bind_table") == 0) {
+              String ieee16 = normalizeIeee(msg["ieee"] | "");
+              if (!ieee16.isEmpty()) {
+                msg.remove("evt");
+                msg.remove("ieee");
+                publishZbEvent(ieee16, "zigbee.bind_table", msg.as<JsonVariantConst>());
+              }
+
+            } else if (strcmp(evt, "bindings") == 0) {
+              msg.remove("evt");
+              msg["link"] = li;
+              msg["ts"] = (unsigned long long)nowMs();
+              String payload;
+              serializeJson(msg, payload);
+              mqttPublish(tZbBindings + "/" + String(li), payload, 1, true);
+
+            } else if (strcmp(evt, "net_backup") == 0) {
+              netBackupOnEvt(li, msg);
+
+            } else if (strcmp(evt, "net_restore") == 0) {
+              netRestoreOnEvt(li, msg);
+
+            } else if (strcmp(evt, "resync") == 0) {
+              const char* st = msg["state"] | "";
+              if (strcmp(st, "progress") != 0) {
+                Serial.printf("[Coord%u] resync %s devices=%u reads=%u answered=%u failed=%u deferred=%u ms=%lu\n",
+                              (unsigned)li, st, (unsigned)(msg["devices"] | 0), (unsigned)(msg["reads"] | 0),
+                              (unsigned)(msg["answered"] | 0), (unsigned)(msg["failed"] | 0),
+                              (unsigned)(msg["deferred"] | 0), (unsigned long)(msg["ms"] | 0UL));
+              }
+              msg.remove("evt");
+              msg["link"] = li;
+              msg["ts"] = (unsigned long long)nowMs();
+              String payload;
+              serializeJson(msg, payload);
+              mqttPublish(tZbResyncProgress, payload, 0, false);
+
+            } else if (strcmp(evt, "topology_node") == 0) {
+              // One router's neighbor table; retained per link and router so the map survives until the
+              // next crawl and two coordinators' meshes never overwrite each other.
+              const char* shortStr = msg["short"] | "";
+              String key = msg["ieee"] | "";
+              if (key.isEmpty()) key = String(shortStr);
+              msg.remove("evt");
+              msg["link"] = li;
+              msg["ts"] = (unsigned long long)nowMs();
+              String payload;
+              serializeJson(msg, payload);
+              mqttPublish(tZbTopology + "/" + String(li) + "/node/" + key, payload, 0, true);
+
+            } else if (strcmp(evt, "topology") == 0) {
+              const char* st = msg["state"] | "";
+              Serial.printf("[Coord%u] topology %s routers=%u edges=%u failed=%u weak=%u ms=%lu\n", (unsigned)li, st,
+                            (unsigned)(msg["routers"] | 0), (unsigned)(msg["edges"] | 0),
+                            (unsigned)(msg["failed"] | 0), (unsigned)msg["weak"].size(),
+                            (unsigned long)(msg["ms"] | 0UL));
+              msg.remove("evt");
+              msg["link"] = li;
+              msg["ts"] = (unsigned long long)nowMs();
+              String payload;
+              serializeJson(msg, payload);
+              mqttPublish(tZbTopology + "/" + String(li) + "/state", payload, 0, strcmp(st, "started") != 0);
+
+            } else if (strcmp(evt, "install_code") == 0) {
+              bulkOnInstallCodeResult(li, msg["dev"] | "", msg["ok"] | false, msg["error"] | "");
 
             } else if (strcmp(evt, "fw_info") == 0) {
               // Sprint 7: coordinator reports its fwVersion at boot.
               const char* fwV = msg["fwVersion"] | "";
               const char* bt = msg["buildTime"] | "";
+              L.channel = msg["channel"] | 0;
+              L.maxDevices = msg["maxDevices"] | 0;
+              L.interview = msg["interview"] | false;
+              // Coordinator just booted: its Time cluster has no time yet.
+              timeSyncSendLink(li);
+              // A reboot the supervisor did not drive (watchdog, brown-out) skips
+              // coordResyncAfterRecovery; the coordinator waits for formation itself.
+              if (L.state == COORD_ST_OK) coordSendResync(li);
               if (fwV && fwV[0]) {
                 Serial.printf("[UART] fw_info coordinator fwVersion=%s\n", fwV);
                 publishCoordinatorFwInfo(String(fwV), String(bt));
@@ -1938,134 +6129,36 @@ static void processUartLines() {
                 const char* model = msg["model"] | "";
                 const char* swBuildId = msg["swBuildId"] | "";
 
-                fp_entry_t* fp = fp_upsert(ieee16.c_str());
-                if (fp) {
-                  if (manuf && manuf[0]) strncpy(fp->manufacturer, manuf, sizeof(fp->manufacturer) - 1);
-                  if (model && model[0]) strncpy(fp->model, model, sizeof(fp->model) - 1);
-                  if (swBuildId && swBuildId[0]) strncpy(fp->swBuildId, swBuildId, sizeof(fp->swBuildId) - 1);
-                  fp->lastUpdateMs = millis();
-                }
+                fpUpdate(ieee16, manuf, model, swBuildId);
 
                 Serial.printf("[UART] basic_fingerprint ieee=%s short=0x%04x manuf=%s model=%s\n",
                               ieee16.c_str(), (unsigned)shortAddr,
                               manuf && manuf[0] ? manuf : "-", model && model[0] ? model : "-");
 
-                // If we're in pairing mode, publish discovered again so backend gets fingerprint.
-                publishDiscovered(ieee16, shortAddr);
+                // Legacy coordinators: publish discovered again so backend gets fingerprint.
+                if (!L.interview) publishDiscovered(ieee16, shortAddr, JsonVariantConst());
               }
 
             } else if (strcmp(evt, "attr_report") == 0) {
-              String ieeeRaw = msg["ieee"] | "";
-              const char* cluster = msg["cluster"] | "";
-              const char* attr = msg["attr"] | "";
-              JsonVariant value = msg["value"];
-
-              String ieee16 = normalizeIeee(ieeeRaw);
+              String ieee16 = normalizeIeee(msg["ieee"] | "");
               if (!ieee16.isEmpty()) {
-                bool handled = false;
-
-                const bool isGateDev = is_model_gate_pir(ieee16.c_str());
-                if (isGateDev) {
-                  gate_state_t* gs = gate_upsert(ieee16.c_str());
-                  if (gs) {
-                    // Gate state (OnOff)
-                    if (strcmp(cluster, "onoff") == 0 && strcmp(attr, "onoff") == 0) {
-                      const bool open = value.as<int>() != 0;
-                      const bool changed = (gs->gateOpen != open);
-                      gs->gateOpen = open;
-                      gs->lastUpdateMs = millis();
-                      publishGatePirSnapshot(ieee16, gs);
-                      if (changed) {
-                        StaticJsonDocument<96> data;
-                        data["open"] = open;
-                        publishZbEvent(ieee16, "gate.state", data.as<JsonVariantConst>());
-                      }
-                      handled = true;
-                    }
-
-                    // Light state (Level)
-                    if (!handled && strcmp(cluster, "level") == 0 &&
-                        (strcmp(attr, "level") == 0 || strcmp(attr, "current_level") == 0)) {
-                      int lvl = value.as<int>();
-                      if (lvl < 0) lvl = 0;
-                      if (lvl > 255) lvl = 255;
-                      const bool on = lvl > 0;
-                      const bool changed = (gs->lightOn != on);
-                      gs->lightOn = on;
-                      gs->lightLevel = (uint8_t)lvl;
-                      gs->lastUpdateMs = millis();
-                      publishGatePirSnapshot(ieee16, gs);
-                      if (changed) {
-                        StaticJsonDocument<128> data;
-                        data["on"] = on;
-                        publishZbEvent(ieee16, "light.state", data.as<JsonVariantConst>());
-                      }
-                      handled = true;
-                    }
-
-                    // PIR motion (Occupancy)
-                    const bool isOcc = (strcmp(cluster, "occupancy") == 0 && strcmp(attr, "occupied") == 0) ||
-                                       (strcmp(cluster, "0x0406") == 0 && strcmp(attr, "0x0000") == 0);
-                    if (!handled && isOcc) {
-                      const int occ = value.as<int>();
-                      if (occ != 0) {
-                        gs->motionLastAt = nowMs();
-                        gs->lastUpdateMs = millis();
-                        publishGatePirSnapshot(ieee16, gs);
-                        StaticJsonDocument<96> data;
-                        data["level"] = occ;
-                        publishZbEvent(ieee16, "motion.detected", data.as<JsonVariantConst>());
-                      }
-                      handled = true;
-                    }
-                  }
-                }
-
-                // TH_SENSOR_V1: temperature/humidity reports are partial updates.
-                // Keep a per-device cache so we always publish a full snapshot.
-                if (!handled && strcmp(attr, "value") == 0) {
-                  const bool isTemp = strcmp(cluster, "temperature") == 0;
-                  const bool isHum = strcmp(cluster, "humidity") == 0;
-                  if (isTemp || isHum) {
-                    th_state_t* th = th_upsert(ieee16.c_str());
-                    if (th) {
-                      const int32_t v = (int32_t)value.as<long>();
-                      if (isTemp) {
-                        th->tempX100 = v;
-                        th->hasTemp = true;
-                      } else {
-                        th->humX100 = v;
-                        th->hasHum = true;
-                      }
-                      th->lastUpdateMs = millis();
-
-                      StaticJsonDocument<192> st;
-                      if (th->hasTemp) st["temperature"] = ((float)th->tempX100) / 100.0f;
-                      if (th->hasHum) st["humidity"] = ((float)th->humX100) / 100.0f;
-                      publishZbState(ieee16, st);
-                      handled = true;
-                    }
-                  }
-                }
-
-                if (!handled) {
-                  // Default mapping for generic Zigbee devices
-                  StaticJsonDocument<256> state;
-                  if (strcmp(cluster, "onoff") == 0 && strcmp(attr, "onoff") == 0) {
-                    state["relay"] = value.as<int>() != 0;
-                  } else if (strcmp(cluster, "level") == 0 &&
-                             (strcmp(attr, "level") == 0 || strcmp(attr, "current_level") == 0)) {
-                    int lvl = value.as<int>();
-                    if (lvl < 0) lvl = 0;
-                    if (lvl > 255) lvl = 255;
-                    state["pwm"] = lvl;
-                  } else {
-                    state["cluster"] = cluster;
-                    state["attr"] = attr;
-                    state["value"] = value;
+                // Batched {"attrs":[{cluster,attr,value},...]} (one line per ZCL frame / window);
+                // older coordinators send a single flat attribute per line.
+                attr_apply_t ap;
+                const bool rawX100 = (msg["u"] | 0) < 1;
+                JsonArray attrs = msg["attrs"].as<JsonArray>();
+                if (attrs.isNull()) {
+                  attrReportApply(ieee16, msg["cluster"] | "", msg["attr"] | "", msg["value"], ap, rawX100);
+                  L.rptAttrs++;
+                } else {
+                  for (JsonObject a : attrs) {
+                    attrReportApply(ieee16, a["cluster"] | "", a["attr"] | "", a["value"], ap, rawX100);
+                    L.rptAttrs++;
                   }
-                  publishZbState(ieee16, state);
                 }
+                attrReportFlush(ieee16, ap);
+                L.rptLines++;
+                L.rptPublishes += ap.publishes;
               }
 
             } else if (strcmp(evt, "join_state") == 0) {
@@ -2091,8 +6184,11 @@ static void processUartLines() {
               String ieee16 = normalizeIeee(ieeeRaw);
               const char* type = msg["type"] | "";
               JsonVariantConst data = msg["data"].as<JsonVariantConst>();
+              // Only trust device stamps that look like epoch ms (an unsynced device sends none).
+              uint64_t devTs = msg["ts"] | 0ULL;
+              if (devTs < 1000000000000ULL) devTs = 0;
               if (!ieee16.isEmpty() && type && type[0] != '\0') {
-                publishZbEvent(ieee16, type, data);
+                publishZbEvent(ieee16, type, data, devTs);
               }
 
             } else if (strcmp(evt, "zb_state") == 0) {
@@ -2101,7 +6197,7 @@ static void processUartLines() {
               String ieee16 = normalizeIeee(ieeeRaw);
               JsonVariantConst stV = msg["state"].as<JsonVariantConst>();
               if (!ieee16.isEmpty()) {
-                DynamicJsonDocument stDoc(1024);
+                DynamicJsonDocument stDoc(stV.memoryUsage() + measureJson(stV) + 128);
                 if (!stV.isNull()) {
                   stDoc.set(stV);
                 } else {
@@ -2110,8 +6206,16 @@ static void processUartLines() {
                 publishZbState(ieee16, stDoc);
               }
 
+            } else if (strcmp(evt, "cmd_sent") == 0) {
+              // Tracked command left the coordinator queue; its cmd_result follows once the device answers.
+              coordOnCmdResult(li, msg["cmdId"] | "");
+
+            } else if (strcmp(evt, "cmd_backpressure") == 0) {
+              coordOnBackpressure(li, msg);
+
             } else if (strcmp(evt, "cmd_result") == 0) {
               const char* cmdId = msg["cmdId"] | "";
+              if (!(msg["tracked"] | false)) coordOnCmdResult(li, cmdId);
               String ieeeRaw = msg["ieee"] | "";
               bool ok = msg["ok"] | false;
               const char* error = msg["error"] | "";
@@ -2124,7 +6228,8 @@ static void processUartLines() {
                             (ok || !error || error[0] == '\0') ? "" : error);
 
               if (!ieee16.isEmpty()) {
-                publishZbCmdResult(ieee16, cmdId, ok, error);
+                // Hub-generated ids only carry the credit; the caller sent none.
+                publishZbCmdResult(ieee16, linkIsAutoCmdId(cmdId) ? "" : cmdId, ok, error, &msg);
               }
 
             } else if (strcmp(evt, "log") == 0) {
@@ -2137,33 +6242,41 @@ static void processUartLines() {
         }
       }
 
-      uartLineLen = 0;
-      uartLineOverflow = false;
+      L.lineLen = 0;
+      L.lineOverflow = false;
       continue;
     }
 
-    if (uartLineOverflow) continue;
+    if (L.lineOverflow) continue;
 
-    if (uartLineLen + 1 < UART_LINE_BUF_SIZE) {
-      uartLineBuf[uartLineLen++] = c;
+    if (L.lineLen + 1 < UART_LINE_BUF_SIZE) {
+      L.lineBuf[L.lineLen++] = c;
     } else {
-      uartLineOverflow = true;
+      L.lineOverflow = true;
     }
   }
 }
 
+static void processUartLines() {
+  for (uint8_t li = 0; li < COORD_LINK_COUNT; li++) processUartLink(li);
+}
+
 // ----------------- ARDUINO -----------------
 void setup() {
   Serial.begin(115200);
   delay(200);
   Serial.println("\n[Hub] boot");
+  gProf.begin(PROF_BASE_HZ, PROF_STALL_MS_DEFAULT);
 
   initHubIdFromNvsOrMac();
   loadRuleConfig();
   loadAutomationFromNvs();
+  loadLanKeyFromNvs();
+  loadLanBrokerConfigFromNvs();
+  loadAnalyticsConfigFromNvs();
 
-  // UART
-  Serial2.begin(UART_BAUD, SERIAL_8N1, UART2_RX, UART2_TX);
+  // UART link(s) to coordinator(s) + persisted device routes
+  coordLinksBegin();
 
   // Topics depend on hubId
   buildTopics();
@@ -2204,12 +6317,30 @@ void setup() {
 }
 
 void loop() {
+  // Marks name the phase a stall report points at.
+  gProf.sectionBegin(HubProfiler::SLOT_LOOP, "wifi");
   ensureWifiNonBlocking();
   ensureTimeInit();
   checkTimeSynced();
+  gProf.mark(HubProfiler::SLOT_LOOP, "mqtt_connect");
   ensureMqttNonBlocking();
+  gProf.mark(HubProfiler::SLOT_LOOP, "uart");
   processUartLines();
+  gProf.mark(HubProfiler::SLOT_LOOP, "coord");
+  coordinatorSupervisionTick();
+  gProf.mark(HubProfiler::SLOT_LOOP, "availability");
+  availabilityTick();
+  gProf.mark(HubProfiler::SLOT_LOOP, "analytics");
+  analyticsTick();
+  gProf.mark(HubProfiler::SLOT_LOOP, "lan");
+  lanTick();
+  lanBrokerTick();
+  gProf.mark(HubProfiler::SLOT_LOOP, "automation");
   automationTick();
+  gProf.mark(HubProfiler::SLOT_LOOP, "misc");
+  bulkTick();
+  timeSyncTick();
+  netBackupTick();
 
   // Periodic status heartbeat (retain)
   if (mqtt.connected() && timeDue(millis(), nextHubStatusMs)) {
@@ -2220,7 +6351,11 @@ void loop() {
   // expire pairing (do NOT block)
   if (!activePairingToken.isEmpty() && timeDue(millis(), activePairingUntilMs)) {
     Serial.println("[ZB] pairing expired");
+    bulkEnd("expired");
     activePairingToken = "";
     activePairingUntilMs = 0;
   }
+
+  gProf.sectionEnd(HubProfiler::SLOT_LOOP);
+  profilerTick();
 }
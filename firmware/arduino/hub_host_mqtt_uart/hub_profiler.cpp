@@ -0,0 +1,334 @@
+#include "hub_profiler.h"
+
+#include <esp_arduino_version.h>
+#include <esp_idf_version.h>
+#include <esp_timer.h>
+#include <esp_debug_helpers.h>
+#include <soc/soc.h>
+
+static_assert((HUBPROF_MAX_PCS & (HUBPROF_MAX_PCS - 1)) == 0, "HUBPROF_MAX_PCS must be a power of two");
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+#define HUBPROF_CUR_TASK(core) xTaskGetCurrentTaskHandleForCore(core)
+#define HUBPROF_IDLE_TASK(core) xTaskGetIdleTaskHandleForCore(core)
+#else
+#define HUBPROF_CUR_TASK(core) xTaskGetCurrentTaskHandleForCPU(core)
+#define HUBPROF_IDLE_TASK(core) xTaskGetIdleTaskHandleForCPU(core)
+#endif
+
+static const uint32_t TIMER_FREQ_HZ = 1000000;
+static const uint8_t PROBE_MAX = 8;
+
+HubProfiler* HubProfiler::_self = nullptr;
+
+// Everything reachable from the ISR lives in IRAM/DRAM: the timer interrupt is
+// IRAM-safe, so it also fires while the flash cache is off (OTA / NVS writes).
+
+static inline bool IRAM_ATTR inDram(const void* p) {
+  const uint32_t a = (uint32_t)p;
+  return a >= SOC_DRAM_LOW && a + 24 <= SOC_DRAM_HIGH && (a & 3) == 0;
+}
+
+// Xtensa port: pxTopOfStack is the first TCB member and points at the saved frame.
+//   XtExcFrame (interrupted / preempted): exit, pc, ps, a0, a1, ...
+//   XtSolFrame (voluntary yield):         exit = 0, pc, ps, next, a0, a1, ...
+// On ISR entry the port stores the interrupted task's frame there, so for the
+// current task of this core the frame is always an XtExcFrame.
+static inline const uint32_t* IRAM_ATTR savedFrame(TaskHandle_t t) {
+  return *(const uint32_t* const*)t;
+}
+
+// Windowed-ABI return address -> address inside the call instruction.
+static inline uint32_t IRAM_ATTR stackPc(uint32_t pc) {
+  if (pc & 0x80000000U) pc = (pc & 0x3fffffffU) | 0x40000000U;
+  return pc - 3;
+}
+
+HubProfiler::HubProfiler() {
+  memset((void*)this, 0, sizeof(*this));
+  _mux = portMUX_INITIALIZER_UNLOCKED;
+  _baseHz = 100;
+  _hz = 100;
+  _stallMs = 500;
+}
+
+bool HubProfiler::begin(uint32_t baseHz, uint32_t stallMs) {
+  if (_self) return false;
+  _self = this;
+  _baseHz = baseHz < 10 ? 10 : baseHz;
+  _hz = _baseHz;
+  setStallThreshold(stallMs);
+  _loopTask = xTaskGetCurrentTaskHandle();
+  for (int c = 0; c < portNUM_PROCESSORS && c < 2; c++) _idle[c] = HUBPROF_IDLE_TASK(c);
+  refreshTasks();
+
+  // A timer interrupt is serviced on the core that attached it: attach one per core.
+  for (int c = 0; c < portNUM_PROCESSORS && c < 2; c++) {
+    xTaskCreatePinnedToCore(coreInitTask, "prof_init", 3072, (void*)(intptr_t)c, configMAX_PRIORITIES - 1, nullptr, c);
+  }
+  return true;
+}
+
+void HubProfiler::coreInitTask(void* arg) {
+  _self->installTimer((int)(intptr_t)arg);
+  vTaskDelete(nullptr);
+}
+
+void HubProfiler::installTimer(int core) {
+  const uint64_t period = TIMER_FREQ_HZ / _hz;
+#if ESP_ARDUINO_VERSION_MAJOR >= 3
+  hw_timer_t* t = timerBegin(TIMER_FREQ_HZ);
+  if (!t) return;
+  timerAttachInterrupt(t, &HubProfiler::onTimerIsr);
+  timerAlarm(t, period, true, 0);
+#else
+  hw_timer_t* t = timerBegin((uint8_t)core, 80, true);  // 80 MHz APB / 80 = 1 MHz
+  if (!t) return;
+  timerAttachInterrupt(t, &HubProfiler::onTimerIsr, true);
+  timerAlarmWrite(t, period, true);
+  timerAlarmEnable(t);
+#endif
+  _timer[core] = t;
+}
+
+void HubProfiler::setTimerRate(uint32_t hz) {
+  _hz = hz;
+  const uint64_t period = TIMER_FREQ_HZ / hz;
+  for (int c = 0; c < 2; c++) {
+    if (!_timer[c]) continue;
+#if ESP_ARDUINO_VERSION_MAJOR >= 3
+    timerAlarm(_timer[c], period, true, 0);
+#else
+    timerAlarmWrite(_timer[c], period, true);
+#endif
+  }
+}
+
+void HubProfiler::refreshTasks() {
+  if (!_asyncTask) _asyncTask = xTaskGetHandle("async_tcp");
+}
+
+const char* HubProfiler::taskName(uint8_t t) {
+  switch (t) {
+    case TASK_LOOP: return "loop";
+    case TASK_ASYNC_TCP: return "async_tcp";
+    case TASK_IDLE: return "idle";
+    default: return "other";
+  }
+}
+
+void HubProfiler::start(uint32_t hz, uint32_t durationMs) {
+  if (hz < 10) hz = 10;
+  if (hz > 1000) hz = 1000;
+  portENTER_CRITICAL(&_mux);
+  memset(_pcs, 0, sizeof(_pcs));
+  memset(_counts, 0, sizeof(_counts));
+  memset(_tasks, 0, sizeof(_tasks));
+  memset(_perTask, 0, sizeof(_perTask));
+  _samples = 0;
+  _dropped = 0;
+  _startMs = millis();
+  _stopMs = 0;
+  _durationMs = durationMs;
+  _expiredPending = false;
+  _active = true;
+  portEXIT_CRITICAL(&_mux);
+  setTimerRate(hz);
+}
+
+void HubProfiler::stop() {
+  if (!_active) return;
+  _active = false;
+  _stopMs = millis();
+  setTimerRate(_baseHz);
+}
+
+bool HubProfiler::expired() {
+  if (_active && _durationMs && (millis() - _startMs) >= _durationMs) {
+    stop();
+    return true;
+  }
+  return false;
+}
+
+void HubProfiler::sectionBegin(Slot slot, const char* tag) {
+  Section& s = _sec[slot];
+  portENTER_CRITICAL(&_mux);
+  s.task = xTaskGetCurrentTaskHandle();
+  s.tag = tag;
+  s.captured = false;
+  s.depth = 0;
+  s.startMs = millis() | 1U;  // 0 means "not running"
+  portEXIT_CRITICAL(&_mux);
+}
+
+void HubProfiler::sectionEnd(Slot slot) {
+  Section& s = _sec[slot];
+  const uint32_t now = millis();
+  portENTER_CRITICAL(&_mux);
+  const uint32_t start = s.startMs;
+  s.startMs = 0;
+  if (start) {
+    const uint32_t ms = now - start;
+    if (ms > _maxSectionMs[slot]) _maxSectionMs[slot] = ms;
+    if (ms >= _stallMs) {
+      _stallCount++;
+      const uint8_t idx = (uint8_t)((_ringHead + _ringCount) % HUBPROF_STALL_RING);
+      Stall& st = _ring[idx];
+      st.slot = slot;
+      st.tag = s.tag;
+      st.ms = ms;
+      st.atMs = now;
+      st.depth = s.captured ? s.depth : 0;
+      memcpy(st.pcs, s.pcs, sizeof(st.pcs));
+      if (_ringCount < HUBPROF_STALL_RING) {
+        _ringCount++;
+      } else {
+        _ringHead = (uint8_t)((_ringHead + 1) % HUBPROF_STALL_RING);  // overwrite oldest
+      }
+    }
+  }
+  portEXIT_CRITICAL(&_mux);
+}
+
+bool HubProfiler::popStall(Stall& out) {
+  bool ok = false;
+  portENTER_CRITICAL(&_mux);
+  if (_ringCount) {
+    out = _ring[_ringHead];
+    _ringHead = (uint8_t)((_ringHead + 1) % HUBPROF_STALL_RING);
+    _ringCount--;
+    ok = true;
+  }
+  portEXIT_CRITICAL(&_mux);
+  return ok;
+}
+
+size_t HubProfiler::top(Sample* out, size_t max) {
+  Sample* all = (Sample*)malloc(sizeof(Sample) * HUBPROF_MAX_PCS);
+  if (!all) return 0;
+  size_t n = 0;
+  portENTER_CRITICAL(&_mux);
+  for (size_t i = 0; i < HUBPROF_MAX_PCS; i++) {
+    if (!_counts[i]) continue;
+    all[n].pc = _pcs[i];
+    all[n].count = _counts[i];
+    all[n].task = _tasks[i];
+    n++;
+  }
+  portEXIT_CRITICAL(&_mux);
+
+  // Partial selection sort: max is small (tens), n <= HUBPROF_MAX_PCS.
+  size_t outN = 0;
+  for (; outN < max && outN < n; outN++) {
+    size_t best = outN;
+    for (size_t j = outN + 1; j < n; j++) {
+      if (all[j].count > all[best].count) best = j;
+    }
+    const Sample tmp = all[outN];
+    all[outN] = all[best];
+    all[best] = tmp;
+    out[outN] = all[outN];
+  }
+  free(all);
+  return outN;
+}
+
+HubProfiler::Stats HubProfiler::stats() {
+  Stats st;
+  portENTER_CRITICAL(&_mux);
+  st.active = _active;
+  st.hz = _hz;
+  st.elapsedMs = (_active ? millis() : _stopMs) - _startMs;
+  st.samples = _samples;
+  st.dropped = _dropped;
+  memcpy(st.perTask, _perTask, sizeof(st.perTask));
+  memcpy(st.maxSectionMs, _maxSectionMs, sizeof(st.maxSectionMs));
+  st.stalls = _stallCount;
+  portEXIT_CRITICAL(&_mux);
+  return st;
+}
+
+// ----------------- ISR side -----------------
+
+void IRAM_ATTR HubProfiler::onTimerIsr() {
+  if (_self) _self->isr();
+}
+
+uint8_t IRAM_ATTR HubProfiler::classify(TaskHandle_t t, int core) const {
+  if (t == _loopTask) return TASK_LOOP;
+  if (t == _asyncTask) return TASK_ASYNC_TCP;
+  if (core < 2 && t == _idle[core]) return TASK_IDLE;
+  return TASK_OTHER;
+}
+
+void IRAM_ATTR HubProfiler::record(uint8_t task, uint32_t pc) {
+  _samples++;
+  _perTask[task]++;
+  uint32_t idx = ((pc >> 2) ^ ((uint32_t)task * 0x9E37U)) & (HUBPROF_MAX_PCS - 1);
+  for (uint8_t probe = 0; probe < PROBE_MAX; probe++) {
+    if (_counts[idx] == 0) {
+      _pcs[idx] = pc;
+      _tasks[idx] = task;
+      _counts[idx] = 1;
+      return;
+    }
+    if (_pcs[idx] == pc && _tasks[idx] == task) {
+      _counts[idx]++;
+      return;
+    }
+    idx = (idx + 1) & (HUBPROF_MAX_PCS - 1);
+  }
+  _dropped++;
+}
+
+// Walk the saved frame of a task that is not running on the other core.
+// The interrupt entry and voluntary context switches spill register windows,
+// so caller frames are on the stack.
+void IRAM_ATTR HubProfiler::captureBacktrace(Section& s) {
+  s.depth = 0;
+  const uint32_t* fr = savedFrame(s.task);
+  if (!inDram(fr)) return;
+  const bool solicited = fr[0] == 0;
+  const uint32_t pc = fr[1];
+  const uint32_t a0 = solicited ? fr[4] : fr[3];
+  const uint32_t a1 = solicited ? fr[5] : fr[4];
+  if (!inDram((const void*)a1)) return;
+
+  s.pcs[s.depth++] = solicited ? stackPc(pc) : pc;
+  esp_backtrace_frame_t f = {};
+  f.pc = pc;
+  f.sp = a1;
+  f.next_pc = a0;
+  while (s.depth < HUBPROF_STALL_DEPTH && f.next_pc) {
+    const bool more = esp_backtrace_get_next_frame(&f);
+    s.pcs[s.depth++] = stackPc(f.pc);
+    if (!more) break;
+  }
+}
+
+void IRAM_ATTR HubProfiler::isr() {
+  const int core = xPortGetCoreID();
+  const uint32_t now = (uint32_t)(esp_timer_get_time() / 1000);
+  TaskHandle_t cur = HUBPROF_CUR_TASK(core);
+#if portNUM_PROCESSORS > 1
+  TaskHandle_t other = HUBPROF_CUR_TASK(core ^ 1);
+#else
+  TaskHandle_t other = nullptr;
+#endif
+
+  portENTER_CRITICAL_ISR(&_mux);
+  if (_active && cur) {
+    const uint32_t* fr = savedFrame(cur);
+    if (inDram(fr) && fr[0] != 0) record(classify(cur, core), fr[1]);
+  }
+  for (uint8_t i = 0; i < SLOT_COUNT; i++) {
+    Section& s = _sec[i];
+    const uint32_t start = s.startMs;
+    if (!start || s.captured || !s.task || s.task == other) continue;
+    if ((now - start) < _stallMs) continue;
+    captureBacktrace(s);
+    s.captured = true;
+  }
+  portEXIT_CRITICAL_ISR(&_mux);
+}
@@ -0,0 +1,147 @@
+/*
+  On-device sampling profiler + stall detector (hub side, ESP32 / Xtensa).
+
+  Sampling: a hardware timer on each core interrupts at `hz`. The ISR reads the
+  program counter of the task it interrupted (FreeRTOS saves the interrupted
+  frame at pxTopOfStack on ISR entry) and counts (task, pc) in a fixed
+  histogram. Tasks are bucketed as loop (Arduino loopTask), async_tcp
+  (AsyncTCP / MQTT callbacks), idle, or other.
+
+  Stall detection: code brackets long-running work with sectionBegin/End
+  (loop() and the MQTT message callback). When a section runs past the
+  threshold, the ISR records a backtrace of the owning task once; the record
+  is handed out by popStall() when the section ends.
+
+  PCs are raw addresses: symbolize them against the firmware ELF with
+  backend/scripts/hub-profile.js.
+
+  The timer keeps running at the base rate when no profile is active so stall
+  detection always works; histogram updates only happen while active.
+*/
+#pragma once
+
+#include <Arduino.h>
+
+#ifndef HUBPROF_MAX_PCS
+#define HUBPROF_MAX_PCS 512          // distinct (task, pc) entries
+#endif
+#ifndef HUBPROF_STALL_DEPTH
+#define HUBPROF_STALL_DEPTH 16       // backtrace frames per stall
+#endif
+#ifndef HUBPROF_STALL_RING
+#define HUBPROF_STALL_RING 4
+#endif
+
+class HubProfiler {
+ public:
+  enum Task : uint8_t { TASK_LOOP = 0, TASK_ASYNC_TCP = 1, TASK_IDLE = 2, TASK_OTHER = 3, TASK_COUNT = 4 };
+  enum Slot : uint8_t { SLOT_LOOP = 0, SLOT_MQTT = 1, SLOT_COUNT = 2 };
+
+  struct Sample {
+    uint32_t pc;
+    uint32_t count;
+    uint8_t task;
+  };
+
+  struct Stall {
+    uint8_t slot;
+    const char* tag;   // last mark() inside the section (static string)
+    uint32_t ms;       // section duration
+    uint32_t atMs;     // millis() when the section ended
+    uint8_t depth;
+    uint32_t pcs[HUBPROF_STALL_DEPTH];
+  };
+
+  struct Stats {
+    bool active;
+    uint32_t hz;
+    uint32_t elapsedMs;
+    uint32_t samples;
+    uint32_t dropped;  // histogram full
+    uint32_t perTask[TASK_COUNT];
+    uint32_t maxSectionMs[SLOT_COUNT];
+    uint32_t stalls;
+  };
+
+  HubProfiler();
+
+  // Call from setup() (the loop task). Installs one timer per core.
+  bool begin(uint32_t baseHz = 100, uint32_t stallMs = 500);
+
+  // Start a profile (clears the histogram). durationMs = 0 runs until stop().
+  void start(uint32_t hz, uint32_t durationMs);
+  void stop();
+  bool active() const { return _active; }
+  // True once when a timed profile has just run out (report it, then it is reset by start()).
+  bool expired();
+
+  void setStallThreshold(uint32_t ms) { _stallMs = ms < 20 ? 20 : ms; }
+  uint32_t stallThreshold() const { return _stallMs; }
+
+  void sectionBegin(Slot slot, const char* tag);
+  void mark(Slot slot, const char* tag) { _sec[slot].tag = tag; }
+  void sectionEnd(Slot slot);
+
+  bool popStall(Stall& out);
+
+  // Copies the hottest entries (descending count). Returns number copied.
+  size_t top(Sample* out, size_t max);
+  Stats stats();
+
+  // Re-resolve task handles (AsyncTCP creates its task lazily). Call from loop().
+  void refreshTasks();
+
+  static const char* taskName(uint8_t t);
+
+ private:
+  struct Section {
+    volatile uint32_t startMs;  // 0 = not running
+    volatile bool captured;
+    TaskHandle_t task;
+    const char* tag;
+    uint8_t depth;
+    uint32_t pcs[HUBPROF_STALL_DEPTH];
+  };
+
+  static void onTimerIsr();
+  static void coreInitTask(void* arg);
+  void installTimer(int core);
+  void setTimerRate(uint32_t hz);
+
+  void isr();
+  uint8_t classify(TaskHandle_t t, int core) const;
+  void record(uint8_t task, uint32_t pc);
+  void captureBacktrace(Section& s);
+
+  static HubProfiler* _self;
+
+  portMUX_TYPE _mux;
+  hw_timer_t* _timer[2];
+  uint32_t _baseHz;
+  uint32_t _hz;
+  uint32_t _stallMs;
+
+  volatile bool _active;
+  uint32_t _startMs;
+  uint32_t _stopMs;
+  uint32_t _durationMs;
+  bool _expiredPending;
+
+  TaskHandle_t _loopTask;
+  TaskHandle_t _asyncTask;
+  TaskHandle_t _idle[2];
+
+  uint32_t _pcs[HUBPROF_MAX_PCS];
+  uint32_t _counts[HUBPROF_MAX_PCS];
+  uint8_t _tasks[HUBPROF_MAX_PCS];
+  uint32_t _samples;
+  uint32_t _dropped;
+  uint32_t _perTask[TASK_COUNT];
+
+  Section _sec[SLOT_COUNT];
+  uint32_t _maxSectionMs[SLOT_COUNT];
+  uint32_t _stallCount;
+  Stall _ring[HUBPROF_STALL_RING];
+  uint8_t _ringHead;
+  uint8_t _ringCount;
+};
@@ -0,0 +1,555 @@
+#include "lan_mqtt_broker.h"
+
+// MQTT 3.1.1 control packet types (upper nibble of the fixed header)
+static const uint8_t MQTT_CONNECT = 1;
+static const uint8_t MQTT_CONNACK = 2;
+static const uint8_t MQTT_PUBLISH = 3;
+static const uint8_t MQTT_PUBACK = 4;
+static const uint8_t MQTT_SUBSCRIBE = 8;
+static const uint8_t MQTT_SUBACK = 9;
+static const uint8_t MQTT_UNSUBSCRIBE = 10;
+static const uint8_t MQTT_UNSUBACK = 11;
+static const uint8_t MQTT_PINGREQ = 12;
+static const uint8_t MQTT_PINGRESP = 13;
+static const uint8_t MQTT_DISCONNECT = 14;
+
+static const uint8_t CONNACK_ACCEPTED = 0;
+static const uint8_t CONNACK_BAD_PROTOCOL = 1;
+static const uint8_t CONNACK_NOT_AUTHORIZED = 5;
+
+// Read a length-prefixed UTF-8 string. Returns false on truncation.
+static bool readStr(const uint8_t*& p, const uint8_t* end, const uint8_t** out, uint16_t* outLen) {
+  if (end - p < 2) return false;
+  uint16_t n = (uint16_t)((p[0] << 8) | p[1]);
+  p += 2;
+  if ((size_t)(end - p) < n) return false;
+  *out = p;
+  *outLen = n;
+  p += n;
+  return true;
+}
+
+static bool copyStr(char* dst, size_t cap, const uint8_t* src, uint16_t n) {
+  if (n >= cap) return false;
+  memcpy(dst, src, n);
+  dst[n] = 0;
+  return true;
+}
+
+static size_t encodeRemainingLength(uint8_t* out, size_t len) {
+  size_t i = 0;
+  do {
+    uint8_t b = len % 128;
+    len /= 128;
+    if (len > 0) b |= 0x80;
+    out[i++] = b;
+  } while (len > 0 && i < 4);
+  return i;
+}
+
+LanMqttBroker::LanMqttBroker() : _server(nullptr), _mutex(nullptr) {
+  memset(_sessions, 0, sizeof(_sessions));
+  memset(_retained, 0, sizeof(_retained));
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+void LanMqttBroker::lock() {
+  if (_mutex) xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+}
+
+void LanMqttBroker::unlock() {
+  if (_mutex) xSemaphoreGiveRecursive(_mutex);
+}
+
+bool LanMqttBroker::begin(uint16_t port, const char* user, const char* pass) {
+  if (_server) return true;
+  if (!_mutex) _mutex = xSemaphoreCreateRecursiveMutex();
+  _user = user ? user : "";
+  _pass = pass ? pass : "";
+  _server = new AsyncServer(port);
+  _server->onClient(&LanMqttBroker::onClientStatic, this);
+  _server->setNoDelay(true);
+  _server->begin();
+  return true;
+}
+
+void LanMqttBroker::end() {
+  if (!_server) return;
+  lock();
+  for (size_t i = 0; i < LANMQTT_MAX_CLIENTS; i++) {
+    if (_sessions[i].tcp) {
+      _sessions[i].graceful = true; // administrative stop: do not fire wills
+      _sessions[i].tcp->close(true);
+    }
+  }
+  unlock();
+  _server->end();
+  delete _server;
+  _server = nullptr;
+}
+
+void LanMqttBroker::onClientStatic(void* arg, AsyncClient* c) {
+  static_cast<LanMqttBroker*>(arg)->onClient(c);
+}
+
+void LanMqttBroker::onClient(AsyncClient* c) {
+  lock();
+  Session* s = nullptr;
+  for (size_t i = 0; i < LANMQTT_MAX_CLIENTS; i++) {
+    if (!_sessions[i].tcp) {
+      s = &_sessions[i];
+      break;
+    }
+  }
+  uint8_t* rx = s ? (uint8_t*)malloc(LANMQTT_MAX_PACKET) : nullptr;
+  if (!s || !rx) {
+    _stats.rejected++;
+    unlock();
+    free(rx);
+    c->close(true);
+    delete c;
+    return;
+  }
+  memset(s, 0, sizeof(*s));
+  s->owner = this;
+  s->tcp = c;
+  s->rx = rx;
+  s->lastRxMs = millis();
+  s->keepAliveSec = 30; // until CONNECT says otherwise
+  unlock();
+
+  c->setNoDelay(true);
+  c->onData(
+      [](void* arg, AsyncClient* cl, void* data, size_t len) {
+        (void)cl;
+        Session* ss = static_cast<Session*>(arg);
+        ss->owner->onData(ss, (const uint8_t*)data, len);
+      },
+      s);
+  c->onDisconnect(
+      [](void* arg, AsyncClient* cl) {
+        Session* ss = static_cast<Session*>(arg);
+        ss->owner->onDisconnect(ss);
+        delete cl;
+      },
+      s);
+  c->onTimeout([](void* arg, AsyncClient* cl, uint32_t t) { (void)arg; (void)t; cl->close(true); }, s);
+}
+
+void LanMqttBroker::freeSessionLocked(Session* s) {
+  free(s->rx);
+  free(s->willPayload);
+  memset(s, 0, sizeof(*s));
+}
+
+void LanMqttBroker::onDisconnect(Session* s) {
+  bool fireWill = false;
+  char topic[LANMQTT_MAX_TOPIC];
+  uint8_t* payload = nullptr;
+  size_t len = 0;
+  bool retain = false;
+
+  lock();
+  if (s->mqttConnected && _stats.clients > 0) _stats.clients--;
+  if (s->mqttConnected && !s->graceful && s->hasWill) {
+    fireWill = true;
+    strncpy(topic, s->willTopic, sizeof(topic));
+    payload = s->willPayload;
+    len = s->willLen;
+    retain = s->willRetain;
+    s->willPayload = nullptr; // ownership moves here
+  }
+  freeSessionLocked(s);
+  unlock();
+
+  if (fireWill) {
+    routeInbound(topic, payload, len, retain);
+    free(payload);
+  }
+}
+
+void LanMqttBroker::onData(Session* s, const uint8_t* data, size_t len) {
+  lock();
+  s->lastRxMs = millis();
+  bool ok = true;
+  while (len > 0 && ok) {
+    size_t take = LANMQTT_MAX_PACKET - s->rxLen;
+    if (take == 0) {
+      ok = false; // packet larger than we accept
+      break;
+    }
+    if (take > len) take = len;
+    memcpy(s->rx + s->rxLen, data, take);
+    s->rxLen += take;
+    data += take;
+    len -= take;
+
+    // Drain complete packets.
+    while (ok && s->rxLen >= 2) {
+      size_t remLen = 0, mult = 1, i = 1;
+      bool complete = false;
+      for (; i < s->rxLen && i <= 4; i++) {
+        remLen += (s->rx[i] & 0x7F) * mult;
+        mult *= 128;
+        if ((s->rx[i] & 0x80) == 0) {
+          complete = true;
+          break;
+        }
+      }
+      if (!complete) {
+        if (i > 4) ok = false; // malformed length
+        break;
+      }
+      const size_t hdrLen = i + 1;
+      if (hdrLen + remLen > LANMQTT_MAX_PACKET) {
+        ok = false;
+        break;
+      }
+      if (s->rxLen < hdrLen + remLen) break;
+      ok = handlePacket(s, s->rx[0], s->rx + hdrLen, remLen);
+      memmove(s->rx, s->rx + hdrLen + remLen, s->rxLen - hdrLen - remLen);
+      s->rxLen -= hdrLen + remLen;
+    }
+  }
+  AsyncClient* tcp = s->tcp;
+  unlock();
+  if (!ok && tcp) tcp->close(true);
+}
+
+bool LanMqttBroker::handlePacket(Session* s, uint8_t hdr, const uint8_t* body, size_t len) {
+  const uint8_t type = hdr >> 4;
+  if (!s->mqttConnected && type != MQTT_CONNECT) return false;
+
+  switch (type) {
+    case MQTT_CONNECT:
+      return handleConnect(s, body, len);
+    case MQTT_PUBLISH:
+      return handlePublish(s, hdr & 0x0F, body, len);
+    case MQTT_SUBSCRIBE:
+      return handleSubscribe(s, body, len);
+    case MQTT_UNSUBSCRIBE:
+      return handleUnsubscribe(s, body, len);
+    case MQTT_PINGREQ: {
+      const uint8_t resp[2] = {(uint8_t)(MQTT_PINGRESP << 4), 0};
+      sendRaw(s, resp, sizeof(resp));
+      return true;
+    }
+    case MQTT_DISCONNECT:
+      s->graceful = true;
+      return false; // close without will
+    case MQTT_PUBACK:
+      return true; // we only deliver QoS0; ignore stray acks
+    default:
+      return false;
+  }
+}
+
+bool LanMqttBroker::handleConnect(Session* s, const uint8_t* p, size_t len) {
+  if (s->mqttConnected) return false; // second CONNECT is a protocol violation
+  const uint8_t* end = p + len;
+  const uint8_t* name;
+  uint16_t nameLen;
+  uint8_t rc = CONNACK_ACCEPTED;
+
+  if (!readStr(p, end, &name, &nameLen) || end - p < 4) return false;
+  const uint8_t level = p[0];
+  const uint8_t flags = p[1];
+  s->keepAliveSec = (uint16_t)((p[2] << 8) | p[3]);
+  p += 4;
+  const bool v311 = nameLen == 4 && memcmp(name, "MQTT", 4) == 0 && level == 4;
+  const bool v31 = nameLen == 6 && memcmp(name, "MQIsdp", 6) == 0 && level == 3;
+  if (!v311 && !v31) rc = CONNACK_BAD_PROTOCOL;
+
+  const uint8_t* f;
+  uint16_t fl;
+  if (!readStr(p, end, &f, &fl)) return false;
+  if (!copyStr(s->clientId, sizeof(s->clientId), f, fl)) return false;
+
+  if (flags & 0x04) {
+    if (!readStr(p, end, &f, &fl) || !copyStr(s->willTopic, sizeof(s->willTopic), f, fl)) return false;
+    if (!readStr(p, end, &f, &fl)) return false;
+    s->willPayload = (uint8_t*)malloc(fl ? fl : 1);
+    if (!s->willPayload) return false;
+    memcpy(s->willPayload, f, fl);
+    s->willLen = fl;
+    s->willRetain = (flags & 0x20) != 0;
+    s->hasWill = true;
+  }
+
+  char user[64] = {0}, pass[64] = {0};
+  if (flags & 0x80) {
+    if (!readStr(p, end, &f, &fl)) return false;
+    if (!copyStr(user, sizeof(user), f, fl)) rc = CONNACK_NOT_AUTHORIZED;
+  }
+  if (flags & 0x40) {
+    if (!readStr(p, end, &f, &fl)) return false;
+    if (!copyStr(pass, sizeof(pass), f, fl)) rc = CONNACK_NOT_AUTHORIZED;
+  }
+  if (rc == CONNACK_ACCEPTED && _user.length() && (_user != user || _pass != pass)) rc = CONNACK_NOT_AUTHORIZED;
+
+  const uint8_t ack[4] = {(uint8_t)(MQTT_CONNACK << 4), 2, 0, rc};
+  sendRaw(s, ack, sizeof(ack));
+  if (rc != CONNACK_ACCEPTED) {
+    _stats.rejected++;
+    s->graceful = true;
+    return false;
+  }
+
+  // Same clientId reconnecting: drop the stale session (no will, it is the same device).
+  for (size_t i = 0; i < LANMQTT_MAX_CLIENTS; i++) {
+    Session* o = &_sessions[i];
+    if (o != s && o->tcp && o->mqttConnected && strcmp(o->clientId, s->clientId) == 0) {
+      o->graceful = true;
+      o->tcp->close(true);
+    }
+  }
+
+  s->mqttConnected = true;
+  _stats.clients++;
+  _stats.connects++;
+  return true;
+}
+
+bool LanMqttBroker::handlePublish(Session* s, uint8_t flags, const uint8_t* p, size_t len) {
+  const uint8_t qos = (flags >> 1) & 0x03;
+  const bool retain = (flags & 0x01) != 0;
+  if (qos > 1) return false; // QoS2 not supported
+
+  const uint8_t* end = p + len;
+  const uint8_t* t;
+  uint16_t tl;
+  char topic[LANMQTT_MAX_TOPIC];
+  if (!readStr(p, end, &t, &tl) || !copyStr(topic, sizeof(topic), t, tl)) return false;
+  if (strchr(topic, '+') || strchr(topic, '#')) return false;
+
+  if (qos == 1) {
+    if (end - p < 2) return false;
+    const uint8_t ack[4] = {(uint8_t)(MQTT_PUBACK << 4), 2, p[0], p[1]};
+    p += 2;
+    sendRaw(s, ack, sizeof(ack));
+  }
+  _stats.msgsIn++;
+  routeInbound(topic, p, (size_t)(end - p), retain);
+  return true;
+}
+
+bool LanMqttBroker::handleSubscribe(Session* s, const uint8_t* p, size_t len) {
+  const uint8_t* end = p + len;
+  if (end - p < 2) return false;
+  const uint8_t pidHi = p[0], pidLo = p[1];
+  p += 2;
+
+  uint8_t resp[4 + 8 + 16];
+  size_t n = 0;
+  char added[8][LANMQTT_MAX_TOPIC];
+  size_t addedCount = 0;
+
+  while (p < end && n < 16) {
+    const uint8_t* f;
+    uint16_t fl;
+    if (!readStr(p, end, &f, &fl) || p >= end) return false;
+    p++; // requested QoS; we always grant 0
+    char filter[LANMQTT_MAX_TOPIC];
+    uint8_t code = 0x80;
+    if (copyStr(filter, sizeof(filter), f, fl)) {
+      bool exists = false;
+      for (uint8_t i = 0; i < s->subCount; i++) exists |= strcmp(s->subs[i], filter) == 0;
+      if (exists) {
+        code = 0;
+      } else if (s->subCount < LANMQTT_MAX_SUBS) {
+        strcpy(s->subs[s->subCount++], filter);
+        code = 0;
+        if (addedCount < 8) strcpy(added[addedCount++], filter);
+      }
+    }
+    resp[4 + n++] = code;
+  }
+
+  resp[0] = (uint8_t)((MQTT_SUBACK << 4));
+  resp[1] = (uint8_t)(2 + n);
+  resp[2] = pidHi;
+  resp[3] = pidLo;
+  // SUBACK remaining length < 128 here, so fixed header is 2 bytes.
+  sendRaw(s, resp, 4 + n);
+
+  // Retained messages for the new filters.
+  for (size_t a = 0; a < addedCount; a++) {
+    for (size_t r = 0; r < LANMQTT_MAX_RETAINED; r++) {
+      if (_retained[r].used && topicMatches(added[a], _retained[r].topic)) {
+        sendPublish(s, _retained[r].topic, _retained[r].payload, _retained[r].len, true);
+      }
+    }
+  }
+  if (_onSubscribe) {
+    for (size_t a = 0; a < addedCount; a++) _onSubscribe(added[a]);
+  }
+  return true;
+}
+
+bool LanMqttBroker::handleUnsubscribe(Session* s, const uint8_t* p, size_t len) {
+  const uint8_t* end = p + len;
+  if (end - p < 2) return false;
+  const uint8_t ack[4] = {(uint8_t)(MQTT_UNSUBACK << 4), 2, p[0], p[1]};
+  p += 2;
+  while (p < end) {
+    const uint8_t* f;
+    uint16_t fl;
+    if (!readStr(p, end, &f, &fl)) return false;
+    for (uint8_t i = 0; i < s->subCount; i++) {
+      if (strlen(s->subs[i]) == fl && memcmp(s->subs[i], f, fl) == 0) {
+        memmove(s->subs[i], s->subs[s->subCount - 1], LANMQTT_MAX_TOPIC);
+        s->subCount--;
+        break;
+      }
+    }
+  }
+  sendRaw(s, ack, sizeof(ack));
+  return true;
+}
+
+void LanMqttBroker::routeInbound(const char* topic, const uint8_t* payload, size_t len, bool retain) {
+  lock();
+  if (retain) storeRetainedLocked(topic, payload, len);
+  deliverLocked(topic, payload, len, false, nullptr);
+  unlock();
+  if (_onPublish) _onPublish(topic, payload, len, retain);
+}
+
+void LanMqttBroker::storeRetainedLocked(const char* topic, const uint8_t* payload, size_t len) {
+  Retained* slot = nullptr;
+  Retained* freeSlot = nullptr;
+  for (size_t i = 0; i < LANMQTT_MAX_RETAINED; i++) {
+    if (_retained[i].used && strcmp(_retained[i].topic, topic) == 0) slot = &_retained[i];
+    if (!_retained[i].used && !freeSlot) freeSlot = &_retained[i];
+  }
+  if (len == 0) { // empty retained payload clears
+    if (slot) {
+      free(slot->payload);
+      memset(slot, 0, sizeof(*slot));
+    }
+    return;
+  }
+  if (!slot) slot = freeSlot;
+  if (!slot) return; // store full: message is still delivered, just not retained
+  uint8_t* copy = (uint8_t*)malloc(len);
+  if (!copy) return;
+  memcpy(copy, payload, len);
+  free(slot->payload);
+  slot->used = true;
+  strncpy(slot->topic, topic, sizeof(slot->topic) - 1);
+  slot->payload = copy;
+  slot->len = len;
+}
+
+size_t LanMqttBroker::deliverLocked(const char* topic, const uint8_t* payload, size_t len, bool retainFlag,
+                                    Session* only) {
+  size_t sent = 0;
+  for (size_t i = 0; i < LANMQTT_MAX_CLIENTS; i++) {
+    Session* s = &_sessions[i];
+    if (!s->tcp || !s->mqttConnected) continue;
+    if (only && s != only) continue;
+    for (uint8_t k = 0; k < s->subCount; k++) {
+      if (topicMatches(s->subs[k], topic)) {
+        if (sendPublish(s, topic, payload, len, retainFlag)) sent++;
+        break; // one copy per session even with overlapping filters
+      }
+    }
+  }
+  return sent;
+}
+
+size_t LanMqttBroker::publish(const char* topic, const uint8_t* payload, size_t len, bool retain) {
+  if (!_server) return 0;
+  lock();
+  if (retain) storeRetainedLocked(topic, payload, len);
+  size_t n = deliverLocked(topic, payload, len, false, nullptr);
+  unlock();
+  return n;
+}
+
+bool LanMqttBroker::sendPublish(Session* s, const char* topic, const uint8_t* payload, size_t len, bool retainFlag) {
+  const size_t tl = strlen(topic);
+  const size_t rem = 2 + tl + len;
+  uint8_t hdr[1 + 4 + 2];
+  hdr[0] = (uint8_t)((MQTT_PUBLISH << 4) | (retainFlag ? 1 : 0));
+  size_t h = 1 + encodeRemainingLength(hdr + 1, rem);
+  hdr[h++] = (uint8_t)(tl >> 8);
+  hdr[h++] = (uint8_t)(tl & 0xFF);
+
+  if (s->tcp->space() < h + tl + len) {
+    _stats.dropsOut++;
+    return false;
+  }
+  s->tcp->add((const char*)hdr, h);
+  s->tcp->add(topic, tl);
+  if (len) s->tcp->add((const char*)payload, len);
+  s->tcp->send();
+  _stats.msgsOut++;
+  return true;
+}
+
+bool LanMqttBroker::sendRaw(Session* s, const uint8_t* data, size_t len) {
+  if (!s->tcp || s->tcp->space() < len) return false;
+  s->tcp->add((const char*)data, len);
+  s->tcp->send();
+  return true;
+}
+
+bool LanMqttBroker::hasSubscriber(const char* topic) {
+  if (!_server) return false;
+  bool found = false;
+  lock();
+  for (size_t i = 0; i < LANMQTT_MAX_CLIENTS && !found; i++) {
+    const Session* s = &_sessions[i];
+    if (!s->tcp || !s->mqttConnected) continue;
+    for (uint8_t k = 0; k < s->subCount && !found; k++) found = topicMatches(s->subs[k], topic);
+  }
+  unlock();
+  return found;
+}
+
+void LanMqttBroker::forEachSubscription(std::function<void(const char*)> fn) {
+  lock();
+  for (size_t i = 0; i < LANMQTT_MAX_CLIENTS; i++) {
+    const Session* s = &_sessions[i];
+    if (!s->tcp || !s->mqttConnected) continue;
+    for (uint8_t k = 0; k < s->subCount; k++) fn(s->subs[k]);
+  }
+  unlock();
+}
+
+void LanMqttBroker::loop() {
+  if (!_server) return;
+  const uint32_t now = millis();
+  lock();
+  for (size_t i = 0; i < LANMQTT_MAX_CLIENTS; i++) {
+    Session* s = &_sessions[i];
+    if (!s->tcp) continue;
+    // Spec: close after 1.5x keepalive without any packet. Before CONNECT use 10s.
+    const uint32_t limitMs = s->mqttConnected ? (s->keepAliveSec ? s->keepAliveSec * 1500UL : 0) : 10000UL;
+    if (limitMs && (now - s->lastRxMs) > limitMs) s->tcp->close(true);
+  }
+  unlock();
+}
+
+LanMqttBroker::Stats LanMqttBroker::stats() {
+  lock();
+  Stats st = _stats;
+  unlock();
+  return st;
+}
+
+bool LanMqttBroker::topicMatches(const char* filter, const char* topic) {
+  while (*filter) {
+    if (*filter == '#') return true;
+    if (*filter == '+') {
+      while (*topic && *topic != '/') topic++;
+      filter++;
+      continue;
+    }
+    if (*filter != *topic) return false;
+    filter++;
+    topic++;
+  }
+  return *topic == 0;
+}
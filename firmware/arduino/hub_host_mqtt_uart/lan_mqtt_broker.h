@@ -0,0 +1,133 @@
+/*
+  Minimal MQTT 3.1.1 broker for LAN Wi-Fi devices (hub side).
+
+  Scope (what esp32_smarthome_mqtt and similar devices need, nothing more):
+    - CONNECT with optional username/password, clean session only
+    - PUBLISH QoS0/QoS1 in (PUBACK), delivery to local subscribers at QoS0
+    - SUBSCRIBE / UNSUBSCRIBE with '+' and '#' wildcards
+    - retained messages (small fixed store), Last Will on unclean disconnect
+    - PINGREQ, keepalive enforcement (1.5x)
+  Not supported: QoS2 (connection is closed), persistent sessions.
+
+  Runs on AsyncTCP. Callbacks fire on the async_tcp task; publish() may be
+  called from any task (state is guarded by a recursive mutex).
+*/
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <functional>
+
+#ifndef LANMQTT_MAX_CLIENTS
+#define LANMQTT_MAX_CLIENTS 8
+#endif
+#ifndef LANMQTT_MAX_SUBS
+#define LANMQTT_MAX_SUBS 4            // per client
+#endif
+#ifndef LANMQTT_MAX_TOPIC
+#define LANMQTT_MAX_TOPIC 112
+#endif
+#ifndef LANMQTT_MAX_PACKET
+#define LANMQTT_MAX_PACKET 2048
+#endif
+#ifndef LANMQTT_MAX_RETAINED
+#define LANMQTT_MAX_RETAINED 24
+#endif
+
+class LanMqttBroker {
+ public:
+  // (topic, payload, len, retain) for every message a local client publishes (incl. wills).
+  typedef std::function<void(const char*, const uint8_t*, size_t, bool)> PublishCb;
+  // (topic filter) whenever a local client subscribes.
+  typedef std::function<void(const char*)> SubscribeCb;
+
+  struct Stats {
+    uint32_t clients;
+    uint32_t connects;
+    uint32_t rejected;
+    uint32_t msgsIn;
+    uint32_t msgsOut;
+    uint32_t dropsOut;   // delivery skipped: TCP send buffer full
+  };
+
+  LanMqttBroker();
+
+  bool begin(uint16_t port, const char* user, const char* pass);
+  void end();
+  bool running() const { return _server != nullptr; }
+
+  void onPublish(PublishCb cb) { _onPublish = cb; }
+  void onSubscribe(SubscribeCb cb) { _onSubscribe = cb; }
+
+  // Deliver a message to local subscribers (e.g. /set coming down from the cloud
+  // or from a local automation). Returns number of sessions it was sent to.
+  size_t publish(const char* topic, const uint8_t* payload, size_t len, bool retain);
+
+  bool hasSubscriber(const char* topic);
+  void forEachSubscription(std::function<void(const char*)> fn);
+
+  // Keepalive enforcement; call from loop().
+  void loop();
+
+  Stats stats();
+
+  static bool topicMatches(const char* filter, const char* topic);
+
+ private:
+  struct Session {
+    LanMqttBroker* owner;
+    AsyncClient* tcp;
+    bool mqttConnected;
+    bool graceful;
+    char clientId[48];
+    uint16_t keepAliveSec;
+    uint32_t lastRxMs;
+    uint8_t* rx;
+    size_t rxLen;
+    char subs[LANMQTT_MAX_SUBS][LANMQTT_MAX_TOPIC];
+    uint8_t subCount;
+    bool hasWill;
+    bool willRetain;
+    char willTopic[LANMQTT_MAX_TOPIC];
+    uint8_t* willPayload;
+    size_t willLen;
+  };
+
+  struct Retained {
+    bool used;
+    char topic[LANMQTT_MAX_TOPIC];
+    uint8_t* payload;
+    size_t len;
+  };
+
+  static void onClientStatic(void* arg, AsyncClient* c);
+  void onClient(AsyncClient* c);
+  void onData(Session* s, const uint8_t* data, size_t len);
+  void onDisconnect(Session* s);
+
+  bool handlePacket(Session* s, uint8_t hdr, const uint8_t* body, size_t len);
+  bool handleConnect(Session* s, const uint8_t* p, size_t len);
+  bool handlePublish(Session* s, uint8_t flags, const uint8_t* p, size_t len);
+  bool handleSubscribe(Session* s, const uint8_t* p, size_t len);
+  bool handleUnsubscribe(Session* s, const uint8_t* p, size_t len);
+
+  void routeInbound(const char* topic, const uint8_t* payload, size_t len, bool retain);
+  size_t deliverLocked(const char* topic, const uint8_t* payload, size_t len, bool retainFlag, Session* only);
+  bool sendPublish(Session* s, const char* topic, const uint8_t* payload, size_t len, bool retainFlag);
+  bool sendRaw(Session* s, const uint8_t* data, size_t len);
+  void storeRetainedLocked(const char* topic, const uint8_t* payload, size_t len);
+  void freeSessionLocked(Session* s);
+
+  void lock();
+  void unlock();
+
+  AsyncServer* _server;
+  SemaphoreHandle_t _mutex;
+  Session _sessions[LANMQTT_MAX_CLIENTS];
+  Retained _retained[LANMQTT_MAX_RETAINED];
+  String _user;
+  String _pass;
+  PublishCb _onPublish;
+  SubscribeCb _onSubscribe;
+  Stats _stats;
+};
@@ -0,0 +1,190 @@
+/*
+  Zigbee coordinator device index (short address -> slot, IEEE -> slot).
+
+  Two fixed-size open-addressing tables (linear probing, load <= 0.5) that map
+  into the caller's device array. Keys are stored in the buckets, so a lookup
+  never touches the device entries. Deletion uses backward shift, so there are
+  no tombstones and probe chains stay short however often devices rejoin.
+
+  The caller owns slot allocation; this file only keeps the two indexes in sync:
+    - zb_devidx_bind() attaches (ieee, short) to a slot and handles a device
+      rejoining with a new short address, or a short address being reused by
+      another device (the old owner loses its short mapping).
+    - zb_devidx_unbind() drops both keys of a slot.
+
+  Not thread-safe: use from the Zigbee task only (same as the device table).
+  Kept identical in the Arduino and the ESP-IDF coordinator folders.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef ZB_DEVIDX_CAPACITY
+#define ZB_DEVIDX_CAPACITY 256
+#endif
+#define ZB_DEVIDX_BUCKETS (ZB_DEVIDX_CAPACITY * 2)  // power of two
+#define ZB_DEVIDX_MASK (ZB_DEVIDX_BUCKETS - 1)
+#define ZB_DEVIDX_NONE 0xFFFFu
+#define ZB_DEVIDX_NO_SHORT 0xFFFFu  // unknown / released short address
+
+#if (ZB_DEVIDX_BUCKETS & ZB_DEVIDX_MASK) != 0
+#error "ZB_DEVIDX_CAPACITY must be a power of two"
+#endif
+
+typedef struct {
+  uint16_t short_key[ZB_DEVIDX_BUCKETS];
+  uint16_t short_slot[ZB_DEVIDX_BUCKETS];
+  uint64_t ieee_key[ZB_DEVIDX_BUCKETS];
+  uint16_t ieee_slot[ZB_DEVIDX_BUCKETS];
+  // Per slot: keys currently bound (needed to unbind / detect rejoin).
+  uint64_t slot_ieee[ZB_DEVIDX_CAPACITY];
+  uint16_t slot_short[ZB_DEVIDX_CAPACITY];
+  uint16_t count;
+} zb_devidx_t;
+
+static inline uint32_t zb_devidx_hash16(uint16_t k) {
+  uint32_t h = (uint32_t)k * 2654435761u;
+  return (h ^ (h >> 15)) & ZB_DEVIDX_MASK;
+}
+
+static inline uint32_t zb_devidx_hash64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  return (uint32_t)k & ZB_DEVIDX_MASK;
+}
+
+static inline void zb_devidx_init(zb_devidx_t *x) {
+  for (uint32_t i = 0; i < ZB_DEVIDX_BUCKETS; i++) {
+    x->short_slot[i] = ZB_DEVIDX_NONE;
+    x->ieee_slot[i] = ZB_DEVIDX_NONE;
+  }
+  for (uint32_t i = 0; i < ZB_DEVIDX_CAPACITY; i++) {
+    x->slot_ieee[i] = 0;
+    x->slot_short[i] = ZB_DEVIDX_NO_SHORT;
+  }
+  x->count = 0;
+}
+
+// Big-endian hex string (16 chars, any case) -> u64. Returns false on bad input.
+static inline bool zb_devidx_ieee_from_str(const char *s, uint64_t *out) {
+  uint64_t v = 0;
+  for (int i = 0; i < 16; i++) {
+    char c = s[i];
+    uint8_t d;
+    if (c >= '0' && c <= '9') d = (uint8_t)(c - '0');
+    else if (c >= 'a' && c <= 'f') d = (uint8_t)(c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F') d = (uint8_t)(c - 'A' + 10);
+    else return false;
+    v = (v << 4) | d;
+  }
+  *out = v;
+  return true;
+}
+
+// Stack little-endian bytes -> u64 (same value as the printed big-endian string).
+static inline uint64_t zb_devidx_ieee_from_le(const uint8_t le[8]) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) v = (v << 8) | le[i];
+  return v;
+}
+
+static inline uint16_t zb_devidx_find_short(const zb_devidx_t *x, uint16_t short_addr) {
+  for (uint32_t i = zb_devidx_hash16(short_addr);; i = (i + 1) & ZB_DEVIDX_MASK) {
+    if (x->short_slot[i] == ZB_DEVIDX_NONE) return ZB_DEVIDX_NONE;
+    if (x->short_key[i] == short_addr) return x->short_slot[i];
+  }
+}
+
+static inline uint16_t zb_devidx_find_ieee(const zb_devidx_t *x, uint64_t ieee) {
+  for (uint32_t i = zb_devidx_hash64(ieee);; i = (i + 1) & ZB_DEVIDX_MASK) {
+    if (x->ieee_slot[i] == ZB_DEVIDX_NONE) return ZB_DEVIDX_NONE;
+    if (x->ieee_key[i] == ieee) return x->ieee_slot[i];
+  }
+}
+
+// True if bucket j may move into hole i: its home h is not cyclically in (i, j].
+static inline bool zb_devidx_can_shift(uint32_t h, uint32_t i, uint32_t j) {
+  return (i <= j) ? (h <= i || h > j) : (h <= i && h > j);
+}
+
+static inline void zb_devidx_del_short(zb_devidx_t *x, uint16_t short_addr) {
+  uint32_t i = zb_devidx_hash16(short_addr);
+  while (x->short_slot[i] != ZB_DEVIDX_NONE && x->short_key[i] != short_addr) i = (i + 1) & ZB_DEVIDX_MASK;
+  if (x->short_slot[i] == ZB_DEVIDX_NONE) return;
+  for (uint32_t j = (i + 1) & ZB_DEVIDX_MASK; x->short_slot[j] != ZB_DEVIDX_NONE; j = (j + 1) & ZB_DEVIDX_MASK) {
+    if (zb_devidx_can_shift(zb_devidx_hash16(x->short_key[j]), i, j)) {
+      x->short_key[i] = x->short_key[j];
+      x->short_slot[i] = x->short_slot[j];
+      i = j;
+    }
+  }
+  x->short_slot[i] = ZB_DEVIDX_NONE;
+}
+
+static inline void zb_devidx_del_ieee(zb_devidx_t *x, uint64_t ieee) {
+  uint32_t i = zb_devidx_hash64(ieee);
+  while (x->ieee_slot[i] != ZB_DEVIDX_NONE && x->ieee_key[i] != ieee) i = (i + 1) & ZB_DEVIDX_MASK;
+  if (x->ieee_slot[i] == ZB_DEVIDX_NONE) return;
+  for (uint32_t j = (i + 1) & ZB_DEVIDX_MASK; x->ieee_slot[j] != ZB_DEVIDX_NONE; j = (j + 1) & ZB_DEVIDX_MASK) {
+    if (zb_devidx_can_shift(zb_devidx_hash64(x->ieee_key[j]), i, j)) {
+      x->ieee_key[i] = x->ieee_key[j];
+      x->ieee_slot[i] = x->ieee_slot[j];
+      i = j;
+    }
+  }
+  x->ieee_slot[i] = ZB_DEVIDX_NONE;
+}
+
+// Insert or overwrite key -> slot (callers delete stale mappings first).
+static inline void zb_devidx_put_short(zb_devidx_t *x, uint16_t short_addr, uint16_t slot) {
+  uint32_t i = zb_devidx_hash16(short_addr);
+  while (x->short_slot[i] != ZB_DEVIDX_NONE && x->short_key[i] != short_addr) i = (i + 1) & ZB_DEVIDX_MASK;
+  x->short_key[i] = short_addr;
+  x->short_slot[i] = slot;
+}
+
+static inline void zb_devidx_put_ieee(zb_devidx_t *x, uint64_t ieee, uint16_t slot) {
+  uint32_t i = zb_devidx_hash64(ieee);
+  while (x->ieee_slot[i] != ZB_DEVIDX_NONE && x->ieee_key[i] != ieee) i = (i + 1) & ZB_DEVIDX_MASK;
+  x->ieee_key[i] = ieee;
+  x->ieee_slot[i] = slot;
+}
+
+// Bind an empty slot to ieee, or update the short address of the slot already
+// holding ieee. *evicted_slot is set to the slot that lost short_addr (address
+// reused by another device after a leave/rejoin), or ZB_DEVIDX_NONE.
+static inline void zb_devidx_bind(zb_devidx_t *x, uint16_t slot, uint64_t ieee, uint16_t short_addr,
+                                  uint16_t *evicted_slot) {
+  *evicted_slot = ZB_DEVIDX_NONE;
+  if (zb_devidx_find_ieee(x, ieee) != slot) {
+    zb_devidx_put_ieee(x, ieee, slot);
+    x->slot_ieee[slot] = ieee;
+    x->count++;
+  }
+  const uint16_t oldShort = x->slot_short[slot];
+  if (oldShort == short_addr) return;
+  if (oldShort != ZB_DEVIDX_NO_SHORT) zb_devidx_del_short(x, oldShort);
+  x->slot_short[slot] = short_addr;
+  if (short_addr == ZB_DEVIDX_NO_SHORT) return;
+  const uint16_t owner = zb_devidx_find_short(x, short_addr);
+  if (owner != ZB_DEVIDX_NONE && owner != slot) {
+    x->slot_short[owner] = ZB_DEVIDX_NO_SHORT;
+    *evicted_slot = owner;
+  }
+  zb_devidx_put_short(x, short_addr, slot);
+}
+
+static inline void zb_devidx_unbind(zb_devidx_t *x, uint16_t slot) {
+  if (zb_devidx_find_ieee(x, x->slot_ieee[slot]) == slot) {
+    zb_devidx_del_ieee(x, x->slot_ieee[slot]);
+    if (x->count) x->count--;
+  }
+  if (x->slot_short[slot] != ZB_DEVIDX_NO_SHORT && zb_devidx_find_short(x, x->slot_short[slot]) == slot) {
+    zb_devidx_del_short(x, x->slot_short[slot]);
+  }
+  x->slot_short[slot] = ZB_DEVIDX_NO_SHORT;
+  x->slot_ieee[slot] = 0;
+}
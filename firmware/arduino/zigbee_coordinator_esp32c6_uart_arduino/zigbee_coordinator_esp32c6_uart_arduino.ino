@@ -5,13 +5,62 @@
   - Works with Arduino‑ESP32 (ESP32‑C6) Zigbee stack API (ESP‑Zigbee)
   - UART protocol (newline‑delimited JSON) matches Hub Host firmware in this repo
   - Device announce -> Hub: {"evt":"device_annce","ieee":"00124b0001abcd12","short":"0x1234"}
-  - Attribute report -> Hub: {"evt":"attr_report","ieee":"...","cluster":"onoff","attr":"onoff","value":1}
+  - Attribute report -> Hub, one line per device per ATTR_BATCH_WINDOW_MS (all attributes of a frame):
+      {"evt":"attr_report","ieee":"...","u":1,"attrs":[{"cluster":"temperature","attr":"value","value":23.45},
+                                                        {"cluster":"humidity","attr":"value","value":41.2}]}
+      ("u":1 = typed and unit-scaled, see ZCL attribute decoding; without it the hub assumes raw x100: "onoff" true/false, "humidity" %RH,
+       "power"/"battery" %; unknown attributes as "cluster":"0x0b04","attr":"0x050b","type":41)
   - Join state -> Hub: {"evt":"join_state","enabled":true,"duration":60}
+  - Boot info -> Hub: {"evt":"fw_info","fwVersion":"...","buildTime":"...","channel":15,"maxDevices":256,"devices":42,"interview":true}
+  - Device interview -> Hub (one record per joined device, replaces basic_fingerprint during pairing):
+      {"evt":"device_interview","ieee":"...","short":"0x1234","ok":true,"ms":840,
+       "manufacturer":"...","model":"...","swBuildId":"...",
+       "endpoints":[{"ep":1,"profile":260,"device":770,"in":[0,3,1026],"out":[25]}]}
+  - Install code result -> Hub: {"evt":"install_code","dev":"<ieee>","ok":true}
+  - Liveness heartbeat -> Hub (every HEARTBEAT_INTERVAL_MS):
+      {"evt":"hb","seq":12,"up":24000,"q":0,"qMax":32,"zb":"formed","zbAgeMs":3,"heap":201234,"minHeap":190000,
+       "txDrop":0,"txOvf":0,  (UART lines dropped: TX buffer full / line over TX_LINE_MAX)
+       "qHw":5,"poolMin":27,"plMin":6,"poolFail":0,"bp":false,  (command pool high-water marks)
+       "zbWakes":1830,"dispUsMax":410,"dispUsAvg":95,  (zb_task wakeups since boot; UART->dispatch latency
+                                                        since the previous hb)
+       "attrs":120,"attrLines":64,  (attributes forwarded / attr_report lines, since boot)
+       "lkRetx":0,"lkCrc":0}  (SmartLock fragments resent / dropped on CRC, since boot)
+  - Command pool backpressure -> Hub (edge-triggered; hub holds device commands while on):
+      {"evt":"cmd_backpressure","on":true,"free":4,"payloadFree":3}
   - Hub -> Coordinator commands:
       {"cmd":"permit_join","duration":60,"cmdId":"..."}
       {"cmd":"zcl_onoff","ieee":"...","value":1,"endpoint":1,"cmdId":"..."}
       {"cmd":"zcl_level","ieee":"...","value":128,"endpoint":1,"cmdId":"..."}
+        (zcl_onoff / zcl_level / identify accept "retries":0..5 and "timeoutMs"; they answer
+         {"evt":"cmd_sent","cmdId"} when transmitted, then
+         {"evt":"cmd_result","cmdId","ok","confirm":"zcl"|"aps","ms":84,"attempts":1,"tracked":true}
+         once the device answered, or ok=false "timeout" after the last retry)
+      {"cmd":"report_cfg","ieee":"...","endpoint":1,"cluster":1026,
+       "attrs":[{"attr":0,"type":41,"min":60,"max":1800,"change":25}],"cmdId":"..."}
+        (ZCL Configure Reporting; "type" may be left out for attributes in RPT_PROFILES)
+      {"cmd":"report_read","ieee":"...","endpoint":1,"cluster":1026,"attrs":[0],"cmdId":"..."}
+      {"cmd":"report_profile","ieee":"...","cmdId":"..."}  -> bind + configure from RPT_PROFILES again
+        report_cfg / report_read answer cmd_sent + tracked cmd_result like zcl_onoff, and every
+        request (also the ones sent after an interview) ends in
+        {"evt":"report_cfg","ieee","ep","cluster","op":"configure"|"read","source":"profile"|"hub","ok",
+         "attrs":[{"attr":0,"status":0,"type":41,"min":60,"max":1800,"change":25}]}
+      {"cmd":"resync","rate":4,"sleepyWaitSec":600}  (or "stop":true) -> paced read of all device state,
+        progress as {"evt":"resync","state":"started"|"progress"|"done"|"stopped",...} (see State resync)
+      {"cmd":"topology","gapMs":300,"weakLqi":60,"cmdId":"..."}  (or "stop":true) -> paced Mgmt_Lqi crawl,
+        one {"evt":"topology_node",...} per router, then {"evt":"topology","state":"done",...} (see Topology crawl)
+      {"cmd":"bind"|"unbind","ieee":"<src>","endpoint":1,"cluster":6,"dst":"<ieee>","dstEp":1,"cmdId":"..."}
+        -> ZDO Bind/Unbind_req, desired set kept in NVS (group destinations: unbind only)
+      {"cmd":"bind_table","ieee":"...","cmdId":"..."} -> {"evt":"bind_table",...} (Mgmt_Bind_req)
+      {"cmd":"bind_list","cmdId":"..."} -> {"evt":"bindings","items":[...]}  (see Direct bindings)
+      {"cmd":"net_backup"} -> {"evt":"net_backup","state":"begin",...}, parts, {"evt":"net_backup","state":"done",...}
+      {"cmd":"net_restore","seq":0,"state":"begin",...} ... "commit" -> reboot into the saved network
+        (answered from loop(), each line acked by {"evt":"net_restore","seq","ok"}; see Network backup)
       {"cmd":"remove_device","ieee":"...","cmdId":"..."}
+      {"cmd":"install_code","ieee":"...","code":"83FED3407A939723A5C639B26916D505C3B5"}  (code incl. CRC)
+      {"cmd":"time_sync","epoch":1760000000,"ms":250}  -> served as Zigbee Time cluster (answered from loop())
+      {"cmd":"ping"}     -> immediate {"evt":"hb",...} (answered from loop(), not zb_task)
+      {"cmd":"reboot"}   -> soft restart requested by hub supervision
+      {"cmd":"devtable_bench","devices":200,"reports":20000} -> {"evt":"devtable_bench","hashNsPerReport",...}
 
   Arduino IDE dependencies:
     - ArduinoJson (v6)
@@ -24,7 +73,8 @@
 
   Notes:
     - Zigbee APIs must be called from the Zigbee task context.
-      => UART commands are queued into g_cmdQueue and executed inside zb_task.
+      => UART commands are queued into g_cmdQueue and executed inside zb_task
+         (drained by a scheduler alarm that loop() arms under the Zigbee lock).
     - IEEE string is normalized to 16 hex chars (no 0x, no separators, lowercase).
 */
 
@@ -35,10 +85,38 @@
 // Forward declare custom structs used in function signatures so those
 // auto-generated prototypes compile cleanly.
 struct device_entry_t;
+struct dev_ep_t;
+struct devstore_reader_t;
+struct cmd_pending_t;
 struct uart_cmd_t;
+struct attr_batch_t;
+struct lock_frag_tx_t;
+struct lock_frag_rx_t;
+struct iv_ep_t;
+struct interview_t;
+struct rpt_rec_t;
+struct rpt_req_t;
+struct rpt_pending_t;
+struct resync_attrs_t;
+struct resync_state_t;
+struct topo_nb_t;
+struct topo_state_t;
+struct bind_rec_t;
+struct bind_entry_t;
+struct bind_op_t;
+struct bind_read_t;
+struct net_params_t;
+struct net_backup_t;
+struct net_restore_t;
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include <Preferences.h>
+#include <freertos/message_buffer.h>
+#include "mbedtls/base64.h"
+#include "esp_partition.h"
+
+#include "zb_device_index.h"
 
 // Zigbee (ESP‑Zigbee) headers from Arduino‑ESP32
 #include "esp_zigbee_core.h"
@@ -65,6 +143,14 @@ struct uart_cmd_t;
 #endif
 #include "ha/esp_zigbee_ha_standard.h"
 
+// Install-code API (esp_zb_secur_ic_add) is only exposed by some Arduino Zigbee builds.
+#if __has_include("esp_zigbee_secur.h")
+#include "esp_zigbee_secur.h"
+#define ZB_HAS_SECUR_IC 1
+#else
+#define ZB_HAS_SECUR_IC 0
+#endif
+
 // Some Arduino Zigbee builds don't expose these IDs.
 #ifndef ESP_ZB_ZCL_CLUSTER_ID_OCCUPANCY_SENSING
 #define ESP_ZB_ZCL_CLUSTER_ID_OCCUPANCY_SENSING 0x0406
@@ -72,6 +158,15 @@ struct uart_cmd_t;
 #ifndef ESP_ZB_ZCL_ATTR_OCCUPANCY_SENSING_OCCUPANCY_ID
 #define ESP_ZB_ZCL_ATTR_OCCUPANCY_SENSING_OCCUPANCY_ID 0x0000
 #endif
+#ifndef ESP_ZB_ZCL_CLUSTER_ID_TIME
+#define ESP_ZB_ZCL_CLUSTER_ID_TIME 0x000A
+#endif
+#ifndef ESP_ZB_ZCL_ATTR_TIME_TIME_ID
+#define ESP_ZB_ZCL_ATTR_TIME_TIME_ID 0x0000
+#endif
+#ifndef ESP_ZB_ZCL_ATTR_TIME_TIME_STATUS_ID
+#define ESP_ZB_ZCL_ATTR_TIME_TIME_STATUS_ID 0x0001
+#endif
 
 // ------------------------ CONFIG ------------------------
 
@@ -87,10 +182,26 @@ static const int UART_RX_PIN = UART_RX_GPIO;
 #endif
 static const int UART_TX_PIN = UART_TX_GPIO;
 
+// UART TX: every line goes through one TX task. Senders (zb_task callbacks,
+// loop()) only copy the line into a per-priority message buffer and never wait
+// for the UART; when a buffer is full the line is dropped and counted (hb.txDrop).
+static const size_t TX_LINE_MAX = 2048;       // largest line (device_interview)
+static const size_t TX_BUF_CMD = 2048;        // cmd_result, hb, fw_info
+static const size_t TX_BUF_EVENT = 6144;      // annce, interview, zb_event/state, ...
+static const size_t TX_BUF_REPORT = 4096;     // attr_report
+static const size_t TX_BATCH_MAX = TX_LINE_MAX + 256; // bytes per UART write
+
 // Sprint 7: coordinator firmware version report
 static const char* COORD_FIRMWARE_VERSION = "ZB_COORD_C6-1.0.0";
 static const char* COORD_BUILD_TIME = __DATE__ " " __TIME__;
 
+// Zigbee channel. When one hub drives several coordinators, flash each one with
+// a different channel (e.g. 15 / 20 / 25) so their networks do not share airtime.
+// 0 = let the stack pick from all channels.
+#ifndef ZB_CHANNEL
+#define ZB_CHANNEL 0
+#endif
+
 // Zigbee endpoint config
 static const uint8_t COORD_ENDPOINT = 1;
 static const uint8_t DEFAULT_DST_ENDPOINT = 1;
@@ -102,11 +213,120 @@ static const uint8_t LOCK_CMD_ACTION_REQ = 0x00;
 static const uint8_t LOCK_CMD_CMD_RESULT = 0x01;
 static const uint8_t LOCK_CMD_EVENT = 0x02;
 static const uint8_t LOCK_CMD_STATE = 0x03;
-static const size_t LOCK_MAX_JSON = 240; // must fit ZCL char string (1-byte length)
+// Fragmented messages (see SmartLock fragmentation; must match enddevice_lock_c6)
+static const uint8_t LOCK_CMD_FRAG = 0x10;
+static const uint8_t LOCK_CMD_FRAG_ACK = 0x11;
+static const uint8_t LOCK_FRAG_HDR = 8;        // cmd, seq, index, count, total(2), crc16(2)
+static const uint8_t LOCK_SINGLE_MAX = 250;    // longest message sent as one unfragmented ZCL string
+static const uint8_t LOCK_FRAG_DATA = 64;      // header + ZCL overhead stay within one APS frame
+static const uint8_t LOCK_FRAG_MAX_COUNT = 16; // ack bitmap width
+static const size_t LOCK_FRAG_MAX_MSG = (size_t)LOCK_FRAG_DATA * LOCK_FRAG_MAX_COUNT;
+static const uint8_t LOCK_FRAG_WINDOW = 4;     // fragments in flight before an ack is expected
+static const uint8_t LOCK_FRAG_TX_SLOTS = 4;
+static const uint8_t LOCK_FRAG_RX_SLOTS = 4;
+static const uint8_t LOCK_FRAG_RETRIES = 4;    // unanswered windows before giving up
+static const uint32_t LOCK_FRAG_ACK_TIMEOUT_MS = 1500;  // rx-on peers; sleepy: CMD_TIMEOUT_SLEEPY_MS
+static const uint32_t LOCK_FRAG_GAP_MS = 500;           // receiver: no progress -> ack showing the holes
+static const uint32_t LOCK_FRAG_RX_TIMEOUT_MS = 20000;  // partial message dropped / done one forgotten
+static const size_t LOCK_JSON_DOC = 3072;               // parse / forward a full-size lock message
+// First byte of a MessagePack lock payload (see SmartLock wire format); JSON ones start with '{'
+static const uint8_t LOCK_WIRE_V1 = 0x01;
+
+// Device table (hashed by short address and IEEE, see zb_device_index.h)
+static const uint16_t MAX_DEVICES = ZB_DEVIDX_CAPACITY;
+static const uint8_t DEV_MAX_EPS = 4;
+
+// Device table persistence (NVS namespace "zbdevs", one blob per 16 slots).
+// Changes are batched: a chunk is written once the table has been quiet for
+// DEVSTORE_SETTLE_MS (or DEVSTORE_MAX_DELAY_MS after the first change during a
+// join storm), and only if its bytes differ from what is already stored.
+static const uint8_t DEVSTORE_SLOTS_PER_CHUNK = 16;
+static const uint32_t DEVSTORE_SETTLE_MS = 5000;
+static const uint32_t DEVSTORE_MAX_DELAY_MS = 30000;
 
 // Queue sizing
-static const uint8_t MAX_DEVICES = 32;
-static const uint8_t CMD_QUEUE_LEN = 16;
+// Commands are pool objects passed to zb_task by pointer; only lock JSON and
+// install codes take one of the (fewer) payload blocks, so a burst of lock
+// actions cannot starve small on/off commands of queue slots.
+static const uint8_t CMD_POOL_SIZE = 32;        // also the queue depth (hb.qMax)
+static const uint8_t CMD_PAYLOAD_SLOTS = 8;
+static const size_t CMD_PAYLOAD_MAX = 256;
+// Backpressure to the hub: on at <= CMD_POOL_LOW free objects (or no payload
+// block left), off again once CMD_POOL_LOW * 2 objects and 2 blocks are free.
+static const uint8_t CMD_POOL_LOW = 4;
+
+// Command completion: ON/OFF, level and identify complete on the device's ZCL
+// Default Response (or its APS ack); no answer within the timeout -> retry with
+// exponential backoff, then cmd_result ok=false "timeout".
+static const uint8_t CMD_PENDING_MAX = 16;
+static const uint8_t CMD_RETRIES_DEFAULT = 2;          // extra attempts; per command: "retries"
+static const uint8_t CMD_RETRIES_MAX = 5;
+static const uint32_t CMD_TIMEOUT_MS = 2000;           // rx-on-when-idle devices
+static const uint32_t CMD_TIMEOUT_SLEEPY_MS = 9000;    // parent holds indirect frames ~7.7s
+static const uint32_t CMD_BACKOFF_BASE_MS = 250;       // 250, 500, 1000, ... + jitter
+
+// Attribute reporting (Configure Reporting / Read Reporting Configuration)
+static const uint8_t RPT_MAX_ATTRS = 4;      // records per request (one cluster)
+static const uint8_t RPT_PENDING_MAX = 12;   // requests waiting for the device's answer
+static const uint32_t RPT_TIMEOUT_MS = 5000; // sleepy devices: CMD_TIMEOUT_SLEEPY_MS
+
+// attr_report batching: attributes of one device within the window share a line.
+static const uint32_t ATTR_BATCH_WINDOW_MS = 50; // covers one frame (one callback per attribute)
+static const uint8_t ATTR_BATCH_SLOTS = 6;       // devices with an open batch
+static const size_t ATTR_BATCH_DOC = 1024;
+static const size_t ATTR_BATCH_ROOM = 320;       // flush before adding when less is free
+
+// State resync after a hub / coordinator restart (paced Read Attributes)
+static const uint16_t RESYNC_RATE_DEFAULT = 4;          // frames per second (token bucket, burst = rate)
+static const uint8_t RESYNC_MAX_INFLIGHT = 4;
+static const uint32_t RESYNC_READ_TIMEOUT_MS = 3000;
+static const uint32_t RESYNC_PROGRESS_MS = 2000;
+static const uint16_t RESYNC_SLEEPY_WAIT_S_DEFAULT = 600; // wait for sleepy devices to poll
+
+// Topology crawl (ZDO Mgmt_Lqi, one request in flight)
+static const uint8_t TOPO_MAX_ROUTERS = 64;
+static const uint8_t TOPO_MAX_NB = 24;          // neighbor rows reported per router (hub parses lines in 3 KB)
+static const uint8_t TOPO_WEAK_MAX = 16;        // weakest links listed in the summary
+static const uint16_t TOPO_GAP_MS_DEFAULT = 300;
+static const uint8_t TOPO_WEAK_LQI_DEFAULT = 60;
+static const uint32_t TOPO_REQ_TIMEOUT_MS = 4000;
+static const uint8_t TOPO_RETRIES = 1;
+static const size_t TOPO_NODE_DOC = 3072;       // topology_node line with TOPO_MAX_NB rows
+
+// Direct device-to-device bindings (desired set persisted in NVS)
+static const uint8_t BIND_MAX = 32;
+static const uint8_t BIND_OPS_MAX = 4;          // Bind/Unbind_req waiting for an answer
+static const uint8_t BIND_READ_MAX = 24;        // Mgmt_Bind rows reported per device
+static const uint32_t BIND_TIMEOUT_MS = 5000;   // sleepy sources: + CMD_TIMEOUT_SLEEPY_MS
+static const uint32_t BIND_RETRY_MS = 30000;    // pending binding: min gap between attempts
+static const size_t BIND_DOC = 3072;
+
+// Network backup / restore (coordinator replacement, see Network backup)
+static const size_t NET_PART_BYTES = 192;           // NVS bytes per UART line (256 chars base64)
+static const uint32_t NET_RESTORE_IDLE_MS = 30000;  // restore abandoned when the hub goes quiet
+
+// Liveness heartbeat to hub (hub supervision detects silence / stuck queue)
+static const uint32_t HEARTBEAT_INTERVAL_MS = 2000;
+
+// zb_task scheduling (see Zigbee init/task): the stack loop sleeps until it has
+// work; our own deadlines run from one self-rearming alarm.
+static const uint32_t ZB_TICK_BUSY_MS = 20;   // a tracked command / interview / resync is pending
+static const uint32_t ZB_TICK_IDLE_MS = 1000; // nothing pending: clock + liveness only
+static const uint32_t ZB_LOCK_WAIT_MS = 20;   // loop() gives up waking zb_task after this (tick drains)
+
+// 1 = only devices whose install code was loaded ({"cmd":"install_code"}) may join.
+#ifndef ZB_INSTALL_CODE_POLICY
+#define ZB_INSTALL_CODE_POLICY 0
+#endif
+
+// Device interview (Active_EP -> Simple_Desc per endpoint -> Basic read).
+// Several joins are interviewed in parallel; the rest wait in a small FIFO.
+static const uint8_t IV_MAX_ACTIVE = 4;
+static const uint8_t IV_PENDING_MAX = 16;
+static const uint8_t IV_MAX_EPS = 4;
+static const uint8_t IV_MAX_CLUSTERS = 16; // per endpoint, in + out
+static const uint32_t IV_STEP_TIMEOUT_MS = 4000;
+static const uint8_t IV_STEP_RETRIES = 2;
 
 // ------------------------ COMPAT FALLBACKS ------------------------
 
@@ -164,6 +384,9 @@ static const uint8_t CMD_QUEUE_LEN = 16;
 #define ESP_ZB_ZCL_ATTR_IDENTIFY_TIME_ID 0x0000
 #endif
 
+#ifndef ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING
+#define ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING 0x41
+#endif
 #ifndef ESP_ZB_ZCL_ATTR_TYPE_CHAR_STRING
 #define ESP_ZB_ZCL_ATTR_TYPE_CHAR_STRING 0x42
 #endif
@@ -171,25 +394,202 @@ static const uint8_t CMD_QUEUE_LEN = 16;
 #define ESP_ZB_ZCL_ATTR_TYPE_LONG_CHAR_STRING 0x43
 #endif
 
-// ------------------------ UART JSON helpers ------------------------
+// ------------------------ Liveness state ------------------------
+
+// Zigbee stack state as seen from esp_zb_app_signal_handler (reported in heartbeat).
+typedef enum {
+  ZB_STACK_INIT = 0,
+  ZB_STACK_FORMING = 1,
+  ZB_STACK_FORMED = 2,
+  ZB_STACK_FAILED = 3,
+} zb_stack_state_t;
+
+static volatile zb_stack_state_t g_zbStackState = ZB_STACK_INIT;
+// Stamped by every zb_task wakeup (at least every ZB_TICK_IDLE_MS); a stale
+// value means zb_task is wedged.
+static volatile uint32_t g_zbLastIterMs = 0;
+// Scheduling metrics (hb): wakeups since boot; UART -> dispatch latency since the last hb.
+static volatile uint32_t g_zbWakes = 0;
+static uint32_t g_dispUsMax = 0;
+static uint32_t g_dispUsSum = 0;
+static uint32_t g_dispCount = 0;
+static portMUX_TYPE g_dispMux = portMUX_INITIALIZER_UNLOCKED;
+// attr_report batching (hb): attributes forwarded, lines they went out in.
+static volatile uint32_t g_attrCount = 0;
+static volatile uint32_t g_attrLines = 0;
+// SmartLock fragmentation (hb): fragments resent, fragments dropped on CRC.
+static uint32_t g_lockFragResent = 0;
+static uint32_t g_lockFragCrcErr = 0;
+
+// Hub-distributed wall clock (time_sync). Written by loop(), read by zb_task.
+static portMUX_TYPE g_timeMux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t g_timeEpochSec = 0; // 0 = never synced
+static uint32_t g_timeEpochAtMs = 0; // millis() at the start of g_timeEpochSec
+static uint32_t g_hbSeq = 0;
+static uint32_t g_nextHeartbeatMs = 0;
+
+static const char *zb_stack_state_str(zb_stack_state_t st) {
+  switch (st) {
+    case ZB_STACK_FORMING: return "forming";
+    case ZB_STACK_FORMED: return "formed";
+    case ZB_STACK_FAILED: return "failed";
+    default: return "init";
+  }
+}
+
+// ------------------------ UART TX task ------------------------
+
+enum tx_prio_t : uint8_t { TX_PRIO_CMD = 0, TX_PRIO_EVENT = 1, TX_PRIO_REPORT = 2, TX_PRIO_COUNT = 3 };
+
+static uint8_t g_txStoreCmd[TX_BUF_CMD];
+static uint8_t g_txStoreEvent[TX_BUF_EVENT];
+static uint8_t g_txStoreReport[TX_BUF_REPORT];
+static StaticMessageBuffer_t g_txMbStruct[TX_PRIO_COUNT];
+static MessageBufferHandle_t g_txMb[TX_PRIO_COUNT] = {};
+static SemaphoreHandle_t g_txWriteLock = nullptr; // message buffers allow one writer at a time
+static TaskHandle_t g_txTask = nullptr;
+static volatile bool g_txBusy = false;
+static uint8_t g_txBatch[TX_BATCH_MAX];
+
+static volatile uint32_t g_txDropped[TX_PRIO_COUNT] = {};
+static volatile uint32_t g_txOverflow = 0; // line longer than TX_LINE_MAX
+
+static uint32_t tx_dropped_total() {
+  return g_txDropped[TX_PRIO_CMD] + g_txDropped[TX_PRIO_EVENT] + g_txDropped[TX_PRIO_REPORT];
+}
+
+// Drains the buffers highest priority first, packing as many whole lines as
+// fit into one batch per U.write().
+static void uart_tx_task(void *) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    g_txBusy = true;
+    for (;;) {
+      size_t n = 0;
+      bool more = true;
+      while (more) {
+        more = false;
+        for (uint8_t c = 0; c < TX_PRIO_COUNT; c++) {
+          if (xMessageBufferIsEmpty(g_txMb[c]) == pdTRUE) continue;
+          const size_t got = xMessageBufferReceive(g_txMb[c], g_txBatch + n, sizeof(g_txBatch) - n, 0);
+          if (got == 0) break; // next line does not fit: write what we have first
+          n += got;
+          more = true;
+          break;
+        }
+      }
+      if (n == 0) break;
+      U.write(g_txBatch, n);
+    }
+    g_txBusy = false;
+  }
+}
+
+static void uart_tx_begin() {
+  g_txMb[TX_PRIO_CMD] = xMessageBufferCreateStatic(sizeof(g_txStoreCmd), g_txStoreCmd, &g_txMbStruct[TX_PRIO_CMD]);
+  g_txMb[TX_PRIO_EVENT] = xMessageBufferCreateStatic(sizeof(g_txStoreEvent), g_txStoreEvent, &g_txMbStruct[TX_PRIO_EVENT]);
+  g_txMb[TX_PRIO_REPORT] =
+      xMessageBufferCreateStatic(sizeof(g_txStoreReport), g_txStoreReport, &g_txMbStruct[TX_PRIO_REPORT]);
+  g_txWriteLock = xSemaphoreCreateMutex();
+  xTaskCreate(uart_tx_task, "uart_tx", 3072, nullptr, 4, &g_txTask);
+}
+
+// Non-blocking: copies one complete line (incl. '\n') or drops it.
+static bool uart_tx_enqueue(uint8_t prio, const char *line, size_t len) {
+  if (!g_txTask) {
+    U.write((const uint8_t *)line, len);
+    return true;
+  }
+  // The lock is only held for a memcpy; a short wait covers loop() vs zb_task.
+  if (xSemaphoreTake(g_txWriteLock, pdMS_TO_TICKS(2)) != pdTRUE) {
+    g_txDropped[prio]++;
+    return false;
+  }
+  const size_t sent = xMessageBufferSend(g_txMb[prio], line, len, 0);
+  xSemaphoreGive(g_txWriteLock);
+  if (sent != len) {
+    g_txDropped[prio]++;
+    return false;
+  }
+  xTaskNotifyGive(g_txTask);
+  return true;
+}
 
-static void uart_write_line(const String &line) {
-  U.print(line);
-  U.print('\n');
+// Waits until everything queued so far is on the wire (reboot path).
+static void uart_tx_flush(uint32_t timeoutMs) {
+  const uint32_t start = millis();
+  while (g_txTask && (uint32_t)(millis() - start) < timeoutMs) {
+    bool empty = !g_txBusy;
+    for (uint8_t c = 0; c < TX_PRIO_COUNT; c++) empty = empty && xMessageBufferIsEmpty(g_txMb[c]) == pdTRUE;
+    if (empty) break;
+    delay(2);
+  }
+  U.flush();
 }
 
-static void uart_send_json(const JsonDocument &doc) {
-  String out;
-  serializeJson(doc, out);
-  uart_write_line(out);
+// ------------------------ UART JSON helpers ------------------------
+
+static bool uart_send_json(const JsonDocument &doc, uint8_t prio = TX_PRIO_EVENT) {
+  const size_t len = measureJson(doc);
+  if (len + 1 > TX_LINE_MAX) {
+    g_txOverflow++;
+    return false;
+  }
+  char small[256];
+  char *buf = (len + 1 <= sizeof(small)) ? small : (char *)malloc(len + 1);
+  if (!buf) {
+    g_txDropped[prio]++;
+    return false;
+  }
+  serializeJson(doc, buf, len + 1);
+  buf[len] = '\n';
+  const bool ok = uart_tx_enqueue(prio, buf, len + 1);
+  if (buf != small) free(buf);
+  return ok;
 }
 
+static uint16_t device_count();
+static void cmd_pool_hb_fields(JsonDocument &doc);
+
 static void uart_send_fw_info() {
   StaticJsonDocument<200> doc;
   doc["evt"] = "fw_info";
   doc["fwVersion"] = COORD_FIRMWARE_VERSION;
   doc["buildTime"] = COORD_BUILD_TIME;
-  uart_send_json(doc);
+  doc["channel"] = ZB_CHANNEL;
+  doc["maxDevices"] = MAX_DEVICES;
+  doc["devices"] = device_count();
+  doc["interview"] = true;
+  uart_send_json(doc, TX_PRIO_CMD);
+}
+
+// Heartbeat is sent from loop() so it keeps flowing even if zb_task hangs;
+// the hub detects that case through zbAgeMs and a non-draining queue.
+static void uart_send_heartbeat(uint32_t queueDepth) {
+  StaticJsonDocument<256> doc;
+  doc["evt"] = "hb";
+  doc["seq"] = ++g_hbSeq;
+  doc["up"] = millis();
+  doc["q"] = queueDepth;
+  doc["qMax"] = CMD_POOL_SIZE;
+  cmd_pool_hb_fields(doc);
+  doc["zb"] = zb_stack_state_str(g_zbStackState);
+  doc["zbAgeMs"] = g_zbLastIterMs ? (uint32_t)(millis() - g_zbLastIterMs) : 0;
+  doc["zbWakes"] = g_zbWakes;
+  portENTER_CRITICAL(&g_dispMux);
+  doc["dispUsMax"] = g_dispUsMax;
+  doc["dispUsAvg"] = g_dispCount ? g_dispUsSum / g_dispCount : 0;
+  g_dispUsMax = g_dispUsSum = g_dispCount = 0;
+  portEXIT_CRITICAL(&g_dispMux);
+  doc["attrs"] = g_attrCount;
+  doc["attrLines"] = g_attrLines;
+  doc["lkRetx"] = g_lockFragResent;
+  doc["lkCrc"] = g_lockFragCrcErr;
+  doc["heap"] = ESP.getFreeHeap();
+  doc["minHeap"] = ESP.getMinFreeHeap();
+  doc["txDrop"] = tx_dropped_total();
+  doc["txOvf"] = g_txOverflow;
+  uart_send_json(doc, TX_PRIO_CMD);
 }
 
 static void uart_send_cmd_result(const char *cmdId, const char *ieeeStr, bool ok, const char *err = nullptr) {
@@ -199,21 +599,23 @@ static void uart_send_cmd_result(const char *cmdId, const char *ieeeStr, bool ok
   if (ieeeStr && ieeeStr[0] != '\0') doc["ieee"] = ieeeStr;
   doc["ok"] = ok;
   if (!ok && err) doc["error"] = err;
-  uart_send_json(doc);
+  uart_send_json(doc, TX_PRIO_CMD);
 }
 
 // Sprint 10: pass-through Zigbee events/state from lock end-device to hub_host
-static void uart_send_zb_event(const char *ieeeStr, const char *type, JsonVariantConst data) {
-  StaticJsonDocument<384> doc;
+// ts: epoch ms stamped by the device from the Time cluster (0 = device not synced).
+static void uart_send_zb_event(const char *ieeeStr, const char *type, JsonVariantConst data, uint64_t ts) {
+  DynamicJsonDocument doc(LOCK_JSON_DOC); // lock events can carry a full history
   doc["evt"] = "zb_event";
   if (ieeeStr && ieeeStr[0] != '\0') doc["ieee"] = ieeeStr;
   doc["type"] = type;
   if (!data.isNull()) doc["data"] = data;
+  if (ts) doc["ts"] = (unsigned long long)ts;
   uart_send_json(doc);
 }
 
 static void uart_send_zb_state(const char *ieeeStr, JsonVariantConst state) {
-  StaticJsonDocument<640> doc;
+  DynamicJsonDocument doc(LOCK_JSON_DOC); // lock state can carry a full credential list
   doc["evt"] = "zb_state";
   if (ieeeStr && ieeeStr[0] != '\0') doc["ieee"] = ieeeStr;
   if (!state.isNull()) doc["state"] = state;
@@ -248,16 +650,6 @@ static void uart_send_device_annce(const char *ieeeStr, uint16_t shortAddr) {
   uart_send_json(doc);
 }
 
-static void uart_send_attr_report(const char *ieeeStr, const char *cluster, const char *attr, int32_t value) {
-  StaticJsonDocument<256> doc;
-  doc["evt"] = "attr_report";
-  doc["ieee"] = ieeeStr;
-  doc["cluster"] = cluster;
-  doc["attr"] = attr;
-  doc["value"] = value;
-  uart_send_json(doc);
-}
-
 static void uart_send_basic_fingerprint(const char *ieeeStr, uint16_t shortAddr,
                                         const char *manufacturer,
                                         const char *model,
@@ -274,6 +666,16 @@ static void uart_send_basic_fingerprint(const char *ieeeStr, uint16_t shortAddr,
   uart_send_json(doc);
 }
 
+// Key is "dev", not "ieee": the hub treats any frame with "ieee" as proof the device is on this network.
+static void uart_send_install_code_result(const char *ieeeStr, bool ok, const char *err) {
+  StaticJsonDocument<160> doc;
+  doc["evt"] = "install_code";
+  doc["dev"] = ieeeStr;
+  doc["ok"] = ok;
+  if (!ok && err) doc["error"] = err;
+  uart_send_json(doc);
+}
+
 // ------------------------ IEEE helpers ------------------------
 
 static bool normalize_ieee_str(const char *in, char out16[17]) {
@@ -321,6 +723,27 @@ static bool ieee_str16_to_le_bytes(const char *ieeeIn, uint8_t out_le[8]) {
 
 // ------------------------ Device table ------------------------
 
+// Endpoint summary kept per device (from the interview). Server clusters are a
+// bitmask over DEV_CLUSTER_IDS so the record stays small enough to persist.
+struct dev_ep_t {
+  uint8_t ep;
+  uint16_t profile;
+  uint16_t device;
+  uint32_t inMask;
+};
+
+static const uint16_t DEV_CLUSTER_IDS[] = {
+    0x0000, 0x0001, 0x0003, 0x0006, 0x0008, 0x000A, 0x0101, 0x0102, 0x0201, 0x0300,
+    0x0400, 0x0402, 0x0403, 0x0405, 0x0406, 0x0500, 0x0702, 0x0B04, 0xFF00,
+};
+
+static uint32_t dev_cluster_bit(uint16_t cluster) {
+  for (uint8_t i = 0; i < sizeof(DEV_CLUSTER_IDS) / sizeof(DEV_CLUSTER_IDS[0]); i++) {
+    if (DEV_CLUSTER_IDS[i] == cluster) return 1UL << i;
+  }
+  return 0;
+}
+
 struct device_entry_t {
   bool used;
   uint16_t short_addr;
@@ -329,69 +752,123 @@ struct device_entry_t {
   char manufacturer[33];
   char model[33];
   char swBuildId[33];
+  uint8_t epCount;
+  dev_ep_t eps[DEV_MAX_EPS];
+  bool sleepy; // rx-off-when-idle end device (from device_annce capability; not persisted)
+  bool lockBin; // SmartLock sent a LOCK_WIRE_V1 message: send it binary too (not persisted)
 };
 
+// Entries live in a flat array; g_devIndex maps short address and IEEE to the
+// array slot in O(1), so attribute reports from 200+ nodes don't scan the table.
+// IEEE is the identity: a rejoin with a new short address updates the same
+// slot, and a short address handed to another device is dropped from the old
+// owner (short_addr = ZB_DEVIDX_NO_SHORT until it announces again).
 static device_entry_t g_devices[MAX_DEVICES];
+static zb_devidx_t g_devIndex;
+static uint16_t g_devFreeHint = 0;
+
+// Chunks changed since the last NVS write (see devstore_tick()).
+static uint16_t g_devDirty = 0;
+static uint32_t g_devFirstDirtyMs = 0;
+static uint32_t g_devLastDirtyMs = 0;
+// Network restore (loop) owns the NVS namespace: hold writes, then rewrite
+// everything from RAM if the restore is abandoned (see Network backup).
+static volatile bool g_devStoreHold = false;
+static volatile bool g_devStoreRewrite = false;
+
+static void devstore_mark(uint16_t slot) {
+  if (!g_devDirty) g_devFirstDirtyMs = millis();
+  g_devDirty |= (uint16_t)(1U << (slot / DEVSTORE_SLOTS_PER_CHUNK));
+  g_devLastDirtyMs = millis();
+}
 
 static device_entry_t *find_device_by_short(uint16_t short_addr) {
-  for (uint8_t i = 0; i < MAX_DEVICES; i++) {
-    if (g_devices[i].used && g_devices[i].short_addr == short_addr) return &g_devices[i];
-  }
-  return nullptr;
+  uint16_t slot = zb_devidx_find_short(&g_devIndex, short_addr);
+  return slot == ZB_DEVIDX_NONE ? nullptr : &g_devices[slot];
 }
 
 static device_entry_t *find_device_by_ieee(const char *ieee16) {
-  for (uint8_t i = 0; i < MAX_DEVICES; i++) {
-    if (g_devices[i].used && strncmp(g_devices[i].ieee16, ieee16, 16) == 0) return &g_devices[i];
-  }
-  return nullptr;
+  uint64_t ieee;
+  if (!zb_devidx_ieee_from_str(ieee16, &ieee)) return nullptr;
+  uint16_t slot = zb_devidx_find_ieee(&g_devIndex, ieee);
+  return slot == ZB_DEVIDX_NONE ? nullptr : &g_devices[slot];
 }
 
-static device_entry_t *upsert_device(uint16_t short_addr, const uint8_t ieee_le[8]) {
-  char ieee16[17];
-  ieee_le_to_str16(ieee_le, ieee16);
-  device_entry_t *e = find_device_by_short(short_addr);
-  if (!e) e = find_device_by_ieee(ieee16);
-  if (!e) {
-    // find empty
-    for (uint8_t i = 0; i < MAX_DEVICES; i++) {
-      if (!g_devices[i].used) {
-        e = &g_devices[i];
-        break;
-      }
+static uint16_t alloc_device_slot() {
+  for (uint16_t n = 0; n < MAX_DEVICES; n++) {
+    uint16_t i = (uint16_t)((g_devFreeHint + n) % MAX_DEVICES);
+    if (!g_devices[i].used) {
+      g_devFreeHint = (uint16_t)((i + 1) % MAX_DEVICES);
+      return i;
     }
   }
-  if (!e) {
-    // evict oldest
-    uint8_t oldest = 0;
-    uint32_t bestAge = 0;
-    for (uint8_t i = 0; i < MAX_DEVICES; i++) {
-      uint32_t age = millis() - g_devices[i].last_seen_ms;
-      if (age >= bestAge) {
-        bestAge = age;
-        oldest = i;
-      }
+  // Full: evict the device heard from longest ago (only on join, so the scan is fine).
+  uint16_t oldest = 0;
+  uint32_t bestAge = 0;
+  for (uint16_t i = 0; i < MAX_DEVICES; i++) {
+    uint32_t age = millis() - g_devices[i].last_seen_ms;
+    if (age >= bestAge) {
+      bestAge = age;
+      oldest = i;
     }
-    e = &g_devices[oldest];
-  }
-  bool ieeeChanged = true;
-  if (e && e->used) {
-    ieeeChanged = (strncmp(e->ieee16, ieee16, 16) != 0);
   }
+  Serial.printf("[C6] device table full, evicting %s\n", g_devices[oldest].ieee16);
+  zb_devidx_unbind(&g_devIndex, oldest);
+  g_devices[oldest].used = false;
+  devstore_mark(oldest);
+  return oldest;
+}
 
-  e->used = true;
-  e->short_addr = short_addr;
-  strncpy(e->ieee16, ieee16, sizeof(e->ieee16));
-  e->ieee16[16] = 0;
-  e->last_seen_ms = millis();
-  if (ieeeChanged) {
+static device_entry_t *upsert_device(uint16_t short_addr, const uint8_t ieee_le[8]) {
+  const uint64_t ieee = zb_devidx_ieee_from_le(ieee_le);
+  uint16_t slot = zb_devidx_find_ieee(&g_devIndex, ieee);
+  device_entry_t *e;
+  if (slot != ZB_DEVIDX_NONE) {
+    e = &g_devices[slot];
+  } else {
+    slot = alloc_device_slot();
+    e = &g_devices[slot];
+    e->used = true;
+    ieee_le_to_str16(ieee_le, e->ieee16);
     e->manufacturer[0] = 0;
     e->model[0] = 0;
     e->swBuildId[0] = 0;
+    e->epCount = 0;
+    e->lockBin = false;
+    e->short_addr = ZB_DEVIDX_NO_SHORT;
   }
+
+  if (e->short_addr != short_addr) {
+    uint16_t evicted;
+    zb_devidx_bind(&g_devIndex, slot, ieee, short_addr, &evicted);
+    if (evicted != ZB_DEVIDX_NONE) {
+      g_devices[evicted].short_addr = ZB_DEVIDX_NO_SHORT;
+      devstore_mark(evicted);
+    }
+    devstore_mark(slot);
+  }
+  e->short_addr = short_addr;
+  e->last_seen_ms = millis();
   return e;
 }
 
+// Device with a current short address (a released address would turn a unicast into a broadcast).
+static device_entry_t *find_routable_device(const char *ieee16) {
+  device_entry_t *d = find_device_by_ieee(ieee16);
+  return (d && d->short_addr != ZB_DEVIDX_NO_SHORT) ? d : nullptr;
+}
+
+static uint16_t device_count() {
+  return g_devIndex.count;
+}
+
+static void forget_device(device_entry_t *e) {
+  if (!e || !e->used) return;
+  zb_devidx_unbind(&g_devIndex, (uint16_t)(e - g_devices));
+  e->used = false;
+  devstore_mark((uint16_t)(e - g_devices));
+}
+
 static bool zcl_string_to_cstr(uint8_t zclType, const void *valuePtr, char *out, size_t outLen) {
   if (!out || outLen == 0) return false;
   out[0] = 0;
@@ -416,8 +893,407 @@ static bool zcl_string_to_cstr(uint8_t zclType, const void *valuePtr, char *out,
   return false;
 }
 
+// Stores one Basic fingerprint attribute (manufacturer/model/swBuildId); false if not one of those.
+static bool device_store_basic_attr(device_entry_t *dev, uint16_t attrId, uint8_t zclType, const void *valuePtr) {
+  char *dst = nullptr;
+  size_t dstLen = 0;
+  if (attrId == ESP_ZB_ZCL_ATTR_BASIC_MANUFACTURER_NAME_ID) {
+    dst = dev->manufacturer;
+    dstLen = sizeof(dev->manufacturer);
+  } else if (attrId == ESP_ZB_ZCL_ATTR_BASIC_MODEL_IDENTIFIER_ID) {
+    dst = dev->model;
+    dstLen = sizeof(dev->model);
+  } else if (attrId == ESP_ZB_ZCL_ATTR_BASIC_SW_BUILD_ID) {
+    dst = dev->swBuildId;
+    dstLen = sizeof(dev->swBuildId);
+  }
+  if (!dst) return false;
+  char buf[33];
+  if (!zcl_string_to_cstr(zclType, valuePtr, buf, sizeof(buf))) return false;
+  if (strncmp(dst, buf, dstLen) == 0) return true;
+  strncpy(dst, buf, dstLen);
+  dst[dstLen - 1] = 0;
+  devstore_mark((uint16_t)(dev - g_devices));
+  return true;
+}
+
+// ------------------------ Device table persistence ------------------------
+//
+// Chunk blob "c<NN>": 'D', version, record count, then per record:
+//   slot(1) ieee(8, LE) short(2) epCount(1) eps{ep(1) profile(2) device(2) inMask(4)}
+//   manufacturer / model / swBuildId as length-prefixed strings.
+// Loaded in setup() before the Zigbee task starts, so commands for known devices
+// work right away; devstore_reconcile() then fixes short addresses from the
+// stack's address and neighbor tables once the stack has restored the network.
+
+static Preferences g_devPrefs;
+static uint32_t g_devChunkHash[MAX_DEVICES / DEVSTORE_SLOTS_PER_CHUNK];
+static uint8_t g_devStoreBuf[4 + DEVSTORE_SLOTS_PER_CHUNK * (14 + DEV_MAX_EPS * 9 + 3 * 33)];
+
+static uint32_t devstore_hash(const uint8_t *p, size_t n) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+static void devstore_key(uint8_t chunk, char out[5]) {
+  snprintf(out, 5, "c%02u", (unsigned)chunk);
+}
+
+static void put_u16(uint8_t *&w, uint16_t v) {
+  *w++ = (uint8_t)v;
+  *w++ = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t *&w, uint32_t v) {
+  put_u16(w, (uint16_t)v);
+  put_u16(w, (uint16_t)(v >> 16));
+}
+
+static void put_str(uint8_t *&w, const char *s) {
+  const uint8_t n = (uint8_t)strnlen(s, 32);
+  *w++ = n;
+  memcpy(w, s, n);
+  w += n;
+}
+
+static size_t devstore_encode_chunk(uint8_t chunk) {
+  uint8_t *w = g_devStoreBuf;
+  *w++ = 'D';
+  *w++ = 1;
+  uint8_t *countPos = w++;
+  *countPos = 0;
+  const uint16_t first = (uint16_t)chunk * DEVSTORE_SLOTS_PER_CHUNK;
+  for (uint16_t slot = first; slot < first + DEVSTORE_SLOTS_PER_CHUNK; slot++) {
+    const device_entry_t &e = g_devices[slot];
+    if (!e.used) continue;
+    uint8_t ieee_le[8];
+    if (!ieee_str16_to_le_bytes(e.ieee16, ieee_le)) continue;
+    *w++ = (uint8_t)(slot - first);
+    memcpy(w, ieee_le, 8);
+    w += 8;
+    put_u16(w, e.short_addr);
+    *w++ = e.epCount;
+    for (uint8_t i = 0; i < e.epCount; i++) {
+      *w++ = e.eps[i].ep;
+      put_u16(w, e.eps[i].profile);
+      put_u16(w, e.eps[i].device);
+      put_u32(w, e.eps[i].inMask);
+    }
+    put_str(w, e.manufacturer);
+    put_str(w, e.model);
+    put_str(w, e.swBuildId);
+    (*countPos)++;
+  }
+  return (size_t)(w - g_devStoreBuf);
+}
+
+struct devstore_reader_t {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool ok;
+};
+
+static const uint8_t *rd_take(devstore_reader_t &r, size_t n) {
+  if (!r.ok || (size_t)(r.end - r.p) < n) {
+    r.ok = false;
+    return nullptr;
+  }
+  const uint8_t *at = r.p;
+  r.p += n;
+  return at;
+}
+
+static uint8_t rd_u8(devstore_reader_t &r) {
+  const uint8_t *p = rd_take(r, 1);
+  return p ? p[0] : 0;
+}
+
+static uint16_t rd_u16(devstore_reader_t &r) {
+  const uint8_t *p = rd_take(r, 2);
+  return p ? (uint16_t)(p[0] | (p[1] << 8)) : 0;
+}
+
+static uint32_t rd_u32(devstore_reader_t &r) {
+  const uint32_t lo = rd_u16(r);
+  return lo | ((uint32_t)rd_u16(r) << 16);
+}
+
+static void rd_str(devstore_reader_t &r, char *out, size_t cap) {
+  const uint8_t n = rd_u8(r);
+  const uint8_t *p = rd_take(r, n);
+  const size_t k = (p && n < cap) ? n : 0;
+  if (k) memcpy(out, p, k);
+  out[k] = 0;
+}
+
+static uint16_t devstore_decode_chunk(uint8_t chunk, const uint8_t *buf, size_t len) {
+  devstore_reader_t r = {buf, buf + len, true};
+  if (rd_u8(r) != 'D' || rd_u8(r) != 1) return 0;
+  const uint8_t count = rd_u8(r);
+  uint16_t loaded = 0;
+  for (uint8_t n = 0; n < count && r.ok; n++) {
+    const uint8_t rel = rd_u8(r);
+    const uint8_t *ieee_le = rd_take(r, 8);
+    const uint16_t short_addr = rd_u16(r);
+    const uint8_t epCount = rd_u8(r);
+    if (!r.ok || rel >= DEVSTORE_SLOTS_PER_CHUNK || epCount > DEV_MAX_EPS) break;
+
+    const uint16_t slot = (uint16_t)chunk * DEVSTORE_SLOTS_PER_CHUNK + rel;
+    device_entry_t &e = g_devices[slot];
+    memset(&e, 0, sizeof(e));
+    e.epCount = epCount;
+    for (uint8_t i = 0; i < epCount; i++) {
+      e.eps[i].ep = rd_u8(r);
+      e.eps[i].profile = rd_u16(r);
+      e.eps[i].device = rd_u16(r);
+      e.eps[i].inMask = rd_u32(r);
+    }
+    rd_str(r, e.manufacturer, sizeof(e.manufacturer));
+    rd_str(r, e.model, sizeof(e.model));
+    rd_str(r, e.swBuildId, sizeof(e.swBuildId));
+    if (!r.ok) {
+      memset(&e, 0, sizeof(e));
+      break;
+    }
+
+    const uint64_t ieee = zb_devidx_ieee_from_le(ieee_le);
+    if (zb_devidx_find_ieee(&g_devIndex, ieee) != ZB_DEVIDX_NONE) {
+      memset(&e, 0, sizeof(e));
+      continue;
+    }
+    e.used = true;
+    ieee_le_to_str16(ieee_le, e.ieee16);
+    e.short_addr = short_addr;
+    uint16_t evicted;
+    zb_devidx_bind(&g_devIndex, slot, ieee, short_addr, &evicted);
+    if (evicted != ZB_DEVIDX_NONE) g_devices[evicted].short_addr = ZB_DEVIDX_NO_SHORT;
+    loaded++;
+  }
+  return loaded;
+}
+
+// setup(): restore the table before the Zigbee task starts.
+static uint16_t devstore_load() {
+  g_devPrefs.begin("zbdevs", false);
+  uint16_t total = 0;
+  for (uint8_t c = 0; c < MAX_DEVICES / DEVSTORE_SLOTS_PER_CHUNK; c++) {
+    char key[5];
+    devstore_key(c, key);
+    if (!g_devPrefs.isKey(key)) continue;
+    const size_t len = g_devPrefs.getBytesLength(key);
+    if (len == 0 || len > sizeof(g_devStoreBuf)) continue;
+    if (g_devPrefs.getBytes(key, g_devStoreBuf, len) != len) continue;
+    g_devChunkHash[c] = devstore_hash(g_devStoreBuf, len);
+    total += devstore_decode_chunk(c, g_devStoreBuf, len);
+  }
+  Serial.printf("[C6] device table: %u restored from NVS\n", (unsigned)total);
+  return total;
+}
+
+static void devstore_flush() {
+  for (uint8_t c = 0; c < MAX_DEVICES / DEVSTORE_SLOTS_PER_CHUNK; c++) {
+    if (!(g_devDirty & (1U << c))) continue;
+    const size_t len = devstore_encode_chunk(c);
+    const uint32_t h = devstore_hash(g_devStoreBuf, len);
+    if (h == g_devChunkHash[c]) continue; // nothing new (e.g. short changed and changed back)
+    char key[5];
+    devstore_key(c, key);
+    bool ok;
+    if (g_devStoreBuf[2] == 0) {
+      ok = g_devPrefs.remove(key) || !g_devPrefs.isKey(key);
+    } else {
+      ok = g_devPrefs.putBytes(key, g_devStoreBuf, len) == len;
+    }
+    if (ok) g_devChunkHash[c] = h;
+    else Serial.printf("[C6] device table: NVS write %s failed (%u bytes)\n", key, (unsigned)len);
+  }
+  g_devDirty = 0;
+}
+
+static void bind_save();
+
+// zb_task: write dirty chunks once changes settle.
+static void devstore_tick() {
+  if (g_devStoreHold) return;
+  if (g_devStoreRewrite) {
+    g_devStoreRewrite = false;
+    memset(g_devChunkHash, 0, sizeof(g_devChunkHash));
+    g_devDirty = (uint16_t)((1UL << (MAX_DEVICES / DEVSTORE_SLOTS_PER_CHUNK)) - 1);
+    devstore_flush();
+    bind_save();
+    return;
+  }
+  if (!g_devDirty) return;
+  const uint32_t now = millis();
+  if ((uint32_t)(now - g_devLastDirtyMs) < DEVSTORE_SETTLE_MS &&
+      (uint32_t)(now - g_devFirstDirtyMs) < DEVSTORE_MAX_DELAY_MS) {
+    return;
+  }
+  devstore_flush();
+}
+
+// New network formed: nothing from the old table can be on it.
+static void devstore_clear() {
+  for (uint16_t slot = 0; slot < MAX_DEVICES; slot++) {
+    if (!g_devices[slot].used) continue;
+    zb_devidx_unbind(&g_devIndex, slot);
+    g_devices[slot].used = false;
+    devstore_mark(slot);
+  }
+  devstore_flush();
+}
+
+// Stack restored the network after a reboot: take current short addresses from
+// the address table, then from the neighbor table (direct children/routers).
+static void devstore_reconcile() {
+  uint16_t known = 0, moved = 0, unknown = 0;
+  for (uint16_t slot = 0; slot < MAX_DEVICES; slot++) {
+    device_entry_t &e = g_devices[slot];
+    if (!e.used) continue;
+    uint8_t ieee_le[8];
+    if (!ieee_str16_to_le_bytes(e.ieee16, ieee_le)) continue;
+    const uint16_t sa = esp_zb_address_short_by_ieee(ieee_le);
+    if (sa >= 0xFFF8) {
+      unknown++;
+      continue;
+    }
+    known++;
+    if (sa != e.short_addr) {
+      upsert_device(sa, ieee_le);
+      moved++;
+    }
+  }
+#if defined(ESP_ZB_NWK_INFO_ITERATOR_INIT)
+  esp_zb_nwk_info_iterator_t it = ESP_ZB_NWK_INFO_ITERATOR_INIT;
+  esp_zb_nwk_neighbor_info_t nbr;
+  while (esp_zb_nwk_get_next_neighbor(&it, &nbr) == ESP_OK) {
+    const uint16_t slot = zb_devidx_find_ieee(&g_devIndex, zb_devidx_ieee_from_le(nbr.ieee_addr));
+    if (slot == ZB_DEVIDX_NONE || g_devices[slot].short_addr == nbr.short_addr) continue;
+    upsert_device(nbr.short_addr, nbr.ieee_addr);
+    moved++;
+  }
+#endif
+  Serial.printf("[C6] device table reconciled: known=%u moved=%u unknown=%u\n", (unsigned)known, (unsigned)moved,
+                (unsigned)unknown);
+}
+
+// ------------------------ Device table benchmark ------------------------
+// {"cmd":"devtable_bench","devices":200,"reports":20000} (answered from loop()).
+// Simulates a report flood on a scratch index (the live table is untouched):
+// every report resolves short -> slot like the attr_report path, every 8th also
+// resolves IEEE -> slot like a command, and 1% of reports are rejoins with a new
+// short address. The same lookups then run as a linear scan over `devices`
+// entries (the previous table layout) for comparison.
+struct bench_dev_t {
+  bool used;
+  uint16_t short_addr;
+  char ieee16[17];
+};
+
+static void devtable_bench(uint16_t devices, uint32_t reports) {
+  if (devices == 0 || devices > MAX_DEVICES) devices = 200;
+  if (reports == 0 || reports > 100000) reports = 20000;
+
+  zb_devidx_t *idx = (zb_devidx_t *)malloc(sizeof(zb_devidx_t));
+  bench_dev_t *lin = (bench_dev_t *)calloc(devices, sizeof(bench_dev_t));
+  uint16_t *order = (uint16_t *)malloc(sizeof(uint16_t) * 1024);
+  if (!idx || !lin || !order) {
+    free(idx);
+    free(lin);
+    free(order);
+    uart_send_cmd_result("", "", false, "devtable_bench: out of memory");
+    return;
+  }
+
+  zb_devidx_init(idx);
+  uint64_t ieee[MAX_DEVICES];
+  uint16_t evicted;
+  for (uint16_t i = 0; i < devices; i++) {
+    ieee[i] = ((uint64_t)esp_random() << 32) | esp_random();
+    uint16_t sa;
+    do {
+      sa = (uint16_t)(esp_random() & 0xFFF7);
+    } while (zb_devidx_find_short(idx, sa) != ZB_DEVIDX_NONE);
+    zb_devidx_bind(idx, i, ieee[i], sa, &evicted);
+    lin[i].used = true;
+    lin[i].short_addr = sa;
+    char tmp[17];
+    snprintf(tmp, sizeof(tmp), "%08lx%08lx", (unsigned long)(ieee[i] >> 32), (unsigned long)ieee[i]);
+    memcpy(lin[i].ieee16, tmp, sizeof(tmp));
+  }
+  for (uint16_t i = 0; i < 1024; i++) order[i] = (uint16_t)(esp_random() % devices);
+
+  uint32_t misses = 0;
+  uint32_t rejoins = 0;
+  uint32_t t0 = micros();
+  for (uint32_t r = 0; r < reports; r++) {
+    uint16_t dev = order[r & 1023];
+    if ((r % 100) == 99) {
+      uint16_t sa;
+      do {
+        sa = (uint16_t)(esp_random() & 0xFFF7);
+      } while (zb_devidx_find_short(idx, sa) != ZB_DEVIDX_NONE);
+      zb_devidx_bind(idx, dev, ieee[dev], sa, &evicted);
+      rejoins++;
+    }
+    if (zb_devidx_find_short(idx, idx->slot_short[dev]) != dev) misses++;
+    if ((r & 7) == 0 && zb_devidx_find_ieee(idx, ieee[dev]) != dev) misses++;
+  }
+  uint32_t hashUs = micros() - t0;
+
+  t0 = micros();
+  for (uint32_t r = 0; r < reports; r++) {
+    uint16_t dev = order[r & 1023];
+    const uint16_t want = lin[dev].short_addr;
+    bench_dev_t *hit = nullptr;
+    for (uint16_t i = 0; i < devices; i++) {
+      if (lin[i].used && lin[i].short_addr == want) {
+        hit = &lin[i];
+        break;
+      }
+    }
+    if ((r & 7) == 0 && hit) {
+      for (uint16_t i = 0; i < devices; i++) {
+        if (lin[i].used && strncmp(lin[i].ieee16, hit->ieee16, 16) == 0) break;
+      }
+    }
+  }
+  uint32_t linUs = micros() - t0;
+
+  // Longest probe chain in the short index (worst case lookup).
+  uint16_t maxProbe = 0;
+  for (uint16_t i = 0; i < devices; i++) {
+    uint16_t n = 1;
+    for (uint32_t b = zb_devidx_hash16(idx->slot_short[i]); idx->short_key[b] != idx->slot_short[i];
+         b = (b + 1) & ZB_DEVIDX_MASK) n++;
+    if (n > maxProbe) maxProbe = n;
+  }
+
+  StaticJsonDocument<320> doc;
+  doc["evt"] = "devtable_bench";
+  doc["devices"] = devices;
+  doc["reports"] = reports;
+  doc["rejoins"] = rejoins;
+  doc["misses"] = misses;
+  doc["hashUs"] = hashUs;
+  doc["linearUs"] = linUs;
+  doc["hashNsPerReport"] = (uint32_t)((uint64_t)hashUs * 1000 / reports);
+  doc["linearNsPerReport"] = (uint32_t)((uint64_t)linUs * 1000 / reports);
+  doc["maxProbe"] = maxProbe;
+  doc["indexBytes"] = (uint32_t)sizeof(zb_devidx_t);
+  uart_send_json(doc);
+
+  free(idx);
+  free(lin);
+  free(order);
+}
+
 // ------------------------ Zigbee command helpers ------------------------
 
+// Join window as last requested by the hub; new joins are only expected inside it.
+static uint32_t g_permitJoinUntilMs = 0;
+
 static void zb_set_permit_join(uint16_t duration_sec) {
   // Newer esp-zigbee APIs use esp_zb_zdo_permit_joining_req().
   esp_zb_zdo_permit_joining_req_param_t req = {0};
@@ -425,20 +1301,22 @@ static void zb_set_permit_join(uint16_t duration_sec) {
   req.permit_duration = (duration_sec > 0xFF) ? 0xFF : (uint8_t)duration_sec;
   req.tc_significance = 1;
   (void)esp_zb_zdo_permit_joining_req(&req, nullptr, nullptr);
+  g_permitJoinUntilMs = duration_sec ? millis() + (uint32_t)req.permit_duration * 1000U : 0;
   uart_send_join_state(duration_sec > 0, (int)duration_sec);
 }
 
-static void zb_send_onoff(uint16_t short_addr, uint8_t dst_endpoint, bool on) {
+// The zb_send_* helpers return the ZCL transaction sequence number used for the frame.
+static uint8_t zb_send_onoff(uint16_t short_addr, uint8_t dst_endpoint, bool on) {
   esp_zb_zcl_on_off_cmd_t cmd = {0};
   cmd.zcl_basic_cmd.src_endpoint = COORD_ENDPOINT;
   cmd.zcl_basic_cmd.dst_endpoint = dst_endpoint ? dst_endpoint : DEFAULT_DST_ENDPOINT;
   cmd.address_mode = ESP_ZB_APS_ADDR_MODE_16_ENDP_PRESENT;
   cmd.zcl_basic_cmd.dst_addr_u.addr_short = short_addr;
   cmd.on_off_cmd_id = on ? ESP_ZB_ZCL_CMD_ON_OFF_ON_ID : ESP_ZB_ZCL_CMD_ON_OFF_OFF_ID;
-  (void)esp_zb_zcl_on_off_cmd_req(&cmd);
+  return esp_zb_zcl_on_off_cmd_req(&cmd);
 }
 
-static void zb_send_level(uint16_t short_addr, uint8_t dst_endpoint, uint8_t level, uint16_t transition_ds) {
+static uint8_t zb_send_level(uint16_t short_addr, uint8_t dst_endpoint, uint8_t level, uint16_t transition_ds) {
   // In esp-zigbee v1.6+ the type is esp_zb_zcl_move_to_level_cmd_t.
   esp_zb_zcl_move_to_level_cmd_t cmd = {0};
   cmd.zcl_basic_cmd.src_endpoint = COORD_ENDPOINT;
@@ -447,21 +1325,11 @@ static void zb_send_level(uint16_t short_addr, uint8_t dst_endpoint, uint8_t lev
   cmd.zcl_basic_cmd.dst_addr_u.addr_short = short_addr;
   cmd.level = level;
   cmd.transition_time = transition_ds; // deci‑seconds
-  (void)esp_zb_zcl_level_move_to_level_cmd_req(&cmd);
+  return esp_zb_zcl_level_move_to_level_cmd_req(&cmd);
 }
 
-static void zb_send_lock_custom_cmd(uint16_t short_addr, uint8_t dst_endpoint, uint8_t custom_cmd_id, const char *json) {
-  if (!json) return;
-  const size_t len = strlen(json);
-  if (len == 0 || len > 250) {
-    Serial.printf("[ZB] lock_custom_cmd payload too large len=%u\n", (unsigned)len);
-    return;
-  }
-
-  uint8_t zclStr[1 + 251];
-  zclStr[0] = (uint8_t)len;
-  memcpy(zclStr + 1, json, len);
-
+static void zb_send_lock_raw(uint16_t short_addr, uint8_t dst_endpoint, uint8_t custom_cmd_id, uint8_t zclType,
+                             uint8_t *data, uint16_t size) {
   esp_zb_zcl_custom_cluster_cmd_req_t req = {0};
   req.zcl_basic_cmd.src_endpoint = COORD_ENDPOINT;
   req.zcl_basic_cmd.dst_endpoint = dst_endpoint ? dst_endpoint : DEFAULT_DST_ENDPOINT;
@@ -471,16 +1339,39 @@ static void zb_send_lock_custom_cmd(uint16_t short_addr, uint8_t dst_endpoint, u
   req.profile_id = ESP_ZB_AF_HA_PROFILE_ID;
   req.direction = ESP_ZB_ZCL_CMD_DIRECTION_TO_SRV;
   req.custom_cmd_id = custom_cmd_id;
-  req.data.type = ESP_ZB_ZCL_ATTR_TYPE_CHAR_STRING;
-  req.data.size = (uint16_t)(len + 1);
-  req.data.value = zclStr;
+  req.data.type = zclType;
+  req.data.size = size;
+  req.data.value = data;
 
   (void)esp_zb_zcl_custom_cluster_cmd_req(&req);
 }
 
+static bool lock_frag_send(uint16_t shortAddr, uint8_t dstEp, uint8_t cmd, const char *data, size_t len,
+                           const char *cmdId, const char *ieee16);
+
+// Payloads up to LOCK_SINGLE_MAX go as one ZCL command (octet string for binary,
+// char string for legacy JSON) and rely on APS fragmentation if they outgrow a
+// frame; only longer ones use the lock fragmentation protocol. cmdId/ieee16 let a failed fragmented
+// delivery answer the hub's command.
+static bool zb_send_lock_custom_cmd(uint16_t short_addr, uint8_t dst_endpoint, uint8_t custom_cmd_id, const char *data,
+                                    size_t len, const char *cmdId = nullptr, const char *ieee16 = nullptr) {
+  if (!data || len == 0) return false;
+  if (len > LOCK_SINGLE_MAX) {
+    return lock_frag_send(short_addr, dst_endpoint, custom_cmd_id, data, len, cmdId, ieee16);
+  }
+
+  uint8_t zclStr[1 + LOCK_SINGLE_MAX];
+  zclStr[0] = (uint8_t)len;
+  memcpy(zclStr + 1, data, len);
+  const uint8_t type = ((uint8_t)data[0] == LOCK_WIRE_V1) ? ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING
+                                                          : ESP_ZB_ZCL_ATTR_TYPE_CHAR_STRING;
+  zb_send_lock_raw(short_addr, dst_endpoint, custom_cmd_id, type, zclStr, (uint16_t)(len + 1));
+  return true;
+}
+
 // Sprint 11: Identify (blink) command
 // Use custom cluster command sender to avoid dependency on identify-specific wrappers.
-static void zb_send_identify(uint16_t short_addr, uint8_t dst_endpoint, uint16_t identify_time_sec) {
+static uint8_t zb_send_identify(uint16_t short_addr, uint8_t dst_endpoint, uint16_t identify_time_sec) {
   uint8_t payload[2];
   payload[0] = (uint8_t)(identify_time_sec & 0xFF);
   payload[1] = (uint8_t)((identify_time_sec >> 8) & 0xFF);
@@ -498,7 +1389,7 @@ static void zb_send_identify(uint16_t short_addr, uint8_t dst_endpoint, uint16_t
   req.data.size = 2;
   req.data.value = payload;
 
-  (void)esp_zb_zcl_custom_cluster_cmd_req(&req);
+  return esp_zb_zcl_custom_cluster_cmd_req(&req);
 }
 
 // Sprint 11: Actively read basic fingerprint right after device announce.
@@ -531,379 +1422,3788 @@ static void zb_remove_device(const uint8_t ieee_le[8]) {
   (void)esp_zb_zdo_device_leave_req(&req, nullptr, nullptr);
 }
 
-// ------------------------ Zigbee callbacks ------------------------
+// ZDO Bind_req on the device: (its endpoint, cluster) -> coordinator endpoint.
+// Reports only go out to bound destinations, so reporting config needs this first.
+static void zb_bind_to_coordinator(const uint8_t ieee_le[8], uint16_t short_addr, uint8_t src_endpoint,
+                                   uint16_t cluster) {
+  esp_zb_zdo_bind_req_param_t req = {};
+  memcpy(req.src_address, ieee_le, sizeof(req.src_address));
+  req.src_endp = src_endpoint;
+  req.cluster_id = cluster;
+  req.dst_addr_mode = ESP_ZB_ZDO_BIND_DST_ADDR_MODE_64_BIT_EXTENDED;
+  esp_zb_get_long_address(req.dst_address_u.addr_long);
+  req.dst_endp = COORD_ENDPOINT;
+  req.req_dst_addr = short_addr;
+  esp_zb_zdo_device_bind_req(&req, nullptr, nullptr);
+}
 
-static esp_err_t zb_action_handler(esp_zb_core_action_callback_id_t callback_id, const void *message) {
-  switch (callback_id) {
-    case ESP_ZB_CORE_REPORT_ATTR_CB_ID: {
-      const esp_zb_zcl_report_attr_message_t *m = (const esp_zb_zcl_report_attr_message_t *)message;
-      if (!m || m->status != ESP_ZB_ZCL_STATUS_SUCCESS) return ESP_OK;
+// ------------------------ SmartLock fragmentation ------------------------
+//
+// A lock message longer than LOCK_SINGLE_MAX travels as up to
+// LOCK_FRAG_MAX_COUNT LOCK_CMD_FRAG commands, each an octet string
+//   [inner cmd][seq][index][count][total lo][total hi][crc lo][crc hi][data...]
+// with CRC-16/CCITT over the six header bytes and the data. The receiver answers
+// LOCK_CMD_FRAG_ACK [seq][count][mask lo][mask hi] (bit i = fragment i held)
+// after the last fragment of each LOCK_FRAG_WINDOW block, after a repaired hole,
+// when the message is complete, and after LOCK_FRAG_GAP_MS without progress.
+// The sender keeps one window in flight, resends whatever the mask lacks, and
+// gives up after LOCK_FRAG_RETRIES unanswered windows. Messages up to
+// LOCK_SINGLE_MAX stay a single string command, which older lock firmware
+// understands.
+// Must match enddevice_lock_c6.
 
-      device_entry_t *dev = find_device_by_short(m->src_address.u.short_addr);
-      if (!dev) return ESP_OK;
-      dev->last_seen_ms = millis();
+struct lock_frag_tx_t {
+  bool used;
+  uint16_t shortAddr;
+  uint8_t dstEp;
+  uint8_t cmd;
+  uint8_t seq;
+  uint8_t count;
+  uint16_t len;
+  uint16_t acked;    // fragments the receiver confirmed
+  uint16_t inflight; // sent in the current window
+  uint8_t tries;     // windows without an ack
+  uint32_t deadlineMs;
+  char cmdId[40];    // lock_action: answered with cmd_result when delivery fails
+  char ieee16[17];
+  uint8_t buf[LOCK_FRAG_MAX_MSG];
+};
 
-      // Map to the string contract expected by Hub Host firmware.
-      const char *clusterName = "raw";
-      const char *attrName = "raw";
-      int32_t valueInt = 0;
+struct lock_frag_rx_t {
+  bool used;
+  bool done; // delivered; kept until LOCK_FRAG_RX_TIMEOUT_MS to re-ack duplicates
+  uint16_t shortAddr;
+  uint8_t cmd;
+  uint8_t seq;
+  uint8_t count;
+  uint16_t len;
+  uint16_t mask;
+  uint8_t maxIdx;
+  uint32_t lastRxMs;
+  uint32_t lastAckMs;
+  char buf[LOCK_FRAG_MAX_MSG + 1];
+};
 
-      const uint16_t cluster = m->cluster;
-      const uint16_t attrId = m->attribute.id;
-      const uint8_t type = m->attribute.data.type;
-      const void *val = m->attribute.data.value;
+static lock_frag_tx_t g_lockTx[LOCK_FRAG_TX_SLOTS];
+static lock_frag_rx_t g_lockRx[LOCK_FRAG_RX_SLOTS];
+static uint8_t g_lockFragSeq = 0;
 
-      // Sprint 2: capture Basic cluster fingerprint (manufacturer/model) for pairing UX.
-      if (cluster == ESP_ZB_ZCL_CLUSTER_ID_BASIC &&
-          (attrId == ESP_ZB_ZCL_ATTR_BASIC_MANUFACTURER_NAME_ID ||
-           attrId == ESP_ZB_ZCL_ATTR_BASIC_MODEL_IDENTIFIER_ID ||
-           attrId == ESP_ZB_ZCL_ATTR_BASIC_SW_BUILD_ID)) {
-        char buf[33];
-        if (zcl_string_to_cstr(type, val, buf, sizeof(buf))) {
-          if (attrId == ESP_ZB_ZCL_ATTR_BASIC_MANUFACTURER_NAME_ID) {
-            strncpy(dev->manufacturer, buf, sizeof(dev->manufacturer));
-            dev->manufacturer[sizeof(dev->manufacturer) - 1] = 0;
-          } else if (attrId == ESP_ZB_ZCL_ATTR_BASIC_MODEL_IDENTIFIER_ID) {
-            strncpy(dev->model, buf, sizeof(dev->model));
-            dev->model[sizeof(dev->model) - 1] = 0;
-          } else if (attrId == ESP_ZB_ZCL_ATTR_BASIC_SW_BUILD_ID) {
-            strncpy(dev->swBuildId, buf, sizeof(dev->swBuildId));
-            dev->swBuildId[sizeof(dev->swBuildId) - 1] = 0;
-          }
+static uint16_t lock_crc16(const uint8_t *p, size_t n, uint16_t crc = 0xFFFF) {
+  while (n--) {
+    crc ^= (uint16_t)(*p++) << 8;
+    for (uint8_t b = 0; b < 8; b++) crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
 
-          uart_send_basic_fingerprint(dev->ieee16, dev->short_addr,
-                                     dev->manufacturer,
-                                     dev->model,
-                                     dev->swBuildId);
-        }
-        return ESP_OK;
-      }
+static uint16_t lock_frag_full(uint8_t count) {
+  return (uint16_t)((count >= 16) ? 0xFFFF : ((1U << count) - 1));
+}
 
-      if (cluster == ESP_ZB_ZCL_CLUSTER_ID_ON_OFF && attrId == ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID) {
-        clusterName = "onoff";
-        attrName = "onoff";
-        // bool can be stored as uint8_t in some builds
-        if (val) valueInt = (*(const uint8_t *)val) ? 1 : 0;
-      } else if (cluster == ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL &&
-                 attrId == ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_CURRENT_LEVEL_ID) {
-        clusterName = "level";
-        attrName = "level";
-        if (val) valueInt = *(const uint8_t *)val;
-      } else if (cluster == ESP_ZB_ZCL_CLUSTER_ID_OCCUPANCY_SENSING &&
-                 attrId == ESP_ZB_ZCL_ATTR_OCCUPANCY_SENSING_OCCUPANCY_ID) {
-        clusterName = "occupancy";
-        attrName = "occupied";
-        if (val) valueInt = *(const uint8_t *)val;
-      } else if (cluster == ESP_ZB_ZCL_CLUSTER_ID_TEMP_MEASUREMENT &&
-                 attrId == ESP_ZB_ZCL_ATTR_TEMP_MEASUREMENT_VALUE_ID) {
-        clusterName = "temperature";
-        attrName = "value";
-        if (val) valueInt = *(const int16_t *)val; // unit: 0.01°C
-      } else if (cluster == ESP_ZB_ZCL_CLUSTER_ID_REL_HUMIDITY_MEASUREMENT &&
-                 attrId == ESP_ZB_ZCL_ATTR_REL_HUMIDITY_MEASUREMENT_VALUE_ID) {
-        clusterName = "humidity";
-        attrName = "value";
-        if (val) valueInt = *(const uint16_t *)val; // unit: 0.01%
-      } else if (cluster == ESP_ZB_ZCL_CLUSTER_ID_IDENTIFY && attrId == ESP_ZB_ZCL_ATTR_IDENTIFY_TIME_ID) {
-        // Sprint 11: Identify confirmation. Many devices do not send an explicit ack.
-        // If we ever receive Identify Time >0, forward as a UART event.
-        uint16_t t = 0;
-        if (val) t = *(const uint16_t *)val;
-        if (t > 0) {
-          uart_send_zb_identify(dev->ieee16, t, "attr_report");
-        }
-        return ESP_OK;
-      } else {
-        static char clusterBuf[8];
-        static char attrBuf[8];
-        snprintf(clusterBuf, sizeof(clusterBuf), "0x%04x", (unsigned)cluster);
-        snprintf(attrBuf, sizeof(attrBuf), "0x%04x", (unsigned)attrId);
-        clusterName = clusterBuf;
-        attrName = attrBuf;
-
-        // best‑effort decode common scalar types
-        if (!val) {
-          valueInt = 0;
-        } else if (type == ESP_ZB_ZCL_ATTR_TYPE_U8) {
-          valueInt = *(const uint8_t *)val;
-        } else if (type == ESP_ZB_ZCL_ATTR_TYPE_S16) {
-          valueInt = *(const int16_t *)val;
-        } else if (type == ESP_ZB_ZCL_ATTR_TYPE_U16) {
-          valueInt = *(const uint16_t *)val;
-        } else if (type == ESP_ZB_ZCL_ATTR_TYPE_BOOL) {
-          valueInt = (*(const uint8_t *)val) ? 1 : 0;
-        } else {
-          valueInt = 0;
-        }
+static uint32_t lock_frag_timeout(uint16_t shortAddr) {
+  const device_entry_t *d = find_device_by_short(shortAddr);
+  return (d && d->sleepy) ? CMD_TIMEOUT_SLEEPY_MS : LOCK_FRAG_ACK_TIMEOUT_MS;
+}
+
+static void lock_frag_send_one(lock_frag_tx_t &t, uint8_t idx) {
+  const uint16_t off = (uint16_t)idx * LOCK_FRAG_DATA;
+  const uint8_t n = (uint8_t)((t.len - off) < LOCK_FRAG_DATA ? (t.len - off) : LOCK_FRAG_DATA);
+  uint8_t f[1 + LOCK_FRAG_HDR + LOCK_FRAG_DATA];
+  uint8_t *h = f + 1; // octet string length first
+  h[0] = t.cmd;
+  h[1] = t.seq;
+  h[2] = idx;
+  h[3] = t.count;
+  h[4] = (uint8_t)(t.len & 0xFF);
+  h[5] = (uint8_t)(t.len >> 8);
+  memcpy(h + LOCK_FRAG_HDR, t.buf + off, n);
+  const uint16_t crc = lock_crc16(h + LOCK_FRAG_HDR, n, lock_crc16(h, 6));
+  h[6] = (uint8_t)(crc & 0xFF);
+  h[7] = (uint8_t)(crc >> 8);
+  f[0] = (uint8_t)(LOCK_FRAG_HDR + n);
+  zb_send_lock_raw(t.shortAddr, t.dstEp, LOCK_CMD_FRAG, ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING, f, (uint16_t)(1 + f[0]));
+}
+
+// Sends the next window of fragments the receiver has not confirmed.
+static void lock_frag_pump(lock_frag_tx_t &t) {
+  uint8_t sent = 0;
+  for (uint8_t i = 0; i < t.count && sent < LOCK_FRAG_WINDOW; i++) {
+    const uint16_t bit = (uint16_t)(1U << i);
+    if ((t.acked | t.inflight) & bit) continue;
+    lock_frag_send_one(t, i);
+    t.inflight |= bit;
+    sent++;
+  }
+  t.deadlineMs = millis() + lock_frag_timeout(t.shortAddr);
+}
+
+static void lock_frag_tx_end(lock_frag_tx_t &t, bool ok) {
+  if (!ok) {
+    Serial.printf("[LOCK] frag tx to 0x%04x seq=%u failed acked=0x%04x/%u\n", (unsigned)t.shortAddr,
+                  (unsigned)t.seq, (unsigned)t.acked, (unsigned)t.count);
+    if (t.cmdId[0]) uart_send_cmd_result(t.cmdId, t.ieee16, false, "lock_unreachable");
+  }
+  t.used = false;
+}
+
+// Queues a lock message for fragmented delivery; false when too large or all slots are busy.
+static bool lock_frag_send(uint16_t shortAddr, uint8_t dstEp, uint8_t cmd, const char *data, size_t len,
+                           const char *cmdId, const char *ieee16) {
+  if (len > LOCK_FRAG_MAX_MSG) return false;
+  for (uint8_t i = 0; i < LOCK_FRAG_TX_SLOTS; i++) {
+    lock_frag_tx_t &t = g_lockTx[i];
+    if (t.used) continue;
+    t.used = true;
+    t.shortAddr = shortAddr;
+    t.dstEp = dstEp ? dstEp : DEFAULT_DST_ENDPOINT;
+    t.cmd = cmd;
+    t.seq = g_lockFragSeq++;
+    t.len = (uint16_t)len;
+    t.count = (uint8_t)((len + LOCK_FRAG_DATA - 1) / LOCK_FRAG_DATA);
+    t.acked = 0;
+    t.inflight = 0;
+    t.tries = 0;
+    strncpy(t.cmdId, cmdId ? cmdId : "", sizeof(t.cmdId) - 1);
+    t.cmdId[sizeof(t.cmdId) - 1] = 0;
+    strncpy(t.ieee16, ieee16 ? ieee16 : "", sizeof(t.ieee16) - 1);
+    t.ieee16[sizeof(t.ieee16) - 1] = 0;
+    memcpy(t.buf, data, len);
+    lock_frag_pump(t);
+    return true;
+  }
+  return false;
+}
+
+static void lock_frag_on_ack(uint16_t srcShort, const uint8_t *p, uint8_t n) {
+  if (n < 4) return;
+  const uint16_t mask = (uint16_t)(p[2] | (p[3] << 8));
+  for (uint8_t i = 0; i < LOCK_FRAG_TX_SLOTS; i++) {
+    lock_frag_tx_t &t = g_lockTx[i];
+    if (!t.used || t.shortAddr != srcShort || t.seq != p[0] || t.count != p[1]) continue;
+    const uint16_t lost = t.inflight & ~mask;
+    g_lockFragResent += (uint32_t)__builtin_popcount(lost);
+    t.acked |= mask & lock_frag_full(t.count);
+    t.inflight = 0;
+    t.tries = 0;
+    if (t.acked == lock_frag_full(t.count)) lock_frag_tx_end(t, true);
+    else lock_frag_pump(t);
+    return;
+  }
+}
+
+static void lock_frag_send_ack(lock_frag_rx_t &r) {
+  uint8_t a[1 + 4];
+  a[0] = 4;
+  a[1] = r.seq;
+  a[2] = r.count;
+  a[3] = (uint8_t)(r.mask & 0xFF);
+  a[4] = (uint8_t)(r.mask >> 8);
+  zb_send_lock_raw(r.shortAddr, DEFAULT_DST_ENDPOINT, LOCK_CMD_FRAG_ACK, ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING, a, sizeof(a));
+  r.lastAckMs = millis();
+}
+
+static void lock_on_message(device_entry_t *dev, uint8_t cmdId, const char *data, size_t len);
+
+static void lock_frag_on_fragment(device_entry_t *dev, const uint8_t *p, uint8_t n) {
+  if (n < LOCK_FRAG_HDR) return;
+  const uint8_t cmd = p[0], seq = p[1], idx = p[2], count = p[3];
+  const uint16_t total = (uint16_t)(p[4] | (p[5] << 8));
+  const uint8_t dlen = (uint8_t)(n - LOCK_FRAG_HDR);
+  const uint16_t crc = (uint16_t)(p[6] | (p[7] << 8));
+  if (lock_crc16(p + LOCK_FRAG_HDR, dlen, lock_crc16(p, 6)) != crc) {
+    g_lockFragCrcErr++; // left out of the mask: the sender repeats it
+    return;
+  }
+  if (count == 0 || count > LOCK_FRAG_MAX_COUNT || idx >= count || total > LOCK_FRAG_MAX_MSG ||
+      (uint32_t)idx * LOCK_FRAG_DATA + dlen > total) {
+    return;
+  }
+
+  const uint32_t now = millis();
+  lock_frag_rx_t *r = nullptr;
+  lock_frag_rx_t *freeSlot = nullptr;
+  lock_frag_rx_t *oldest = nullptr;
+  for (uint8_t i = 0; i < LOCK_FRAG_RX_SLOTS; i++) {
+    lock_frag_rx_t &x = g_lockRx[i];
+    if (!x.used) {
+      if (!freeSlot) freeSlot = &x;
+      continue;
+    }
+    if (x.shortAddr == dev->short_addr && x.seq == seq) {
+      r = &x;
+      break;
+    }
+    if (!oldest || (int32_t)(x.lastRxMs - oldest->lastRxMs) < 0) oldest = &x;
+  }
+  if (r && (r->count != count || r->len != total || r->cmd != cmd)) {
+    freeSlot = r; // same seq, different message: the sender restarted
+    r = nullptr;
+  }
+  if (!r) {
+    r = freeSlot ? freeSlot : oldest;
+    memset(r, 0, offsetof(lock_frag_rx_t, buf));
+    r->used = true;
+    r->shortAddr = dev->short_addr;
+    r->cmd = cmd;
+    r->seq = seq;
+    r->count = count;
+    r->len = total;
+  }
+  r->lastRxMs = now;
+  if (r->done) {
+    lock_frag_send_ack(*r); // our ack was lost; the message was delivered already
+    return;
+  }
+
+  const uint16_t bit = (uint16_t)(1U << idx);
+  const bool repair = (r->mask != 0) && idx < r->maxIdx;
+  if (!(r->mask & bit)) {
+    memcpy(r->buf + (uint16_t)idx * LOCK_FRAG_DATA, p + LOCK_FRAG_HDR, dlen);
+    r->mask |= bit;
+  }
+  if (idx > r->maxIdx) r->maxIdx = idx;
+
+  if (r->mask == lock_frag_full(count)) {
+    r->done = true;
+    lock_frag_send_ack(*r);
+    r->buf[r->len] = 0;
+    lock_on_message(dev, r->cmd, r->buf, r->len);
+  } else if (repair || (idx % LOCK_FRAG_WINDOW) == LOCK_FRAG_WINDOW - 1) {
+    lock_frag_send_ack(*r);
+  }
+}
+
+static void lock_frag_tick() {
+  const uint32_t now = millis();
+  for (uint8_t i = 0; i < LOCK_FRAG_TX_SLOTS; i++) {
+    lock_frag_tx_t &t = g_lockTx[i];
+    if (!t.used || (int32_t)(now - t.deadlineMs) < 0) continue;
+    if (++t.tries > LOCK_FRAG_RETRIES) {
+      lock_frag_tx_end(t, false);
+      continue;
+    }
+    g_lockFragResent += (uint32_t)__builtin_popcount(t.inflight);
+    t.inflight = 0;
+    lock_frag_pump(t);
+  }
+  for (uint8_t i = 0; i < LOCK_FRAG_RX_SLOTS; i++) {
+    lock_frag_rx_t &r = g_lockRx[i];
+    if (!r.used) continue;
+    if ((uint32_t)(now - r.lastRxMs) >= LOCK_FRAG_RX_TIMEOUT_MS) {
+      r.used = false;
+    } else if (!r.done && (uint32_t)(now - r.lastRxMs) >= LOCK_FRAG_GAP_MS &&
+               (uint32_t)(now - r.lastAckMs) >= LOCK_FRAG_GAP_MS) {
+      lock_frag_send_ack(r); // the mask shows the holes
+    }
+  }
+}
+
+static bool lock_frag_busy() {
+  for (uint8_t i = 0; i < LOCK_FRAG_TX_SLOTS; i++) {
+    if (g_lockTx[i].used) return true;
+  }
+  for (uint8_t i = 0; i < LOCK_FRAG_RX_SLOTS; i++) {
+    if (g_lockRx[i].used && !g_lockRx[i].done) return true;
+  }
+  return false;
+}
+
+// ------------------------ SmartLock wire format ------------------------
+//
+// Over the air a lock message is LOCK_WIRE_V1 followed by MessagePack; the UART
+// to the hub stays JSON. Fields are positional so no key names are sent:
+//   ACTION_REQ v1: [cmdId, action, args]
+//   CMD_RESULT v1: [cmdId, ok, error]
+//   EVENT      v1: [type, data, ts]
+//   STATE      v1: {state map}
+// Trailing fields may be left out; later versions only append fields. Legacy
+// JSON objects are still accepted, and a lock gets binary ACTION_REQs only once
+// it has sent a binary message itself (device_entry_t::lockBin).
+// Must match enddevice_lock_c6.
+
+// Field idx of a binary message, or key of a legacy JSON one.
+static JsonVariantConst lock_field(const JsonDocument &doc, bool bin, uint8_t idx, const char *key) {
+  return bin ? doc[idx] : doc[key];
+}
+
+// Called from loop() while parsing lock_action; out holds CMD_PAYLOAD_MAX bytes.
+static size_t lock_encode_action(const char *cmdId, const char *action, JsonVariantConst args, char *out) {
+  StaticJsonDocument<256> pl;
+  JsonArray a = pl.to<JsonArray>();
+  a.add(cmdId);
+  a.add(action);
+  if (!args.isNull()) a.add(args);
+  if (pl.overflowed() || 1 + measureMsgPack(pl) > CMD_PAYLOAD_MAX) return 0;
+  out[0] = (char)LOCK_WIRE_V1;
+  return 1 + serializeMsgPack(pl, out + 1, CMD_PAYLOAD_MAX - 1);
+}
+
+// ACTION_REQ for a lock that has not spoken binary yet: v1 array -> legacy JSON object.
+static size_t lock_action_to_json(const char *bin, size_t len, char *out, size_t cap) {
+  DynamicJsonDocument in(2 * CMD_PAYLOAD_MAX);
+  if (len < 1 || deserializeMsgPack(in, bin + 1, len - 1)) return 0;
+  DynamicJsonDocument pl(2 * CMD_PAYLOAD_MAX);
+  pl["cmdId"] = in[0];
+  pl["action"] = in[1];
+  if (!in[2].isNull()) pl["args"] = in[2];
+  const size_t n = measureJson(pl);
+  if (n >= cap) return 0;
+  return serializeJson(pl, out, cap);
+}
+
+// A complete lock message (single command or reassembled) -> hub.
+static void lock_on_message(device_entry_t *dev, uint8_t cmdId, const char *data, size_t len) {
+  if (len == 0) return;
+  DynamicJsonDocument doc(LOCK_JSON_DOC);
+  const bool bin = (uint8_t)data[0] == LOCK_WIRE_V1;
+  DeserializationError err = bin ? deserializeMsgPack(doc, data + 1, len - 1) : deserializeJson(doc, data, len);
+  if (err) {
+    Serial.printf("[ZB] custom_cmd %s parse fail: %s\n", bin ? "msgpack" : "JSON", err.c_str());
+    return;
+  }
+  if (bin) dev->lockBin = true;
+
+  if (cmdId == LOCK_CMD_CMD_RESULT) {
+    const char *cmdIdStr = lock_field(doc, bin, 0, "cmdId") | "";
+    const bool ok = lock_field(doc, bin, 1, "ok") | false;
+    const char *error = lock_field(doc, bin, 2, "error") | "";
+    uart_send_cmd_result(cmdIdStr, dev->ieee16, ok, error);
+  } else if (cmdId == LOCK_CMD_EVENT) {
+    const char *type = lock_field(doc, bin, 0, "type") | "";
+    JsonVariantConst data = lock_field(doc, bin, 1, "data");
+    if (type && type[0]) {
+      uart_send_zb_event(dev->ieee16, type, data, lock_field(doc, bin, 2, "ts") | 0ULL);
+    }
+  } else if (cmdId == LOCK_CMD_STATE) {
+    // State payload is already the reported object
+    uart_send_zb_state(dev->ieee16, doc.as<JsonVariantConst>());
+  } else {
+    Serial.printf("[ZB] unknown custom_cmd id=0x%02x from %s\n", cmdId, dev->ieee16);
+  }
+}
+
+// ------------------------ Time cluster ------------------------
+//
+// The coordinator is the network's time master: the Time cluster server on
+// COORD_ENDPOINT is kept at the hub's NTP time so end devices can read it
+// (ZCL UTCTime counts seconds from 2000-01-01).
+
+static const uint32_t ZCL_EPOCH_OFFSET_SEC = 946684800UL;
+static const uint8_t ZCL_TIME_STATUS_MASTER = 0x01;
+static const uint8_t ZCL_TIME_STATUS_SYNCHRONIZED = 0x02;
+
+static uint32_t g_timeLastSetSec = 0;
+
+// Called from loop() when the hub sends {"cmd":"time_sync"}.
+static void time_on_sync(uint32_t epochSec, uint16_t ms) {
+  if (epochSec <= ZCL_EPOCH_OFFSET_SEC) return;
+  if (ms > 999) ms = 999;
+  portENTER_CRITICAL(&g_timeMux);
+  g_timeEpochSec = epochSec;
+  g_timeEpochAtMs = millis() - ms;
+  portEXIT_CRITICAL(&g_timeMux);
+}
+
+static uint32_t time_now_epoch_sec() {
+  portENTER_CRITICAL(&g_timeMux);
+  const uint32_t base = g_timeEpochSec;
+  const uint32_t atMs = g_timeEpochAtMs;
+  portEXIT_CRITICAL(&g_timeMux);
+  if (!base) return 0;
+  return base + (millis() - atMs) / 1000U;
+}
+
+// Called from zb_task: advance the Time attribute once per second.
+static void time_tick() {
+  const uint32_t epoch = time_now_epoch_sec();
+  if (!epoch || epoch == g_timeLastSetSec) return;
+  uint32_t zclTime = epoch - ZCL_EPOCH_OFFSET_SEC;
+  esp_zb_zcl_set_attribute_val(COORD_ENDPOINT, ESP_ZB_ZCL_CLUSTER_ID_TIME, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+                               ESP_ZB_ZCL_ATTR_TIME_TIME_ID, &zclTime, false);
+  if (g_timeLastSetSec == 0) {
+    uint8_t status = ZCL_TIME_STATUS_MASTER | ZCL_TIME_STATUS_SYNCHRONIZED;
+    esp_zb_zcl_set_attribute_val(COORD_ENDPOINT, ESP_ZB_ZCL_CLUSTER_ID_TIME, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+                                 ESP_ZB_ZCL_ATTR_TIME_TIME_STATUS_ID, &status, false);
+    Serial.printf("[TIME] synced epoch=%u\n", (unsigned)epoch);
+  }
+  g_timeLastSetSec = epoch;
+}
+
+// ------------------------ Install codes ------------------------
+
+// Code is the install code followed by its CRC-16 (8/10/14/18 bytes for 48/64/96/128-bit codes).
+static esp_err_t zb_add_install_code(uint8_t ieee_le[8], uint8_t *code, uint8_t len) {
+#if ZB_HAS_SECUR_IC
+  uint8_t icType;
+  switch (len) {
+    case 8: icType = ESP_ZB_IC_TYPE_48; break;
+    case 10: icType = ESP_ZB_IC_TYPE_64; break;
+    case 14: icType = ESP_ZB_IC_TYPE_96; break;
+    case 18: icType = ESP_ZB_IC_TYPE_128; break;
+    default: return ESP_ERR_INVALID_ARG;
+  }
+  return esp_zb_secur_ic_add(ieee_le, icType, code);
+#else
+  (void)ieee_le;
+  (void)code;
+  (void)len;
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+// ------------------------ Device interview ------------------------
+//
+// On device_annce the coordinator learns the device's endpoints (Active_EP_req),
+// each endpoint's clusters (Simple_Desc_req) and its Basic fingerprint, then
+// sends ONE device_interview record. Up to IV_MAX_ACTIVE devices are interviewed
+// at once so a batch of joins does not serialize behind the slowest device.
+// Everything here runs in the Zigbee task (signal handler, ZDO callbacks, zb_task).
+
+typedef enum {
+  IV_IDLE = 0,
+  IV_ACTIVE_EP = 1,
+  IV_SIMPLE_DESC = 2,
+  IV_BASIC = 3,
+} iv_stage_t;
+
+struct iv_ep_t {
+  uint8_t ep;
+  uint16_t profile;
+  uint16_t device;
+  uint8_t inCount;
+  uint8_t outCount;
+  uint16_t clusters[IV_MAX_CLUSTERS]; // in clusters first, then out
+};
+
+struct interview_t {
+  iv_stage_t stage;
+  uint8_t seq;    // bumped per request; stale ZDO callbacks are ignored
+  uint8_t tries;
+  uint16_t short_addr;
+  char ieee16[17];
+  uint32_t startMs;
+  uint32_t deadlineMs;
+  uint8_t epCount;
+  uint8_t epIdx;  // endpoint whose Simple_Desc is in flight
+  bool truncated;
+  iv_ep_t eps[IV_MAX_EPS];
+  const char *error; // first step that gave up (record is still sent)
+};
+
+struct iv_pending_t {
+  uint16_t short_addr;
+  char ieee16[17];
+};
+
+static interview_t g_iv[IV_MAX_ACTIVE];
+static iv_pending_t g_ivPending[IV_PENDING_MAX];
+static uint8_t g_ivPendHead = 0;
+static uint8_t g_ivPendCount = 0;
+
+static interview_t *iv_find_short(uint16_t short_addr) {
+  for (uint8_t i = 0; i < IV_MAX_ACTIVE; i++) {
+    if (g_iv[i].stage != IV_IDLE && g_iv[i].short_addr == short_addr) return &g_iv[i];
+  }
+  return nullptr;
+}
+
+static interview_t *iv_find_ieee(const char *ieee16) {
+  for (uint8_t i = 0; i < IV_MAX_ACTIVE; i++) {
+    if (g_iv[i].stage != IV_IDLE && strncmp(g_iv[i].ieee16, ieee16, 16) == 0) return &g_iv[i];
+  }
+  return nullptr;
+}
+
+static void *iv_ctx(const interview_t *iv) {
+  return (void *)(uintptr_t)(((uint32_t)(iv - g_iv) << 8) | iv->seq);
+}
+
+static interview_t *iv_from_ctx(void *ctx) {
+  const uint32_t v = (uint32_t)(uintptr_t)ctx;
+  const uint32_t slot = v >> 8;
+  if (slot >= IV_MAX_ACTIVE) return nullptr;
+  interview_t *iv = &g_iv[slot];
+  if (iv->stage == IV_IDLE || iv->seq != (uint8_t)(v & 0xFF)) return nullptr;
+  return iv;
+}
+
+// Basic lives on the first endpoint that lists it as a server cluster.
+static uint8_t iv_basic_endpoint(const interview_t *iv) {
+  for (uint8_t i = 0; i < iv->epCount; i++) {
+    for (uint8_t c = 0; c < iv->eps[i].inCount; c++) {
+      if (iv->eps[i].clusters[c] == ESP_ZB_ZCL_CLUSTER_ID_BASIC) return iv->eps[i].ep;
+    }
+  }
+  return iv->epCount ? iv->eps[0].ep : DEFAULT_DST_ENDPOINT;
+}
+
+static void iv_active_ep_cb(esp_zb_zdp_status_t zdo_status, uint8_t ep_count, uint8_t *ep_id_list, void *user_ctx);
+static void iv_simple_desc_cb(esp_zb_zdp_status_t zdo_status, esp_zb_af_simple_desc_1_1_t *simple_desc, void *user_ctx);
+
+static void iv_send_step(interview_t *iv) {
+  iv->seq++;
+  iv->deadlineMs = millis() + IV_STEP_TIMEOUT_MS;
+  if (iv->stage == IV_ACTIVE_EP) {
+    esp_zb_zdo_active_ep_req_param_t req = {};
+    req.addr_of_interest = iv->short_addr;
+    esp_zb_zdo_active_ep_req(&req, iv_active_ep_cb, iv_ctx(iv));
+  } else if (iv->stage == IV_SIMPLE_DESC) {
+    esp_zb_zdo_simple_desc_req_param_t req = {};
+    req.addr_of_interest = iv->short_addr;
+    req.endpoint = iv->eps[iv->epIdx].ep;
+    esp_zb_zdo_simple_desc_req(&req, iv_simple_desc_cb, iv_ctx(iv));
+  } else if (iv->stage == IV_BASIC) {
+    zb_read_basic_fingerprint(iv->short_addr, iv_basic_endpoint(iv));
+  }
+}
+
+static void iv_pump();
+static uint8_t rpt_apply_profile(device_entry_t *dev);
+
+static void iv_finish(interview_t *iv) {
+  DynamicJsonDocument doc(2048);
+  doc["evt"] = "device_interview";
+  doc["ieee"] = iv->ieee16;
+  char sh[8];
+  snprintf(sh, sizeof(sh), "0x%04x", (unsigned)iv->short_addr);
+  doc["short"] = sh;
+  doc["ok"] = (iv->error == nullptr);
+  if (iv->error) doc["error"] = iv->error;
+  doc["ms"] = (uint32_t)(millis() - iv->startMs);
+
+  device_entry_t *dev = find_device_by_short(iv->short_addr);
+  if (dev) {
+    if (dev->manufacturer[0]) doc["manufacturer"] = dev->manufacturer;
+    if (dev->model[0]) doc["model"] = dev->model;
+    if (dev->swBuildId[0]) doc["swBuildId"] = dev->swBuildId;
+    if (iv->epCount) {
+      dev->epCount = iv->epCount > DEV_MAX_EPS ? DEV_MAX_EPS : iv->epCount;
+      for (uint8_t i = 0; i < dev->epCount; i++) {
+        const iv_ep_t &src = iv->eps[i];
+        dev_ep_t &dst = dev->eps[i];
+        dst.ep = src.ep;
+        dst.profile = src.profile;
+        dst.device = src.device;
+        dst.inMask = 0;
+        for (uint8_t c = 0; c < src.inCount; c++) dst.inMask |= dev_cluster_bit(src.clusters[c]);
+      }
+      devstore_mark((uint16_t)(dev - g_devices));
+      // Freshly interviewed device: bind + configure reporting from its profile.
+      rpt_apply_profile(dev);
+    }
+  }
+
+  JsonArray eps = doc.createNestedArray("endpoints");
+  for (uint8_t i = 0; i < iv->epCount; i++) {
+    const iv_ep_t &e = iv->eps[i];
+    JsonObject o = eps.createNestedObject();
+    o["ep"] = e.ep;
+    o["profile"] = e.profile;
+    o["device"] = e.device;
+    JsonArray in = o.createNestedArray("in");
+    for (uint8_t c = 0; c < e.inCount; c++) in.add(e.clusters[c]);
+    JsonArray out = o.createNestedArray("out");
+    for (uint8_t c = 0; c < e.outCount; c++) out.add(e.clusters[e.inCount + c]);
+  }
+  if (iv->truncated) doc["truncated"] = true;
+  uart_send_json(doc);
+
+  Serial.printf("[IV] %s done ok=%d eps=%u ms=%u%s%s\n", iv->ieee16, iv->error ? 0 : 1, (unsigned)iv->epCount,
+                (unsigned)(millis() - iv->startMs), iv->error ? " err=" : "", iv->error ? iv->error : "");
+  iv->stage = IV_IDLE;
+  iv_pump();
+}
+
+// Move to the next step after the current one answered (or gave up).
+static void iv_advance(interview_t *iv) {
+  iv->tries = 0;
+  if (iv->stage == IV_ACTIVE_EP) {
+    iv->epIdx = 0;
+    iv->stage = iv->epCount ? IV_SIMPLE_DESC : IV_BASIC;
+  } else if (iv->stage == IV_SIMPLE_DESC) {
+    if (++iv->epIdx >= iv->epCount) iv->stage = IV_BASIC;
+  } else {
+    iv_finish(iv);
+    return;
+  }
+  iv_send_step(iv);
+}
+
+static void iv_begin(interview_t *iv, uint16_t short_addr, const char *ieee16) {
+  memset(iv, 0, sizeof(*iv));
+  iv->short_addr = short_addr;
+  strncpy(iv->ieee16, ieee16, sizeof(iv->ieee16) - 1);
+  iv->startMs = millis();
+  iv->stage = IV_ACTIVE_EP;
+  iv_send_step(iv);
+}
+
+// Start queued interviews while slots are free.
+static void iv_pump() {
+  for (uint8_t i = 0; i < IV_MAX_ACTIVE && g_ivPendCount > 0; i++) {
+    if (g_iv[i].stage != IV_IDLE) continue;
+    const iv_pending_t &p = g_ivPending[g_ivPendHead];
+    g_ivPendHead = (uint8_t)((g_ivPendHead + 1) % IV_PENDING_MAX);
+    g_ivPendCount--;
+    iv_begin(&g_iv[i], p.short_addr, p.ieee16);
+  }
+}
+
+static void iv_request(uint16_t short_addr, const char *ieee16) {
+  // Re-announce while in flight (rejoin): restart with the new short address.
+  interview_t *iv = iv_find_ieee(ieee16);
+  if (iv) {
+    const uint32_t startMs = iv->startMs;
+    iv_begin(iv, short_addr, ieee16);
+    iv->startMs = startMs;
+    return;
+  }
+  for (uint8_t i = 0; i < g_ivPendCount; i++) {
+    iv_pending_t &p = g_ivPending[(g_ivPendHead + i) % IV_PENDING_MAX];
+    if (strncmp(p.ieee16, ieee16, 16) == 0) {
+      p.short_addr = short_addr;
+      return;
+    }
+  }
+  if (g_ivPendCount >= IV_PENDING_MAX) {
+    // Still give the hub its single record so pairing UX does not stall.
+    StaticJsonDocument<192> doc;
+    doc["evt"] = "device_interview";
+    doc["ieee"] = ieee16;
+    char sh[8];
+    snprintf(sh, sizeof(sh), "0x%04x", (unsigned)short_addr);
+    doc["short"] = sh;
+    doc["ok"] = false;
+    doc["error"] = "interview queue full";
+    uart_send_json(doc);
+    return;
+  }
+  iv_pending_t &p = g_ivPending[(g_ivPendHead + g_ivPendCount) % IV_PENDING_MAX];
+  p.short_addr = short_addr;
+  strncpy(p.ieee16, ieee16, sizeof(p.ieee16) - 1);
+  p.ieee16[sizeof(p.ieee16) - 1] = 0;
+  g_ivPendCount++;
+  iv_pump();
+}
+
+static void iv_active_ep_cb(esp_zb_zdp_status_t zdo_status, uint8_t ep_count, uint8_t *ep_id_list, void *user_ctx) {
+  interview_t *iv = iv_from_ctx(user_ctx);
+  if (!iv || iv->stage != IV_ACTIVE_EP) return;
+  if (zdo_status != ESP_ZB_ZDP_STATUS_SUCCESS) {
+    iv->error = "active_ep failed";
+  } else {
+    iv->epCount = 0;
+    for (uint8_t i = 0; i < ep_count && ep_id_list; i++) {
+      if (iv->epCount >= IV_MAX_EPS) {
+        iv->truncated = true;
+        break;
+      }
+      iv->eps[iv->epCount++].ep = ep_id_list[i];
+    }
+  }
+  iv_advance(iv);
+}
+
+static void iv_simple_desc_cb(esp_zb_zdp_status_t zdo_status, esp_zb_af_simple_desc_1_1_t *simple_desc, void *user_ctx) {
+  interview_t *iv = iv_from_ctx(user_ctx);
+  if (!iv || iv->stage != IV_SIMPLE_DESC) return;
+  if (zdo_status != ESP_ZB_ZDP_STATUS_SUCCESS || !simple_desc) {
+    if (!iv->error) iv->error = "simple_desc failed";
+  } else {
+    iv_ep_t &e = iv->eps[iv->epIdx];
+    e.profile = simple_desc->app_profile_id;
+    e.device = simple_desc->app_device_id;
+    const uint8_t nIn = simple_desc->app_input_cluster_count;
+    const uint8_t nOut = simple_desc->app_output_cluster_count;
+    e.inCount = 0;
+    e.outCount = 0;
+    for (uint8_t c = 0; c < nIn; c++) {
+      if (e.inCount >= IV_MAX_CLUSTERS) {
+        iv->truncated = true;
+        break;
+      }
+      e.clusters[e.inCount++] = simple_desc->app_cluster_list[c];
+    }
+    for (uint8_t c = 0; c < nOut; c++) {
+      if (e.inCount + e.outCount >= IV_MAX_CLUSTERS) {
+        iv->truncated = true;
+        break;
+      }
+      e.clusters[e.inCount + e.outCount++] = simple_desc->app_cluster_list[nIn + c];
+    }
+  }
+  iv_advance(iv);
+}
+
+// Basic read response for a device in IV_BASIC completes its interview.
+static void iv_on_basic_response(uint16_t short_addr) {
+  interview_t *iv = iv_find_short(short_addr);
+  if (iv && iv->stage == IV_BASIC) iv_advance(iv);
+}
+
+// Called from zb_task: retry a silent step, then give up on it and move on.
+static void iv_tick() {
+  const uint32_t now = millis();
+  for (uint8_t i = 0; i < IV_MAX_ACTIVE; i++) {
+    interview_t *iv = &g_iv[i];
+    if (iv->stage == IV_IDLE || (int32_t)(now - iv->deadlineMs) < 0) continue;
+    if (++iv->tries <= IV_STEP_RETRIES) {
+      iv_send_step(iv);
+      continue;
+    }
+    if (!iv->error) {
+      iv->error = (iv->stage == IV_ACTIVE_EP) ? "active_ep timeout"
+                  : (iv->stage == IV_SIMPLE_DESC) ? "simple_desc timeout" : "basic timeout";
+    }
+    iv_advance(iv);
+  }
+}
+
+// ------------------------ ZCL attribute decoding ------------------------
+//
+// attr_report carries typed values: every ZCL data type is decoded from the
+// stack's attribute buffer (little endian; strings with their length prefix,
+// collections in ZCL wire format) into JSON (number, bool, string, array).
+// Spec "non-values" (uint8 0xFF, int16 0x8000, NaN, string length 0xFF, ...)
+// become null. ZCL_ATTR_MAP names well-known attributes and converts them to
+// display units, so the hub needs no per-model scaling.
+
+typedef enum {
+  ZK_NONE = 0,
+  ZK_UINT,    // data, bitmap, uint, enum, cluster/attr id, BACnet OID
+  ZK_BOOL,
+  ZK_INT,
+  ZK_FLOAT,
+  ZK_OCTSTR,  // -> hex string
+  ZK_CHARSTR,
+  ZK_ARRAY,   // array, set, bag: element type + count
+  ZK_STRUCT,  // count + (type, value) pairs
+  ZK_TOD,     // -> "hh:mm:ss.cc"
+  ZK_DATE,    // -> "YYYY-MM-DD"
+  ZK_UTC,     // seconds since 2000 -> unix epoch seconds
+  ZK_HEX,     // EUI64, 128-bit key -> hex string (EUI64 most significant byte first)
+} zcl_kind_t;
+
+struct zcl_type_t {
+  uint8_t type;
+  uint8_t kind;
+  uint8_t size;   // fixed size in bytes; for strings / collections the length-prefix size
+  bool hasNull;   // all-ones (uint) / minimum (int) is the "invalid" value
+};
+
+static const zcl_type_t ZCL_TYPES[] = {
+    {0x00, ZK_NONE, 0, false},                                 // no data
+    {0x08, ZK_UINT, 1, false}, {0x09, ZK_UINT, 2, false},      // data8 .. data64
+    {0x0A, ZK_UINT, 3, false}, {0x0B, ZK_UINT, 4, false},
+    {0x0C, ZK_UINT, 5, false}, {0x0D, ZK_UINT, 6, false},
+    {0x0E, ZK_UINT, 7, false}, {0x0F, ZK_UINT, 8, false},
+    {0x10, ZK_BOOL, 1, true},
+    {0x18, ZK_UINT, 1, false}, {0x19, ZK_UINT, 2, false},      // bitmap8 .. bitmap64
+    {0x1A, ZK_UINT, 3, false}, {0x1B, ZK_UINT, 4, false},
+    {0x1C, ZK_UINT, 5, false}, {0x1D, ZK_UINT, 6, false},
+    {0x1E, ZK_UINT, 7, false}, {0x1F, ZK_UINT, 8, false},
+    {0x20, ZK_UINT, 1, true}, {0x21, ZK_UINT, 2, true},        // uint8 .. uint64
+    {0x22, ZK_UINT, 3, true}, {0x23, ZK_UINT, 4, true},
+    {0x24, ZK_UINT, 5, true}, {0x25, ZK_UINT, 6, true},
+    {0x26, ZK_UINT, 7, true}, {0x27, ZK_UINT, 8, true},
+    {0x28, ZK_INT, 1, true}, {0x29, ZK_INT, 2, true},          // int8 .. int64
+    {0x2A, ZK_INT, 3, true}, {0x2B, ZK_INT, 4, true},
+    {0x2C, ZK_INT, 5, true}, {0x2D, ZK_INT, 6, true},
+    {0x2E, ZK_INT, 7, true}, {0x2F, ZK_INT, 8, true},
+    {0x30, ZK_UINT, 1, true}, {0x31, ZK_UINT, 2, true},        // enum8, enum16
+    {0x38, ZK_FLOAT, 2, true}, {0x39, ZK_FLOAT, 4, true},      // semi, single, double
+    {0x3A, ZK_FLOAT, 8, true},
+    {0x41, ZK_OCTSTR, 1, true}, {0x42, ZK_CHARSTR, 1, true},   // (long) octet / char string
+    {0x43, ZK_OCTSTR, 2, true}, {0x44, ZK_CHARSTR, 2, true},
+    {0x48, ZK_ARRAY, 2, true}, {0x4C, ZK_STRUCT, 2, true},     // array, structure, set, bag
+    {0x50, ZK_ARRAY, 2, true}, {0x51, ZK_ARRAY, 2, true},
+    {0xE0, ZK_TOD, 4, true}, {0xE1, ZK_DATE, 4, true},         // time of day, date, UTC
+    {0xE2, ZK_UTC, 4, true},
+    {0xE8, ZK_UINT, 2, true}, {0xE9, ZK_UINT, 2, true},        // cluster id, attr id, BACnet OID
+    {0xEA, ZK_UINT, 4, true},
+    {0xF0, ZK_HEX, 8, true}, {0xF1, ZK_HEX, 16, false},        // EUI64, 128-bit key
+};
+static const uint8_t ZCL_TYPE_COUNT = sizeof(ZCL_TYPES) / sizeof(ZCL_TYPES[0]);
+
+static const uint8_t ZCL_DECODE_DEPTH = 3; // nested collections
+static const uint8_t ZCL_STR_MAX = 96;     // longer strings are truncated (UART line budget)
+static const uint8_t ZCL_OCT_MAX = 32;     // octet strings: bytes shown as hex
+
+static const zcl_type_t *zcl_type_find(uint8_t type) {
+  for (uint8_t i = 0; i < ZCL_TYPE_COUNT; i++) {
+    if (ZCL_TYPES[i].type == type) return &ZCL_TYPES[i];
+  }
+  return nullptr;
+}
+
+static uint64_t zcl_le_uint(const uint8_t *p, uint8_t n) {
+  uint64_t v = 0;
+  for (uint8_t i = n; i-- > 0;) v = (v << 8) | p[i];
+  return v;
+}
+
+// IEEE 754 half precision (ZCL semi-precision).
+static float zcl_half_to_float(uint16_t h) {
+  const int exp = (h >> 10) & 0x1F;
+  const float mant = (float)(h & 0x3FF);
+  float v;
+  if (exp == 0) v = ldexpf(mant, -24);
+  else if (exp == 31) v = (h & 0x3FF) ? NAN : INFINITY;
+  else v = ldexpf(mant + 1024.0f, exp - 25);
+  return (h & 0x8000) ? -v : v;
+}
+
+static void zcl_set_hex(JsonVariant out, const uint8_t *p, uint8_t n, bool msbFirst) {
+  char hex[2 * ZCL_OCT_MAX + 1];
+  if (n > ZCL_OCT_MAX) n = ZCL_OCT_MAX;
+  for (uint8_t i = 0; i < n; i++) {
+    snprintf(&hex[2 * i], 3, "%02x", p[msbFirst ? n - 1 - i : i]);
+  }
+  hex[2 * n] = 0;
+  out.set((char *)hex); // char* -> copied into the document
+}
+
+// Decodes one value of ZCL type `type` from p (len bytes available) into out.
+// Returns the bytes consumed, or -1 for an unknown type / short buffer.
+static int32_t zcl_decode(JsonVariant out, uint8_t type, const uint8_t *p, size_t len, uint8_t depth) {
+  const zcl_type_t *t = zcl_type_find(type);
+  if (!t) return -1;
+  const uint8_t n = t->size;
+  if (len < n) return -1;
+
+  switch (t->kind) {
+    case ZK_NONE:
+      return 0;
+    case ZK_BOOL:
+      if (p[0] <= 1) out.set(p[0] == 1);
+      return 1;
+    case ZK_UINT: {
+      const uint64_t v = zcl_le_uint(p, n);
+      const uint64_t ones = (n == 8) ? UINT64_MAX : ((1ULL << (8 * n)) - 1);
+      if (!(t->hasNull && v == ones)) out.set(v);
+      return n;
+    }
+    case ZK_INT: {
+      uint64_t u = zcl_le_uint(p, n);
+      const uint64_t sign = 1ULL << (8 * n - 1);
+      if (t->hasNull && u == sign) return n; // most negative value = invalid
+      if (n < 8 && (u & sign)) u |= ~((sign << 1) - 1);
+      out.set((int64_t)u);
+      return n;
+    }
+    case ZK_FLOAT: {
+      double v;
+      if (n == 2) {
+        v = zcl_half_to_float((uint16_t)zcl_le_uint(p, 2));
+      } else if (n == 4) {
+        float f;
+        memcpy(&f, p, 4);
+        v = f;
+      } else {
+        memcpy(&v, p, 8);
+      }
+      if (!isnan(v) && !isinf(v)) out.set(v); // JSON has neither
+      return n;
+    }
+    case ZK_OCTSTR:
+    case ZK_CHARSTR: {
+      const uint32_t sl = (uint32_t)zcl_le_uint(p, n);
+      if (sl == ((n == 1) ? 0xFFU : 0xFFFFU)) return n; // invalid string
+      if (len < n + sl) return -1;
+      if (t->kind == ZK_OCTSTR) {
+        zcl_set_hex(out, p + n, (uint8_t)(sl > ZCL_OCT_MAX ? ZCL_OCT_MAX : sl), false);
+      } else {
+        char s[ZCL_STR_MAX + 1];
+        const uint32_t cl = sl > ZCL_STR_MAX ? ZCL_STR_MAX : sl;
+        memcpy(s, p + n, cl);
+        s[cl] = 0;
+        out.set((char *)s);
+      }
+      return (int32_t)(n + sl);
+    }
+    case ZK_ARRAY:
+    case ZK_STRUCT: {
+      if (depth >= ZCL_DECODE_DEPTH) return -1;
+      size_t off = 0;
+      uint8_t elemType = 0;
+      if (t->kind == ZK_ARRAY) {
+        if (len < 3) return -1;
+        elemType = p[0];
+        off = 1;
+      }
+      const uint16_t count = (uint16_t)zcl_le_uint(p + off, 2);
+      off += 2;
+      if (count == 0xFFFF) return (int32_t)off; // invalid collection
+      JsonArray arr = out.to<JsonArray>();
+      for (uint16_t i = 0; i < count; i++) {
+        if (t->kind == ZK_STRUCT) {
+          if (off >= len) return -1;
+          elemType = p[off++];
+        }
+        // addElement() returns a null variant once the document is full; keep walking
+        // so the enclosing collection still finds its next element.
+        const int32_t used = zcl_decode(arr.addElement(), elemType, p + off, len - off, depth + 1);
+        if (used < 0) return -1;
+        off += (size_t)used;
+      }
+      return (int32_t)off;
+    }
+    case ZK_TOD: {
+      if (p[0] == 0xFF || p[1] == 0xFF || p[2] == 0xFF) return 4;
+      char s[12];
+      snprintf(s, sizeof(s), "%02u:%02u:%02u.%02u", p[0], p[1], p[2], p[3] == 0xFF ? 0 : p[3]);
+      out.set((char *)s);
+      return 4;
+    }
+    case ZK_DATE: {
+      if (p[0] == 0xFF || p[1] == 0xFF || p[2] == 0xFF) return 4;
+      char s[12];
+      snprintf(s, sizeof(s), "%04u-%02u-%02u", 1900U + p[0], p[1], p[2]);
+      out.set((char *)s);
+      return 4;
+    }
+    case ZK_UTC: {
+      const uint32_t v = (uint32_t)zcl_le_uint(p, 4);
+      if (v != 0xFFFFFFFFUL) out.set((uint64_t)v + ZCL_EPOCH_OFFSET_SEC);
+      return 4;
+    }
+    case ZK_HEX: {
+      bool allOnes = t->hasNull;
+      for (uint8_t i = 0; allOnes && i < n; i++) allOnes = p[i] == 0xFF;
+      if (!allOnes) zcl_set_hex(out, p, n, n == 8);
+      return n;
+    }
+  }
+  return -1;
+}
+
+// Well-known attributes: hub-facing names and unit conversion of the decoded value.
+typedef enum {
+  ZS_NONE = 0,
+  ZS_DIV10,  // 0.1 units (battery voltage 100 mV -> V)
+  ZS_DIV100, // 0.01 units (temperature °C, humidity %RH)
+  ZS_HALF,   // 0.5 units (battery percentage)
+  ZS_LUX,    // 10000 * log10(lux) + 1 -> lux
+} zcl_scale_t;
+
+struct zcl_attr_map_t {
+  uint16_t cluster;
+  uint16_t attr;
+  const char *clusterName;
+  const char *attrName;
+  uint8_t scale;
+};
+
+static const zcl_attr_map_t ZCL_ATTR_MAP[] = {
+    {0x0001, 0x0020, "power", "batteryVoltage", ZS_DIV10}, // V
+    {0x0001, 0x0021, "power", "battery", ZS_HALF},         // %
+    {0x0006, 0x0000, "onoff", "onoff", ZS_NONE},
+    {0x0008, 0x0000, "level", "level", ZS_NONE},
+    {0x0101, 0x0000, "doorlock", "state", ZS_NONE},
+    {0x0102, 0x0008, "cover", "position", ZS_NONE},        // lift %
+    {0x0201, 0x0000, "thermostat", "temperature", ZS_DIV100},
+    {0x0201, 0x0012, "thermostat", "heatSetpoint", ZS_DIV100},
+    {0x0300, 0x0007, "color", "mireds", ZS_NONE},
+    {0x0400, 0x0000, "illuminance", "value", ZS_LUX},      // lx
+    {0x0402, 0x0000, "temperature", "value", ZS_DIV100},   // °C
+    {0x0403, 0x0000, "pressure", "value", ZS_NONE},        // hPa
+    {0x0405, 0x0000, "humidity", "value", ZS_DIV100},      // %RH
+    {0x0406, 0x0000, "occupancy", "occupied", ZS_NONE},
+    {0x0500, 0x0002, "ias", "zoneStatus", ZS_NONE},
+};
+static const uint8_t ZCL_ATTR_MAP_COUNT = sizeof(ZCL_ATTR_MAP) / sizeof(ZCL_ATTR_MAP[0]);
+
+static void zcl_apply_scale(JsonVariant v, uint8_t scale) {
+  if (scale == ZS_NONE || v.isNull()) return;
+  const double raw = v.as<double>();
+  switch (scale) {
+    case ZS_DIV10: v.set(raw / 10.0); break;
+    case ZS_DIV100: v.set(raw / 100.0); break;
+    case ZS_HALF: v.set(raw / 2.0); break;
+    case ZS_LUX: v.set(raw == 0 ? 0.0 : round(pow(10.0, (raw - 1.0) / 10000.0))); break;
+  }
+}
+
+// ------------------------ Attribute batching ------------------------
+//
+// The stack calls zb_action_handler once per attribute, even for a
+// multi-attribute report. forward_attr() therefore appends to a per-device
+// batch that is sent as one attr_report line when ATTR_BATCH_WINDOW_MS has
+// passed since its first attribute (a TH sensor's temperature + humidity
+// become one line and one hub publish instead of two). The window is closed by
+// a scheduler alarm, so it does not depend on the zb_tick period.
+
+struct attr_batch_t {
+  bool used;
+  char ieee16[17];
+  uint32_t firstMs;
+  StaticJsonDocument<ATTR_BATCH_DOC> doc;
+};
+
+static attr_batch_t g_attrBatch[ATTR_BATCH_SLOTS];
+static bool g_attrBatchArmed = false;
+
+static void attr_batch_flush(attr_batch_t &b) {
+  if (!b.used) return;
+  uart_send_json(b.doc, TX_PRIO_REPORT);
+  g_attrLines++;
+  b.used = false;
+  b.doc.clear();
+}
+
+static void attr_batch_timer(uint8_t);
+
+static void attr_batch_arm(uint32_t delayMs) {
+  if (g_attrBatchArmed) return;
+  g_attrBatchArmed = true;
+  esp_zb_scheduler_alarm(attr_batch_timer, 0, delayMs);
+}
+
+// Sends the batches whose window has closed and re-arms for the next one.
+static void attr_batch_timer(uint8_t) {
+  g_attrBatchArmed = false;
+  const uint32_t now = millis();
+  uint32_t next = UINT32_MAX;
+  for (uint8_t i = 0; i < ATTR_BATCH_SLOTS; i++) {
+    attr_batch_t &b = g_attrBatch[i];
+    if (!b.used) continue;
+    const uint32_t age = now - b.firstMs;
+    if (age >= ATTR_BATCH_WINDOW_MS) attr_batch_flush(b);
+    else if (ATTR_BATCH_WINDOW_MS - age < next) next = ATTR_BATCH_WINDOW_MS - age;
+  }
+  if (next != UINT32_MAX) attr_batch_arm(next);
+}
+
+// New attribute object in dev's open batch. Opens one if needed; a full batch
+// is sent early, and with every slot busy the oldest batch is.
+static JsonObject attr_batch_add(const device_entry_t *dev) {
+  attr_batch_t *b = nullptr;
+  attr_batch_t *freeSlot = nullptr;
+  attr_batch_t *oldest = nullptr;
+  for (uint8_t i = 0; i < ATTR_BATCH_SLOTS; i++) {
+    attr_batch_t &x = g_attrBatch[i];
+    if (!x.used) {
+      if (!freeSlot) freeSlot = &x;
+      continue;
+    }
+    if (strcmp(x.ieee16, dev->ieee16) == 0) {
+      b = &x;
+      break;
+    }
+    if (!oldest || (int32_t)(x.firstMs - oldest->firstMs) < 0) oldest = &x;
+  }
+  if (b && b->doc.capacity() - b->doc.memoryUsage() < ATTR_BATCH_ROOM) {
+    attr_batch_flush(*b);
+    freeSlot = b;
+    b = nullptr;
+  }
+  if (!b) {
+    if (!freeSlot) {
+      attr_batch_flush(*oldest);
+      freeSlot = oldest;
+    }
+    b = freeSlot;
+    b->used = true;
+    strncpy(b->ieee16, dev->ieee16, sizeof(b->ieee16) - 1);
+    b->ieee16[sizeof(b->ieee16) - 1] = 0;
+    b->firstMs = millis();
+    b->doc["evt"] = "attr_report";
+    b->doc["ieee"] = (char *)b->ieee16;
+    b->doc["u"] = 1; // display units (older coordinators sent temperature/humidity x100)
+    b->doc.createNestedArray("attrs");
+    attr_batch_arm(ATTR_BATCH_WINDOW_MS);
+  }
+  g_attrCount++;
+  return b->doc["attrs"].as<JsonArray>().createNestedObject();
+}
+
+// ------------------------ Zigbee callbacks ------------------------
+
+static void cmd_track_on_default_resp(uint8_t tsn, uint16_t src_short, uint8_t zcl_status);
+static void rpt_on_default_resp(uint8_t tsn, uint16_t src_short, uint8_t zcl_status);
+static void rpt_on_config_resp(const esp_zb_zcl_cmd_config_report_resp_message_t *m);
+static void rpt_on_read_resp(const esp_zb_zcl_cmd_read_report_config_resp_message_t *m);
+static void resync_on_heard(device_entry_t *dev);
+static void bind_on_heard(device_entry_t *dev);
+static void bind_on_annce(device_entry_t *dev);
+static bool net_restore_pending();
+static void net_restore_formed();
+static void resync_on_read_resp(uint8_t tsn, uint16_t short_addr);
+
+// Attribute value (report or read response) -> typed entry of the device's attr_report batch:
+//   {"cluster":"temperature","attr":"value","value":23.45}
+// Attributes outside ZCL_ATTR_MAP keep hex names and also carry "type" (ZCL data type).
+static void forward_attr(const device_entry_t *dev, uint16_t cluster, uint16_t attrId, uint8_t type,
+                         const void *val, uint16_t size) {
+  if (cluster == ESP_ZB_ZCL_CLUSTER_ID_IDENTIFY && attrId == ESP_ZB_ZCL_ATTR_IDENTIFY_TIME_ID) {
+    // Sprint 11: Identify confirmation. Many devices do not send an explicit ack.
+    // If we ever receive Identify Time >0, forward as a UART event.
+    uint16_t t = 0;
+    if (val) t = *(const uint16_t *)val;
+    if (t > 0) {
+      uart_send_zb_identify(dev->ieee16, t, "attr_report");
+    }
+    return;
+  }
+
+  const zcl_attr_map_t *map = nullptr;
+  for (uint8_t i = 0; i < ZCL_ATTR_MAP_COUNT; i++) {
+    if (ZCL_ATTR_MAP[i].cluster == cluster && ZCL_ATTR_MAP[i].attr == attrId) {
+      map = &ZCL_ATTR_MAP[i];
+      break;
+    }
+  }
+
+  JsonObject a = attr_batch_add(dev);
+  if (map) {
+    a["cluster"] = map->clusterName;
+    a["attr"] = map->attrName;
+  } else {
+    char clusterBuf[8];
+    char attrBuf[8];
+    snprintf(clusterBuf, sizeof(clusterBuf), "0x%04x", (unsigned)cluster);
+    snprintf(attrBuf, sizeof(attrBuf), "0x%04x", (unsigned)attrId);
+    a["cluster"] = (char *)clusterBuf;
+    a["attr"] = (char *)attrBuf;
+    a["type"] = type;
+  }
+
+  JsonVariant value = a.getOrAddMember("value");
+  if (val) {
+    // Variable-length values are bounded by their own length prefix when the
+    // stack does not pass a size.
+    const zcl_type_t *t = zcl_type_find(type);
+    size_t len = size;
+    if (!len && t) len = (t->kind >= ZK_OCTSTR && t->kind <= ZK_STRUCT) ? 0xFFFF : t->size;
+    if (zcl_decode(value, type, (const uint8_t *)val, len, 0) < 0) value.clear();
+  }
+  if (map) zcl_apply_scale(value, map->scale);
+}
+
+static esp_err_t zb_action_handler(esp_zb_core_action_callback_id_t callback_id, const void *message) {
+  switch (callback_id) {
+    case ESP_ZB_CORE_CMD_DEFAULT_RESP_CB_ID: {
+      const esp_zb_zcl_cmd_default_resp_message_t *m = (const esp_zb_zcl_cmd_default_resp_message_t *)message;
+      if (!m) return ESP_OK;
+      cmd_track_on_default_resp(m->info.header.tsn, m->info.src_address.u.short_addr, (uint8_t)m->status_code);
+      rpt_on_default_resp(m->info.header.tsn, m->info.src_address.u.short_addr, (uint8_t)m->status_code);
+      return ESP_OK;
+    }
+    case ESP_ZB_CORE_CMD_REPORT_CONFIG_RESP_CB_ID:
+      rpt_on_config_resp((const esp_zb_zcl_cmd_config_report_resp_message_t *)message);
+      return ESP_OK;
+    case ESP_ZB_CORE_CMD_READ_REPORT_CFG_RESP_CB_ID:
+      rpt_on_read_resp((const esp_zb_zcl_cmd_read_report_config_resp_message_t *)message);
+      return ESP_OK;
+    case ESP_ZB_CORE_REPORT_ATTR_CB_ID: {
+      const esp_zb_zcl_report_attr_message_t *m = (const esp_zb_zcl_report_attr_message_t *)message;
+      if (!m || m->status != ESP_ZB_ZCL_STATUS_SUCCESS) return ESP_OK;
+
+      device_entry_t *dev = find_device_by_short(m->src_address.u.short_addr);
+      if (!dev) return ESP_OK;
+      dev->last_seen_ms = millis();
+      resync_on_heard(dev);
+      bind_on_heard(dev);
+
+      const uint16_t cluster = m->cluster;
+      const uint16_t attrId = m->attribute.id;
+      const uint8_t type = m->attribute.data.type;
+      const void *val = m->attribute.data.value;
+
+      // Sprint 2: capture Basic cluster fingerprint (manufacturer/model) for pairing UX.
+      // While the device is being interviewed the fingerprint goes out with device_interview.
+      if (cluster == ESP_ZB_ZCL_CLUSTER_ID_BASIC &&
+          (attrId == ESP_ZB_ZCL_ATTR_BASIC_MANUFACTURER_NAME_ID ||
+           attrId == ESP_ZB_ZCL_ATTR_BASIC_MODEL_IDENTIFIER_ID ||
+           attrId == ESP_ZB_ZCL_ATTR_BASIC_SW_BUILD_ID)) {
+        if (device_store_basic_attr(dev, attrId, type, val) && !iv_find_short(dev->short_addr)) {
+          uart_send_basic_fingerprint(dev->ieee16, dev->short_addr,
+                                     dev->manufacturer,
+                                     dev->model,
+                                     dev->swBuildId);
+        }
+        return ESP_OK;
+      }
+
+      forward_attr(dev, cluster, attrId, type, val, m->attribute.data.size);
+      return ESP_OK;
+    }
+    case ESP_ZB_CORE_CMD_READ_ATTR_RESP_CB_ID: {
+      // Answer to zb_read_basic_fingerprint() or a resync read; unsupported attributes come
+      // back with a non-success status.
+      const esp_zb_zcl_cmd_read_attr_resp_message_t *m = (const esp_zb_zcl_cmd_read_attr_resp_message_t *)message;
+      if (!m) return ESP_OK;
+      const uint16_t srcShort = m->info.src_address.u.short_addr;
+      device_entry_t *dev = find_device_by_short(srcShort);
+      if (!dev) return ESP_OK;
+      dev->last_seen_ms = millis();
+      resync_on_heard(dev);
+      bind_on_heard(dev);
+
+      if (m->info.cluster != ESP_ZB_ZCL_CLUSTER_ID_BASIC) {
+        resync_on_read_resp(m->info.header.tsn, srcShort);
+        for (esp_zb_zcl_read_attr_resp_variable_t *v = m->variables; v; v = v->next) {
+          if (v->status != ESP_ZB_ZCL_STATUS_SUCCESS) continue;
+          forward_attr(dev, m->info.cluster, v->attribute.id, v->attribute.data.type, v->attribute.data.value,
+                       v->attribute.data.size);
+        }
+        return ESP_OK;
+      }
+
+      bool changed = false;
+      for (esp_zb_zcl_read_attr_resp_variable_t *v = m->variables; v; v = v->next) {
+        if (v->status != ESP_ZB_ZCL_STATUS_SUCCESS) continue;
+        changed |= device_store_basic_attr(dev, v->attribute.id, v->attribute.data.type, v->attribute.data.value);
+      }
+      if (iv_find_short(srcShort)) {
+        iv_on_basic_response(srcShort);
+      } else if (changed) {
+        uart_send_basic_fingerprint(dev->ieee16, dev->short_addr, dev->manufacturer, dev->model, dev->swBuildId);
+      }
+      return ESP_OK;
+    }
+	  case ESP_ZB_CORE_CMD_CUSTOM_CLUSTER_REQ_CB_ID: {
+	    const esp_zb_zcl_custom_cluster_command_message_t *m = (const esp_zb_zcl_custom_cluster_command_message_t *)message;
+	    if (!m) return ESP_OK;
+	    if (m->info.status != ESP_ZB_ZCL_STATUS_SUCCESS) return ESP_OK;
+
+	    // Map source short address -> ieee string
+	    const uint16_t srcShort = m->info.src_address.u.short_addr;
+	    device_entry_t *dev = find_device_by_short(srcShort);
+	    if (!dev) {
+	      Serial.printf("[ZB] custom_cmd id=0x%02x from unknown short=0x%04x\n", m->info.command.id, srcShort);
+	      return ESP_OK;
+	    }
+	    resync_on_heard(dev);
+	    bind_on_heard(dev);
+
+	    // Payload is a ZCL char/octet string (len byte + data)
+	    const uint8_t *raw = (const uint8_t *)m->data.value;
+	    if (!raw || m->data.size < 1) return ESP_OK;
+	    // best-effort: trust the provided buffer size over the length byte
+	    const size_t len = (m->data.size < (size_t)(1 + raw[0])) ? (size_t)(m->data.size - 1) : (size_t)raw[0];
+
+	    const uint8_t cmdId = m->info.command.id;
+	    if (cmdId == LOCK_CMD_FRAG) {
+	      lock_frag_on_fragment(dev, raw + 1, (uint8_t)len);
+	    } else if (cmdId == LOCK_CMD_FRAG_ACK) {
+	      lock_frag_on_ack(srcShort, raw + 1, (uint8_t)len);
+	    } else {
+	      char jsonBuf[256];
+	      memcpy(jsonBuf, raw + 1, len);
+	      jsonBuf[len] = '\0';
+	      lock_on_message(dev, cmdId, jsonBuf, len);
+	    }
+	    return ESP_OK;
+	  }
+	    default:
+	      return ESP_OK;
+  }
+}
+
+// Zigbee stack calls this weak symbol.
+
+// esp_zb_scheduler_alarm() passes a uint8_t parameter (Arduino-ESP32 Zigbee libs
+// build with that signature). Keep an adapter to avoid void* casts.
+static void bdb_commissioning_cb(uint8_t mode) {
+  esp_zb_bdb_start_top_level_commissioning((esp_zb_bdb_commissioning_mode_t)mode);
+}
+
+extern "C" void esp_zb_app_signal_handler(esp_zb_app_signal_t *signal_struct) {
+  if (!signal_struct) return;
+
+  esp_zb_app_signal_type_t sig = *(esp_zb_app_signal_type_t *)signal_struct->p_app_signal;
+  esp_err_t status = signal_struct->esp_err_status;
+
+  if (sig == ESP_ZB_ZDO_SIGNAL_SKIP_STARTUP) {
+    // Start commissioning
+    esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_INITIALIZATION);
+    return;
+  }
+
+  if (sig == ESP_ZB_BDB_SIGNAL_DEVICE_FIRST_START || sig == ESP_ZB_BDB_SIGNAL_DEVICE_REBOOT) {
+    if (status == ESP_OK) {
+      if (sig == ESP_ZB_BDB_SIGNAL_DEVICE_REBOOT) devstore_reconcile();
+      else if (!net_restore_pending()) devstore_clear(); // a restored table belongs to this network
+      g_zbStackState = ZB_STACK_FORMING;
+      esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_NETWORK_FORMATION);
+    } else {
+      g_zbStackState = ZB_STACK_FAILED;
+    }
+    return;
+  }
+
+  if (sig == ESP_ZB_BDB_SIGNAL_FORMATION) {
+    if (status == ESP_OK) {
+      g_zbStackState = ZB_STACK_FORMED;
+      if (net_restore_pending()) net_restore_formed();
+      esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_NETWORK_STEERING);
+    } else {
+      g_zbStackState = ZB_STACK_FAILED;
+      // Retry formation
+      esp_zb_scheduler_alarm(bdb_commissioning_cb,
+                             (uint8_t)ESP_ZB_BDB_MODE_NETWORK_FORMATION,
+                             1000);
+    }
+    return;
+  }
+
+  if (sig == ESP_ZB_ZDO_SIGNAL_DEVICE_ANNCE) {
+    esp_zb_zdo_signal_device_annce_params_t *annce =
+        (esp_zb_zdo_signal_device_annce_params_t *)esp_zb_app_signal_get_params((uint32_t *)signal_struct->p_app_signal);
+    if (!annce) return;
+
+    device_entry_t *dev = upsert_device(annce->device_short_addr, annce->ieee_addr);
+    if (dev) {
+      dev->sleepy = (annce->capability & 0x08) == 0; // MAC capability bit 3: receiver on when idle
+      uart_send_device_annce(dev->ieee16, dev->short_addr);
+      bind_on_annce(dev);
+      bind_on_heard(dev);
+      // New joins (join window open) and devices we never fingerprinted get a full interview;
+      // a known device re-announcing after a power cycle does not.
+      const bool joinOpen = g_permitJoinUntilMs && (int32_t)(millis() - g_permitJoinUntilMs) < 0;
+      if (joinOpen || dev->model[0] == 0 || dev->epCount == 0) iv_request(dev->short_addr, dev->ieee16);
+    }
+    return;
+  }
+}
+
+// ------------------------ UART command queue ------------------------
+
+typedef enum {
+  CMD_PERMIT_JOIN = 1,
+  CMD_ZCL_ONOFF = 2,
+  CMD_ZCL_LEVEL = 3,
+  CMD_REMOVE_DEVICE = 4,
+  CMD_LOCK_ACTION = 5,
+  CMD_IDENTIFY = 6,
+  CMD_INSTALL_CODE = 7,
+  CMD_REPORT_CFG = 8,
+  CMD_REPORT_READ = 9,
+  CMD_REPORT_PROFILE = 10,
+  CMD_RESYNC = 11,
+  CMD_TOPOLOGY = 12,
+  CMD_BIND = 13,
+  CMD_UNBIND = 14,
+  CMD_BIND_TABLE = 15,
+  CMD_BIND_LIST = 16,
+  CMD_NET_BACKUP = 17,
+} cmd_type_t;
+
+struct uart_cmd_t {
+  cmd_type_t type;
+  char cmdId[40];
+  char ieee16[17];
+  uint8_t dst_ep; // default 1
+  uint16_t u16;
+  uint8_t retries;     // CMD_RETRIES_DEFAULT unless the hub sent "retries"
+  uint16_t timeoutMs;  // per-attempt answer timeout; 0 = by device type (resync: sleepy wait, seconds)
+  char *payload;       // CMD_PAYLOAD_MAX block from the payload pool, or nullptr
+  uint32_t enqUs;      // micros() when queued (dispatch latency)
+};
+
+// Reporting record / request (report_cfg and report_read carry one in the payload block).
+struct rpt_rec_t {
+  uint16_t attr;
+  uint8_t type;    // ZCL data type; decides whether a reportable change is sent
+  uint16_t minS;
+  uint16_t maxS;
+  uint32_t change; // in attribute units (0.01 °C for temperature, ...)
+};
+
+struct rpt_req_t {
+  uint16_t cluster;
+  uint8_t count;
+  rpt_rec_t rec[RPT_MAX_ATTRS];
+};
+
+// Queue of uart_cmd_t* (loop() -> zb_task). Objects come from g_cmdPool and are
+// returned by zb_task after execution; nothing is copied besides the pointer.
+static QueueHandle_t g_cmdQueue = nullptr;
+static uart_cmd_t g_cmdPool[CMD_POOL_SIZE];
+static uart_cmd_t *g_cmdFree[CMD_POOL_SIZE];
+static uint8_t g_cmdFreeCount = 0;
+static char g_cmdPayloadPool[CMD_PAYLOAD_SLOTS][CMD_PAYLOAD_MAX];
+static uint32_t g_cmdPayloadUsed = 0; // bit per block
+static portMUX_TYPE g_cmdPoolMux = portMUX_INITIALIZER_UNLOCKED;
+
+// High-water / failure counters (hb: qHw, poolMin, plMin, poolFail)
+static uint8_t g_cmdQueueHw = 0;
+static uint8_t g_cmdPoolMinFree = CMD_POOL_SIZE;
+static uint8_t g_cmdPayloadMinFree = CMD_PAYLOAD_SLOTS;
+static uint32_t g_cmdPoolFail = 0;
+static bool g_cmdBackpressure = false;
+
+static void cmd_pool_init() {
+  for (uint8_t i = 0; i < CMD_POOL_SIZE; i++) g_cmdFree[i] = &g_cmdPool[CMD_POOL_SIZE - 1 - i];
+  g_cmdFreeCount = CMD_POOL_SIZE;
+  g_cmdQueue = xQueueCreate(CMD_POOL_SIZE, sizeof(uart_cmd_t *));
+}
+
+static uint8_t cmd_payload_free_count() {
+  return (uint8_t)(CMD_PAYLOAD_SLOTS - __builtin_popcount(g_cmdPayloadUsed));
+}
+
+static uart_cmd_t *cmd_alloc() {
+  uart_cmd_t *c = nullptr;
+  portENTER_CRITICAL(&g_cmdPoolMux);
+  if (g_cmdFreeCount) {
+    c = g_cmdFree[--g_cmdFreeCount];
+    if (g_cmdFreeCount < g_cmdPoolMinFree) g_cmdPoolMinFree = g_cmdFreeCount;
+  } else {
+    g_cmdPoolFail++;
+  }
+  portEXIT_CRITICAL(&g_cmdPoolMux);
+  if (c) memset(c, 0, sizeof(*c));
+  return c;
+}
+
+// Attaches a payload block to c; false when all blocks are in use.
+static bool cmd_payload_alloc(uart_cmd_t *c) {
+  portENTER_CRITICAL(&g_cmdPoolMux);
+  for (uint8_t i = 0; i < CMD_PAYLOAD_SLOTS; i++) {
+    if (g_cmdPayloadUsed & (1UL << i)) continue;
+    g_cmdPayloadUsed |= (1UL << i);
+    const uint8_t left = cmd_payload_free_count();
+    if (left < g_cmdPayloadMinFree) g_cmdPayloadMinFree = left;
+    portEXIT_CRITICAL(&g_cmdPoolMux);
+    c->payload = g_cmdPayloadPool[i];
+    c->payload[0] = 0;
+    return true;
+  }
+  g_cmdPoolFail++;
+  portEXIT_CRITICAL(&g_cmdPoolMux);
+  return false;
+}
+
+static void cmd_free(uart_cmd_t *c) {
+  if (!c) return;
+  portENTER_CRITICAL(&g_cmdPoolMux);
+  if (c->payload) {
+    const uint32_t idx = (uint32_t)((c->payload - g_cmdPayloadPool[0]) / CMD_PAYLOAD_MAX);
+    if (idx < CMD_PAYLOAD_SLOTS) g_cmdPayloadUsed &= ~(1UL << idx);
+    c->payload = nullptr;
+  }
+  if (g_cmdFreeCount < CMD_POOL_SIZE) g_cmdFree[g_cmdFreeCount++] = c;
+  portEXIT_CRITICAL(&g_cmdPoolMux);
+}
+
+static void zb_cmd_wake();
+
+static bool enqueue_cmd(uart_cmd_t *cmd) {
+  if (!g_cmdQueue) return false;
+  cmd->enqUs = micros();
+  if (xQueueSend(g_cmdQueue, &cmd, 0) != pdTRUE) return false;
+  const uint8_t depth = (uint8_t)uxQueueMessagesWaiting(g_cmdQueue);
+  if (depth > g_cmdQueueHw) g_cmdQueueHw = depth;
+  zb_cmd_wake();
+  return true;
+}
+
+// loop(): tell the hub to pause/resume device commands (hysteresis, edge-triggered).
+static void cmd_pool_backpressure_tick() {
+  portENTER_CRITICAL(&g_cmdPoolMux);
+  const uint8_t freeObjs = g_cmdFreeCount;
+  const uint8_t freeBlocks = cmd_payload_free_count();
+  portEXIT_CRITICAL(&g_cmdPoolMux);
+  bool want = g_cmdBackpressure;
+  if (!g_cmdBackpressure && (freeObjs <= CMD_POOL_LOW || freeBlocks == 0)) want = true;
+  if (g_cmdBackpressure && freeObjs >= CMD_POOL_LOW * 2 && freeBlocks >= 2) want = false;
+  if (want == g_cmdBackpressure) return;
+  g_cmdBackpressure = want;
+  StaticJsonDocument<128> doc;
+  doc["evt"] = "cmd_backpressure";
+  doc["on"] = want;
+  doc["free"] = freeObjs;
+  doc["payloadFree"] = freeBlocks;
+  uart_send_json(doc, TX_PRIO_CMD);
+}
+
+static void cmd_pool_hb_fields(JsonDocument &doc) {
+  doc["qHw"] = g_cmdQueueHw;
+  doc["poolMin"] = g_cmdPoolMinFree;
+  doc["plMin"] = g_cmdPayloadMinFree;
+  doc["poolFail"] = g_cmdPoolFail;
+  doc["bp"] = g_cmdBackpressure;
+}
+
+static bool rpt_profile_type(uint16_t cluster, uint16_t attr, uint8_t *type);
+
+// report_cfg: "attrs":[{attr,type,min,max,change}] (or a single record at top level);
+// report_read: "attrs":[attrId, ...]. Stored as rpt_req_t in a payload block.
+static bool parse_report_req(const JsonDocument &doc, bool read, uart_cmd_t &out, const char **err) {
+  rpt_req_t req = {};
+  if (doc["cluster"].isNull()) {
+    *err = "missing cluster";
+    return false;
+  }
+  req.cluster = doc["cluster"] | 0;
+  JsonArrayConst attrs = doc["attrs"].as<JsonArrayConst>();
+  if (attrs.isNull() && doc["attr"].isNull()) {
+    *err = "missing attrs";
+    return false;
+  }
+  const size_t n = attrs.isNull() ? 1 : attrs.size();
+  if (n == 0 || n > RPT_MAX_ATTRS) {
+    *err = "1..4 attrs per request";
+    return false;
+  }
+  for (size_t i = 0; i < n; i++) {
+    JsonVariantConst a = attrs.isNull() ? doc.as<JsonVariantConst>() : attrs[i];
+    rpt_rec_t &r = req.rec[req.count++];
+    if (read) {
+      r.attr = a.is<JsonObjectConst>() ? (a["attr"] | 0) : a.as<uint16_t>();
+      continue;
+    }
+    r.attr = a["attr"] | 0;
+    r.minS = a["min"] | 0;
+    r.maxS = a["max"] | 0xFFFF;
+    r.change = a["change"] | 0UL;
+    if (!a["type"].isNull()) r.type = a["type"] | 0;
+    else if (!rpt_profile_type(req.cluster, r.attr, &r.type)) {
+      *err = "type required for this attribute";
+      return false;
+    }
+  }
+  if (!cmd_payload_alloc(&out)) {
+    *err = "cmd payload pool exhausted";
+    return false;
+  }
+  memcpy(out.payload, &req, sizeof(req));
+  out.type = read ? CMD_REPORT_READ : CMD_REPORT_CFG;
+  return true;
+}
+
+// out comes from cmd_alloc(); a payload block is attached only for commands that need one.
+static bool parse_bind_req(const JsonDocument &doc, bool unbind, uart_cmd_t &out, const char **err);
+
+static bool parse_uart_cmd(const JsonDocument &doc, uart_cmd_t &out, const char **err) {
+  *err = nullptr;
+
+  const char *cmd = doc["cmd"] | "";
+  const char *cmdId = doc["cmdId"] | "";
+  if (cmdId && cmdId[0] != '\0') {
+    strncpy(out.cmdId, cmdId, sizeof(out.cmdId) - 1);
+    out.cmdId[sizeof(out.cmdId) - 1] = 0;
+  }
+  const int retries = doc["retries"] | (int)CMD_RETRIES_DEFAULT;
+  out.retries = (uint8_t)constrain(retries, 0, (int)CMD_RETRIES_MAX);
+  out.timeoutMs = (uint16_t)constrain(doc["timeoutMs"] | 0, 0, 30000);
+
+  if (strcmp(cmd, "permit_join") == 0) {
+    int duration = doc["duration"] | (doc["durationSec"] | 60);
+    if (duration < 0) duration = 0;
+    if (duration > 255) duration = 255;
+    out.type = CMD_PERMIT_JOIN;
+    out.u16 = (uint16_t)duration;
+    return true;
+  }
+
+  if (strcmp(cmd, "zcl_onoff") == 0) {
+    const char *ieeeIn = doc["ieee"] | "";
+    char norm[17];
+    if (!normalize_ieee_str(ieeeIn, norm)) {
+      *err = "invalid ieee";
+      return false;
+    }
+    int v = doc["value"].is<int>() ? doc["value"].as<int>() : (doc["on"].as<bool>() ? 1 : 0);
+    out.type = CMD_ZCL_ONOFF;
+    strncpy(out.ieee16, norm, sizeof(out.ieee16));
+    out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
+    if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
+    out.u16 = (uint16_t)(v ? 1 : 0);
+    return true;
+  }
+
+  if (strcmp(cmd, "zcl_level") == 0) {
+    const char *ieeeIn = doc["ieee"] | "";
+    char norm[17];
+    if (!normalize_ieee_str(ieeeIn, norm)) {
+      *err = "invalid ieee";
+      return false;
+    }
+    int level = doc["value"] | (doc["level"] | 0);
+    if (level < 0) level = 0;
+    if (level > 255) level = 255;
+    out.type = CMD_ZCL_LEVEL;
+    strncpy(out.ieee16, norm, sizeof(out.ieee16));
+    out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
+    if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
+    out.u16 = (uint16_t)level;
+    return true;
+  }
+
+  // Sprint 11: Identify (blink) command
+  if (strcmp(cmd, "identify") == 0) {
+    const char *ieeeIn = doc["ieee"] | "";
+    char norm[17];
+    if (!normalize_ieee_str(ieeeIn, norm)) {
+      *err = "invalid ieee";
+      return false;
+    }
+    int timeSec = doc["time"] | (doc["duration"] | (doc["durationSec"] | 4));
+    if (timeSec < 0) timeSec = 0;
+    if (timeSec > 255) timeSec = 255;
+    out.type = CMD_IDENTIFY;
+    strncpy(out.ieee16, norm, sizeof(out.ieee16));
+    out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
+    if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
+    out.u16 = (uint16_t)timeSec;
+    return true;
+  }
+
+	if (strcmp(cmd, "lock_action") == 0) {
+	  const char *ieeeIn = doc["ieee"] | "";
+	  char norm[17];
+	  if (!normalize_ieee_str(ieeeIn, norm)) {
+	    *err = "invalid ieee";
+	    return false;
+	  }
+	  const char *action = doc["action"] | "";
+	  JsonVariantConst argsV = doc["args"].as<JsonVariantConst>();
+	  if (!action || action[0] == 0) {
+	    *err = "missing action";
+	    return false;
+	  }
+	  out.type = CMD_LOCK_ACTION;
+	  strncpy(out.ieee16, norm, sizeof(out.ieee16));
+	  out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
+	  if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
+
+	  // Binary ACTION_REQ (see SmartLock wire format); u16 = payload length
+	  if (!cmd_payload_alloc(&out)) {
+	    *err = "cmd payload pool exhausted";
+	    return false;
+	  }
+	  out.u16 = (uint16_t)lock_encode_action(out.cmdId, action, argsV, out.payload);
+	  if (out.u16 == 0) {
+	    *err = "payload too large";
+	    return false;
+	  }
+	  return true;
+	}
+
+  if (strcmp(cmd, "install_code") == 0) {
+    const char *ieeeIn = doc["ieee"] | "";
+    char norm[17];
+    if (!normalize_ieee_str(ieeeIn, norm)) {
+      *err = "invalid ieee";
+      return false;
+    }
+    // Hex, separators allowed; stored as raw bytes in payload, byte count in u16.
+    if (!cmd_payload_alloc(&out)) {
+      *err = "cmd payload pool exhausted";
+      return false;
+    }
+    const char *code = doc["code"] | "";
+    uint8_t n = 0;
+    int hi = -1;
+    for (size_t i = 0; code[i] != 0; i++) {
+      const char c = code[i];
+      int v;
+      if (c >= '0' && c <= '9') v = c - '0';
+      else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+      else continue;
+      if (hi < 0) {
+        hi = v;
+        continue;
+      }
+      if (n >= 18) {
+        *err = "invalid install code";
+        return false;
+      }
+      out.payload[n++] = (char)((hi << 4) | v);
+      hi = -1;
+    }
+    if (hi >= 0 || (n != 8 && n != 10 && n != 14 && n != 18)) {
+      *err = "invalid install code";
+      return false;
+    }
+    out.type = CMD_INSTALL_CODE;
+    strncpy(out.ieee16, norm, sizeof(out.ieee16));
+    out.u16 = n;
+    return true;
+  }
+
+  if (strcmp(cmd, "resync") == 0) {
+    out.type = CMD_RESYNC;
+    const bool stop = doc["stop"] | false;
+    out.u16 = stop ? 0 : (uint16_t)constrain(doc["rate"] | (int)RESYNC_RATE_DEFAULT, 1, 20);
+    out.timeoutMs = (uint16_t)constrain(doc["sleepyWaitSec"] | (int)RESYNC_SLEEPY_WAIT_S_DEFAULT, 0, 3600);
+    return true;
+  }
+
+  if (strcmp(cmd, "topology") == 0) {
+    out.type = CMD_TOPOLOGY;
+    const bool stop = doc["stop"] | false;
+    out.u16 = stop ? 0 : (uint16_t)constrain(doc["gapMs"] | (int)TOPO_GAP_MS_DEFAULT, 50, 10000);
+    out.dst_ep = (uint8_t)constrain(doc["weakLqi"] | (int)TOPO_WEAK_LQI_DEFAULT, 0, 255);
+    return true;
+  }
+
+  if (strcmp(cmd, "bind_list") == 0) {
+    out.type = CMD_BIND_LIST;
+    return true;
+  }
+
+  if (strcmp(cmd, "net_backup") == 0) {
+    out.type = CMD_NET_BACKUP;
+    return true;
+  }
+
+  if (strcmp(cmd, "bind") == 0 || strcmp(cmd, "unbind") == 0 || strcmp(cmd, "bind_table") == 0) {
+    const char *ieeeIn = doc["ieee"] | "";
+    char norm[17];
+    if (!normalize_ieee_str(ieeeIn, norm)) {
+      *err = "invalid ieee";
+      return false;
+    }
+    strncpy(out.ieee16, norm, sizeof(out.ieee16));
+    out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
+    if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
+    if (strcmp(cmd, "bind_table") == 0) {
+      out.type = CMD_BIND_TABLE;
+      return true;
+    }
+    return parse_bind_req(doc, strcmp(cmd, "unbind") == 0, out, err);
+  }
+
+  if (strcmp(cmd, "report_cfg") == 0 || strcmp(cmd, "report_read") == 0 || strcmp(cmd, "report_profile") == 0) {
+    const char *ieeeIn = doc["ieee"] | "";
+    char norm[17];
+    if (!normalize_ieee_str(ieeeIn, norm)) {
+      *err = "invalid ieee";
+      return false;
+    }
+    strncpy(out.ieee16, norm, sizeof(out.ieee16));
+    out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
+    if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
+    if (strcmp(cmd, "report_profile") == 0) {
+      out.type = CMD_REPORT_PROFILE;
+      return true;
+    }
+    const bool read = strcmp(cmd, "report_read") == 0;
+    return parse_report_req(doc, read, out, err);
+  }
+
+  if (strcmp(cmd, "remove_device") == 0) {
+    const char *ieeeIn = doc["ieee"] | "";
+    char norm[17];
+    if (!normalize_ieee_str(ieeeIn, norm)) {
+      *err = "invalid ieee";
+      return false;
+    }
+    out.type = CMD_REMOVE_DEVICE;
+    strncpy(out.ieee16, norm, sizeof(out.ieee16));
+    return true;
+  }
+
+  *err = "unknown cmd";
+  return false;
+}
+
+// ------------------------ Command completion ------------------------
+//
+// Each ON/OFF / level / identify command is remembered by ZCL TSN until the
+// device answers. Completion, in order of strength:
+//   - ZCL Default Response for that TSN -> ok = (status == SUCCESS), confirm "zcl"
+//   - APS ack (send status ESP_OK) but no Default Response before the timeout
+//     -> ok, confirm "aps" (some devices suppress the Default Response)
+//   - nothing -> retry (new TSN, short address re-resolved) with exponential
+//     backoff; after the last attempt cmd_result ok=false error "timeout".
+// cmd_result carries ms (first send -> answer) and attempts. The hub's queue
+// credit is returned by {"evt":"cmd_sent"} as soon as the command leaves the
+// queue, not by the (later) cmd_result, which carries "tracked":true.
+// All of this runs in the Zigbee context (zb_task, action handler, send-status callback).
+
+struct cmd_pending_t {
+  bool used;
+  bool apsAcked;
+  uint8_t tsn;
+  uint8_t type;
+  uint8_t dst_ep;
+  uint8_t attempts;
+  uint8_t maxAttempts;
+  uint16_t short_addr;
+  uint16_t value;
+  uint32_t timeoutMs;
+  uint32_t firstSentMs;
+  uint32_t deadlineMs; // answer deadline of the current attempt (0 while waiting to retry)
+  uint32_t retryAtMs;
+  char cmdId[40];
+  char ieee16[17];
+};
+
+static cmd_pending_t g_cmdPending[CMD_PENDING_MAX];
+static uint32_t g_cmdTimeouts = 0;
+static uint32_t g_cmdRetries = 0;
+
+static void uart_send_cmd_sent(const char *cmdId) {
+  StaticJsonDocument<96> doc;
+  doc["evt"] = "cmd_sent";
+  doc["cmdId"] = cmdId;
+  uart_send_json(doc, TX_PRIO_CMD);
+}
+
+static void cmd_track_result(cmd_pending_t &p, bool ok, const char *confirm, const char *err, int zclStatus) {
+  StaticJsonDocument<320> doc;
+  doc["evt"] = "cmd_result";
+  if (p.cmdId[0]) doc["cmdId"] = p.cmdId;
+  doc["ieee"] = p.ieee16;
+  doc["ok"] = ok;
+  if (!ok && err) doc["error"] = err;
+  if (confirm) doc["confirm"] = confirm;
+  if (zclStatus >= 0) doc["zclStatus"] = zclStatus;
+  doc["ms"] = (uint32_t)(millis() - p.firstSentMs);
+  doc["attempts"] = p.attempts;
+  doc["tracked"] = true;
+  uart_send_json(doc, TX_PRIO_CMD);
+  p.used = false;
+}
+
+// Sends the current attempt; false if the device is no longer routable.
+static bool cmd_track_transmit(cmd_pending_t &p) {
+  device_entry_t *d = find_routable_device(p.ieee16);
+  if (!d) return false;
+  p.short_addr = d->short_addr;
+  if (p.type == CMD_ZCL_ONOFF) p.tsn = zb_send_onoff(p.short_addr, p.dst_ep, p.value ? true : false);
+  else if (p.type == CMD_ZCL_LEVEL) p.tsn = zb_send_level(p.short_addr, p.dst_ep, (uint8_t)p.value, 0);
+  else p.tsn = zb_send_identify(p.short_addr, p.dst_ep, p.value);
+  p.attempts++;
+  p.apsAcked = false;
+  p.retryAtMs = 0;
+  p.deadlineMs = millis() + p.timeoutMs;
+  return true;
+}
+
+static void cmd_track_start(const uart_cmd_t &cmd, const device_entry_t *d) {
+  cmd_pending_t *p = nullptr;
+  for (uint8_t i = 0; i < CMD_PENDING_MAX && !p; i++) {
+    if (!g_cmdPending[i].used) p = &g_cmdPending[i];
+  }
+
+  if (!p) {
+    // Tracking table full: send once and report "queued" like before.
+    if (cmd.type == CMD_ZCL_ONOFF) zb_send_onoff(d->short_addr, cmd.dst_ep, cmd.u16 ? true : false);
+    else if (cmd.type == CMD_ZCL_LEVEL) zb_send_level(d->short_addr, cmd.dst_ep, (uint8_t)cmd.u16, 0);
+    else zb_send_identify(d->short_addr, cmd.dst_ep, cmd.u16);
+    uart_send_cmd_result(cmd.cmdId, cmd.ieee16, true, nullptr);
+    return;
+  }
+
+  memset(p, 0, sizeof(*p));
+  p->used = true;
+  p->type = (uint8_t)cmd.type;
+  p->dst_ep = cmd.dst_ep;
+  p->value = cmd.u16;
+  p->maxAttempts = (uint8_t)(1 + cmd.retries);
+  p->timeoutMs = cmd.timeoutMs ? cmd.timeoutMs : (d->sleepy ? CMD_TIMEOUT_SLEEPY_MS : CMD_TIMEOUT_MS);
+  strncpy(p->cmdId, cmd.cmdId, sizeof(p->cmdId) - 1);
+  strncpy(p->ieee16, cmd.ieee16, sizeof(p->ieee16) - 1);
+  p->firstSentMs = millis();
+  cmd_track_transmit(*p);
+  if (p->cmdId[0]) uart_send_cmd_sent(p->cmdId);
+}
+
+static cmd_pending_t *cmd_track_find(uint8_t tsn, uint16_t short_addr) {
+  for (uint8_t i = 0; i < CMD_PENDING_MAX; i++) {
+    cmd_pending_t &p = g_cmdPending[i];
+    if (p.used && p.deadlineMs && p.tsn == tsn && p.short_addr == short_addr) return &p;
+  }
+  return nullptr;
+}
+
+static void cmd_track_schedule_retry(cmd_pending_t &p) {
+  if (p.attempts >= p.maxAttempts) {
+    g_cmdTimeouts++;
+    cmd_track_result(p, false, nullptr, "timeout", -1);
+    return;
+  }
+  const uint32_t backoff = (CMD_BACKOFF_BASE_MS << (p.attempts - 1)) + (esp_random() % CMD_BACKOFF_BASE_MS);
+  p.deadlineMs = 0;
+  p.retryAtMs = millis() + backoff;
+  if (p.retryAtMs == 0) p.retryAtMs = 1;
+}
+
+static void cmd_track_on_default_resp(uint8_t tsn, uint16_t src_short, uint8_t zcl_status) {
+  cmd_pending_t *p = cmd_track_find(tsn, src_short);
+  if (!p) return;
+  const bool ok = zcl_status == ESP_ZB_ZCL_STATUS_SUCCESS;
+  char err[24];
+  snprintf(err, sizeof(err), "zcl status 0x%02x", (unsigned)zcl_status);
+  cmd_track_result(*p, ok, "zcl", ok ? nullptr : err, zcl_status);
+}
+
+// APS-level outcome of a ZCL frame (ESP_OK = acked by the destination).
+static void cmd_track_send_status_cb(esp_zb_zcl_command_send_status_message_t message) {
+  cmd_pending_t *p = cmd_track_find(message.tsn, message.dst_addr.u.short_addr);
+  if (!p) return;
+  if (message.status == ESP_OK) {
+    p->apsAcked = true;
+  } else {
+    cmd_track_schedule_retry(*p);
+  }
+}
+
+static void cmd_track_tick() {
+  const uint32_t now = millis();
+  for (uint8_t i = 0; i < CMD_PENDING_MAX; i++) {
+    cmd_pending_t &p = g_cmdPending[i];
+    if (!p.used) continue;
+    if (p.retryAtMs) {
+      if ((int32_t)(now - p.retryAtMs) < 0) continue;
+      g_cmdRetries++;
+      if (!cmd_track_transmit(p)) cmd_track_result(p, false, nullptr, "unknown device (wait for device_annce)", -1);
+      continue;
+    }
+    if ((int32_t)(now - p.deadlineMs) < 0) continue;
+    if (p.apsAcked) cmd_track_result(p, true, "aps", nullptr, -1);
+    else cmd_track_schedule_retry(p);
+  }
+}
+
+// ------------------------ Attribute reporting ------------------------
+//
+// ZCL Configure Reporting / Read Reporting Configuration. After an interview
+// the device's server clusters are matched against RPT_PROFILES: each matching
+// (endpoint, cluster) is bound to the coordinator and configured in one
+// Configure Reporting frame, so stable values stop generating periodic traffic
+// (the device reports on change >= "change", at most every "min" seconds, and
+// at least every "max" seconds as a liveness refresh). The hub can override
+// per attribute (report_cfg), read back what the device has (report_read) and
+// re-apply the profile (report_profile). Every request ends in one
+// {"evt":"report_cfg"}; requests from the hub also get a tracked cmd_result.
+// Runs in the Zigbee context, like the command tracking above.
+
+struct rpt_profile_t {
+  const char *model; // nullptr = any device exposing the cluster
+  uint16_t cluster;
+  uint16_t attr;
+  uint8_t type;
+  uint16_t minS;
+  uint16_t maxS;
+  uint32_t change;
+};
+
+// Model rows win over the generic rows of the same cluster.
+static const rpt_profile_t RPT_PROFILES[] = {
+    {"TH_SENSOR_V1", 0x0402, 0x0000, 0x29, 60, 1800, 25},  // 0.25 °C
+    {"TH_SENSOR_V1", 0x0405, 0x0000, 0x21, 60, 1800, 200}, // 2 %RH
+    {nullptr, 0x0006, 0x0000, 0x10, 0, 900, 0},            // on/off (discrete)
+    {nullptr, 0x0008, 0x0000, 0x20, 1, 900, 3},            // current level
+    {nullptr, 0x0402, 0x0000, 0x29, 30, 900, 20},          // temperature, 0.01 °C
+    {nullptr, 0x0405, 0x0000, 0x21, 30, 900, 100},         // humidity, 0.01 %RH
+    {nullptr, 0x0406, 0x0000, 0x18, 0, 900, 0},            // occupancy (bitmap8)
+};
+static const uint8_t RPT_PROFILE_COUNT = sizeof(RPT_PROFILES) / sizeof(RPT_PROFILES[0]);
+
+struct rpt_pending_t {
+  bool used;
+  bool read;
+  bool fromHub; // answer with a tracked cmd_result too
+  uint8_t tsn;
+  uint8_t ep;
+  uint16_t short_addr;
+  uint32_t sentMs;
+  uint32_t deadlineMs;
+  char cmdId[40];
+  char ieee16[17];
+  rpt_req_t req;
+};
+
+static rpt_pending_t g_rptPending[RPT_PENDING_MAX];
+
+static bool rpt_profile_type(uint16_t cluster, uint16_t attr, uint8_t *type) {
+  for (uint8_t i = 0; i < RPT_PROFILE_COUNT; i++) {
+    if (RPT_PROFILES[i].cluster == cluster && RPT_PROFILES[i].attr == attr) {
+      *type = RPT_PROFILES[i].type;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Size of the reportable change field; 0 for discrete types, which have none.
+static uint8_t zcl_analog_size(uint8_t type) {
+  if (type >= 0x20 && type <= 0x27) return (uint8_t)(type - 0x1F); // uint8..uint64
+  if (type >= 0x28 && type <= 0x2F) return (uint8_t)(type - 0x27); // int8..int64
+  if (type == 0x38) return 2;                                      // semi float
+  if (type == 0x39 || (type >= 0xE0 && type <= 0xE2)) return 4;    // float, ToD/date/UTC
+  if (type == 0x3A) return 8;                                      // double
+  return 0;
+}
+
+static rpt_pending_t *rpt_alloc() {
+  for (uint8_t i = 0; i < RPT_PENDING_MAX; i++) {
+    if (!g_rptPending[i].used) {
+      memset(&g_rptPending[i], 0, sizeof(g_rptPending[i]));
+      return &g_rptPending[i];
+    }
+  }
+  return nullptr;
+}
+
+// status: per record ZCL status (configure) or nullptr for all-success; err ends the request.
+static void rpt_finish(rpt_pending_t &p, const char *err, const uint8_t *status) {
+  DynamicJsonDocument doc(768);
+  doc["evt"] = "report_cfg";
+  doc["ieee"] = p.ieee16;
+  doc["ep"] = p.ep;
+  doc["cluster"] = p.req.cluster;
+  doc["op"] = p.read ? "read" : "configure";
+  doc["source"] = p.fromHub ? "hub" : "profile";
+  bool ok = err == nullptr;
+  JsonArray attrs = doc.createNestedArray("attrs");
+  for (uint8_t i = 0; i < p.req.count; i++) {
+    const rpt_rec_t &r = p.req.rec[i];
+    JsonObject o = attrs.createNestedObject();
+    o["attr"] = r.attr;
+    if (err) continue;
+    const uint8_t st = status ? status[i] : (uint8_t)ESP_ZB_ZCL_STATUS_SUCCESS;
+    o["status"] = st;
+    if (st != ESP_ZB_ZCL_STATUS_SUCCESS) {
+      ok = false;
+      continue;
+    }
+    o["type"] = r.type;
+    o["min"] = r.minS;
+    o["max"] = r.maxS;
+    if (zcl_analog_size(r.type)) o["change"] = r.change;
+  }
+  doc["ok"] = ok;
+  if (err) doc["error"] = err;
+  uart_send_json(doc);
+
+  if (p.fromHub) {
+    StaticJsonDocument<256> res;
+    res["evt"] = "cmd_result";
+    if (p.cmdId[0]) res["cmdId"] = p.cmdId;
+    res["ieee"] = p.ieee16;
+    res["ok"] = ok;
+    if (!ok) res["error"] = err ? err : "attribute rejected";
+    if (!err) res["confirm"] = "zcl";
+    res["ms"] = (uint32_t)(millis() - p.sentMs);
+    res["attempts"] = 1;
+    res["tracked"] = true;
+    uart_send_json(res, TX_PRIO_CMD);
+  }
+  Serial.printf("[RPT] %s ep=%u cluster=0x%04x %s ok=%d%s%s\n", p.ieee16, (unsigned)p.ep, (unsigned)p.req.cluster,
+                p.read ? "read" : "configure", ok ? 1 : 0, err ? " err=" : "", err ? err : "");
+  p.used = false;
+}
+
+static void rpt_transmit(rpt_pending_t &p, const device_entry_t *d) {
+  p.short_addr = d->short_addr;
+  p.sentMs = millis();
+  p.deadlineMs = p.sentMs + (d->sleepy ? CMD_TIMEOUT_SLEEPY_MS : RPT_TIMEOUT_MS);
+
+  if (p.read) {
+    esp_zb_zcl_attribute_record_t recs[RPT_MAX_ATTRS] = {};
+    for (uint8_t i = 0; i < p.req.count; i++) {
+      recs[i].direction = ESP_ZB_ZCL_REPORT_DIRECTION_SEND;
+      recs[i].attributeID = p.req.rec[i].attr;
+    }
+    esp_zb_zcl_read_report_config_cmd_t cmd = {};
+    cmd.zcl_basic_cmd.src_endpoint = COORD_ENDPOINT;
+    cmd.zcl_basic_cmd.dst_endpoint = p.ep;
+    cmd.zcl_basic_cmd.dst_addr_u.addr_short = p.short_addr;
+    cmd.address_mode = ESP_ZB_APS_ADDR_MODE_16_ENDP_PRESENT;
+    cmd.clusterID = p.req.cluster;
+    cmd.record_number = p.req.count;
+    cmd.record_field = recs;
+    p.tsn = esp_zb_zcl_read_report_config_cmd_req(&cmd);
+    return;
+  }
+
+  esp_zb_zcl_config_report_record_t recs[RPT_MAX_ATTRS] = {};
+  uint8_t change[RPT_MAX_ATTRS][8] = {};
+  for (uint8_t i = 0; i < p.req.count; i++) {
+    const rpt_rec_t &r = p.req.rec[i];
+    recs[i].direction = ESP_ZB_ZCL_REPORT_DIRECTION_SEND;
+    recs[i].attributeID = r.attr;
+    recs[i].attrType = r.type;
+    recs[i].min_interval = r.minS;
+    recs[i].max_interval = r.maxS;
+    const uint8_t n = zcl_analog_size(r.type);
+    if (n == 0) continue;
+    if (r.type == 0x39) {
+      const float f = (float)r.change;
+      memcpy(change[i], &f, sizeof(f));
+    } else {
+      for (uint8_t b = 0; b < n && b < 4; b++) change[i][b] = (uint8_t)(r.change >> (8 * b));
+    }
+    recs[i].reportable_change = change[i];
+  }
+  esp_zb_zcl_config_report_cmd_t cmd = {};
+  cmd.zcl_basic_cmd.src_endpoint = COORD_ENDPOINT;
+  cmd.zcl_basic_cmd.dst_endpoint = p.ep;
+  cmd.zcl_basic_cmd.dst_addr_u.addr_short = p.short_addr;
+  cmd.address_mode = ESP_ZB_APS_ADDR_MODE_16_ENDP_PRESENT;
+  cmd.clusterID = p.req.cluster;
+  cmd.record_number = p.req.count;
+  cmd.record_field = recs;
+  p.tsn = esp_zb_zcl_config_report_cmd_req(&cmd);
+}
+
+// Bind + configure every profiled server cluster of dev. Returns requests sent.
+static uint8_t rpt_apply_profile(device_entry_t *dev) {
+  if (!dev || !dev->used || dev->short_addr == ZB_DEVIDX_NO_SHORT) return 0;
+  uint8_t ieee_le[8];
+  if (!ieee_str16_to_le_bytes(dev->ieee16, ieee_le)) return 0;
+
+  uint8_t sent = 0;
+  for (uint8_t e = 0; e < dev->epCount; e++) {
+    const dev_ep_t &ep = dev->eps[e];
+    for (uint8_t i = 0; i < RPT_PROFILE_COUNT; i++) {
+      const uint16_t cluster = RPT_PROFILES[i].cluster;
+      if (!(ep.inMask & dev_cluster_bit(cluster))) continue;
+      // Each cluster once per endpoint (first row that names it).
+      bool seen = false;
+      for (uint8_t j = 0; j < i && !seen; j++) seen = RPT_PROFILES[j].cluster == cluster;
+      if (seen) continue;
+
+      bool modelRows = false;
+      for (uint8_t j = 0; j < RPT_PROFILE_COUNT && !modelRows; j++) {
+        modelRows = RPT_PROFILES[j].cluster == cluster && RPT_PROFILES[j].model &&
+                    strcmp(RPT_PROFILES[j].model, dev->model) == 0;
+      }
+      rpt_pending_t *p = rpt_alloc();
+      if (!p) {
+        Serial.printf("[RPT] %s: pending table full, profile incomplete\n", dev->ieee16);
+        return sent;
+      }
+      p->used = true;
+      p->ep = ep.ep;
+      strncpy(p->ieee16, dev->ieee16, sizeof(p->ieee16) - 1);
+      p->req.cluster = cluster;
+      for (uint8_t j = 0; j < RPT_PROFILE_COUNT && p->req.count < RPT_MAX_ATTRS; j++) {
+        const rpt_profile_t &row = RPT_PROFILES[j];
+        if (row.cluster != cluster) continue;
+        if (modelRows ? !(row.model && strcmp(row.model, dev->model) == 0) : row.model != nullptr) continue;
+        rpt_rec_t &r = p->req.rec[p->req.count++];
+        r.attr = row.attr;
+        r.type = row.type;
+        r.minS = row.minS;
+        r.maxS = row.maxS;
+        r.change = row.change;
+      }
+      zb_bind_to_coordinator(ieee_le, dev->short_addr, ep.ep, cluster);
+      rpt_transmit(*p, dev);
+      sent++;
+    }
+  }
+  return sent;
+}
+
+// zb_task: report_cfg / report_read / report_profile from the hub.
+static void rpt_execute(const uart_cmd_t &cmd) {
+  device_entry_t *d = find_routable_device(cmd.ieee16);
+  if (!d) {
+    uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "unknown device (wait for device_annce)");
+    return;
+  }
+  if (cmd.type == CMD_REPORT_PROFILE) {
+    const uint8_t n = rpt_apply_profile(d);
+    uart_send_cmd_result(cmd.cmdId, cmd.ieee16, n > 0, n > 0 ? nullptr : "no profiled clusters");
+    return;
+  }
+  rpt_pending_t *p = rpt_alloc();
+  if (!p) {
+    uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "reporting busy");
+    return;
+  }
+  p->used = true;
+  p->read = cmd.type == CMD_REPORT_READ;
+  p->fromHub = true;
+  p->ep = cmd.dst_ep;
+  strncpy(p->cmdId, cmd.cmdId, sizeof(p->cmdId) - 1);
+  strncpy(p->ieee16, cmd.ieee16, sizeof(p->ieee16) - 1);
+  memcpy(&p->req, cmd.payload, sizeof(p->req));
+  rpt_transmit(*p, d);
+  if (p->cmdId[0]) uart_send_cmd_sent(p->cmdId);
+}
+
+static rpt_pending_t *rpt_find(uint8_t tsn, uint16_t short_addr) {
+  for (uint8_t i = 0; i < RPT_PENDING_MAX; i++) {
+    rpt_pending_t &p = g_rptPending[i];
+    if (p.used && p.tsn == tsn && p.short_addr == short_addr) return &p;
+  }
+  return nullptr;
+}
+
+// A Default Response instead of the proper answer means the device refused the command.
+static void rpt_on_default_resp(uint8_t tsn, uint16_t src_short, uint8_t zcl_status) {
+  rpt_pending_t *p = rpt_find(tsn, src_short);
+  if (!p) return;
+  char err[24];
+  snprintf(err, sizeof(err), "zcl status 0x%02x", (unsigned)zcl_status);
+  rpt_finish(*p, err, nullptr);
+}
+
+static void rpt_on_config_resp(const esp_zb_zcl_cmd_config_report_resp_message_t *m) {
+  if (!m) return;
+  rpt_pending_t *p = rpt_find(m->info.header.tsn, m->info.src_address.u.short_addr);
+  if (!p || p->read) return;
+  // All records accepted -> a single SUCCESS record without attribute id.
+  uint8_t status[RPT_MAX_ATTRS] = {};
+  for (esp_zb_zcl_config_report_resp_variable_t *v = m->variables; v; v = v->next) {
+    if (v->status == ESP_ZB_ZCL_STATUS_SUCCESS) continue;
+    for (uint8_t i = 0; i < p->req.count; i++) {
+      if (p->req.rec[i].attr == v->attribute_id) status[i] = (uint8_t)v->status;
+    }
+  }
+  rpt_finish(*p, nullptr, status);
+}
+
+static void rpt_on_read_resp(const esp_zb_zcl_cmd_read_report_config_resp_message_t *m) {
+  if (!m) return;
+  rpt_pending_t *p = rpt_find(m->info.header.tsn, m->info.src_address.u.short_addr);
+  if (!p || !p->read) return;
+  uint8_t status[RPT_MAX_ATTRS];
+  memset(status, ESP_ZB_ZCL_STATUS_UNSUP_ATTRIB, sizeof(status));
+  for (esp_zb_zcl_read_report_config_resp_variable_t *v = m->variables; v; v = v->next) {
+    for (uint8_t i = 0; i < p->req.count; i++) {
+      rpt_rec_t &r = p->req.rec[i];
+      if (r.attr != v->attribute_id) continue;
+      status[i] = (uint8_t)v->status;
+      if (v->status != ESP_ZB_ZCL_STATUS_SUCCESS) continue;
+      r.type = v->client.attr_type;
+      r.minS = v->client.min_interval;
+      r.maxS = v->client.max_interval;
+      r.change = 0;
+      const uint8_t n = zcl_analog_size(r.type);
+      for (uint8_t b = 0; b < n && b < 4; b++) r.change |= (uint32_t)v->client.delta[b] << (8 * b);
+    }
+  }
+  rpt_finish(*p, nullptr, status);
+}
+
+static void rpt_tick() {
+  const uint32_t now = millis();
+  for (uint8_t i = 0; i < RPT_PENDING_MAX; i++) {
+    rpt_pending_t &p = g_rptPending[i];
+    if (p.used && (int32_t)(now - p.deadlineMs) >= 0) rpt_finish(p, "timeout", nullptr);
+  }
+}
+
+// ------------------------ State resync ------------------------
+//
+// {"cmd":"resync"} walks the device table and reads the current value of every
+// state attribute the device's server clusters have (RESYNC_ATTRS), one Read
+// Attributes frame per (endpoint, cluster). A token bucket paces the frames
+// (default RESYNC_RATE_DEFAULT per second, at most RESYNC_MAX_INFLIGHT waiting
+// for an answer) so a restart does not flood the radio. Mains-powered devices
+// go first; sleepy ones (rx off when idle, or battery powered) are deferred
+// until they are heard from (report, response, lock frame) and then read right
+// away while their radio is on. Deferred devices not heard within sleepyWaitSec
+// are counted as skipped. Values reach the hub as ordinary attr_report frames.
+//   -> {"evt":"resync","state":"started"|"progress"|"done"|"stopped",
+//       "devices":40,"devicesDone":12,"reads":30,"answered":28,"failed":1,"deferred":5,"skipped":0,"ms":5400}
+
+struct resync_attrs_t {
+  uint16_t cluster;
+  uint8_t count;
+  uint16_t attrs[3];
+};
+
+static const resync_attrs_t RESYNC_ATTRS[] = {
+    {0x0006, 1, {0x0000}},                 // on/off
+    {0x0008, 1, {0x0000}},                 // current level
+    {0x0101, 1, {0x0000}},                 // lock state
+    {0x0102, 1, {0x0008}},                 // current position lift %
+    {0x0201, 2, {0x0000, 0x0012}},         // local temperature, occupied heating setpoint
+    {0x0300, 3, {0x0003, 0x0004, 0x0007}}, // current x / y, color temperature
+    {0x0400, 1, {0x0000}},                 // illuminance
+    {0x0402, 1, {0x0000}},                 // temperature
+    {0x0405, 1, {0x0000}},                 // humidity
+    {0x0406, 1, {0x0000}},                 // occupancy
+    {0x0500, 1, {0x0002}},                 // IAS zone status
+    {0x0702, 1, {0x0000}},                 // current summation delivered
+    {0x0B04, 1, {0x050B}},                 // active power
+    {0x0001, 1, {0x0021}},                 // battery percentage remaining
+};
+static const uint8_t RESYNC_ATTR_COUNT = sizeof(RESYNC_ATTRS) / sizeof(RESYNC_ATTRS[0]);
+
+struct resync_inflight_t {
+  bool used;
+  uint8_t tsn;
+  uint16_t short_addr;
+  uint32_t deadlineMs;
+};
+
+struct resync_state_t {
+  bool active;
+  bool waitForm;         // requested before the network was up
+  uint16_t ratePerSec;
+  uint32_t sleepyWaitMs;
+  uint32_t startMs;
+  uint32_t lastRefillMs;
+  uint32_t milliTokens;  // token bucket, 1000 = one frame
+  uint32_t nextProgressMs;
+  uint16_t order[MAX_DEVICES]; // mains-powered slots, in table order
+  uint16_t orderCount;
+  uint16_t orderPos;
+  uint16_t wake[8];      // deferred sleepy slots that just spoke
+  uint8_t wakeCount;
+  uint16_t cur;          // slot being read, ZB_DEVIDX_NONE between devices
+  uint8_t curEp;
+  uint8_t curAttr;       // next RESYNC_ATTRS row for cur/curEp
+  uint16_t devices, devicesDone, deferred, reads, answered, failed;
+};
+
+static resync_state_t g_resync;
+
+static uint32_t g_resyncDeferred[MAX_DEVICES / 32]; // bit per slot
+static resync_inflight_t g_resyncInflight[RESYNC_MAX_INFLIGHT];
+
+static bool resync_is_sleepy(const device_entry_t &d) {
+  if (d.sleepy) return true; // from device_annce; not known after a coordinator restart
+  const uint32_t powerCfg = dev_cluster_bit(0x0001);
+  for (uint8_t e = 0; e < d.epCount; e++) {
+    if (d.eps[e].inMask & powerCfg) return true; // battery powered
+  }
+  return false;
+}
+
+static void resync_send_state(const char *state) {
+  StaticJsonDocument<256> doc;
+  doc["evt"] = "resync";
+  doc["state"] = state;
+  doc["devices"] = g_resync.devices;
+  doc["devicesDone"] = g_resync.devicesDone;
+  doc["reads"] = g_resync.reads;
+  doc["answered"] = g_resync.answered;
+  doc["failed"] = g_resync.failed;
+  doc["deferred"] = g_resync.deferred;
+  if (strcmp(state, "done") == 0 || strcmp(state, "stopped") == 0) doc["skipped"] = g_resync.deferred;
+  doc["ms"] = (uint32_t)(millis() - g_resync.startMs);
+  uart_send_json(doc);
+}
+
+static void resync_stop(const char *state) {
+  if (g_resync.active || g_resync.waitForm) resync_send_state(state);
+  g_resync.active = false;
+  g_resync.waitForm = false;
+  memset(g_resyncDeferred, 0, sizeof(g_resyncDeferred));
+  memset(g_resyncInflight, 0, sizeof(g_resyncInflight));
+}
+
+static void resync_begin() {
+  const uint32_t now = millis();
+  g_resync.active = true;
+  g_resync.waitForm = false;
+  g_resync.startMs = now;
+  g_resync.lastRefillMs = now;
+  g_resync.milliTokens = 1000; // first frame right away
+  g_resync.nextProgressMs = now + RESYNC_PROGRESS_MS;
+  g_resync.orderCount = g_resync.orderPos = 0;
+  g_resync.wakeCount = 0;
+  g_resync.cur = ZB_DEVIDX_NONE;
+  g_resync.devices = g_resync.devicesDone = g_resync.deferred = 0;
+  g_resync.reads = g_resync.answered = g_resync.failed = 0;
+  memset(g_resyncDeferred, 0, sizeof(g_resyncDeferred));
+  memset(g_resyncInflight, 0, sizeof(g_resyncInflight));
+  for (uint16_t slot = 0; slot < MAX_DEVICES; slot++) {
+    const device_entry_t &d = g_devices[slot];
+    if (!d.used || d.short_addr == ZB_DEVIDX_NO_SHORT || d.epCount == 0) continue;
+    g_resync.devices++;
+    if (resync_is_sleepy(d)) {
+      g_resyncDeferred[slot / 32] |= 1UL << (slot % 32);
+      g_resync.deferred++;
+    } else {
+      g_resync.order[g_resync.orderCount++] = slot;
+    }
+  }
+  resync_send_state("started");
+}
+
+// zb_task: {"cmd":"resync","rate":4,"sleepyWaitSec":600} / {"cmd":"resync","stop":true}
+static void resync_request(const uart_cmd_t &cmd) {
+  if (cmd.u16 == 0) {
+    resync_stop("stopped");
+    return;
+  }
+  if (g_resync.active) resync_stop("stopped"); // restart with the current table
+  g_resync.ratePerSec = cmd.u16;
+  g_resync.sleepyWaitMs = (uint32_t)cmd.timeoutMs * 1000UL;
+  if (g_zbStackState == ZB_STACK_FORMED) {
+    resync_begin();
+  } else {
+    g_resync.waitForm = true;
+    g_resync.startMs = millis();
+  }
+}
+
+// Any frame from a device: a deferred sleepy device is awake right now.
+static void resync_on_heard(device_entry_t *dev) {
+  if (!g_resync.active || !dev) return;
+  const uint16_t slot = (uint16_t)(dev - g_devices);
+  uint32_t &word = g_resyncDeferred[slot / 32];
+  const uint32_t bit = 1UL << (slot % 32);
+  if (!(word & bit) || g_resync.wakeCount >= sizeof(g_resync.wake) / sizeof(g_resync.wake[0])) return;
+  word &= ~bit;
+  g_resync.deferred--;
+  g_resync.wake[g_resync.wakeCount++] = slot;
+}
+
+static void resync_on_read_resp(uint8_t tsn, uint16_t short_addr) {
+  for (uint8_t i = 0; i < RESYNC_MAX_INFLIGHT; i++) {
+    resync_inflight_t &f = g_resyncInflight[i];
+    if (f.used && f.tsn == tsn && f.short_addr == short_addr) {
+      f.used = false;
+      g_resync.answered++;
+      return;
+    }
+  }
+}
+
+// Next (endpoint, cluster) of the current device that has state to read; false when the device is done.
+static bool resync_next_item(const device_entry_t &d, uint8_t *ep, const resync_attrs_t **row) {
+  for (; g_resync.curEp < d.epCount; g_resync.curEp++, g_resync.curAttr = 0) {
+    const uint32_t mask = d.eps[g_resync.curEp].inMask;
+    while (g_resync.curAttr < RESYNC_ATTR_COUNT) {
+      const resync_attrs_t &r = RESYNC_ATTRS[g_resync.curAttr++];
+      if (mask & dev_cluster_bit(r.cluster)) {
+        *ep = d.eps[g_resync.curEp].ep;
+        *row = &r;
+        return true;
       }
+    }
+  }
+  return false;
+}
 
-      uart_send_attr_report(dev->ieee16, clusterName, attrName, valueInt);
-      return ESP_OK;
+static void resync_tick() {
+  const uint32_t now = millis();
+  if (g_resync.waitForm) {
+    if (g_zbStackState == ZB_STACK_FORMED) resync_begin();
+    return;
+  }
+  if (!g_resync.active) return;
+
+  uint8_t inflight = 0;
+  for (uint8_t i = 0; i < RESYNC_MAX_INFLIGHT; i++) {
+    resync_inflight_t &f = g_resyncInflight[i];
+    if (f.used && (int32_t)(now - f.deadlineMs) >= 0) {
+      f.used = false;
+      g_resync.failed++;
     }
-	  case ESP_ZB_CORE_CMD_CUSTOM_CLUSTER_REQ_CB_ID: {
-	    const esp_zb_zcl_custom_cluster_command_message_t *m = (const esp_zb_zcl_custom_cluster_command_message_t *)message;
-	    if (!m) return ESP_OK;
-	    if (m->info.status != ESP_ZB_ZCL_STATUS_SUCCESS) return ESP_OK;
+    if (f.used) inflight++;
+  }
 
-	    // Map source short address -> ieee string
-	    const uint16_t srcShort = m->info.src_address.u.short_addr;
-	    device_entry_t *dev = find_device_by_short(srcShort);
-	    if (!dev) {
-	      Serial.printf("[ZB] custom_cmd id=0x%02x from unknown short=0x%04x\n", m->info.command.id, srcShort);
-	      return ESP_OK;
-	    }
+  const uint32_t burst = (uint32_t)g_resync.ratePerSec * 1000UL;
+  g_resync.milliTokens += (now - g_resync.lastRefillMs) * g_resync.ratePerSec;
+  if (g_resync.milliTokens > burst) g_resync.milliTokens = burst;
+  g_resync.lastRefillMs = now;
 
-	    // Our payload is ZCL char-string (len byte + data)
-	    const uint8_t *raw = (const uint8_t *)m->data.value;
-	    if (!raw || m->data.size < 1) return ESP_OK;
-	    const uint8_t len = raw[0];
-	    char jsonBuf[256];
-	    const size_t copyN = (len < sizeof(jsonBuf) - 1) ? len : (sizeof(jsonBuf) - 1);
-	    if (m->data.size < (size_t)(1 + len)) {
-	      // best-effort: trust provided buffer size
-	      const size_t avail = (m->data.size > 1) ? (m->data.size - 1) : 0;
-	      const size_t n2 = (avail < (sizeof(jsonBuf) - 1)) ? avail : (sizeof(jsonBuf) - 1);
-	      memcpy(jsonBuf, raw + 1, n2);
-	      jsonBuf[n2] = '\0';
-	    } else {
-	      memcpy(jsonBuf, raw + 1, copyN);
-	      jsonBuf[copyN] = '\0';
-	    }
+  while (g_resync.milliTokens >= 1000 && inflight < RESYNC_MAX_INFLIGHT) {
+    if (g_resync.cur == ZB_DEVIDX_NONE) {
+      if (g_resync.wakeCount) {
+        g_resync.cur = g_resync.wake[0];
+        memmove(g_resync.wake, g_resync.wake + 1, --g_resync.wakeCount * sizeof(g_resync.wake[0]));
+      } else if (g_resync.orderPos < g_resync.orderCount) {
+        g_resync.cur = g_resync.order[g_resync.orderPos++];
+      } else {
+        break;
+      }
+      g_resync.curEp = 0;
+      g_resync.curAttr = 0;
+    }
+    const device_entry_t &d = g_devices[g_resync.cur];
+    uint8_t ep;
+    const resync_attrs_t *row;
+    if (!d.used || d.short_addr == ZB_DEVIDX_NO_SHORT || !resync_next_item(d, &ep, &row)) {
+      g_resync.devicesDone++;
+      g_resync.cur = ZB_DEVIDX_NONE;
+      continue;
+    }
+
+    uint16_t attrs[3];
+    memcpy(attrs, row->attrs, sizeof(attrs));
+    esp_zb_zcl_read_attr_cmd_t cmd = {0};
+    cmd.zcl_basic_cmd.src_endpoint = COORD_ENDPOINT;
+    cmd.zcl_basic_cmd.dst_endpoint = ep;
+    cmd.zcl_basic_cmd.dst_addr_u.addr_short = d.short_addr;
+    cmd.address_mode = ESP_ZB_APS_ADDR_MODE_16_ENDP_PRESENT;
+    cmd.cluster_id = row->cluster;
+    cmd.attr_number = row->count;
+    cmd.attr_field = attrs;
+    const uint8_t tsn = esp_zb_zcl_read_attr_cmd_req(&cmd);
+
+    for (uint8_t i = 0; i < RESYNC_MAX_INFLIGHT; i++) {
+      resync_inflight_t &f = g_resyncInflight[i];
+      if (f.used) continue;
+      f.used = true;
+      f.tsn = tsn;
+      f.short_addr = d.short_addr;
+      f.deadlineMs = now + (resync_is_sleepy(d) ? CMD_TIMEOUT_SLEEPY_MS : RESYNC_READ_TIMEOUT_MS);
+      break;
+    }
+    inflight++;
+    g_resync.reads++;
+    g_resync.milliTokens -= 1000;
+  }
+
+  const bool walked = g_resync.cur == ZB_DEVIDX_NONE && g_resync.orderPos >= g_resync.orderCount &&
+                      g_resync.wakeCount == 0 && inflight == 0;
+  if (walked && (g_resync.deferred == 0 || (uint32_t)(now - g_resync.startMs) >= g_resync.sleepyWaitMs)) {
+    resync_stop("done");
+    return;
+  }
+  if ((int32_t)(now - g_resync.nextProgressMs) >= 0) {
+    g_resync.nextProgressMs = now + RESYNC_PROGRESS_MS;
+    resync_send_state("progress");
+  }
+}
+
+// ------------------------ Topology crawl ------------------------
+//
+// {"cmd":"topology"} walks the mesh breadth-first from the coordinator with
+// ZDO Mgmt_Lqi_req: one request in flight, TOPO_GAP_MS_DEFAULT (or "gapMs") between
+// requests, neighbor tables paged by start index. Routers found in a table are
+// queued for their own request; rows past TOPO_MAX_NB are left out of the line
+// ("total" tells) but still count for the weak-link list. Each router answers
+// the hub with one line
+//   -> {"evt":"topology_node","short":"0x1234","ieee":"...","ok":true,"total":7,
+//       "nb":[[short,lqi,depth,relationship,deviceType],...]}
+// (relationship: 0 parent, 1 child, 2 sibling, 3 none, 4 previous child;
+//  deviceType: 0 coordinator, 1 router, 2 end device, +4 when rx on when idle)
+// and the crawl ends with a summary listing the weakest links
+//   -> {"evt":"topology","state":"started"|"done"|"stopped","cmdId":"...","routers":9,"edges":41,
+//       "failed":0,"ms":5200,"weakLqi":60,"weak":[[from,to,lqi],...]}
+
+struct topo_nb_t {
+  uint16_t short_addr;
+  uint8_t lqi;
+  uint8_t depth;
+  uint8_t rel;
+  uint8_t type;
+};
+
+struct topo_state_t {
+  bool active;
+  bool waiting;          // Mgmt_Lqi_req in flight
+  uint8_t reqSeq;        // user_ctx of the request in flight; stale answers are dropped
+  uint8_t tries;
+  uint8_t startIdx;      // neighbor table page of the current router
+  uint16_t gapMs;
+  uint8_t weakLqi;
+  char cmdId[40];
+  uint32_t startMs;
+  uint32_t nextReqMs;
+  uint32_t deadlineMs;
+  uint16_t queue[TOPO_MAX_ROUTERS]; // routers to query, coordinator first
+  uint8_t qLen;
+  uint8_t qPos;
+  uint8_t nbTotal;       // table size the current router reported
+  uint8_t nbCount;
+  topo_nb_t nb[TOPO_MAX_NB];
+  uint16_t routers, edges, failed;
+  uint8_t weakCount;
+  uint16_t weak[TOPO_WEAK_MAX][3]; // from, to, lqi; weakest kept
+};
+
+static topo_state_t g_topo;
+
+static void topo_send_state(const char *state) {
+  DynamicJsonDocument doc(1024);
+  doc["evt"] = "topology";
+  doc["state"] = state;
+  if (g_topo.cmdId[0]) doc["cmdId"] = g_topo.cmdId;
+  doc["routers"] = g_topo.routers;
+  doc["edges"] = g_topo.edges;
+  doc["failed"] = g_topo.failed;
+  doc["ms"] = (uint32_t)(millis() - g_topo.startMs);
+  doc["weakLqi"] = g_topo.weakLqi;
+  JsonArray weak = doc.createNestedArray("weak");
+  for (uint8_t i = 0; i < g_topo.weakCount; i++) {
+    JsonArray w = weak.createNestedArray();
+    w.add(g_topo.weak[i][0]);
+    w.add(g_topo.weak[i][1]);
+    w.add(g_topo.weak[i][2]);
+  }
+  uart_send_json(doc);
+}
+
+static void topo_stop(const char *state) {
+  if (g_topo.active) topo_send_state(state);
+  g_topo.active = false;
+  g_topo.waiting = false;
+}
+
+static void topo_queue_router(uint16_t short_addr) {
+  if (g_topo.qLen >= TOPO_MAX_ROUTERS) return;
+  for (uint8_t i = 0; i < g_topo.qLen; i++) {
+    if (g_topo.queue[i] == short_addr) return;
+  }
+  g_topo.queue[g_topo.qLen++] = short_addr;
+}
+
+// Keeps the TOPO_WEAK_MAX weakest links below weakLqi.
+static void topo_note_weak(uint16_t from, uint16_t to, uint8_t lqi) {
+  if (lqi >= g_topo.weakLqi) return;
+  uint8_t at = g_topo.weakCount;
+  if (at >= TOPO_WEAK_MAX) {
+    at = 0;
+    for (uint8_t i = 1; i < TOPO_WEAK_MAX; i++) {
+      if (g_topo.weak[i][2] > g_topo.weak[at][2]) at = i;
+    }
+    if (g_topo.weak[at][2] <= lqi) return;
+  } else {
+    g_topo.weakCount++;
+  }
+  g_topo.weak[at][0] = from;
+  g_topo.weak[at][1] = to;
+  g_topo.weak[at][2] = lqi;
+}
+
+static void topo_lqi_cb(const esp_zb_zdo_mgmt_lqi_rsp_t *rsp, void *user_ctx);
+
+static void topo_send_req() {
+  esp_zb_zdo_mgmt_lqi_req_param_t req = {};
+  req.dst_addr = g_topo.queue[g_topo.qPos];
+  req.start_index = g_topo.startIdx;
+  g_topo.reqSeq++;
+  g_topo.waiting = true;
+  g_topo.deadlineMs = millis() + TOPO_REQ_TIMEOUT_MS;
+  esp_zb_zdo_mgmt_lqi_req(&req, topo_lqi_cb, (void *)(uintptr_t)g_topo.reqSeq);
+}
+
+// Current router finished (ok) or gave up: report its table and move on.
+static void topo_node_done(bool ok) {
+  const uint16_t short_addr = g_topo.queue[g_topo.qPos];
+  DynamicJsonDocument doc(TOPO_NODE_DOC);
+  doc["evt"] = "topology_node";
+  char shortStr[7];
+  snprintf(shortStr, sizeof(shortStr), "0x%04x", (unsigned)short_addr);
+  doc["short"] = shortStr;
+  const device_entry_t *d = find_device_by_short(short_addr);
+  if (d) doc["ieee"] = d->ieee16;
+  doc["ok"] = ok;
+  if (ok) {
+    doc["total"] = g_topo.nbTotal;
+    JsonArray nb = doc.createNestedArray("nb");
+    for (uint8_t i = 0; i < g_topo.nbCount; i++) {
+      const topo_nb_t &n = g_topo.nb[i];
+      JsonArray e = nb.createNestedArray();
+      e.add(n.short_addr);
+      e.add(n.lqi);
+      e.add(n.depth);
+      e.add(n.rel);
+      e.add(n.type);
+    }
+    g_topo.routers++;
+    g_topo.edges += g_topo.nbCount;
+  } else {
+    g_topo.failed++;
+  }
+  uart_send_json(doc);
+
+  g_topo.qPos++;
+  g_topo.waiting = false;
+  g_topo.tries = 0;
+  g_topo.startIdx = 0;
+  g_topo.nbTotal = 0;
+  g_topo.nbCount = 0;
+  g_topo.nextReqMs = millis() + g_topo.gapMs;
+}
+
+static void topo_lqi_cb(const esp_zb_zdo_mgmt_lqi_rsp_t *rsp, void *user_ctx) {
+  if (!g_topo.active || !g_topo.waiting || (uint8_t)(uintptr_t)user_ctx != g_topo.reqSeq) return;
+  if (!rsp || rsp->status != ESP_ZB_ZDP_STATUS_SUCCESS) {
+    topo_node_done(false);
+    return;
+  }
+
+  const uint16_t from = g_topo.queue[g_topo.qPos];
+  g_topo.nbTotal = rsp->neighbor_table_entries;
+  for (uint8_t i = 0; i < rsp->neighbor_table_list_count; i++) {
+    const esp_zb_zdo_neighbor_table_list_record_t &r = rsp->neighbor_table_list[i];
+    const uint8_t devType = r.device_type;
+    if (devType <= 1 && r.network_addr != from) topo_queue_router(r.network_addr); // coordinator / router
+    topo_note_weak(from, r.network_addr, r.lqi);
+    if (g_topo.nbCount >= TOPO_MAX_NB) continue;
+    topo_nb_t &n = g_topo.nb[g_topo.nbCount++];
+    n.short_addr = r.network_addr;
+    n.lqi = r.lqi;
+    n.depth = r.depth;
+    n.rel = r.relationship;
+    n.type = (uint8_t)(devType | ((r.rx_on_when_idle == 1) ? 4 : 0));
+  }
+
+  const uint16_t next = (uint16_t)rsp->start_index + rsp->neighbor_table_list_count;
+  if (rsp->neighbor_table_list_count > 0 && next < rsp->neighbor_table_entries) {
+    g_topo.startIdx = (uint8_t)next;
+    g_topo.tries = 0;
+    topo_send_req(); // next page of the same table
+  } else {
+    topo_node_done(true);
+  }
+}
+
+// zb_task: {"cmd":"topology","gapMs":300,"weakLqi":60} / {"cmd":"topology","stop":true}
+static void topo_request(const uart_cmd_t &cmd) {
+  if (cmd.u16 == 0) {
+    topo_stop("stopped");
+    return;
+  }
+  if (g_zbStackState != ZB_STACK_FORMED) {
+    uart_send_cmd_result(cmd.cmdId, "", false, "network not formed");
+    return;
+  }
+  if (g_topo.active) topo_stop("stopped"); // restart from the coordinator
+  memset(&g_topo, 0, sizeof(g_topo));
+  g_topo.active = true;
+  g_topo.gapMs = cmd.u16;
+  g_topo.weakLqi = cmd.dst_ep;
+  strncpy(g_topo.cmdId, cmd.cmdId, sizeof(g_topo.cmdId) - 1);
+  g_topo.startMs = millis();
+  g_topo.nextReqMs = g_topo.startMs;
+  g_topo.queue[g_topo.qLen++] = 0x0000;
+  topo_send_state("started");
+}
+
+static void topo_tick() {
+  if (!g_topo.active) return;
+  const uint32_t now = millis();
+  if (g_topo.waiting) {
+    if ((int32_t)(now - g_topo.deadlineMs) < 0) return;
+    if (++g_topo.tries > TOPO_RETRIES) {
+      topo_node_done(false);
+    } else {
+      topo_send_req();
+    }
+    return;
+  }
+  if ((int32_t)(now - g_topo.nextReqMs) < 0) return;
+  if (g_topo.qPos >= g_topo.qLen) {
+    topo_stop("done");
+    return;
+  }
+  topo_send_req();
+}
+
+// ------------------------ Direct bindings ------------------------
+//
+// Device-to-device bindings (a switch's On/Off client -> a light) let the mesh
+// carry the command in one hop without the hub. The hub's desired bindings
+// live here, in NVS key "bind" of the device-table namespace:
+//   'B', version, count, then per record
+//   srcIeee(8, LE) srcEp(1) cluster(2) dstMode(1) dst(8: IEEE LE, or group in the first 2) dstEp(1)
+//   [, flags(1) in version 2: bit 0 = unbinding]
+// A record is sent as ZDO Bind_req to the source device when added, again when
+// the source re-announces (a reset device forgets its bindings), and while it
+// is pending whenever the source is heard from (sleepy switches only take the
+// request while awake). The hub's cmd_result comes from the first attempt.
+// "unbind" works the same way in reverse: the record stays, marked unbinding,
+// and Unbind_req is repeated until the device answers SUCCESS or NO_ENTRY; only
+// then is it dropped. Removing a device drops every record naming it.
+// Group destinations are refused for "bind": a group binding only reaches lights
+// that were given Groups Add Group, which nothing here sends, so it would report
+// ok and switch nothing. "unbind" still accepts "group" to clear old rows.
+//   {"cmd":"bind","ieee":"<src>","endpoint":1,"cluster":6,"dst":"<ieee>","dstEp":1,"cmdId":"..."}
+//   {"cmd":"unbind",...same fields, or "group":"0x0003" instead of dst/dstEp...}
+//   {"cmd":"bind_table","ieee":"...","cmdId":"..."}  -> ZDO Mgmt_Bind_req, paged:
+//     {"evt":"bind_table","ieee","cmdId","ok","total":3,
+//      "entries":[{"ep":1,"cluster":6,"dst":"<ieee>","dstEp":1}|{"ep":1,"cluster":6,"group":"0x0003"}]}
+//   {"cmd":"bind_list","cmdId":"..."} -> {"evt":"bindings","items":[{src,ep,cluster,dst,dstEp,state}]}
+//     state: "pending" | "ok" | "failed" | "unbinding"
+
+struct bind_rec_t {
+  uint8_t src[8];
+  uint8_t srcEp;
+  uint16_t cluster;
+  uint8_t dstMode;  // ESP_ZB_ZDO_BIND_DST_ADDR_MODE_64_BIT_EXTENDED or _16_BIT_GROUP
+  uint8_t dst[8];   // IEEE LE, or the group id in dst[0..1]
+  uint8_t dstEp;
+};
+
+enum bind_state_t : uint8_t {
+  BIND_PENDING = 0, // not confirmed by the device yet
+  BIND_OK = 1,
+  BIND_FAILED = 2,  // rejected by the device (e.g. not supported / table full)
+  BIND_UNBINDING = 3, // removed by the hub, Unbind_req not confirmed yet
+};
+
+struct bind_entry_t {
+  bool used;
+  bind_state_t state;
+  uint32_t lastTryMs;
+  bind_rec_t rec;
+};
+
+// One Bind/Unbind_req waiting for its ZDO answer.
+struct bind_op_t {
+  bool used;
+  uint8_t seq;
+  bool unbind;
+  int8_t entry;      // g_binds index, -1 for an unbind of a record not kept
+  char cmdId[40];    // empty for automatic retries
+  char ieee16[17];
+  uint32_t deadlineMs;
+};
+
+// Mgmt_Bind_req read in progress (one at a time); rows collected over the pages.
+struct bind_read_t {
+  bool active;
+  uint8_t seq;
+  uint16_t short_addr;
+  uint8_t startIdx;
+  uint8_t total;
+  uint8_t count;
+  char cmdId[40];
+  char ieee16[17];
+  uint32_t deadlineMs;
+  struct {
+    uint8_t ep;
+    uint16_t cluster;
+    uint8_t dstMode;
+    uint8_t dst[8];
+    uint8_t dstEp;
+  } rows[BIND_READ_MAX];
+};
+
+static bind_entry_t g_binds[BIND_MAX];
+static bind_op_t g_bindOps[BIND_OPS_MAX];
+static bind_read_t g_bindRead;
+static uint8_t g_bindSeq = 0;
+
+static bool bind_same(const bind_rec_t &a, const bind_rec_t &b) {
+  return memcmp(a.src, b.src, 8) == 0 && a.srcEp == b.srcEp && a.cluster == b.cluster && a.dstMode == b.dstMode &&
+         a.dstEp == b.dstEp && memcmp(a.dst, b.dst, a.dstMode == ESP_ZB_ZDO_BIND_DST_ADDR_MODE_16_BIT_GROUP ? 2 : 8) == 0;
+}
+
+static void bind_save() {
+  uint8_t buf[3 + BIND_MAX * 22];
+  uint8_t *w = buf;
+  *w++ = 'B';
+  *w++ = 2;
+  uint8_t *countPos = w++;
+  *countPos = 0;
+  for (uint8_t i = 0; i < BIND_MAX; i++) {
+    if (!g_binds[i].used) continue;
+    const bind_rec_t &r = g_binds[i].rec;
+    memcpy(w, r.src, 8);
+    w += 8;
+    *w++ = r.srcEp;
+    put_u16(w, r.cluster);
+    *w++ = r.dstMode;
+    memcpy(w, r.dst, 8);
+    w += 8;
+    *w++ = r.dstEp;
+    *w++ = g_binds[i].state == BIND_UNBINDING ? 1 : 0;
+    (*countPos)++;
+  }
+  const size_t len = (size_t)(w - buf);
+  if (g_devPrefs.putBytes("bind", buf, len) != len) {
+    Serial.printf("[BIND] NVS write failed (%u bytes)\n", (unsigned)len);
+  }
+}
+
+// setup(), after devstore_load() opened the namespace. Loaded records are
+// assumed to be on the devices already; a re-announce sends them again.
+static void bind_load() {
+  uint8_t buf[3 + BIND_MAX * 22];
+  const size_t len = g_devPrefs.isKey("bind") ? g_devPrefs.getBytesLength("bind") : 0;
+  if (len == 0 || len > sizeof(buf) || g_devPrefs.getBytes("bind", buf, len) != len) return;
+  devstore_reader_t r = {buf, buf + len, true};
+  const uint8_t magic = rd_u8(r), version = rd_u8(r);
+  if (magic != 'B' || (version != 1 && version != 2)) return;
+  const uint8_t count = rd_u8(r);
+  uint8_t loaded = 0;
+  for (uint8_t n = 0; n < count && r.ok && loaded < BIND_MAX; n++) {
+    bind_rec_t rec = {};
+    const uint8_t *p = rd_take(r, 8);
+    if (p) memcpy(rec.src, p, 8);
+    rec.srcEp = rd_u8(r);
+    rec.cluster = rd_u16(r);
+    rec.dstMode = rd_u8(r);
+    p = rd_take(r, 8);
+    if (p) memcpy(rec.dst, p, 8);
+    rec.dstEp = rd_u8(r);
+    const uint8_t flags = version >= 2 ? rd_u8(r) : 0;
+    if (!r.ok) break;
+    if (rec.dstMode == ESP_ZB_ZDO_BIND_DST_ADDR_MODE_16_BIT_GROUP) continue; // no longer re-applied
+    bind_entry_t &e = g_binds[loaded++];
+    e.used = true;
+    e.state = (flags & 1) ? BIND_UNBINDING : BIND_OK;
+    e.rec = rec;
+  }
+  Serial.printf("[BIND] %u desired bindings restored from NVS\n", (unsigned)loaded);
+}
+
+// loop(): {"cmd":"bind"|"unbind"} -> bind_rec_t in the payload block (ieee16 / dst_ep already parsed).
+static bool parse_bind_req(const JsonDocument &doc, bool unbind, uart_cmd_t &out, const char **err) {
+  bind_rec_t rec = {};
+  if (!ieee_str16_to_le_bytes(out.ieee16, rec.src)) {
+    *err = "invalid ieee";
+    return false;
+  }
+  rec.srcEp = out.dst_ep;
+  if (doc["cluster"].isNull()) {
+    *err = "missing cluster";
+    return false;
+  }
+  rec.cluster = doc["cluster"] | 0;
+  JsonVariantConst group = doc["group"];
+  if (!group.isNull()) {
+    if (!unbind) {
+      *err = "group bind unsupported (destinations not in group)";
+      return false;
+    }
+    const uint16_t g = group.is<const char *>() ? (uint16_t)strtoul(group.as<const char *>(), nullptr, 0)
+                                               : group.as<uint16_t>();
+    rec.dstMode = ESP_ZB_ZDO_BIND_DST_ADDR_MODE_16_BIT_GROUP;
+    rec.dst[0] = (uint8_t)(g & 0xFF);
+    rec.dst[1] = (uint8_t)(g >> 8);
+  } else {
+    char norm[17];
+    if (!normalize_ieee_str(doc["dst"] | "", norm) || !ieee_str16_to_le_bytes(norm, rec.dst)) {
+      *err = "invalid dst";
+      return false;
+    }
+    rec.dstMode = ESP_ZB_ZDO_BIND_DST_ADDR_MODE_64_BIT_EXTENDED;
+    rec.dstEp = (uint8_t)(doc["dstEp"] | DEFAULT_DST_ENDPOINT);
+  }
+  if (!cmd_payload_alloc(&out)) {
+    *err = "cmd payload pool exhausted";
+    return false;
+  }
+  memcpy(out.payload, &rec, sizeof(rec));
+  out.type = unbind ? CMD_UNBIND : CMD_BIND;
+  return true;
+}
+
+static void bind_zdo_cb(esp_zb_zdp_status_t zdo_status, void *user_ctx);
+static void bind_list_send(const char *cmdId);
+
+// Sends Bind_req / Unbind_req for rec to its source device; false when the source
+// is not routable or no op slot is free.
+static bool bind_send(const bind_rec_t &rec, bool unbind, int8_t entry, const char *cmdId) {
+  const uint16_t slot = zb_devidx_find_ieee(&g_devIndex, zb_devidx_ieee_from_le(rec.src));
+  if (slot == ZB_DEVIDX_NONE || g_devices[slot].short_addr == ZB_DEVIDX_NO_SHORT) return false;
+  bind_op_t *op = nullptr;
+  uint8_t opIdx = 0;
+  for (; opIdx < BIND_OPS_MAX; opIdx++) {
+    if (!g_bindOps[opIdx].used) {
+      op = &g_bindOps[opIdx];
+      break;
+    }
+  }
+  if (!op) return false;
+  const device_entry_t &d = g_devices[slot];
+
+  op->used = true;
+  op->seq = ++g_bindSeq;
+  op->unbind = unbind;
+  op->entry = entry;
+  strncpy(op->cmdId, cmdId ? cmdId : "", sizeof(op->cmdId) - 1);
+  op->cmdId[sizeof(op->cmdId) - 1] = 0;
+  memcpy(op->ieee16, d.ieee16, sizeof(op->ieee16));
+  op->deadlineMs = millis() + (d.sleepy ? CMD_TIMEOUT_SLEEPY_MS : BIND_TIMEOUT_MS) + BIND_TIMEOUT_MS;
+
+  esp_zb_zdo_bind_req_param_t req = {};
+  memcpy(req.src_address, rec.src, sizeof(req.src_address));
+  req.src_endp = rec.srcEp;
+  req.cluster_id = rec.cluster;
+  req.dst_addr_mode = rec.dstMode;
+  if (rec.dstMode == ESP_ZB_ZDO_BIND_DST_ADDR_MODE_16_BIT_GROUP) {
+    req.dst_address_u.addr_short = (uint16_t)(rec.dst[0] | (rec.dst[1] << 8));
+  } else {
+    memcpy(req.dst_address_u.addr_long, rec.dst, sizeof(req.dst_address_u.addr_long));
+    req.dst_endp = rec.dstEp;
+  }
+  req.req_dst_addr = d.short_addr;
+  void *ctx = (void *)(uintptr_t)(((uint32_t)opIdx << 8) | op->seq);
+  if (unbind) {
+    esp_zb_zdo_device_unbind_req(&req, bind_zdo_cb, ctx);
+  } else {
+    esp_zb_zdo_device_bind_req(&req, bind_zdo_cb, ctx);
+  }
+  if (entry >= 0) g_binds[entry].lastTryMs = millis();
+  return true;
+}
+
+// Drops g_binds[i]; ops still waiting on it no longer touch the slot.
+static void bind_drop(uint8_t i) {
+  g_binds[i].used = false;
+  for (uint8_t k = 0; k < BIND_OPS_MAX; k++) {
+    if (g_bindOps[k].used && g_bindOps[k].entry == (int8_t)i) g_bindOps[k].entry = -1;
+  }
+}
+
+static void bind_op_end(bind_op_t &op, bool ok, bool timeout, esp_zb_zdp_status_t st) {
+  bool dropped = false;
+  if (op.entry >= 0 && g_binds[op.entry].used) {
+    bind_entry_t &e = g_binds[op.entry];
+    // An answer to a request the hub has since reversed leaves the entry alone.
+    if (op.unbind && e.state == BIND_UNBINDING) {
+      // Off the device (or never there): only now is the record forgotten. Anything
+      // else keeps it unbinding for the next time the device is heard.
+      if (ok) {
+        bind_drop((uint8_t)op.entry);
+        bind_save();
+        dropped = true;
+      }
+    } else if (!op.unbind && e.state != BIND_UNBINDING) {
+      // A timeout leaves the binding pending for the next time the device is heard.
+      e.state = ok ? BIND_OK : (timeout ? BIND_PENDING : BIND_FAILED);
+    }
+  }
+  if (op.cmdId[0]) {
+    char err[48];
+    if (timeout) strncpy(err, "timeout (retried when device is heard)", sizeof(err));
+    else snprintf(err, sizeof(err), "zdo status 0x%02x", (unsigned)st);
+    uart_send_cmd_result(op.cmdId, op.ieee16, ok, ok ? nullptr : err);
+  }
+  op.used = false;
+  // Refresh the hub's retained list after a user change or a confirmed unbind.
+  if (op.cmdId[0] || dropped) bind_list_send(nullptr);
+}
+
+static void bind_zdo_cb(esp_zb_zdp_status_t zdo_status, void *user_ctx) {
+  const uint32_t v = (uint32_t)(uintptr_t)user_ctx;
+  const uint32_t idx = v >> 8;
+  if (idx >= BIND_OPS_MAX) return;
+  bind_op_t &op = g_bindOps[idx];
+  if (!op.used || op.seq != (uint8_t)(v & 0xFF)) return;
+  // Unbinding something that is not bound is still the wanted end state.
+  const bool ok = zdo_status == ESP_ZB_ZDP_STATUS_SUCCESS || (op.unbind && zdo_status == ESP_ZB_ZDP_STATUS_NO_ENTRY);
+  bind_op_end(op, ok, zdo_status == ESP_ZB_ZDP_STATUS_TIMEOUT, zdo_status);
+}
+
+// zb_task: {"cmd":"bind"} / {"cmd":"unbind"}; the record is in the payload block.
+static void bind_request(const uart_cmd_t &cmd) {
+  bind_rec_t rec;
+  memcpy(&rec, cmd.payload, sizeof(rec));
+  const bool unbind = cmd.type == CMD_UNBIND;
+
+  int8_t found = -1, freeIdx = -1;
+  for (uint8_t i = 0; i < BIND_MAX; i++) {
+    if (g_binds[i].used && bind_same(g_binds[i].rec, rec)) found = (int8_t)i;
+    if (!g_binds[i].used && freeIdx < 0) freeIdx = (int8_t)i;
+  }
+  int8_t entry = -1;
+  if (unbind) {
+    // A kept record is dropped once the device confirms (bind_op_end); one that
+    // is not kept (e.g. an old group row) only gets this one request.
+    entry = found;
+    if (found >= 0 && g_binds[found].state != BIND_UNBINDING) {
+      g_binds[found].state = BIND_UNBINDING;
+      bind_save();
+    }
+  } else {
+    entry = found >= 0 ? found : freeIdx;
+    if (entry < 0) {
+      uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "binding table full");
+      return;
+    }
+    bind_entry_t &e = g_binds[entry];
+    const bool wasUnbinding = found >= 0 && e.state == BIND_UNBINDING;
+    if (found < 0) {
+      e.used = true;
+      e.rec = rec;
+    }
+    e.state = BIND_PENDING;
+    if (found < 0 || wasUnbinding) bind_save();
+  }
+  if (!bind_send(rec, unbind, entry, cmd.cmdId)) {
+    // Kept anyway: a kept bind or unbind goes out when the device is heard.
+    uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "device not reachable now");
+  }
+}
+
+// CMD_REMOVE_DEVICE: records naming the device as source or destination go with it.
+static void bind_forget_device(const uint8_t ieee_le[8]) {
+  bool changed = false;
+  for (uint8_t i = 0; i < BIND_MAX; i++) {
+    const bind_entry_t &e = g_binds[i];
+    if (!e.used) continue;
+    const bool dst = e.rec.dstMode != ESP_ZB_ZDO_BIND_DST_ADDR_MODE_16_BIT_GROUP && memcmp(e.rec.dst, ieee_le, 8) == 0;
+    if (memcmp(e.rec.src, ieee_le, 8) != 0 && !dst) continue;
+    bind_drop(i);
+    changed = true;
+  }
+  if (changed) {
+    bind_save();
+    bind_list_send(nullptr);
+  }
+}
+
+// Source device re-announced: it may have been reset, so send all its bindings again.
+static void bind_on_annce(device_entry_t *dev) {
+  uint8_t ieee_le[8];
+  if (!dev || !ieee_str16_to_le_bytes(dev->ieee16, ieee_le)) return;
+  for (uint8_t i = 0; i < BIND_MAX; i++) {
+    bind_entry_t &e = g_binds[i];
+    if (e.used && memcmp(e.rec.src, ieee_le, 8) == 0) {
+      if (e.state != BIND_UNBINDING) e.state = BIND_PENDING;
+      e.lastTryMs = millis() - BIND_RETRY_MS;
+    }
+  }
+}
+
+// Any frame from a device: it is awake, so retry its pending binds and unbinds.
+static void bind_on_heard(device_entry_t *dev) {
+  if (!dev) return;
+  uint8_t ieee_le[8];
+  bool parsed = false;
+  const uint32_t now = millis();
+  for (uint8_t i = 0; i < BIND_MAX; i++) {
+    bind_entry_t &e = g_binds[i];
+    if (!e.used || (e.state != BIND_PENDING && e.state != BIND_UNBINDING) || (uint32_t)(now - e.lastTryMs) < BIND_RETRY_MS) {
+      continue;
+    }
+    if (!parsed) {
+      if (!ieee_str16_to_le_bytes(dev->ieee16, ieee_le)) return;
+      parsed = true;
+    }
+    if (memcmp(e.rec.src, ieee_le, 8) != 0) continue;
+    bool inFlight = false;
+    for (uint8_t k = 0; k < BIND_OPS_MAX; k++) inFlight |= g_bindOps[k].used && g_bindOps[k].entry == (int8_t)i;
+    if (!inFlight && !bind_send(e.rec, e.state == BIND_UNBINDING, (int8_t)i, nullptr)) return; // out of op slots
+  }
+}
+
+static void bind_list_send(const char *cmdId) {
+  DynamicJsonDocument doc(BIND_DOC);
+  doc["evt"] = "bindings";
+  if (cmdId && cmdId[0]) doc["cmdId"] = cmdId;
+  JsonArray items = doc.createNestedArray("items");
+  for (uint8_t i = 0; i < BIND_MAX; i++) {
+    const bind_entry_t &e = g_binds[i];
+    if (!e.used) continue;
+    JsonObject o = items.createNestedObject();
+    char s[17];
+    ieee_le_to_str16(e.rec.src, s);
+    o["src"] = s;
+    o["ep"] = e.rec.srcEp;
+    o["cluster"] = e.rec.cluster;
+    ieee_le_to_str16(e.rec.dst, s); // group records are never kept (see parse_bind_req)
+    o["dst"] = s;
+    o["dstEp"] = e.rec.dstEp;
+    static const char *const STATES[] = {"pending", "ok", "failed", "unbinding"};
+    o["state"] = STATES[e.state];
+  }
+  uart_send_json(doc);
+}
+
+// ---- Mgmt_Bind_req (binding table read) ----
+
+static void bind_read_cb(const esp_zb_zdo_binding_table_info_t *info, void *user_ctx);
+
+static void bind_read_send() {
+  esp_zb_zdo_mgmt_bind_param_t req = {};
+  req.dst_addr = g_bindRead.short_addr;
+  req.start_index = g_bindRead.startIdx;
+  g_bindRead.seq++;
+  g_bindRead.deadlineMs = millis() + BIND_TIMEOUT_MS;
+  esp_zb_zdo_binding_table_req(&req, bind_read_cb, (void *)(uintptr_t)g_bindRead.seq);
+}
+
+static void bind_read_end(bool ok, const char *err) {
+  DynamicJsonDocument doc(BIND_DOC);
+  doc["evt"] = "bind_table";
+  doc["ieee"] = g_bindRead.ieee16;
+  if (g_bindRead.cmdId[0]) doc["cmdId"] = g_bindRead.cmdId;
+  doc["ok"] = ok;
+  if (!ok && err) doc["error"] = err;
+  doc["total"] = g_bindRead.total; // rows past BIND_READ_MAX are only counted here
+  JsonArray entries = doc.createNestedArray("entries");
+  for (uint8_t i = 0; i < g_bindRead.count; i++) {
+    const auto &row = g_bindRead.rows[i];
+    JsonObject o = entries.createNestedObject();
+    o["ep"] = row.ep;
+    o["cluster"] = row.cluster;
+    char s[17];
+    if (row.dstMode == ESP_ZB_ZDO_BIND_DST_ADDR_MODE_16_BIT_GROUP) {
+      snprintf(s, sizeof(s), "0x%04x", (unsigned)(row.dst[0] | (row.dst[1] << 8)));
+      o["group"] = s;
+    } else {
+      ieee_le_to_str16(row.dst, s);
+      o["dst"] = s;
+      o["dstEp"] = row.dstEp;
+    }
+  }
+  uart_send_json(doc);
+  // The table goes out as an event; the cmd_result releases the hub's credit.
+  if (g_bindRead.cmdId[0]) uart_send_cmd_result(g_bindRead.cmdId, g_bindRead.ieee16, ok, ok ? nullptr : err);
+  g_bindRead.active = false;
+}
+
+static void bind_read_cb(const esp_zb_zdo_binding_table_info_t *info, void *user_ctx) {
+  if (!g_bindRead.active || (uint8_t)(uintptr_t)user_ctx != g_bindRead.seq) return;
+  if (!info || info->status != ESP_ZB_ZDP_STATUS_SUCCESS) {
+    bind_read_end(false, "mgmt_bind failed");
+    return;
+  }
+  g_bindRead.total = info->total;
+  uint8_t n = 0;
+  for (const esp_zb_zdo_binding_table_record_t *r = info->record; r; r = r->next, n++) {
+    if (g_bindRead.count >= BIND_READ_MAX) continue;
+    auto &row = g_bindRead.rows[g_bindRead.count++];
+    row.ep = r->src_endp;
+    row.cluster = r->cluster_id;
+    row.dstMode = r->dst_addr_mode;
+    if (r->dst_addr_mode == ESP_ZB_ZDO_BIND_DST_ADDR_MODE_16_BIT_GROUP) {
+      row.dst[0] = (uint8_t)(r->dst_address.addr_short & 0xFF);
+      row.dst[1] = (uint8_t)(r->dst_address.addr_short >> 8);
+    } else {
+      memcpy(row.dst, r->dst_address.addr_long, 8);
+    }
+    row.dstEp = r->dst_endp;
+  }
+  const uint16_t next = (uint16_t)info->index + n;
+  if (n > 0 && next < info->total) {
+    g_bindRead.startIdx = (uint8_t)next;
+    bind_read_send();
+  } else {
+    bind_read_end(true, nullptr);
+  }
+}
+
+// zb_task: {"cmd":"bind_table"}
+static void bind_table_request(const uart_cmd_t &cmd) {
+  const device_entry_t *d = find_routable_device(cmd.ieee16);
+  if (!d) {
+    uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "unknown device (wait for device_annce)");
+    return;
+  }
+  if (g_bindRead.active) {
+    uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "binding table read busy");
+    return;
+  }
+  g_bindRead.active = true;
+  g_bindRead.short_addr = d->short_addr;
+  g_bindRead.startIdx = 0;
+  g_bindRead.total = 0;
+  g_bindRead.count = 0;
+  strncpy(g_bindRead.cmdId, cmd.cmdId, sizeof(g_bindRead.cmdId) - 1);
+  g_bindRead.cmdId[sizeof(g_bindRead.cmdId) - 1] = 0;
+  memcpy(g_bindRead.ieee16, d->ieee16, sizeof(g_bindRead.ieee16));
+  bind_read_send();
+}
+
+static void bind_tick() {
+  const uint32_t now = millis();
+  for (uint8_t i = 0; i < BIND_OPS_MAX; i++) {
+    bind_op_t &op = g_bindOps[i];
+    if (op.used && (int32_t)(now - op.deadlineMs) >= 0) bind_op_end(op, false, true, ESP_ZB_ZDP_STATUS_TIMEOUT);
+  }
+  if (g_bindRead.active && (int32_t)(now - g_bindRead.deadlineMs) >= 0) bind_read_end(false, "timeout");
+}
+
+static bool bind_busy() {
+  if (g_bindRead.active) return true;
+  for (uint8_t i = 0; i < BIND_OPS_MAX; i++) {
+    if (g_bindOps[i].used) return true;
+  }
+  return false;
+}
+
+// ------------------------ Network backup ------------------------
+//
+// A replacement coordinator takes over the home's network: the hub keeps an
+// encrypted copy of the network parameters, this coordinator's IEEE address, the
+// "zbdevs" NVS namespace (device table chunks and desired bindings) and an image
+// of the stack's own NVRAM partition ("zb_storage": NWK outgoing frame counter,
+// APS link keys, neighbour state) and plays it back into a fresh C6, which then
+// resumes the same network under the same IEEE (bindings and report destinations
+// on the devices point at it).
+//   {"cmd":"net_backup"} -> paced, from zb_task:
+//     {"evt":"net_backup","state":"begin","pan":"0x1a2b","epan":"<ieee16>","channel":15,"key":"<base64>",
+//      "coordIeee":"<this coordinator>","devices":42,"nvram":24576}
+//     {"evt":"net_backup","k":"c03","off":0,"len":2388,"data":"<base64>"}  (NET_PART_BYTES per line)
+//     ... "bind", then "zbst" (the NVRAM image, nvram bytes; absent when nvram is 0)
+//     {"evt":"net_backup","state":"done","parts":31,"bytes":5120,"fnv":123}  (or "failed" + "error")
+//   {"cmd":"net_restore","seq":0,"state":"begin","pan","epan","channel","key","coordIeee","force":false}
+//   {"cmd":"net_restore","seq":1,"k":"c03","off":0,"len":2388,"data":"<base64>"} ...
+//   {"cmd":"net_restore","seq":N,"state":"commit","bytes":5120,"fnv":123}  -> reboot
+//     every line answered with {"evt":"net_restore","seq":n,"ok":true} (a repeated seq is re-acked);
+//     after the reboot {"evt":"net_restore","state":"done","ok":true,"nvram":true,"pan","channel",
+//     "coordIeee","devices"} follows.
+// Restore runs in loop() and writes NVS; commit writes the NVRAM image into this
+// chip's "zb_storage" under the stack lock and reboots, and the stack resumes
+// from it under the saved IEEE. Neighbours reject NWK frames whose counter is not
+// above the last one they saw from us, so the counter must move forward: ZBOSS
+// persists it lazily and skips ahead by that persist interval whenever it loads
+// NVRAM, which covers the frames sent between its last write and the snapshot.
+// Frames the old coordinator sent after the backup are covered only up to that
+// same jump, which is why the hub backs up hourly.
+// A backup without an image (no "zb_storage" partition, or one from an older
+// build) restores the parameters only: the network is formed anew with an erased
+// NVRAM, the IEEE is not taken over (its frame counter would start at 0 and every
+// neighbour would drop the frames as replays), and "done" carries "nvram":false -
+// every device has to rejoin.
+
+struct net_params_t {
+  bool pending;      // restored parameters not applied to a formed network yet
+  bool nvram;        // the stack NVRAM image was written: resume it under ieee
+  uint16_t pan;
+  uint8_t epan[8];   // LE, like an IEEE address
+  uint8_t channel;
+  uint8_t key[16];
+  uint8_t ieee[8];   // LE coordinator IEEE
+};
+
+struct net_backup_t {
+  bool active;
+  uint8_t chunk;     // 0..chunks-1: device table, chunks: "bind", chunks+1: "zbst"
+  bool loaded;
+  uint16_t len, off;
+  const uint8_t *src; // buf or nvram
+  uint8_t *nvram;    // "zb_storage" snapshot taken with the begin line
+  uint16_t nvramLen;
+  uint16_t parts;
+  uint32_t bytes;
+  uint32_t fnv;
+  uint32_t startMs;
+  uint8_t buf[sizeof(g_devStoreBuf)];
+};
+
+struct net_restore_t {
+  bool active;
+  bool acked;        // lastSeq was applied and acknowledged
+  uint16_t lastSeq;
+  char key[5];       // NVS key being assembled
+  bool ieeeOk;       // coordIeee was given
+  uint16_t len, off;
+  uint8_t *nvram;    // received "zbst" image
+  uint16_t nvramLen; // complete image length, 0 while none
+  uint32_t bytes;
+  uint32_t fnv;
+  uint32_t lastMs;
+  net_params_t params;
+  uint8_t buf[sizeof(g_devStoreBuf)];
+};
+
+static const uint8_t NET_CHUNKS = MAX_DEVICES / DEVSTORE_SLOTS_PER_CHUNK;
+static const char NET_NVRAM_LABEL[] = "zb_storage";
+static const size_t NET_NVRAM_MAX = 32 * 1024; // the image travels in one hub blob
+
+static Preferences g_netPrefs;
+static net_params_t g_netRst;   // loaded in setup(), applied in zigbee_init_coordinator()
+static net_backup_t g_netBackup;
+static net_restore_t g_netRestore;
+
+static uint32_t net_fnv(uint32_t h, const uint8_t *p, size_t n) {
+  for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+static void net_key_name(uint8_t chunk, char out[5]) {
+  if (chunk < NET_CHUNKS) devstore_key(chunk, out);
+  else strncpy(out, chunk == NET_CHUNKS ? "bind" : "zbst", 5);
+}
+
+static bool net_key_valid(const char *k) {
+  if (strcmp(k, "bind") == 0 || strcmp(k, "zbst") == 0) return true;
+  char name[5];
+  for (uint8_t c = 0; c < NET_CHUNKS; c++) {
+    devstore_key(c, name);
+    if (strcmp(k, name) == 0) return true;
+  }
+  return false;
+}
+
+static const esp_partition_t *net_nvram_partition() {
+  const esp_partition_t *part =
+      esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, NET_NVRAM_LABEL);
+  return part && part->size <= NET_NVRAM_MAX ? part : nullptr;
+}
+
+// "rst" blob in namespace "zbnet": 'N', version, pan(2) epan(8) channel(1) key(16)
+// [, ieee(8) in version 2: the NVRAM image was written].
+static const size_t NET_PARAMS_V1 = 2 + 2 + 8 + 1 + 16;
+
+static void net_params_save(const net_params_t &p) {
+  uint8_t buf[NET_PARAMS_V1 + 8];
+  uint8_t *w = buf;
+  *w++ = 'N';
+  *w++ = p.nvram ? 2 : 1;
+  put_u16(w, p.pan);
+  memcpy(w, p.epan, 8);
+  w += 8;
+  *w++ = p.channel;
+  memcpy(w, p.key, 16);
+  w += 16;
+  if (p.nvram) {
+    memcpy(w, p.ieee, 8);
+    w += 8;
+  }
+  g_netPrefs.putBytes("rst", buf, (size_t)(w - buf));
+}
 
-	    StaticJsonDocument<256> doc;
-	    DeserializationError err = deserializeJson(doc, jsonBuf);
-	    if (err) {
-	      Serial.printf("[ZB] custom_cmd JSON parse fail: %s\n", err.c_str());
-	      return ESP_OK;
-	    }
+// setup(): a restore committed before the last reboot is waiting to be applied.
+static void net_restore_load() {
+  g_netPrefs.begin("zbnet", false);
+  uint8_t buf[NET_PARAMS_V1 + 8];
+  const size_t len = g_netPrefs.getBytesLength("rst");
+  if ((len != NET_PARAMS_V1 && len != sizeof(buf)) || g_netPrefs.getBytes("rst", buf, len) != len) return;
+  devstore_reader_t r = {buf, buf + len, true};
+  const uint8_t magic = rd_u8(r), version = rd_u8(r);
+  if (magic != 'N' || version != (len == NET_PARAMS_V1 ? 1 : 2)) return;
+  g_netRst.pan = rd_u16(r);
+  memcpy(g_netRst.epan, rd_take(r, 8), 8);
+  g_netRst.channel = rd_u8(r);
+  memcpy(g_netRst.key, rd_take(r, 16), 16);
+  g_netRst.nvram = version == 2;
+  if (g_netRst.nvram) memcpy(g_netRst.ieee, rd_take(r, 8), 8);
+  g_netRst.pending = r.ok && g_netRst.channel >= 11 && g_netRst.channel <= 26;
+  Serial.printf("[C6] network restore pending: pan=0x%04x channel=%u\n", (unsigned)g_netRst.pan,
+                (unsigned)g_netRst.channel);
+}
 
-	    const uint8_t cmdId = m->info.command.id;
-	    if (cmdId == LOCK_CMD_CMD_RESULT) {
-	      const char *cmdIdStr = doc["cmdId"] | "";
-	      const bool ok = doc["ok"] | false;
-	      const char *error = doc["error"] | "";
-	      uart_send_cmd_result(cmdIdStr, dev->ieee16, ok, error);
-	    } else if (cmdId == LOCK_CMD_EVENT) {
-	      const char *type = doc["type"] | "";
-	      JsonVariantConst data = doc["data"].as<JsonVariantConst>();
-	      if (type && type[0]) {
-	        uart_send_zb_event(dev->ieee16, type, data);
-	      }
-	    } else if (cmdId == LOCK_CMD_STATE) {
-	      // State payload is already the reported object
-	      uart_send_zb_state(dev->ieee16, doc.as<JsonVariantConst>());
-	    } else {
-	      Serial.printf("[ZB] unknown custom_cmd id=0x%02x from %s\n", cmdId, dev->ieee16);
-	    }
-	    return ESP_OK;
-	  }
-	    default:
-	      return ESP_OK;
+// zigbee_init_coordinator(), between esp_zb_init() and esp_zb_start().
+static void net_restore_apply() {
+  if (g_netRst.nvram) {
+    // The image carries the network, its keys and the frame counters; only the
+    // IEEE comes from the chip and has to be the one they belong to.
+    esp_zb_set_long_address(g_netRst.ieee);
+    return;
   }
+  esp_zb_nvram_erase_at_start(true); // form anew instead of resuming whatever this chip had
+  esp_zb_set_pan_id(g_netRst.pan);
+  esp_zb_set_extended_pan_id(g_netRst.epan);
+#if ZB_HAS_SECUR_IC
+  esp_zb_secur_network_key_set(g_netRst.key);
+#endif
 }
 
-// Zigbee stack calls this weak symbol.
+static bool net_restore_pending() {
+  return g_netRst.pending;
+}
 
-// esp_zb_scheduler_alarm() passes a uint8_t parameter (Arduino-ESP32 Zigbee libs
-// build with that signature). Keep an adapter to avoid void* casts.
-static void bdb_commissioning_cb(uint8_t mode) {
-  esp_zb_bdb_start_top_level_commissioning((esp_zb_bdb_commissioning_mode_t)mode);
+// Signal handler: the network formed after a restore.
+static void net_restore_formed() {
+  const uint16_t pan = esp_zb_get_pan_id();
+  const uint8_t channel = esp_zb_get_current_channel();
+  uint8_t ieee[8];
+  esp_zb_get_long_address(ieee);
+  const bool ieeeOk = !g_netRst.nvram || memcmp(ieee, g_netRst.ieee, sizeof(ieee)) == 0;
+  const bool ok = pan == g_netRst.pan && channel == g_netRst.channel && ieeeOk;
+  g_netRst.pending = false;
+  g_netPrefs.remove("rst");
+
+  StaticJsonDocument<256> doc;
+  doc["evt"] = "net_restore";
+  doc["state"] = "done";
+  doc["ok"] = ok;
+  doc["nvram"] = g_netRst.nvram; // false: formed anew, every device has to rejoin
+  if (!ok) doc["error"] = ieeeOk ? "pan or channel taken" : "ieee not applied";
+  char s[17];
+  snprintf(s, sizeof(s), "0x%04x", (unsigned)pan);
+  doc["pan"] = s;
+  doc["channel"] = channel;
+  ieee_le_to_str16(ieee, s);
+  doc["coordIeee"] = s;
+  doc["devices"] = device_count();
+  uart_send_json(doc);
 }
 
-extern "C" void esp_zb_app_signal_handler(esp_zb_app_signal_t *signal_struct) {
-  if (!signal_struct) return;
+// ---- Backup (zb_task) ----
 
-  esp_zb_app_signal_type_t sig = *(esp_zb_app_signal_type_t *)signal_struct->p_app_signal;
-  esp_err_t status = signal_struct->esp_err_status;
+static void net_backup_end(const char *state, const char *err) {
+  StaticJsonDocument<192> doc;
+  doc["evt"] = "net_backup";
+  doc["state"] = state;
+  if (err) {
+    doc["error"] = err;
+  } else {
+    doc["parts"] = g_netBackup.parts;
+    doc["bytes"] = g_netBackup.bytes;
+    doc["fnv"] = g_netBackup.fnv;
+    doc["ms"] = (uint32_t)(millis() - g_netBackup.startMs);
+  }
+  uart_send_json(doc);
+  g_netBackup.active = false;
+  free(g_netBackup.nvram);
+  g_netBackup.nvram = nullptr;
+  g_netBackup.nvramLen = 0;
+}
 
-  if (sig == ESP_ZB_ZDO_SIGNAL_SKIP_STARTUP) {
-    // Start commissioning
-    esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_INITIALIZATION);
+static void net_backup_request(const uart_cmd_t &cmd) {
+  (void)cmd;
+  if (g_netBackup.active) return; // the running backup answers
+  g_netBackup.startMs = millis();
+  if (g_zbStackState != ZB_STACK_FORMED || g_netRst.pending) {
+    net_backup_end("failed", "network not formed");
     return;
   }
-
-  if (sig == ESP_ZB_BDB_SIGNAL_DEVICE_FIRST_START || sig == ESP_ZB_BDB_SIGNAL_DEVICE_REBOOT) {
-    if (status == ESP_OK) {
-      esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_NETWORK_FORMATION);
-    }
+  uint8_t key[16] = {};
+#if ZB_HAS_SECUR_IC
+  if (esp_zb_secur_network_key_get(key) != ESP_OK) {
+    net_backup_end("failed", "network key not readable");
     return;
   }
+#else
+  net_backup_end("failed", "network key not readable");
+  return;
+#endif
+  if (g_devDirty) devstore_flush(); // back up what is in RAM, not the last settled write
 
-  if (sig == ESP_ZB_BDB_SIGNAL_FORMATION) {
-    if (status == ESP_OK) {
-      esp_zb_bdb_start_top_level_commissioning(ESP_ZB_BDB_MODE_NETWORK_STEERING);
-    } else {
-      // Retry formation
-      esp_zb_scheduler_alarm(bdb_commissioning_cb,
-                             (uint8_t)ESP_ZB_BDB_MODE_NETWORK_FORMATION,
-                             1000);
-    }
+  // Stack NVRAM, copied in one go from zb_task so the stack cannot write it halfway.
+  const esp_partition_t *part = net_nvram_partition();
+  g_netBackup.nvramLen = 0;
+  g_netBackup.nvram = part ? (uint8_t *)malloc(part->size) : nullptr;
+  if (g_netBackup.nvram && esp_partition_read(part, 0, g_netBackup.nvram, part->size) == ESP_OK) {
+    g_netBackup.nvramLen = (uint16_t)part->size;
+  }
+
+  DynamicJsonDocument doc(384);
+  doc["evt"] = "net_backup";
+  doc["state"] = "begin";
+  char s[48];
+  snprintf(s, sizeof(s), "0x%04x", (unsigned)esp_zb_get_pan_id());
+  doc["pan"] = s;
+  uint8_t eui[8];
+  esp_zb_get_extended_pan_id(eui);
+  ieee_le_to_str16(eui, s);
+  doc["epan"] = s;
+  doc["channel"] = esp_zb_get_current_channel();
+  size_t n = 0;
+  mbedtls_base64_encode((unsigned char *)s, sizeof(s), &n, key, sizeof(key));
+  s[n] = 0;
+  doc["key"] = s;
+  esp_zb_get_long_address(eui);
+  ieee_le_to_str16(eui, s);
+  doc["coordIeee"] = s; // not "ieee": the hub takes that as a device it heard from
+  doc["devices"] = device_count();
+  doc["nvram"] = g_netBackup.nvramLen; // 0: restoring this backup means every device rejoins
+  if (!uart_send_json(doc)) {
+    net_backup_end("failed", "uart busy");
     return;
   }
+  memset(key, 0, sizeof(key));
 
-  if (sig == ESP_ZB_ZDO_SIGNAL_DEVICE_ANNCE) {
-    esp_zb_zdo_signal_device_annce_params_t *annce =
-        (esp_zb_zdo_signal_device_annce_params_t *)esp_zb_app_signal_get_params((uint32_t *)signal_struct->p_app_signal);
-    if (!annce) return;
+  g_netBackup.active = true;
+  g_netBackup.chunk = 0;
+  g_netBackup.loaded = false;
+  g_netBackup.parts = 0;
+  g_netBackup.bytes = 0;
+  g_netBackup.fnv = 2166136261u;
+}
 
-    device_entry_t *dev = upsert_device(annce->device_short_addr, annce->ieee_addr);
-    if (dev) {
-      uart_send_device_annce(dev->ieee16, dev->short_addr);
-      // Sprint 11: actively request Basic fingerprint so discovered payload has manufacturer/model/swBuildId.
-      zb_read_basic_fingerprint(dev->short_addr, DEFAULT_DST_ENDPOINT);
+// One part per call while the event buffer has room; the UART drains ~11 KB/s.
+static bool net_backup_part() {
+  net_backup_t &b = g_netBackup;
+  char k[5];
+  while (!b.loaded) {
+    if (b.chunk > NET_CHUNKS + 1) {
+      net_backup_end("done", nullptr);
+      return false;
     }
-    return;
+    net_key_name(b.chunk, k);
+    size_t len = b.nvramLen;
+    b.src = b.nvram;
+    if (b.chunk <= NET_CHUNKS) {
+      len = g_devPrefs.isKey(k) ? g_devPrefs.getBytesLength(k) : 0;
+      b.src = b.buf;
+      if (len > sizeof(b.buf) || g_devPrefs.getBytes(k, b.buf, len) != len) len = 0;
+    }
+    if (len == 0) {
+      b.chunk++;
+      continue;
+    }
+    b.len = (uint16_t)len;
+    b.off = 0;
+    b.loaded = true;
   }
-}
+  net_key_name(b.chunk, k);
+  const uint16_t n = (uint16_t)min((size_t)(b.len - b.off), NET_PART_BYTES);
+  char data[4 * ((NET_PART_BYTES + 2) / 3) + 1];
+  size_t dn = 0;
+  mbedtls_base64_encode((unsigned char *)data, sizeof(data), &dn, b.src + b.off, n);
+  data[dn] = 0;
 
-// ------------------------ UART command queue ------------------------
+  StaticJsonDocument<160> doc;
+  doc["evt"] = "net_backup";
+  doc["k"] = k;
+  doc["off"] = b.off;
+  doc["len"] = b.len;
+  doc["data"] = (const char *)data; // by pointer, serialized below
+  if (!uart_send_json(doc)) return false; // retried on the next tick
 
-typedef enum {
-  CMD_PERMIT_JOIN = 1,
-  CMD_ZCL_ONOFF = 2,
-  CMD_ZCL_LEVEL = 3,
-  CMD_REMOVE_DEVICE = 4,
-  CMD_LOCK_ACTION = 5,
-  CMD_IDENTIFY = 6,
-} cmd_type_t;
+  b.fnv = net_fnv(b.fnv, b.src + b.off, n);
+  b.bytes += n;
+  b.parts++;
+  b.off += n;
+  if (b.off >= b.len) {
+    b.loaded = false;
+    b.chunk++;
+  }
+  return true;
+}
 
-struct uart_cmd_t {
-  cmd_type_t type;
-  char cmdId[40];
-  char ieee16[17];
-  uint8_t dst_ep; // default 1
-  uint16_t u16;
-  char payload[256];
-};
+static void net_backup_tick() {
+  while (g_netBackup.active &&
+         xMessageBufferSpacesAvailable(g_txMb[TX_PRIO_EVENT]) >= TX_BUF_EVENT / 2 && net_backup_part()) {
+  }
+}
 
-static QueueHandle_t g_cmdQueue = nullptr;
+// ---- Restore (loop) ----
 
-static bool enqueue_cmd(const uart_cmd_t &cmd) {
-  if (!g_cmdQueue) return false;
-  return xQueueSend(g_cmdQueue, &cmd, 0) == pdTRUE;
+static void net_restore_ack(uint16_t seq, bool ok, const char *err) {
+  StaticJsonDocument<128> doc;
+  doc["evt"] = "net_restore";
+  doc["seq"] = seq;
+  doc["ok"] = ok;
+  if (err) doc["error"] = err;
+  uart_send_json(doc, TX_PRIO_CMD);
 }
 
-static bool parse_uart_cmd(const JsonDocument &doc, uart_cmd_t &out, const char **err) {
-  *err = nullptr;
-  memset(&out, 0, sizeof(out));
-
-  const char *cmd = doc["cmd"] | "";
-  const char *cmdId = doc["cmdId"] | "";
-  if (cmdId && cmdId[0] != '\0') {
-    strncpy(out.cmdId, cmdId, sizeof(out.cmdId) - 1);
-    out.cmdId[sizeof(out.cmdId) - 1] = 0;
-  }
+static void net_restore_abandon(const char *why) {
+  g_netRestore.acked = false;
+  if (!g_netRestore.active) return;
+  g_netRestore.active = false;
+  free(g_netRestore.nvram);
+  g_netRestore.nvram = nullptr;
+  g_netRestore.nvramLen = 0;
+  g_devStoreHold = false;
+  g_devStoreRewrite = true; // put the live table back over the partial copy
+  Serial.printf("[C6] network restore abandoned: %s\n", why);
+}
 
-  if (strcmp(cmd, "permit_join") == 0) {
-    int duration = doc["duration"] | (doc["durationSec"] | 60);
-    if (duration < 0) duration = 0;
-    if (duration > 255) duration = 255;
-    out.type = CMD_PERMIT_JOIN;
-    out.u16 = (uint16_t)duration;
-    return true;
+static const char *net_restore_begin(JsonDocument &doc) {
+  net_restore_t &r = g_netRestore;
+#if !ZB_HAS_SECUR_IC
+  (void)r;
+  return "network key not settable on this build";
+#endif
+  if (device_count() > 0 && !(doc["force"] | false)) return "coordinator has devices (force to overwrite)";
+  net_params_t &p = r.params;
+  const char *pan = doc["pan"] | "";
+  p.pan = (uint16_t)strtoul(pan, nullptr, 16);
+  p.channel = doc["channel"] | 0;
+  size_t n = 0;
+  const char *key = doc["key"] | "";
+  if (!ieee_str16_to_le_bytes(doc["epan"] | "", p.epan) || !pan[0] || p.pan == 0xFFFF || p.channel < 11 ||
+      p.channel > 26 || mbedtls_base64_decode(p.key, sizeof(p.key), &n, (const unsigned char *)key, strlen(key)) != 0 ||
+      n != sizeof(p.key)) {
+    return "bad network parameters";
   }
+  const char *ieee = doc["coordIeee"] | "";
+  r.ieeeOk = ieee[0] != 0;
+  if (r.ieeeOk && !ieee_str16_to_le_bytes(ieee, p.ieee)) return "bad coordinator ieee";
+  g_devStoreHold = true;
+  g_devPrefs.clear();
+  r.active = true;
+  r.key[0] = 0;
+  r.len = r.off = 0;
+  r.bytes = 0;
+  r.fnv = 2166136261u;
+  return nullptr;
+}
 
-  if (strcmp(cmd, "zcl_onoff") == 0) {
-    const char *ieeeIn = doc["ieee"] | "";
-    char norm[17];
-    if (!normalize_ieee_str(ieeeIn, norm)) {
-      *err = "invalid ieee";
-      return false;
+static const char *net_restore_part(JsonDocument &doc) {
+  net_restore_t &r = g_netRestore;
+  const char *k = doc["k"] | "";
+  const uint16_t off = doc["off"] | 0;
+  const uint16_t len = doc["len"] | 0;
+  const bool image = strcmp(k, "zbst") == 0;
+  const esp_partition_t *part = image ? net_nvram_partition() : nullptr;
+  if (image && !part) return "no zb_storage partition";
+  if (!net_key_valid(k) || len == 0 || (image ? len != part->size : len > sizeof(r.buf))) return "bad part";
+  if (off == 0) {
+    if (r.off != r.len) return "previous key incomplete";
+    if (image) {
+      free(r.nvram);
+      r.nvramLen = 0;
+      r.nvram = (uint8_t *)malloc(len);
+      if (!r.nvram) return "out of memory";
     }
-    int v = doc["value"].is<int>() ? doc["value"].as<int>() : (doc["on"].as<bool>() ? 1 : 0);
-    out.type = CMD_ZCL_ONOFF;
-    strncpy(out.ieee16, norm, sizeof(out.ieee16));
-    out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
-    if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
-    out.u16 = (uint16_t)(v ? 1 : 0);
-    return true;
+    strncpy(r.key, k, sizeof(r.key));
+    r.len = len;
+    r.off = 0;
+  } else if (strcmp(k, r.key) != 0 || off != r.off || len != r.len) {
+    return "part out of order";
+  }
+  uint8_t *dst = image ? r.nvram : r.buf;
+  const char *data = doc["data"] | "";
+  size_t n = 0;
+  if (mbedtls_base64_decode(dst + r.off, r.len - r.off, &n, (const unsigned char *)data, strlen(data)) != 0 ||
+      n == 0) {
+    return "bad data";
   }
+  r.fnv = net_fnv(r.fnv, dst + r.off, n);
+  r.bytes += n;
+  r.off += n;
+  if (r.off < r.len) return nullptr;
+  if (image) r.nvramLen = r.len;
+  else if (g_devPrefs.putBytes(r.key, r.buf, r.len) != r.len) return "nvs write failed";
+  return nullptr;
+}
 
-  if (strcmp(cmd, "zcl_level") == 0) {
-    const char *ieeeIn = doc["ieee"] | "";
-    char norm[17];
-    if (!normalize_ieee_str(ieeeIn, norm)) {
-      *err = "invalid ieee";
-      return false;
-    }
-    int level = doc["value"] | (doc["level"] | 0);
-    if (level < 0) level = 0;
-    if (level > 255) level = 255;
-    out.type = CMD_ZCL_LEVEL;
-    strncpy(out.ieee16, norm, sizeof(out.ieee16));
-    out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
-    if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
-    out.u16 = (uint16_t)level;
-    return true;
+// Commit: overwrite the stack NVRAM with the image and reboot. The stack lock
+// keeps zb_task off the partition until the restart and is never released. A
+// failed write falls back to forming anew from the parameters.
+static void net_restore_write_nvram(net_restore_t &r) {
+  const esp_partition_t *part = net_nvram_partition();
+  esp_zb_lock_acquire(portMAX_DELAY);
+  esp_err_t err = esp_partition_erase_range(part, 0, part->size);
+  if (err == ESP_OK) err = esp_partition_write(part, 0, r.nvram, r.nvramLen);
+  if (err != ESP_OK) {
+    Serial.printf("[C6] zb_storage write failed: %s\n", esp_err_to_name(err));
+    r.params.nvram = false;
+    net_params_save(r.params);
   }
+}
 
-  // Sprint 11: Identify (blink) command
-  if (strcmp(cmd, "identify") == 0) {
-    const char *ieeeIn = doc["ieee"] | "";
-    char norm[17];
-    if (!normalize_ieee_str(ieeeIn, norm)) {
-      *err = "invalid ieee";
-      return false;
-    }
-    int timeSec = doc["time"] | (doc["duration"] | (doc["durationSec"] | 4));
-    if (timeSec < 0) timeSec = 0;
-    if (timeSec > 255) timeSec = 255;
-    out.type = CMD_IDENTIFY;
-    strncpy(out.ieee16, norm, sizeof(out.ieee16));
-    out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
-    if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
-    out.u16 = (uint16_t)timeSec;
-    return true;
+// loop(): {"cmd":"net_restore",...}. Leaves the stack alone until commit, which reboots.
+static void net_restore_line(JsonDocument &doc) {
+  net_restore_t &r = g_netRestore;
+  const uint16_t seq = doc["seq"] | 0;
+  const char *state = doc["state"] | "";
+  if (strcmp(state, "abort") == 0) {
+    net_restore_abandon("hub abort");
+    return;
+  }
+  if (r.active && r.acked && seq == r.lastSeq) { // our ack was lost
+    net_restore_ack(seq, true, nullptr);
+    return;
   }
 
-	if (strcmp(cmd, "lock_action") == 0) {
-	  const char *ieeeIn = doc["ieee"] | "";
-	  char norm[17];
-	  if (!normalize_ieee_str(ieeeIn, norm)) {
-	    *err = "invalid ieee";
-	    return false;
-	  }
-	  const char *action = doc["action"] | "";
-	  JsonVariantConst argsV = doc["args"].as<JsonVariantConst>();
-	  if (!action || action[0] == 0) {
-	    *err = "missing action";
-	    return false;
-	  }
-	  out.type = CMD_LOCK_ACTION;
-	  strncpy(out.ieee16, norm, sizeof(out.ieee16));
-	  out.dst_ep = (uint8_t)(doc["endpoint"] | DEFAULT_DST_ENDPOINT);
-	  if (out.dst_ep == 0) out.dst_ep = DEFAULT_DST_ENDPOINT;
+  const char *err = nullptr;
+  if (strcmp(state, "begin") == 0) {
+    net_restore_abandon("restarted");
+    err = net_restore_begin(doc);
+  } else if (!r.active || seq != (uint16_t)(r.lastSeq + 1)) {
+    err = "no restore in progress";
+  } else if (strcmp(state, "commit") == 0) {
+    if (r.off != r.len) err = "last key incomplete";
+    else if ((doc["bytes"] | 0UL) != r.bytes || (doc["fnv"] | 0UL) != r.fnv) err = "checksum mismatch";
+  } else {
+    err = net_restore_part(doc);
+  }
 
-	  // Build payload JSON to send over Zigbee custom cluster command
-	  StaticJsonDocument<256> pl;
-	  pl["cmdId"] = out.cmdId;
-	  pl["action"] = action;
-	  if (!argsV.isNull()) pl["args"] = argsV;
-	  char buf[sizeof(out.payload)];
-	  size_t n = serializeJson(pl, buf, sizeof(buf));
-	  if (n == 0 || n >= sizeof(out.payload)) {
-	    *err = "payload too large";
-	    return false;
-	  }
-	  strncpy(out.payload, buf, sizeof(out.payload));
-	  out.payload[sizeof(out.payload) - 1] = '\0';
-	  return true;
-	}
+  if (err) {
+    net_restore_abandon(err);
+    net_restore_ack(seq, false, err);
+    return;
+  }
+  r.lastSeq = seq;
+  r.acked = true;
+  r.lastMs = millis();
+  net_restore_ack(seq, true, nullptr);
 
-  if (strcmp(cmd, "remove_device") == 0) {
-    const char *ieeeIn = doc["ieee"] | "";
-    char norm[17];
-    if (!normalize_ieee_str(ieeeIn, norm)) {
-      *err = "invalid ieee";
-      return false;
-    }
-    out.type = CMD_REMOVE_DEVICE;
-    strncpy(out.ieee16, norm, sizeof(out.ieee16));
-    return true;
+  if (strcmp(state, "commit") == 0) {
+    r.params.pending = true;
+    r.params.nvram = r.nvramLen > 0 && r.ieeeOk;
+    net_params_save(r.params);
+    Serial.printf("[C6] network restore committed (%lu bytes, nvram %u), rebooting\n", (unsigned long)r.bytes,
+                  (unsigned)(r.params.nvram ? r.nvramLen : 0));
+    uart_tx_flush(200);
+    if (r.params.nvram) net_restore_write_nvram(r);
+    delay(50);
+    ESP.restart();
   }
+}
 
-  *err = "unknown cmd";
-  return false;
+static void net_restore_tick() {
+  if (g_netRestore.active && (uint32_t)(millis() - g_netRestore.lastMs) >= NET_RESTORE_IDLE_MS) {
+    net_restore_abandon("timeout");
+  }
 }
 
 // ------------------------ Zigbee init/task ------------------------
@@ -924,9 +5224,9 @@ static void zigbee_init_coordinator() {
 #else
   // Fallback: minimal coordinator configuration (API fields are stable across SDK revs).
   zb_nwk_cfg.esp_zb_role = ESP_ZB_DEVICE_TYPE_COORDINATOR;
-  zb_nwk_cfg.install_code_policy = false;
   zb_nwk_cfg.nwk_cfg.zczr_cfg.max_children = 16;
 #endif
+  zb_nwk_cfg.install_code_policy = ZB_INSTALL_CODE_POLICY ? true : false;
   esp_zb_init(&zb_nwk_cfg);
 
   // Coordinator endpoint: Basic/Identify server + OnOff/Level client
@@ -943,6 +5243,8 @@ static void zigbee_init_coordinator() {
   // (Match the function signatures used in other Arduino Zigbee sketches in this repo.)
   esp_zb_cluster_list_add_basic_cluster(cluster_list, nullptr, (uint8_t)ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
   esp_zb_cluster_list_add_identify_cluster(cluster_list, nullptr, (uint8_t)ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+  // Time server: reports Time=0 / TimeStatus=0 (not synchronized) until the hub sends time_sync.
+  esp_zb_cluster_list_add_time_cluster(cluster_list, nullptr, (uint8_t)ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
 
   esp_zb_cluster_list_add_on_off_cluster(cluster_list, nullptr, (uint8_t)ESP_ZB_ZCL_CLUSTER_CLIENT_ROLE);
   esp_zb_cluster_list_add_level_cluster(cluster_list, nullptr, (uint8_t)ESP_ZB_ZCL_CLUSTER_CLIENT_ROLE);
@@ -956,72 +5258,175 @@ static void zigbee_init_coordinator() {
   ESP_ERROR_CHECK(esp_zb_device_register(ep_list));
 
   esp_zb_core_action_handler_register(zb_action_handler);
-  esp_zb_set_primary_network_channel_set(ESP_ZB_TRANSCEIVER_ALL_CHANNELS_MASK);
+  esp_zb_zcl_command_send_status_handler_register(cmd_track_send_status_cb);
+  if (g_netRst.pending) {
+    net_restore_apply();
+    esp_zb_set_primary_network_channel_set(1UL << g_netRst.channel);
+  } else {
+    esp_zb_set_primary_network_channel_set(ZB_CHANNEL ? (1UL << ZB_CHANNEL) : ESP_ZB_TRANSCEIVER_ALL_CHANNELS_MASK);
+  }
 
   esp_zb_start(false);
 }
 
-static void zb_task(void *) {
-  zigbee_init_coordinator();
-
-  while (true) {
-    // Process queued UART commands in Zigbee context
-    uart_cmd_t cmd;
-    while (g_cmdQueue && xQueueReceive(g_cmdQueue, &cmd, 0) == pdTRUE) {
-      if (cmd.type == CMD_PERMIT_JOIN) {
-        zb_set_permit_join(cmd.u16);
-        uart_send_cmd_result(cmd.cmdId, "", true, nullptr);
-      } else if (cmd.type == CMD_ZCL_ONOFF) {
-        device_entry_t *d = find_device_by_ieee(cmd.ieee16);
-        if (!d) {
-          uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "unknown device (wait for device_annce)");
-        } else {
-          zb_send_onoff(d->short_addr, cmd.dst_ep, cmd.u16 ? true : false);
-          uart_send_cmd_result(cmd.cmdId, cmd.ieee16, true, nullptr);
-        }
-      } else if (cmd.type == CMD_ZCL_LEVEL) {
-        device_entry_t *d = find_device_by_ieee(cmd.ieee16);
-        if (!d) {
-          uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "unknown device (wait for device_annce)");
-        } else {
-          zb_send_level(d->short_addr, cmd.dst_ep, (uint8_t)cmd.u16, 0);
-          uart_send_cmd_result(cmd.cmdId, cmd.ieee16, true, nullptr);
-        }
+// zb_task runs the stack's blocking loop (esp_zb_stack_main_loop), which sleeps
+// until the radio or a stack timer has work. Ours is injected as scheduler
+// alarms: loop() arms zb_cmd_drain when it queues a command, and zb_tick re-arms
+// itself every ZB_TICK_BUSY_MS while something has a deadline, ZB_TICK_IDLE_MS
+// otherwise. Idle wakeups drop from one per RTOS tick to about one per second.
+static volatile bool g_zbLoopReady = false;
+static volatile bool g_cmdDrainArmed = false;
 
-      } else if (cmd.type == CMD_IDENTIFY) {
-        device_entry_t *d = find_device_by_ieee(cmd.ieee16);
-        if (!d) {
-          uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "unknown device (wait for device_annce)");
-        } else {
-          zb_send_identify_cmd(d->short_addr, cmd.dst_ep, cmd.u16);
-          uart_send_cmd_result(cmd.cmdId, cmd.ieee16, true, nullptr);
-          // Best-effort: treat "sent Identify" as confirmation signal for UI
-          uart_send_zb_identify(d->ieee16, cmd.u16, "cmd");
-        }
-	      } else if (cmd.type == CMD_LOCK_ACTION) {
-	        device_entry_t *d = find_device_by_ieee(cmd.ieee16);
-	        if (!d) {
-	          uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "unknown device (wait for device_annce)");
-	        } else {
-	          zb_send_lock_custom_cmd(d->short_addr, cmd.dst_ep, LOCK_CMD_ACTION_REQ, cmd.payload);
-	          // actual cmd_result will be forwarded by end-device
-	        }
-      } else if (cmd.type == CMD_REMOVE_DEVICE) {
-        uint8_t ieee_le[8];
-        if (!ieee_str16_to_le_bytes(cmd.ieee16, ieee_le)) {
-          uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "invalid ieee");
-        } else {
-          zb_remove_device(ieee_le);
-          uart_send_cmd_result(cmd.cmdId, cmd.ieee16, true, nullptr);
-        }
+static void zb_dispatch(const uart_cmd_t &cmd) {
+  if (cmd.type == CMD_PERMIT_JOIN) {
+    zb_set_permit_join(cmd.u16);
+    uart_send_cmd_result(cmd.cmdId, "", true, nullptr);
+  } else if (cmd.type == CMD_ZCL_ONOFF || cmd.type == CMD_ZCL_LEVEL || cmd.type == CMD_IDENTIFY) {
+    device_entry_t *d = find_routable_device(cmd.ieee16);
+    if (!d) {
+      uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "unknown device (wait for device_annce)");
+    } else {
+      cmd_track_start(cmd, d);
+      // Best-effort: treat "sent Identify" as confirmation signal for UI
+      if (cmd.type == CMD_IDENTIFY) uart_send_zb_identify(d->ieee16, cmd.u16, "cmd");
+    }
+  } else if (cmd.type == CMD_LOCK_ACTION) {
+    device_entry_t *d = find_routable_device(cmd.ieee16);
+    if (!d) {
+      uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "unknown device (wait for device_annce)");
+    } else {
+      const char *data = cmd.payload;
+      size_t len = cmd.u16;
+      char json[2 * CMD_PAYLOAD_MAX];
+      if (!d->lockBin) {
+        len = lock_action_to_json(cmd.payload, cmd.u16, json, sizeof(json));
+        data = json;
+      }
+      if (!zb_send_lock_custom_cmd(d->short_addr, cmd.dst_ep, LOCK_CMD_ACTION_REQ, data, len, cmd.cmdId,
+                                   cmd.ieee16)) {
+        uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, len ? "lock busy" : "payload too large");
       }
+      // otherwise the actual cmd_result will be forwarded by end-device
+    }
+  } else if (cmd.type == CMD_REMOVE_DEVICE) {
+    uint8_t ieee_le[8];
+    if (!ieee_str16_to_le_bytes(cmd.ieee16, ieee_le)) {
+      uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "invalid ieee");
+    } else {
+      zb_remove_device(ieee_le);
+      forget_device(find_device_by_ieee(cmd.ieee16));
+      bind_forget_device(ieee_le);
+      uart_send_cmd_result(cmd.cmdId, cmd.ieee16, true, nullptr);
     }
+  } else if (cmd.type == CMD_INSTALL_CODE) {
+    uint8_t ieee_le[8];
+    esp_err_t r = ESP_ERR_INVALID_ARG;
+    if (ieee_str16_to_le_bytes(cmd.ieee16, ieee_le)) {
+      r = zb_add_install_code(ieee_le, (uint8_t *)cmd.payload, (uint8_t)cmd.u16);
+    }
+    uart_send_install_code_result(cmd.ieee16, r == ESP_OK,
+                                  r == ESP_ERR_NOT_SUPPORTED ? "install codes unsupported" : "install code rejected");
+  } else if (cmd.type == CMD_REPORT_CFG || cmd.type == CMD_REPORT_READ || cmd.type == CMD_REPORT_PROFILE) {
+    rpt_execute(cmd);
+  } else if (cmd.type == CMD_RESYNC) {
+    resync_request(cmd);
+  } else if (cmd.type == CMD_TOPOLOGY) {
+    topo_request(cmd);
+  } else if (cmd.type == CMD_BIND || cmd.type == CMD_UNBIND) {
+    bind_request(cmd);
+  } else if (cmd.type == CMD_BIND_TABLE) {
+    bind_table_request(cmd);
+  } else if (cmd.type == CMD_BIND_LIST) {
+    bind_list_send(cmd.cmdId);
+  } else if (cmd.type == CMD_NET_BACKUP) {
+    net_backup_request(cmd);
+  }
+}
+
+// Something with a deadline finer than ZB_TICK_IDLE_MS is pending.
+static bool zb_tick_busy() {
+  if (g_resync.active || g_resync.waitForm || g_topo.active || bind_busy() || lock_frag_busy() ||
+      g_netBackup.active) {
+    return true;
+  }
+  for (uint8_t i = 0; i < IV_MAX_ACTIVE; i++) {
+    if (g_iv[i].stage != IV_IDLE) return true;
+  }
+  for (uint8_t i = 0; i < CMD_PENDING_MAX; i++) {
+    if (g_cmdPending[i].used) return true;
+  }
+  for (uint8_t i = 0; i < RPT_PENDING_MAX; i++) {
+    if (g_rptPending[i].used) return true;
+  }
+  return false;
+}
+
+static void zb_cmd_drain_queue() {
+  uart_cmd_t *cmdp;
+  while (g_cmdQueue && xQueueReceive(g_cmdQueue, &cmdp, 0) == pdTRUE) {
+    const uint32_t us = micros() - cmdp->enqUs;
+    portENTER_CRITICAL(&g_dispMux);
+    if (us > g_dispUsMax) g_dispUsMax = us;
+    g_dispUsSum += us;
+    g_dispCount++;
+    portEXIT_CRITICAL(&g_dispMux);
+    zb_dispatch(*cmdp);
+    cmd_free(cmdp);
+  }
+}
+
+static void zb_tick(uint8_t) {
+  g_zbLastIterMs = millis();
+  g_zbWakes++;
+  zb_cmd_drain_queue(); // commands whose wakeup was skipped (lock busy)
+
+  iv_tick();
+  time_tick();
+  devstore_tick();
+  cmd_track_tick();
+  rpt_tick();
+  resync_tick();
+  topo_tick();
+  bind_tick();
+  lock_frag_tick();
+  net_backup_tick();
 
-    esp_zb_main_loop_iteration();
-    vTaskDelay(1);
+  esp_zb_scheduler_alarm(zb_tick, 0, zb_tick_busy() ? ZB_TICK_BUSY_MS : ZB_TICK_IDLE_MS);
+}
+
+static void zb_cmd_drain(uint8_t) {
+  g_cmdDrainArmed = false; // before draining: a command queued from here on arms a new drain
+  g_zbLastIterMs = millis();
+  g_zbWakes++;
+  const bool wasBusy = zb_tick_busy();
+  zb_cmd_drain_queue();
+  // The idle tick may be up to ZB_TICK_IDLE_MS away; new deadlines need the fast one.
+  if (!wasBusy && zb_tick_busy()) {
+    esp_zb_scheduler_alarm_cancel(zb_tick, 0);
+    esp_zb_scheduler_alarm(zb_tick, 0, ZB_TICK_BUSY_MS);
   }
 }
 
+// loop(): schedule a drain inside the stack loop. Never blocks for long: if the
+// stack holds the lock, the command waits for the next zb_tick instead.
+static void zb_cmd_wake() {
+  if (!g_zbLoopReady || g_cmdDrainArmed) return;
+  if (!esp_zb_lock_acquire(pdMS_TO_TICKS(ZB_LOCK_WAIT_MS))) return;
+  g_cmdDrainArmed = true;
+  esp_zb_scheduler_alarm(zb_cmd_drain, 0, 0);
+  esp_zb_lock_release();
+}
+
+static void zb_task(void *) {
+  zigbee_init_coordinator();
+
+  g_zbLastIterMs = millis();
+  esp_zb_scheduler_alarm(zb_tick, 0, ZB_TICK_BUSY_MS);
+  g_zbLoopReady = true;
+  esp_zb_stack_main_loop();
+  vTaskDelete(nullptr);
+}
+
 // ------------------------ Arduino entry ------------------------
 
 static String g_uartLine;
@@ -1031,7 +5436,12 @@ void setup() {
   delay(200);
 
   U.begin(UART_BAUD, SERIAL_8N1, UART_RX_PIN, UART_TX_PIN);
-  g_cmdQueue = xQueueCreate(CMD_QUEUE_LEN, sizeof(uart_cmd_t));
+  uart_tx_begin();
+  cmd_pool_init();
+  zb_devidx_init(&g_devIndex);
+  devstore_load();
+  bind_load();
+  net_restore_load();
 
   Serial.println("[C6] Zigbee Coordinator + UART bridge starting...");
   // Sprint 7: report coordinator fwVersion to hub_host
@@ -1057,16 +5467,48 @@ void loop() {
         continue;
       }
 
-      uart_cmd_t cmd;
+      // Supervision commands are served here (not via zb_task) so they still
+      // work when the Zigbee task is the thing that is stuck.
+      const char *cmdName = doc["cmd"] | "";
+      if (strcmp(cmdName, "ping") == 0) {
+        uart_send_heartbeat(g_cmdQueue ? (uint32_t)uxQueueMessagesWaiting(g_cmdQueue) : 0);
+        continue;
+      }
+      if (strcmp(cmdName, "time_sync") == 0) {
+        time_on_sync(doc["epoch"] | 0U, doc["ms"] | 0U);
+        continue;
+      }
+      if (strcmp(cmdName, "net_restore") == 0) {
+        net_restore_line(doc);
+        continue;
+      }
+      if (strcmp(cmdName, "devtable_bench") == 0) {
+        devtable_bench(doc["devices"] | 200, doc["reports"] | 20000UL);
+        continue;
+      }
+      if (strcmp(cmdName, "reboot") == 0) {
+        uart_send_cmd_result(doc["cmdId"] | "", "", true, nullptr);
+        uart_tx_flush(200);
+        delay(50);
+        ESP.restart();
+      }
+
+      uart_cmd_t *cmd = cmd_alloc();
+      if (!cmd) {
+        uart_send_cmd_result(doc["cmdId"] | "", doc["ieee"] | "", false, "cmd queue full");
+        continue;
+      }
       const char *err = nullptr;
-      if (!parse_uart_cmd(doc, cmd, &err)) {
+      if (!parse_uart_cmd(doc, *cmd, &err)) {
         const char *cmdId = doc["cmdId"] | "";
         uart_send_cmd_result(cmdId, doc["ieee"] | "", false, err ? err : "bad cmd");
+        cmd_free(cmd);
         continue;
       }
 
       if (!enqueue_cmd(cmd)) {
-        uart_send_cmd_result(cmd.cmdId, cmd.ieee16, false, "cmd queue full");
+        uart_send_cmd_result(cmd->cmdId, cmd->ieee16, false, "cmd queue full");
+        cmd_free(cmd);
         continue;
       }
     } else {
@@ -1078,5 +5520,13 @@ void loop() {
     }
   }
 
+  cmd_pool_backpressure_tick();
+  net_restore_tick();
+
+  if ((int32_t)(millis() - g_nextHeartbeatMs) >= 0) {
+    g_nextHeartbeatMs = millis() + HEARTBEAT_INTERVAL_MS;
+    uart_send_heartbeat(g_cmdQueue ? (uint32_t)uxQueueMessagesWaiting(g_cmdQueue) : 0);
+  }
+
   delay(2);
 }
@@ -7,7 +7,10 @@
 // - Temperature Measurement (0x0402, server)
 // - Relative Humidity Measurement (0x0405, server)
 //
-// Reports every REPORT_INTERVAL_S seconds.
+// Samples every REPORT_INTERVAL_S seconds. Once the coordinator has bound the
+// measurement clusters and sent Configure Reporting, the ZCL reporting engine
+// decides when to send (change threshold / min / max interval); until then
+// every sample is reported explicitly.
 // OTA trigger: Identify command with identify_time == 0x1234
 // - ESP32-C6: WiFi HTTP OTA (hardcoded SSID/PASS + OTA_URL)
 // - ESP32-H2: WiFi not supported -> ignored
@@ -152,6 +155,18 @@ static void maybe_report_basic_fingerprint() {
   }
 }
 
+// True once the coordinator configured reporting for the attribute (Configure Reporting received).
+static bool reporting_configured(uint16_t cluster_id, uint16_t attr_id) {
+  esp_zb_zcl_attr_location_info_t info = {};
+  info.endpoint_id = SENSOR_ENDPOINT;
+  info.cluster_id = cluster_id;
+  info.cluster_role = ESP_ZB_ZCL_CLUSTER_SERVER_ROLE;
+  info.manuf_code = ESP_ZB_ZCL_ATTR_NON_MANUFACTURER_SPECIFIC;
+  info.attr_id = attr_id;
+  esp_zb_zcl_reporting_info_t *r = esp_zb_zcl_find_reporting_info(info);
+  return r && r->u.send_info.max_interval != 0xFFFF;
+}
+
 static void update_and_report() {
   // Also report Basic fingerprint periodically (Sprint 2 fallback path).
   maybe_report_basic_fingerprint();
@@ -167,8 +182,13 @@ static void update_and_report() {
                               ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, ATTR_MEASURED_VALUE,
                               &rh, false);
 
-  report_attr(ZCL_CLUSTER_TEMP_MEASUREMENT, ATTR_MEASURED_VALUE);
-  report_attr(ZCL_CLUSTER_RH_MEASUREMENT, ATTR_MEASURED_VALUE);
+  // Configured attributes are reported by the stack when the new value crosses the threshold.
+  if (!reporting_configured(ZCL_CLUSTER_TEMP_MEASUREMENT, ATTR_MEASURED_VALUE)) {
+    report_attr(ZCL_CLUSTER_TEMP_MEASUREMENT, ATTR_MEASURED_VALUE);
+  }
+  if (!reporting_configured(ZCL_CLUSTER_RH_MEASUREMENT, ATTR_MEASURED_VALUE)) {
+    report_attr(ZCL_CLUSTER_RH_MEASUREMENT, ATTR_MEASURED_VALUE);
+  }
 
   Serial.printf("[SENSOR] temp=%d.%02dC rh=%d.%02d%%\n", temp / 100, abs(temp % 100), rh / 100, rh % 100);
 }
@@ -8,6 +8,11 @@
         * Receive lock action from coordinator -> UART -> UI
         * Receive cmd_result/event/state from UI -> Zigbee -> coordinator
         * Periodic state snapshot
+        * Lock messages go over the air as MessagePack (see "Wire format"); JSON only on the UART
+        * Messages longer than LOCK_SINGLE_MAX are fragmented (LOCK_CMD_FRAG / LOCK_CMD_FRAG_ACK,
+          same protocol as the coordinator's "SmartLock fragmentation" section)
+        * Read Time cluster from the coordinator -> UART time.sync -> UI
+          (the UI stamps its events/state with epoch ms)
 
   This device identifies as model "LOCK_V2_DUALMCU" to match backend seed.
 
@@ -51,15 +56,57 @@
 #define LOCK_CMD_CMD_RESULT  0x01  // lock end-device -> coordinator
 #define LOCK_CMD_EVENT       0x02  // lock end-device -> coordinator
 #define LOCK_CMD_STATE       0x03  // lock end-device -> coordinator
+#define LOCK_CMD_FRAG        0x10  // both directions: one fragment of a longer message
+#define LOCK_CMD_FRAG_ACK    0x11  // both directions: bitmap of fragments received
+
+// Fragmentation (must match the coordinator)
+//   fragment: [inner cmd][seq][index][count][total lo][total hi][crc lo][crc hi][data...]
+//   ack:      [seq][count][mask lo][mask hi]
+#define LOCK_FRAG_HDR 8
+#define LOCK_SINGLE_MAX 250 // longest message sent as one unfragmented ZCL string
+#define LOCK_FRAG_DATA 64
+#define LOCK_FRAG_MAX_COUNT 16
+#define LOCK_FRAG_MAX_MSG (LOCK_FRAG_DATA * LOCK_FRAG_MAX_COUNT)
+#define LOCK_FRAG_WINDOW 4
+#define LOCK_FRAG_RETRIES 4
+#define LOCK_FRAG_ACK_TIMEOUT_MS 3000UL
+#define LOCK_FRAG_GAP_MS 500UL
+#define LOCK_FRAG_RX_TIMEOUT_MS 20000UL
+
+// Wire format (must match the coordinator). A payload starting with LOCK_WIRE_V1 is
+// MessagePack; one starting with '{' is legacy JSON (still accepted).
+//   ACTION_REQ v1: [cmdId, action, args]
+//   CMD_RESULT v1: [cmdId, ok, error]
+//   EVENT      v1: [type, data, ts]
+//   STATE      v1: {state map}
+// Trailing fields may be left out; later versions only append fields.
+#define LOCK_WIRE_V1 0x01
+
+#define LOCK_JSON_DOC 3072
+#define LOCK_UART_LINE_MAX 1280 // {"evt":"state","state":{...}} with a full-size state
 
 // A placeholder attribute so the custom cluster is not empty.
 #define LOCK_CUSTOM_ATTR_ID 0x0000
 
+// Time cluster served by the coordinator (hub NTP time; ZCL UTCTime = seconds since 2000-01-01)
+#ifndef ESP_ZB_ZCL_CLUSTER_ID_TIME
+#define ESP_ZB_ZCL_CLUSTER_ID_TIME 0x000A
+#endif
+#define ZCL_TIME_ATTR_TIME 0x0000
+#define ZCL_TIME_ATTR_STATUS 0x0001
+#define ZCL_TIME_STATUS_SYNCHRONIZED 0x02
+#define ZCL_EPOCH_OFFSET_SEC 946684800UL
+#define COORD_ENDPOINT 0x01
+
+// Poll fast until the first valid time, then refresh to bound drift of the UI's millis().
+#define TIME_POLL_UNSYNCED_MS 30000UL
+#define TIME_POLL_SYNCED_MS (10UL * 60UL * 1000UL)
+
 static const char *TAG = "lock_ed";
 
 // ============ UART line reader ============
 
-static char g_uartLine[512];
+static char g_uartLine[LOCK_UART_LINE_MAX];
 static size_t g_uartLineLen = 0;
 
 static bool uartReadLine(Stream &s, char *out, size_t outCap) {
@@ -91,32 +138,26 @@ static bool uartReadLine(Stream &s, char *out, size_t outCap) {
 
 typedef struct {
   uint8_t cmd_id;
-  char payload[260]; // JSON payload (NOT including ZCL length byte)
+  uint16_t len;
+  uint8_t payload[LOCK_FRAG_MAX_MSG]; // wire payload (NOT including ZCL length byte)
 } out_msg_t;
 
 static QueueHandle_t g_outQueue = nullptr;
 
 typedef struct {
-  char payload[260]; // JSON payload (from coordinator)
+  uint16_t len;
+  uint8_t payload[LOCK_FRAG_MAX_MSG]; // wire payload (from coordinator)
 } in_msg_t;
 
 static QueueHandle_t g_inQueue = nullptr;
 
-// ============ Zigbee send helper ============
+// Epoch seconds read from the coordinator, handed from the Zigbee task to loop() (0 = none pending).
+static volatile uint32_t g_pendingEpochSec = 0;
+static bool g_timeSynced = false;
 
-static void zb_send_custom_to_coordinator(uint8_t custom_cmd_id, const char *jsonPayload) {
-  if (!jsonPayload) return;
-  const size_t len = strnlen(jsonPayload, 255);
-  if (len == 0 || len > 254) {
-    ESP_LOGW(TAG, "Payload too long (%u)", static_cast<unsigned>(len));
-    return;
-  }
-
-  // ZCL char string: [len][bytes...]
-  uint8_t zclStr[1 + 254];
-  zclStr[0] = static_cast<uint8_t>(len);
-  memcpy(zclStr + 1, jsonPayload, len);
+// ============ Zigbee send helper ============
 
+static void zb_send_lock_raw(uint8_t custom_cmd_id, uint8_t zclType, uint8_t *data, uint16_t size) {
   esp_zb_zcl_custom_cluster_cmd_req_t req = {};
   req.zcl_basic_cmd.dst_addr_u.addr_short = 0x0000; // coordinator
   req.zcl_basic_cmd.dst_endpoint = LOCK_ENDPOINT;
@@ -126,23 +167,274 @@ static void zb_send_custom_to_coordinator(uint8_t custom_cmd_id, const char *jso
   req.profile_id = ESP_ZB_AF_HA_PROFILE_ID;
   req.direction = ESP_ZB_ZCL_CMD_DIRECTION_TO_CLI;
   req.custom_cmd_id = custom_cmd_id;
-  req.data.type = ESP_ZB_ZCL_ATTR_TYPE_CHAR_STRING;
-  req.data.size = static_cast<uint16_t>(len + 1);
-  req.data.value = zclStr;
+  req.data.type = zclType;
+  req.data.size = size;
+  req.data.value = data;
 
   esp_zb_zcl_custom_cluster_cmd_req(&req);
 }
 
+// ============ Fragmentation ============
+// One message in flight each way: the only peer is the coordinator.
+
+typedef struct {
+  bool used;
+  uint8_t cmd;
+  uint8_t seq;
+  uint8_t count;
+  uint16_t len;
+  uint16_t acked;    // fragments the coordinator confirmed
+  uint16_t inflight; // sent in the current window
+  uint8_t tries;     // windows without an ack
+  uint32_t deadlineMs;
+  uint8_t buf[LOCK_FRAG_MAX_MSG];
+} frag_tx_t;
+
+typedef struct {
+  bool used;
+  bool done; // delivered; kept until LOCK_FRAG_RX_TIMEOUT_MS to re-ack duplicates
+  uint8_t cmd;
+  uint8_t seq;
+  uint8_t count;
+  uint8_t maxIdx;
+  uint16_t len;
+  uint16_t mask;
+  uint32_t lastRxMs;
+  uint32_t lastAckMs;
+  char buf[LOCK_FRAG_MAX_MSG + 1];
+} frag_rx_t;
+
+static frag_tx_t g_fragTx;
+static frag_rx_t g_fragRx;
+static uint8_t g_fragSeq = 0;
+
+static uint16_t frag_crc16(const uint8_t *p, size_t n, uint16_t crc = 0xFFFF) {
+  while (n--) {
+    crc ^= static_cast<uint16_t>(*p++) << 8;
+    for (uint8_t b = 0; b < 8; b++) crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+  }
+  return crc;
+}
+
+static uint16_t frag_full(uint8_t count) {
+  return static_cast<uint16_t>((count >= 16) ? 0xFFFF : ((1U << count) - 1));
+}
+
+static void frag_send_one(uint8_t idx) {
+  frag_tx_t &t = g_fragTx;
+  const uint16_t off = static_cast<uint16_t>(idx) * LOCK_FRAG_DATA;
+  const uint8_t n = static_cast<uint8_t>(min<uint16_t>(t.len - off, LOCK_FRAG_DATA));
+  uint8_t f[1 + LOCK_FRAG_HDR + LOCK_FRAG_DATA];
+  uint8_t *h = f + 1; // octet string length first
+  h[0] = t.cmd;
+  h[1] = t.seq;
+  h[2] = idx;
+  h[3] = t.count;
+  h[4] = static_cast<uint8_t>(t.len & 0xFF);
+  h[5] = static_cast<uint8_t>(t.len >> 8);
+  memcpy(h + LOCK_FRAG_HDR, t.buf + off, n);
+  const uint16_t crc = frag_crc16(h + LOCK_FRAG_HDR, n, frag_crc16(h, 6));
+  h[6] = static_cast<uint8_t>(crc & 0xFF);
+  h[7] = static_cast<uint8_t>(crc >> 8);
+  f[0] = static_cast<uint8_t>(LOCK_FRAG_HDR + n);
+  zb_send_lock_raw(LOCK_CMD_FRAG, ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING, f, static_cast<uint16_t>(1 + f[0]));
+}
+
+// Sends the next window of fragments the coordinator has not confirmed.
+static void frag_pump() {
+  frag_tx_t &t = g_fragTx;
+  uint8_t sent = 0;
+  for (uint8_t i = 0; i < t.count && sent < LOCK_FRAG_WINDOW; i++) {
+    const uint16_t bit = static_cast<uint16_t>(1U << i);
+    if ((t.acked | t.inflight) & bit) continue;
+    frag_send_one(i);
+    t.inflight |= bit;
+    sent++;
+  }
+  t.deadlineMs = millis() + LOCK_FRAG_ACK_TIMEOUT_MS;
+}
+
+static bool frag_send(uint8_t cmd, const uint8_t *data, size_t len) {
+  if (g_fragTx.used || len > LOCK_FRAG_MAX_MSG) return false;
+  frag_tx_t &t = g_fragTx;
+  t.used = true;
+  t.cmd = cmd;
+  t.seq = g_fragSeq++;
+  t.len = static_cast<uint16_t>(len);
+  t.count = static_cast<uint8_t>((len + LOCK_FRAG_DATA - 1) / LOCK_FRAG_DATA);
+  t.acked = 0;
+  t.inflight = 0;
+  t.tries = 0;
+  memcpy(t.buf, data, len);
+  frag_pump();
+  return true;
+}
+
+static void frag_on_ack(const uint8_t *p, uint8_t n) {
+  frag_tx_t &t = g_fragTx;
+  if (n < 4 || !t.used || t.seq != p[0] || t.count != p[1]) return;
+  const uint16_t mask = static_cast<uint16_t>(p[2] | (p[3] << 8));
+  t.acked |= mask & frag_full(t.count);
+  t.inflight = 0;
+  t.tries = 0;
+  if (t.acked == frag_full(t.count)) t.used = false;
+  else frag_pump();
+}
+
+static void frag_send_ack() {
+  frag_rx_t &r = g_fragRx;
+  uint8_t a[1 + 4];
+  a[0] = 4;
+  a[1] = r.seq;
+  a[2] = r.count;
+  a[3] = static_cast<uint8_t>(r.mask & 0xFF);
+  a[4] = static_cast<uint8_t>(r.mask >> 8);
+  zb_send_lock_raw(LOCK_CMD_FRAG_ACK, ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING, a, sizeof(a));
+  r.lastAckMs = millis();
+}
+
+static void lock_on_action(const uint8_t *data, size_t len);
+
+static void frag_on_fragment(const uint8_t *p, uint8_t n) {
+  if (n < LOCK_FRAG_HDR) return;
+  const uint8_t cmd = p[0], seq = p[1], idx = p[2], count = p[3];
+  const uint16_t total = static_cast<uint16_t>(p[4] | (p[5] << 8));
+  const uint8_t dlen = static_cast<uint8_t>(n - LOCK_FRAG_HDR);
+  const uint16_t crc = static_cast<uint16_t>(p[6] | (p[7] << 8));
+  if (frag_crc16(p + LOCK_FRAG_HDR, dlen, frag_crc16(p, 6)) != crc) return; // left out of the mask: resent
+  if (count == 0 || count > LOCK_FRAG_MAX_COUNT || idx >= count || total > LOCK_FRAG_MAX_MSG ||
+      static_cast<uint32_t>(idx) * LOCK_FRAG_DATA + dlen > total) {
+    return;
+  }
+
+  frag_rx_t &r = g_fragRx;
+  if (!r.used || r.seq != seq || r.count != count || r.len != total || r.cmd != cmd) {
+    memset(&r, 0, offsetof(frag_rx_t, buf));
+    r.used = true;
+    r.cmd = cmd;
+    r.seq = seq;
+    r.count = count;
+    r.len = total;
+  }
+  r.lastRxMs = millis();
+  if (r.done) {
+    frag_send_ack(); // our ack was lost; the message was delivered already
+    return;
+  }
+
+  const uint16_t bit = static_cast<uint16_t>(1U << idx);
+  const bool repair = (r.mask != 0) && idx < r.maxIdx;
+  if (!(r.mask & bit)) {
+    memcpy(r.buf + static_cast<uint16_t>(idx) * LOCK_FRAG_DATA, p + LOCK_FRAG_HDR, dlen);
+    r.mask |= bit;
+  }
+  if (idx > r.maxIdx) r.maxIdx = idx;
+
+  if (r.mask == frag_full(count)) {
+    r.done = true;
+    frag_send_ack();
+    r.buf[r.len] = '\0';
+    if (r.cmd == LOCK_CMD_ACTION_REQ) lock_on_action((const uint8_t *)r.buf, r.len);
+  } else if (repair || (idx % LOCK_FRAG_WINDOW) == LOCK_FRAG_WINDOW - 1) {
+    frag_send_ack();
+  }
+}
+
+// Called from the Zigbee task loop: window timeouts and receiver gap acks.
+static void frag_tick() {
+  const uint32_t now = millis();
+  frag_tx_t &t = g_fragTx;
+  if (t.used && (int32_t)(now - t.deadlineMs) >= 0) {
+    if (++t.tries > LOCK_FRAG_RETRIES) {
+      ESP_LOGW(TAG, "Fragmented cmd 0x%02x seq=%u dropped acked=0x%04x", t.cmd, t.seq, t.acked);
+      t.used = false;
+    } else {
+      t.inflight = 0;
+      frag_pump();
+    }
+  }
+
+  frag_rx_t &r = g_fragRx;
+  if (r.used) {
+    if ((uint32_t)(now - r.lastRxMs) >= LOCK_FRAG_RX_TIMEOUT_MS) {
+      r.used = false;
+    } else if (!r.done && (uint32_t)(now - r.lastRxMs) >= LOCK_FRAG_GAP_MS &&
+               (uint32_t)(now - r.lastAckMs) >= LOCK_FRAG_GAP_MS) {
+      frag_send_ack(); // the mask shows the holes
+    }
+  }
+}
+
+// Payloads up to LOCK_SINGLE_MAX go as one ZCL octet string; longer ones are fragmented.
+// False while a fragmented message is still in flight (caller retries later).
+static bool zb_send_custom_to_coordinator(uint8_t custom_cmd_id, const uint8_t *data, size_t len) {
+  if (!data || len == 0) return true;
+  if (len > LOCK_FRAG_MAX_MSG) {
+    ESP_LOGW(TAG, "Payload too long (%u)", static_cast<unsigned>(len));
+    return true;
+  }
+  if (len > LOCK_SINGLE_MAX) return frag_send(custom_cmd_id, data, len);
+
+  // ZCL octet string: [len][bytes...]
+  uint8_t zclStr[1 + LOCK_SINGLE_MAX];
+  zclStr[0] = static_cast<uint8_t>(len);
+  memcpy(zclStr + 1, data, len);
+  zb_send_lock_raw(custom_cmd_id, ESP_ZB_ZCL_ATTR_TYPE_OCTET_STRING, zclStr, static_cast<uint16_t>(len + 1));
+  return true;
+}
+
+static void zb_read_coordinator_time() {
+  esp_zb_zcl_read_attr_cmd_t req = {};
+  req.zcl_basic_cmd.dst_addr_u.addr_short = 0x0000; // coordinator
+  req.zcl_basic_cmd.dst_endpoint = COORD_ENDPOINT;
+  req.zcl_basic_cmd.src_endpoint = LOCK_ENDPOINT;
+  req.address_mode = ESP_ZB_APS_ADDR_MODE_16_ENDP_PRESENT;
+  req.cluster_id = ESP_ZB_ZCL_CLUSTER_ID_TIME;
+  static uint16_t attrs[] = {ZCL_TIME_ATTR_TIME, ZCL_TIME_ATTR_STATUS};
+  req.attr_number = sizeof(attrs) / sizeof(attrs[0]);
+  req.attr_field = attrs;
+  esp_zb_zcl_read_attr_cmd_req(&req);
+}
+
 // ============ Zigbee receive handler ============
 
+static esp_err_t zb_read_attr_resp_handler(const esp_zb_zcl_cmd_read_attr_resp_message_t *message) {
+  if (!message || message->info.cluster != ESP_ZB_ZCL_CLUSTER_ID_TIME) return ESP_OK;
+
+  uint32_t zclTime = 0;
+  uint8_t status = 0;
+  for (esp_zb_zcl_read_attr_resp_variable_t *v = message->variables; v; v = v->next) {
+    if (v->status != ESP_ZB_ZCL_STATUS_SUCCESS || !v->attribute.data.value) continue;
+    if (v->attribute.id == ZCL_TIME_ATTR_TIME) zclTime = *(const uint32_t *)v->attribute.data.value;
+    if (v->attribute.id == ZCL_TIME_ATTR_STATUS) status = *(const uint8_t *)v->attribute.data.value;
+  }
+  // Coordinator has no hub time yet.
+  if (!(status & ZCL_TIME_STATUS_SYNCHRONIZED) || zclTime == 0 || zclTime == 0xFFFFFFFFUL) return ESP_OK;
+
+  g_pendingEpochSec = zclTime + ZCL_EPOCH_OFFSET_SEC;
+  g_timeSynced = true;
+  return ESP_OK;
+}
+
+// Zigbee task only; the message is static to keep LOCK_FRAG_MAX_MSG off its stack.
+static void lock_on_action(const uint8_t *data, size_t len) {
+  static in_msg_t im;
+  im.len = static_cast<uint16_t>(min<size_t>(len, sizeof(im.payload)));
+  memcpy(im.payload, data, im.len);
+  if (g_inQueue) {
+    xQueueSend(g_inQueue, &im, 0);
+  }
+}
+
 static esp_err_t zb_custom_cmd_handler(const esp_zb_zcl_custom_cluster_command_message_t *message) {
   ESP_RETURN_ON_FALSE(message, ESP_FAIL, TAG, "Empty message");
   ESP_RETURN_ON_FALSE(message->info.status == ESP_ZB_ZCL_STATUS_SUCCESS, ESP_ERR_INVALID_ARG, TAG,
                       "Received message: error status(%d)", message->info.status);
 
-  // We expect ACTION_REQ from coordinator
-  if (message->info.command.id != LOCK_CMD_ACTION_REQ) {
-    ESP_LOGW(TAG, "Ignore custom cmd id=%u", message->info.command.id);
+  // We expect ACTION_REQ from coordinator, whole or fragmented
+  const uint8_t cmdId = message->info.command.id;
+  if (cmdId != LOCK_CMD_ACTION_REQ && cmdId != LOCK_CMD_FRAG && cmdId != LOCK_CMD_FRAG_ACK) {
+    ESP_LOGW(TAG, "Ignore custom cmd id=%u", cmdId);
     return ESP_OK;
   }
 
@@ -158,18 +450,13 @@ static esp_err_t zb_custom_cmd_handler(const esp_zb_zcl_custom_cluster_command_m
     return ESP_OK;
   }
 
-  char json[260];
-  const size_t copyLen = min<size_t>(slen, sizeof(json) - 1);
-  memcpy(json, zclStr + 1, copyLen);
-  json[copyLen] = '\0';
-
-  in_msg_t im = {};
-  strncpy(im.payload, json, sizeof(im.payload));
-  im.payload[sizeof(im.payload) - 1] = '\0';
-  if (g_inQueue) {
-    xQueueSend(g_inQueue, &im, 0);
+  if (cmdId == LOCK_CMD_FRAG) {
+    frag_on_fragment(zclStr + 1, slen);
+  } else if (cmdId == LOCK_CMD_FRAG_ACK) {
+    frag_on_ack(zclStr + 1, slen);
+  } else {
+    lock_on_action(zclStr + 1, slen);
   }
-
   return ESP_OK;
 }
 
@@ -177,6 +464,8 @@ static esp_err_t zb_action_handler(esp_zb_core_action_callback_id_t callback_id,
   switch (callback_id) {
   case ESP_ZB_CORE_CMD_CUSTOM_CLUSTER_REQ_CB_ID:
     return zb_custom_cmd_handler((const esp_zb_zcl_custom_cluster_command_message_t *)message);
+  case ESP_ZB_CORE_CMD_READ_ATTR_RESP_CB_ID:
+    return zb_read_attr_resp_handler((const esp_zb_zcl_cmd_read_attr_resp_message_t *)message);
   default:
     ESP_LOGD(TAG, "Zigbee action cb: 0x%x", callback_id);
     return ESP_OK;
@@ -255,31 +544,43 @@ static void zigbee_task(void *pvParameters) {
 
   zb_init();
 
-  // Zigbee main loop
-  out_msg_t msg;
-  char lastState[260] = {0};
+  // Zigbee main loop (message buffers are static: each is LOCK_FRAG_MAX_MSG)
+  static out_msg_t msg;
+  static bool msgPending = false;
+  static uint8_t lastState[LOCK_FRAG_MAX_MSG];
+  static uint16_t lastStateLen = 0;
   uint32_t lastStateSentMs = 0;
+  uint32_t nextTimeReadMs = millis() + 5000; // give the join a moment
 
   while (true) {
     esp_zb_main_loop_iteration();
 
-    // Drain outgoing queue
-    while (g_outQueue && xQueueReceive(g_outQueue, &msg, 0) == pdTRUE) {
-      zb_send_custom_to_coordinator(msg.cmd_id, msg.payload);
+    frag_tick();
+
+    // Drain outgoing queue; a fragmented message holds the rest back until it is acked
+    while (!g_fragTx.used && (msgPending || (g_outQueue && xQueueReceive(g_outQueue, &msg, 0) == pdTRUE))) {
+      msgPending = !zb_send_custom_to_coordinator(msg.cmd_id, msg.payload, msg.len);
+      if (msgPending) break;
       if (msg.cmd_id == LOCK_CMD_STATE) {
-        strncpy(lastState, msg.payload, sizeof(lastState));
-        lastState[sizeof(lastState) - 1] = '\0';
+        memcpy(lastState, msg.payload, msg.len);
+        lastStateLen = msg.len;
         lastStateSentMs = millis();
       }
     }
 
     // Periodic state snapshot (re-send last known state)
     const uint32_t now = millis();
-    if (lastState[0] != '\0' && (now - lastStateSentMs) > 10000) {
-      zb_send_custom_to_coordinator(LOCK_CMD_STATE, lastState);
+    if (lastStateLen && !g_fragTx.used && (now - lastStateSentMs) > 10000) {
+      zb_send_custom_to_coordinator(LOCK_CMD_STATE, lastState, lastStateLen);
       lastStateSentMs = now;
     }
 
+    // Time from the coordinator (harmless no-op while not joined)
+    if ((int32_t)(now - nextTimeReadMs) >= 0) {
+      zb_read_coordinator_time();
+      nextTimeReadMs = now + (g_timeSynced ? TIME_POLL_SYNCED_MS : TIME_POLL_UNSYNCED_MS);
+    }
+
     vTaskDelay(10 / portTICK_PERIOD_MS);
   }
 }
@@ -296,37 +597,58 @@ void setup() {
 
   LOCK_UART.begin(LOCK_UART_BAUD, SERIAL_8N1, LOCK_UART_RX_PIN, LOCK_UART_TX_PIN);
 
-  g_outQueue = xQueueCreate(8, sizeof(out_msg_t));
+  g_outQueue = xQueueCreate(4, sizeof(out_msg_t));
   g_inQueue = xQueueCreate(4, sizeof(in_msg_t));
 
   xTaskCreate(zigbee_task, "ZB", 8192, nullptr, 5, nullptr);
 }
 
-static void enqueueOut(uint8_t cmdId, const char *payload) {
-  if (!g_outQueue || !payload) return;
-  out_msg_t m = {};
+// Encodes v as a v1 wire payload and queues it for the Zigbee task.
+static void enqueueOut(uint8_t cmdId, JsonVariantConst v) {
+  if (!g_outQueue) return;
+  static out_msg_t m; // LOCK_FRAG_MAX_MSG: keep it off the loop() stack
+  const size_t n = measureMsgPack(v);
+  if (n + 1 > sizeof(m.payload)) {
+    Serial.printf("[lock_ed] drop cmd 0x%02x: payload over %u bytes\n", cmdId, (unsigned)LOCK_FRAG_MAX_MSG);
+    return;
+  }
   m.cmd_id = cmdId;
-  strncpy(m.payload, payload, sizeof(m.payload));
-  m.payload[sizeof(m.payload) - 1] = '\0';
+  m.payload[0] = LOCK_WIRE_V1;
+  m.len = static_cast<uint16_t>(1 + serializeMsgPack(v, m.payload + 1, sizeof(m.payload) - 1));
   xQueueSend(g_outQueue, &m, 0);
 }
 
 void loop() {
+  // Forward coordinator time to the UI (no cmdId: not a tracked command)
+  const uint32_t epochSec = g_pendingEpochSec;
+  if (epochSec) {
+    g_pendingEpochSec = 0;
+    StaticJsonDocument<96> t;
+    t["cmd"] = "time.sync";
+    t["args"]["epoch"] = epochSec;
+    String line;
+    serializeJson(t, line);
+    LOCK_UART.println(line);
+  }
+
   // Process incoming Zigbee action requests -> send UART command to ESP8266
-  in_msg_t im;
+  static in_msg_t im;
   while (g_inQueue && xQueueReceive(g_inQueue, &im, 0) == pdTRUE) {
-    StaticJsonDocument<384> doc;
-    DeserializationError err = deserializeJson(doc, im.payload);
+    DynamicJsonDocument doc(LOCK_JSON_DOC);
+    const bool bin = im.len > 0 && im.payload[0] == LOCK_WIRE_V1;
+    DeserializationError err = bin ? deserializeMsgPack(doc, (const char *)im.payload + 1, im.len - 1)
+                                   : deserializeJson(doc, (const char *)im.payload, im.len);
     if (err) {
-      Serial.printf("[lock_ed] bad action json: %s\n", err.c_str());
+      Serial.printf("[lock_ed] bad action payload: %s\n", err.c_str());
       continue;
     }
 
-    const char *cmdId = doc["cmdId"] | "";
-    const char *action = doc["action"] | doc["cmd"] | "";
-    JsonVariantConst args = doc["args"].isNull() ? doc["params"] : doc["args"];
+    const JsonDocument &d = doc;
+    const char *cmdId = (bin ? d[0] : d["cmdId"]) | "";
+    const char *action = bin ? (d[1] | "") : (d["action"] | d["cmd"] | "");
+    JsonVariantConst args = bin ? d[2] : (d["args"].isNull() ? d["params"] : d["args"]);
 
-    StaticJsonDocument<384> out;
+    DynamicJsonDocument out(LOCK_JSON_DOC);
     out["cmd"] = action;
     out["cmdId"] = cmdId;
     if (!args.isNull()) out["args"] = args;
@@ -338,9 +660,9 @@ void loop() {
   }
 
   // Read UART from ESP8266 -> push to Zigbee
-  char line[512];
+  static char line[LOCK_UART_LINE_MAX];
   while (uartReadLine(LOCK_UART, line, sizeof(line))) {
-    StaticJsonDocument<512> doc;
+    DynamicJsonDocument doc(LOCK_JSON_DOC);
     DeserializationError err = deserializeJson(doc, line);
     if (err) {
       // Ignore noise (ESP8266 boot logs etc)
@@ -350,25 +672,26 @@ void loop() {
     const char *evt = doc["evt"] | "";
     if (strcmp(evt, "cmd_result") == 0) {
       StaticJsonDocument<256> payload;
-      payload["cmdId"] = doc["cmdId"] | "";
-      payload["ok"] = doc["ok"] | false;
-      if (!doc["error"].isNull()) payload["error"] = doc["error"];
-      String s; serializeJson(payload, s);
-      enqueueOut(LOCK_CMD_CMD_RESULT, s.c_str());
-      Serial.printf("[lock_ed] ZB cmd_result %s\n", s.c_str());
+      JsonArray a = payload.to<JsonArray>(); // v1: [cmdId, ok, error]
+      a.add(doc["cmdId"] | "");
+      a.add(doc["ok"] | false);
+      if (!doc["error"].isNull()) a.add(doc["error"]);
+      enqueueOut(LOCK_CMD_CMD_RESULT, payload.as<JsonVariantConst>());
+      Serial.printf("[lock_ed] ZB cmd_result %s (%u B)\n", doc["cmdId"] | "", (unsigned)(1 + measureMsgPack(payload)));
     } else if (strcmp(evt, "event") == 0) {
-      StaticJsonDocument<384> payload;
-      payload["type"] = doc["type"] | "";
-      if (!doc["data"].isNull()) payload["data"] = doc["data"];
-      String s; serializeJson(payload, s);
-      enqueueOut(LOCK_CMD_EVENT, s.c_str());
-      Serial.printf("[lock_ed] ZB event %s\n", s.c_str());
+      DynamicJsonDocument payload(LOCK_JSON_DOC);
+      JsonArray a = payload.to<JsonArray>(); // v1: [type, data, ts]
+      a.add(doc["type"] | "");
+      const bool hasTs = !doc["ts"].isNull();
+      if (!doc["data"].isNull() || hasTs) a.add(doc["data"]);
+      if (hasTs) a.add(doc["ts"]);
+      enqueueOut(LOCK_CMD_EVENT, payload.as<JsonVariantConst>());
+      Serial.printf("[lock_ed] ZB event %s (%u B)\n", doc["type"] | "", (unsigned)(1 + measureMsgPack(payload)));
     } else if (strcmp(evt, "state") == 0) {
       JsonVariantConst st = doc["state"];
       if (st.isNull()) continue;
-      String s; serializeJson(st, s);
-      enqueueOut(LOCK_CMD_STATE, s.c_str());
-      Serial.printf("[lock_ed] ZB state %s\n", s.c_str());
+      enqueueOut(LOCK_CMD_STATE, st);
+      Serial.printf("[lock_ed] ZB state (%u B)\n", (unsigned)(1 + measureMsgPack(st)));
     }
   }
 
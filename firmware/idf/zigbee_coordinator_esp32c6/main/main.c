@@ -41,6 +41,8 @@
 #include "esp_zigbee_zcl_command.h"
 #include "esp_zigbee_ha_standard.h"
 
+#include "zb_device_index.h"
+
 static const char *TAG = "ZB_COORD";
 
 // -------------------------
@@ -129,7 +131,9 @@ typedef struct {
     uint16_t short_addr;
 } device_entry_t;
 
-static device_entry_t s_devices[32];
+// Lookups go through s_dev_index (hash by short and by IEEE, see zb_device_index.h).
+static device_entry_t s_devices[ZB_DEVIDX_CAPACITY];
+static zb_devidx_t s_dev_index;
 
 static void str_to_lower(char *s)
 {
@@ -172,38 +176,57 @@ static void ieee_bytes_to_str(const uint8_t ieee[8], char out[17])
 
 static device_entry_t *find_device_by_ieee(const char *ieee)
 {
-    for (size_t i = 0; i < sizeof(s_devices) / sizeof(s_devices[0]); i++) {
-        if (s_devices[i].used && strncmp(s_devices[i].ieee, ieee, 17) == 0) return &s_devices[i];
-    }
-    return NULL;
+    uint64_t key;
+    if (!zb_devidx_ieee_from_str(ieee, &key)) return NULL;
+    uint16_t slot = zb_devidx_find_ieee(&s_dev_index, key);
+    if (slot == ZB_DEVIDX_NONE) return NULL;
+    // A device whose short address was taken over by another node is not routable.
+    return s_devices[slot].short_addr == ZB_DEVIDX_NO_SHORT ? NULL : &s_devices[slot];
 }
 
 static device_entry_t *find_device_by_short(uint16_t short_addr)
 {
-    for (size_t i = 0; i < sizeof(s_devices) / sizeof(s_devices[0]); i++) {
-        if (s_devices[i].used && s_devices[i].short_addr == short_addr) return &s_devices[i];
-    }
-    return NULL;
+    uint16_t slot = zb_devidx_find_short(&s_dev_index, short_addr);
+    return slot == ZB_DEVIDX_NONE ? NULL : &s_devices[slot];
 }
 
 static device_entry_t *upsert_device(const char *ieee, uint16_t short_addr)
 {
-    device_entry_t *e = find_device_by_ieee(ieee);
-    if (e) {
-        e->short_addr = short_addr;
-        return e;
-    }
-    for (size_t i = 0; i < sizeof(s_devices) / sizeof(s_devices[0]); i++) {
-        if (!s_devices[i].used) {
-            s_devices[i].used = true;
-            strncpy(s_devices[i].ieee, ieee, sizeof(s_devices[i].ieee));
-            s_devices[i].ieee[16] = '\0';
-            s_devices[i].short_addr = short_addr;
-            return &s_devices[i];
+    uint64_t key;
+    if (!zb_devidx_ieee_from_str(ieee, &key)) return NULL;
+    uint16_t slot = zb_devidx_find_ieee(&s_dev_index, key);
+    if (slot == ZB_DEVIDX_NONE) {
+        for (uint16_t i = 0; i < ZB_DEVIDX_CAPACITY; i++) {
+            if (!s_devices[i].used) {
+                slot = i;
+                break;
+            }
         }
+        if (slot == ZB_DEVIDX_NONE) {
+            ESP_LOGW(TAG, "Device table full; cannot store %s", ieee);
+            return NULL;
+        }
+        s_devices[slot].used = true;
+        strncpy(s_devices[slot].ieee, ieee, sizeof(s_devices[slot].ieee));
+        s_devices[slot].ieee[16] = '\0';
     }
-    ESP_LOGW(TAG, "Device table full; cannot store %s", ieee);
-    return NULL;
+    // Rejoin with a new short address updates this slot; if the address was
+    // reused from another node, that node loses it until it announces again.
+    uint16_t evicted;
+    zb_devidx_bind(&s_dev_index, slot, key, short_addr, &evicted);
+    if (evicted != ZB_DEVIDX_NONE) s_devices[evicted].short_addr = ZB_DEVIDX_NO_SHORT;
+    s_devices[slot].short_addr = short_addr;
+    return &s_devices[slot];
+}
+
+static void forget_device(const char *ieee)
+{
+    uint64_t key;
+    if (!zb_devidx_ieee_from_str(ieee, &key)) return;
+    uint16_t slot = zb_devidx_find_ieee(&s_dev_index, key);
+    if (slot == ZB_DEVIDX_NONE) return;
+    zb_devidx_unbind(&s_dev_index, slot);
+    s_devices[slot].used = false;
 }
 
 // -------------------------
@@ -603,6 +626,7 @@ static void zigbee_task(void *pvParameters)
                 uint8_t ieee_le[8];
                 if (ieee_str_to_bytes_le(cmd.ieee, ieee_le)) {
                     zb_remove_device(ieee_le);
+                    forget_device(cmd.ieee);
                 }
             }
         }
@@ -633,6 +657,7 @@ void app_main(void)
     ESP_ERROR_CHECK(nvs_flash_init());
 
     init_uart();
+    zb_devidx_init(&s_dev_index);
 
     s_cmd_queue = xQueueCreate(16, sizeof(uart_cmd_t));
     s_permit_timer = xTimerCreate("permit", pdMS_TO_TICKS(1000), pdFALSE, NULL, permit_timer_cb);
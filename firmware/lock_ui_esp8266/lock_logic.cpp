@@ -177,7 +177,20 @@ void LockLogic::sendUnlockEvent(const char *method, bool success, int slot, cons
   if (slot >= 0) data["slot"] = slot;
   if (uidHex && uidHex[0]) data["uidHex"] = uidHex;
 
-  _uart->sendEvent("lock.unlock", data.as<JsonVariantConst>());
+  _uart->sendEvent("lock.unlock", data.as<JsonVariantConst>(), toEpochMs(millis()));
+}
+
+void LockLogic::onTimeSync(uint32_t epochSec) {
+  _syncEpochSec = epochSec;
+  _syncAtMs = millis();
+  _timeSynced = true;
+}
+
+uint64_t LockLogic::toEpochMs(uint32_t atMillis) const {
+  if (!_timeSynced) return 0;
+  // Signed delta so instants before the sync (e.g. last action at boot) map correctly.
+  const int32_t delta = (int32_t)(atMillis - _syncAtMs);
+  return (uint64_t)_syncEpochSec * 1000ULL + (int64_t)delta;
 }
 
 void LockLogic::sendState() {
@@ -191,16 +204,21 @@ void LockLogic::sendState() {
   lock["state"] = (_lockState == LockState::LOCKED) ? "LOCKED" : "UNLOCKED";
 
   // New-style (optional) nested lastAction under lock as per Sprint 10 spec
+  // Times are epoch ms once the hub time has arrived; before that they are omitted.
+  const uint64_t lastAt = _lastActionAtMs ? toEpochMs(_lastActionAtMs) : 0;
+
   JsonObject lockLast = lock.createNestedObject("lastAction");
   lockLast["method"] = _lastMethod;
   lockLast["success"] = _lastSuccess;
-  lockLast["atMs"] = _lastActionAtMs;
+  if (lastAt) lockLast["atMs"] = lastAt;
 
   if (isLockoutActive()) {
-    // We don't have epoch time on ESP8266. Provide ms-until for debugging.
-    uint32_t now = millis();
-    uint32_t remain = (_lockoutUntilMs > now) ? (_lockoutUntilMs - now) : 0;
-    lock["lockoutRemainMs"] = remain;
+    if (_timeSynced) {
+      lock["lockoutUntil"] = toEpochMs(_lockoutUntilMs);
+    } else {
+      uint32_t now = millis();
+      lock["lockoutRemainMs"] = (uint32_t)(_lockoutUntilMs - now);
+    }
   }
 
   JsonObject door = s.createNestedObject("door");
@@ -210,12 +228,23 @@ void LockLogic::sendState() {
   lastAction["type"] = "unlock";
   lastAction["method"] = _lastMethod;
   lastAction["success"] = _lastSuccess;
-  lastAction["atMs"] = _lastActionAtMs;
+  if (lastAt) lastAction["atMs"] = lastAt;
 
   _uart->sendState(s.as<JsonVariantConst>());
 }
 
 void LockLogic::onCommand(const char *cmd, const char *cmdId, JsonVariantConst args) {
+  // Time sync from the Zigbee bridge is not a tracked command (no cmdId, no result).
+  if (cmd && strcmp(cmd, "time.sync") == 0) {
+    const uint32_t epoch = args["epoch"] | 0U;
+    if (epoch > 1700000000UL) {
+      const bool first = !_timeSynced;
+      onTimeSync(epoch);
+      if (first) sendState();
+    }
+    return;
+  }
+
   if (!cmd || !cmdId || !cmdId[0]) {
     return;
   }
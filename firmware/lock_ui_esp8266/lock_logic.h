@@ -36,6 +36,10 @@ private:
 
   bool isLockoutActive() const;
 
+  // Wall clock from hub time sync (cmd "time.sync"); 0 while not synced.
+  void onTimeSync(uint32_t epochSec);
+  uint64_t toEpochMs(uint32_t atMillis) const;
+
   CredentialsStore *_store = nullptr;
   Seg7_74HC595 *_display = nullptr;
   Buzzer *_buzzer = nullptr;
@@ -58,4 +62,9 @@ private:
   char _lastMethod[8] = ""; // "PIN" or "RFID"
   bool _lastSuccess = false;
   uint32_t _lastActionAtMs = 0;
+
+  // Time sync: epoch seconds at millis() == _syncAtMs
+  bool _timeSynced = false;
+  uint32_t _syncEpochSec = 0;
+  uint32_t _syncAtMs = 0;
 };
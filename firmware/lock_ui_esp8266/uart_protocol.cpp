@@ -66,10 +66,13 @@ void UartProtocol::sendCmdResult(const char *cmdId, bool ok, const char *errorMs
   sendJsonLine(doc);
 }
 
-void UartProtocol::sendEvent(const char *type, JsonVariantConst data) {
+void UartProtocol::sendEvent(const char *type, JsonVariantConst data, uint64_t ts) {
   StaticJsonDocument<384> doc;
   doc["evt"] = "event";
   doc["type"] = type;
+  if (ts) {
+    doc["ts"] = ts;
+  }
   if (!data.isNull()) {
     doc["data"] = data;
   }
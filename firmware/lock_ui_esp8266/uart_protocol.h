@@ -15,7 +15,8 @@ public:
 
   // Tx helpers
   void sendCmdResult(const char *cmdId, bool ok, const char *errorMsg = nullptr);
-  void sendEvent(const char *type, JsonVariantConst data);
+  // ts: event time in epoch ms (0 = clock not synced yet, omitted)
+  void sendEvent(const char *type, JsonVariantConst data, uint64_t ts = 0);
   void sendState(JsonVariantConst state);
 
 private:
@@ -0,0 +1,169 @@
+// LAN control client: talk to the hub's local WebSocket when the phone is on
+// the same network, fall back to the cloud REST path otherwise.
+//
+// Contract (hub firmware):
+//   -> {type:"auth", token}                       <- {type:"auth_ok"|"auth_err"}
+//   -> {type:"set", ieee, body:{cmdId, action, args}}
+//        <- {type:"ack", cmdId, status:"ok"|"duplicate"|"rejected", reason?}
+//   <- {type:"state"|"event"|"cmd_result"|"availability", ieee, data}
+
+import { http } from "./client";
+import { apiSendCommand } from "./api";
+import type { Device } from "../types";
+
+const CONNECT_TIMEOUT_MS = 1500;
+const ACK_TIMEOUT_MS = 400;
+// After a failed LAN attempt, stay on cloud for a while instead of paying the timeout each tap.
+const LAN_RETRY_AFTER_MS = 30_000;
+
+type LanTokenResponse = {
+  token: string;
+  expiresAt: string;
+  hubId: string;
+  lan: { ip: string | null; mdnsHost: string; port: number; wsPath: string };
+};
+
+type LanAckStatus = "ok" | "duplicate" | "rejected";
+type LanMessage = { type: string; ieee?: string; cmdId?: string; status?: LanAckStatus; data?: any };
+type LanListener = (msg: LanMessage) => void;
+
+type LanSession = {
+  ws: WebSocket;
+  ready: Promise<boolean>;
+  expiresAtMs: number;
+  acks: Map<string, (status: LanAckStatus) => void>;
+};
+
+const sessions = new Map<string, LanSession>();
+const failedAt = new Map<string, number>();
+const listeners = new Set<LanListener>();
+
+function genCmdId() {
+  let s = "";
+  for (let i = 0; i < 32; i++) s += Math.floor(Math.random() * 16).toString(16);
+  return s;
+}
+
+async function openSession(hubId: string): Promise<LanSession | null> {
+  const res = await http.post(`/hubs/${encodeURIComponent(hubId)}/lan/token`, {});
+  const info = res.data as LanTokenResponse;
+  const host = info.lan.ip || info.lan.mdnsHost;
+  if (!host) return null;
+
+  const ws = new WebSocket(`ws://${host}:${info.lan.port}${info.lan.wsPath}`);
+  const acks = new Map<string, (status: LanAckStatus) => void>();
+
+  const ready = new Promise<boolean>((resolve) => {
+    const timer = setTimeout(() => {
+      resolve(false);
+      ws.close();
+    }, CONNECT_TIMEOUT_MS);
+
+    ws.onopen = () => ws.send(JSON.stringify({ type: "auth", token: info.token }));
+    ws.onmessage = (ev) => {
+      let msg: LanMessage;
+      try {
+        msg = JSON.parse(String(ev.data));
+      } catch {
+        return;
+      }
+      if (msg.type === "auth_ok") {
+        clearTimeout(timer);
+        resolve(true);
+        return;
+      }
+      if (msg.type === "auth_err") {
+        clearTimeout(timer);
+        resolve(false);
+        return;
+      }
+      if (msg.type === "ack" && msg.cmdId) {
+        acks.get(msg.cmdId)?.(msg.status ?? "ok");
+        acks.delete(msg.cmdId);
+        return;
+      }
+      listeners.forEach((l) => l(msg));
+    };
+    ws.onerror = () => {
+      clearTimeout(timer);
+      resolve(false);
+    };
+    ws.onclose = () => {
+      clearTimeout(timer);
+      resolve(false);
+      sessions.delete(hubId);
+    };
+  });
+
+  const session: LanSession = { ws, ready, expiresAtMs: Date.parse(info.expiresAt) || 0, acks };
+  sessions.set(hubId, session);
+  return session;
+}
+
+async function getSession(hubId: string): Promise<LanSession | null> {
+  const last = failedAt.get(hubId);
+  if (last && Date.now() - last < LAN_RETRY_AFTER_MS) return null;
+
+  let s = sessions.get(hubId) ?? null;
+  if (s && s.expiresAtMs && s.expiresAtMs - Date.now() < 60_000) {
+    s.ws.close();
+    s = null;
+  }
+  try {
+    if (!s) s = await openSession(hubId);
+    if (s && (await s.ready)) return s;
+  } catch {
+    // token endpoint unreachable -> cloud is down too; caller falls back anyway
+  }
+  failedAt.set(hubId, Date.now());
+  return null;
+}
+
+/** Resolves with the hub's ack status, or null when no ack arrived in time. */
+function sendOverLan(s: LanSession, ieee: string, body: { cmdId: string; action: string; args: any }) {
+  return new Promise<LanAckStatus | null>((resolve) => {
+    const timer = setTimeout(() => {
+      s.acks.delete(body.cmdId);
+      resolve(null);
+    }, ACK_TIMEOUT_MS);
+    s.acks.set(body.cmdId, (status) => {
+      clearTimeout(timer);
+      resolve(status);
+    });
+    s.ws.send(JSON.stringify({ type: "set", ieee, body }));
+  });
+}
+
+/**
+ * Send a Zigbee action, preferring the hub's LAN endpoint.
+ * Same payload shape as apiSendCommand ({action, params}).
+ */
+export async function sendCommandPreferLan(device: Device, payload: { action: string; params?: any }) {
+  const hubId = device.hubId;
+  const ieee = device.zigbeeIeee;
+  let lanCmdId: string | undefined;
+  if (device.protocol === "ZIGBEE" && hubId && ieee) {
+    const s = await getSession(hubId);
+    if (s) {
+      const cmdId = genCmdId();
+      const status = await sendOverLan(s, ieee, { cmdId, action: payload.action, args: payload.params ?? {} });
+      // "duplicate": the hub already ran this cmdId, so it is just as delivered.
+      if (status === "ok" || status === "duplicate") return { cmdId, status: "SENT", via: "lan" as const };
+      failedAt.set(hubId, Date.now());
+      // The frame may have reached the hub with only the ack lost: reuse its cmdId so
+      // the hub's cmdId dedup drops the cloud copy instead of running it twice.
+      // A rejected frame was never dispatched, so reusing it is harmless there too.
+      lanCmdId = cmdId;
+    }
+  }
+  const res = await apiSendCommand(device.id, lanCmdId ? { ...payload, cmdId: lanCmdId } : payload);
+  return { ...res, via: "cloud" as const };
+}
+
+/** Subscribe to state/event/cmd_result frames streamed by the hub over LAN. */
+export function subscribeLan(listener: LanListener) {
+  listeners.add(listener);
+  return () => {
+    listeners.delete(listener);
+  };
+}
@@ -4,6 +4,7 @@ import { useMutation } from "@tanstack/react-query";
 
 import type { Device } from "../types";
 import { apiSendCommand } from "../api/api";
+import { sendCommandPreferLan } from "../api/lanClient";
 import type { DevicePlugin, PluginSectionProps } from "./pluginTypes";
 
 function parseIntSafe(v: string, fallback: number) {
@@ -21,7 +22,10 @@ function LightControlSection({ deviceId, device }: { deviceId: number; device: D
   const isOn = typeof st?.light?.on === "boolean" ? st.light.on : null;
 
   const toggle = useMutation({
-    mutationFn: () => apiSendCommand(deviceId, { action: "light.set", params: { on: !isOn } }),
+    mutationFn: () =>
+      device
+        ? sendCommandPreferLan(device, { action: "light.set", params: { on: !isOn } })
+        : apiSendCommand(deviceId, { action: "light.set", params: { on: !isOn } }),
   });
 
   const busy = toggle.isPending;
@@ -80,6 +80,8 @@ export type Device = {
   serial?: string | null;
   modelId?: string | null;
   zigbeeIeee?: string | null;
+  // Hub the Zigbee device is paired behind (used for LAN control)
+  hubId?: string | null;
   lifecycleStatus?: DeviceLifecycleStatus | null;
   // Sprint 11: Identify-confirmed claim badge
   claimed?: boolean | null;